@@ -286,22 +286,23 @@ BOOL WINAPI NSudoSetTokenAllPrivileges(
     _In_ bool bEnable)
 {
     BOOL result = FALSE;
-    M2::CM2Memory<PTOKEN_PRIVILEGES> pTPs;
 
-    result = SUCCEEDED(M2GetTokenInformation(
-        pTPs,
+    // 特权列表通常能放入对象内的缓冲区，无需再次查询和堆分配
+    M2::CTokenInfo<TOKEN_PRIVILEGES, 1024> TPs;
+
+    result = SUCCEEDED(TPs.Query(
         hExistingToken,
         TokenPrivileges));
     if (result)
     {
         // 设置特权信息
-        for (DWORD i = 0; i < pTPs->PrivilegeCount; ++i)
-            pTPs->Privileges[i].Attributes =
+        for (DWORD i = 0; i < TPs->PrivilegeCount; ++i)
+            TPs->Privileges[i].Attributes =
             (DWORD)(bEnable ? SE_PRIVILEGE_ENABLED : 0);
 
         // 设置进程特权
         result = SUCCEEDED(M2AdjustTokenPrivileges(
-            hExistingToken, FALSE, pTPs, 0, nullptr, nullptr));
+            hExistingToken, FALSE, TPs.Get(), 0, nullptr, nullptr));
     }
 
     return result;
@@ -362,12 +363,14 @@ BOOL WINAPI NSudoCreateLUAToken(
     TOKEN_OWNER Owner = { 0 };
     TOKEN_DEFAULT_DACL NewTokenDacl = { 0 };
     M2::CHandle hToken;
-    M2::CM2Memory<PTOKEN_USER> pTokenUser;
-    M2::CM2Memory<PTOKEN_DEFAULT_DACL> pTokenDacl;
+    PTOKEN_USER pTokenUser = nullptr;
+    PTOKEN_DEFAULT_DACL pTokenDacl = nullptr;
     M2::CSID pAdminSid;
-    M2::CMemory<PACL> NewDefaultDacl;
     PACCESS_ALLOWED_ACE pTempAce = nullptr;
 
+    // 令牌信息和新ACL的临时缓冲区，通常不需要堆分配
+    M2::CStackArena<1024> Arena;
+
     //创建受限令牌
     result = CreateRestrictedToken(
         ExistingTokenHandle,
@@ -387,7 +390,8 @@ BOOL WINAPI NSudoCreateLUAToken(
     result = SUCCEEDED(M2GetTokenInformation(
         pTokenUser,
         hToken,
-        TokenUser));
+        TokenUser,
+        Arena));
     if (!result) goto FuncEnd;
 
     // 设置令牌Owner为当前用户
@@ -400,7 +404,8 @@ BOOL WINAPI NSudoCreateLUAToken(
     result = SUCCEEDED(M2GetTokenInformation(
         pTokenDacl,
         hToken,
-        TokenDefaultDacl));
+        TokenDefaultDacl,
+        Arena));
     if (!result) goto FuncEnd;
 
     // 获取管理员组SID
@@ -416,12 +421,14 @@ BOOL WINAPI NSudoCreateLUAToken(
     Length += sizeof(ACCESS_ALLOWED_ACE);
 
     // 分配ACL结构内存
-    if (!NewDefaultDacl.Alloc(Length))
+    result = SUCCEEDED(Arena.Allocate(
+        reinterpret_cast<PVOID*>(&NewTokenDacl.DefaultDacl),
+        Length));
+    if (!result)
     {
         SetLastError(ERROR_NOT_ENOUGH_MEMORY);
         goto FuncEnd;
     }
-    NewTokenDacl.DefaultDacl = NewDefaultDacl;
 
     // 创建ACL
     result = InitializeAcl(
@@ -481,6 +488,8 @@ HRESULT M2QueryWinLogonProcessId(
     _Out_ PDWORD ProcessId,
     _In_ DWORD SessionId)
 {
+    M2_TRACE_SCOPE("M2QueryWinLogonProcessId");
+
     M2::CWTSMemory<PWTS_PROCESS_INFOW> pProcesses;
     DWORD dwProcessCount = 0;
 
@@ -575,25 +584,65 @@ BOOL WINAPI NSudoImpersonateAsSystem()
     return result;
 }
 
-#include <Userenv.h>
-#pragma comment(lib, "Userenv.lib")
+/**
+ * 环境块缓存。同一身份启动的进程共享同一个环境块，缓存的环境块在一分钟后重新
+ * 创建，以便获取环境变量的修改。
+ *
+ * The environment block cache. The processes launched with the same identity
+ * share one environment block, and the cached blocks are created again after
+ * one minute to pick up the changes of the environment variables.
+ */
+M2::CEnvironmentBlockCache g_EnvironmentBlockCache(60 * 1000);
+
+/**
+ * 获取当前进程令牌的环境块。
+ *
+ * Gets the environment block of the current process token.
+ *
+ * @param Environment The environment block.
+ * @return If the function succeeds, the return value is true.
+ */
+bool NSudoAcquireEnvironmentBlock(
+    _Out_ M2::CEnvironmentBlockReference& Environment)
+{
+    M2_TRACE_SCOPE("NSudoAcquireEnvironmentBlock");
+
+    Environment.reset();
+
+    M2::CHandle hCurrentToken;
+    M2_PROCESS_ACCESS_TOKEN_SOURCE TokenSource;
+    TokenSource.Type = M2_PROCESS_TOKEN_SOURCE_TYPE::Current;
+    if (FAILED(M2OpenProcessToken(
+        &hCurrentToken, &TokenSource, MAXIMUM_ALLOWED)))
+    {
+        return false;
+    }
+
+    return SUCCEEDED(g_EnvironmentBlockCache.Acquire(
+        Environment, hCurrentToken, true));
+}
 
 /*
-NSudoCreateProcess函数创建一个新进程和对应的主线程
-The NSudoCreateProcess function creates a new process and its primary thread.
+NSudoCreateProcessAsUser函数以指定的令牌创建一个新进程和对应的主线程
+The NSudoCreateProcessAsUser function creates a new process and its primary
+thread with the specified token.
 
-如果函数执行失败，返回值为NULL。调用GetLastError可获取详细错误码。
-If the function fails, the return value is NULL. To get extended error
+命令行必须已经使用环境块展开。
+The command line must have been expanded with the environment block.
+
+如果函数执行失败，返回值为false。调用GetLastError可获取详细错误码。
+If the function fails, the return value is false. To get extended error
 information, call GetLastError.
 */
-bool NSudoCreateProcess(
+bool NSudoCreateProcessAsUser(
     _In_opt_ HANDLE hToken,
-    _Inout_ LPCWSTR lpCommandLine,
+    _In_ LPCWSTR lpCommandLine,
     _In_opt_ LPCWSTR lpCurrentDirectory,
+    _In_ LPVOID lpEnvironment,
     _In_ DWORD WaitInterval,
-    _In_ DWORD ProcessPriority = 0,
-    _In_ DWORD ShowWindowMode = SW_SHOWDEFAULT,
-    _In_ bool CreateNewConsole = true)
+    _In_ DWORD ProcessPriority,
+    _In_ DWORD ShowWindowMode,
+    _In_ bool CreateNewConsole)
 {
     DWORD dwCreationFlags = CREATE_SUSPENDED | CREATE_UNICODE_ENVIRONMENT;
 
@@ -612,53 +661,35 @@ bool NSudoCreateProcess(
     StartupInfo.dwFlags |= STARTF_USESHOWWINDOW;
     StartupInfo.wShowWindow = static_cast<WORD>(ShowWindowMode);
 
-    LPVOID lpEnvironment = nullptr;
-
     BOOL result = FALSE;
 
-    M2::CHandle hCurrentToken;
-    M2_PROCESS_ACCESS_TOKEN_SOURCE TokenSource;
-    TokenSource.Type = M2_PROCESS_TOKEN_SOURCE_TYPE::Current;
-    if (SUCCEEDED(M2OpenProcessToken(
-        &hCurrentToken, &TokenSource, MAXIMUM_ALLOWED)))
     {
-        if (CreateEnvironmentBlock(&lpEnvironment, hCurrentToken, TRUE))
-        {
-            std::wstring ExpandedString;
-
-            if (SUCCEEDED(M2ExpandEnvironmentStrings(
-                ExpandedString,
-                lpCommandLine)))
-            {
-                result = CreateProcessAsUserW(
-                    hToken,
-                    nullptr,
-                    const_cast<LPWSTR>(ExpandedString.c_str()),
-                    nullptr,
-                    nullptr,
-                    FALSE,
-                    dwCreationFlags,
-                    lpEnvironment,
-                    lpCurrentDirectory,
-                    &StartupInfo,
-                    &ProcessInfo);
-
-                if (result)
-                {
-                    SetPriorityClass(ProcessInfo.hProcess, ProcessPriority);
+        M2_TRACE_SCOPE("CreateProcessAsUserW");
+        result = CreateProcessAsUserW(
+            hToken,
+            nullptr,
+            const_cast<LPWSTR>(lpCommandLine),
+            nullptr,
+            nullptr,
+            FALSE,
+            dwCreationFlags,
+            lpEnvironment,
+            lpCurrentDirectory,
+            &StartupInfo,
+            &ProcessInfo);
+    }
 
-                    ResumeThread(ProcessInfo.hThread);
+    if (result)
+    {
+        SetPriorityClass(ProcessInfo.hProcess, ProcessPriority);
 
-                    WaitForSingleObjectEx(
-                        ProcessInfo.hProcess, WaitInterval, FALSE);
+        ResumeThread(ProcessInfo.hThread);
 
-                    CloseHandle(ProcessInfo.hProcess);
-                    CloseHandle(ProcessInfo.hThread);
-                }
-            }
+        WaitForSingleObjectEx(
+            ProcessInfo.hProcess, WaitInterval, FALSE);
 
-            DestroyEnvironmentBlock(lpEnvironment);
-        }
+        CloseHandle(ProcessInfo.hProcess);
+        CloseHandle(ProcessInfo.hThread);
     }
 
     //返回结果
@@ -671,6 +702,8 @@ bool NSudoCreateProcess(
 
 #include "ThirdParty/json.hpp"
 
+#include <mutex>
+
 // The NSudo message enum.
 enum NSUDO_MESSAGE
 {
@@ -679,6 +712,7 @@ enum NSUDO_MESSAGE
     INVALID_COMMAND_PARAMETER,
     INVALID_TEXTBOX_PARAMETER,
     CREATE_PROCESS_FAILED,
+    SHORTCUT_UPDATE_FAILED,
     NEED_TO_SHOW_COMMAND_LINE_HELP,
     NEED_TO_SHOW_NSUDO_VERSION
 };
@@ -690,22 +724,52 @@ const char* NSudoMessageTranslationID[] =
     "Message.InvalidCommandParameter",
     "Message.InvalidTextBoxParameter",
     "Message.CreateProcessFailed",
+    "Message.ShortCutUpdateFailed",
     "",
     ""
 };
 
+/**
+ * The function used by the adapters to obtain the embedded resources. The
+ * default implementation reads them from the resource catalog of the current
+ * executable, and another implementation can be passed to feed the adapters
+ * with external data.
+ */
+typedef HRESULT(*PNSUDO_RESOURCE_LOADER)(
+    _Out_ PM2_RESOURCE_INFO ResourceInfo,
+    _In_ LPCWSTR Type,
+    _In_ LPCWSTR Name);
+
+HRESULT NSudoLoadModuleResource(
+    _Out_ PM2_RESOURCE_INFO ResourceInfo,
+    _In_ LPCWSTR Type,
+    _In_ LPCWSTR Name)
+{
+    static M2::CResourceCatalog Catalog;
+    static std::once_flag CatalogInitialized;
+
+    // 首次调用时一次性枚举本模块的字符串资源，之后的查找只需二分查找。
+    std::call_once(CatalogInitialized, []()
+    {
+        const LPCWSTR Types[] = { L"String" };
+        Catalog.AddModule(nullptr, Types, _countof(Types));
+    });
+
+    return Catalog.Find(ResourceInfo, Type, Name);
+}
+
 class CNSudoTranslationAdapter
 {
 private:
     static std::wstring GetUTF8WithBOMStringResources(
+        _In_ PNSUDO_RESOURCE_LOADER ResourceLoader,
         _In_ UINT uID)
     {
         M2_RESOURCE_INFO ResourceInfo = { 0 };
-        if (SUCCEEDED(M2LoadResource(
+        if (SUCCEEDED(ResourceLoader(
             &ResourceInfo,
-            GetModuleHandleW(nullptr),
             L"String",
-            MAKEINTRESOURCEW(uID))))
+            MAKEINTRESOURCEW(uID))) && ResourceInfo.Size >= 3)
         {
             // Raw string without the UTF-8 BOM. (0xEF,0xBB,0xBF)	
             return M2MakeUTF16String(std::string(
@@ -718,7 +782,8 @@ private:
 
 public:
     static void Load(
-        std::map<std::string, std::wstring>& StringTranslations)
+        std::map<std::string, std::wstring>& StringTranslations,
+        _In_ PNSUDO_RESOURCE_LOADER ResourceLoader = NSudoLoadModuleResource)
     {
         StringTranslations.clear();
 
@@ -735,17 +800,18 @@ public:
         StringTranslations.insert(std::make_pair(
             "NSudo.String.Links",
             CNSudoTranslationAdapter::GetUTF8WithBOMStringResources(
+                ResourceLoader,
                 IDR_String_Links)));
 
         StringTranslations.insert(std::make_pair(
             "NSudo.String.CommandLineHelp",
             CNSudoTranslationAdapter::GetUTF8WithBOMStringResources(
+                ResourceLoader,
                 IDR_String_CommandLineHelp)));
 
         M2_RESOURCE_INFO ResourceInfo = { 0 };
-        if (SUCCEEDED(M2LoadResource(
+        if (SUCCEEDED(ResourceLoader(
             &ResourceInfo,
-            GetModuleHandleW(nullptr),
             L"String",
             MAKEINTRESOURCEW(IDR_String_Translations))))
         {
@@ -765,39 +831,547 @@ public:
 };
 
 #include <stdio.h>
+#include <io.h>
+
+/**
+ * The function used by the adapters to read the files. The default
+ * implementation is NSudoReadFile, and another implementation can be passed
+ * to feed the adapters with external data.
+ */
+typedef HRESULT(*PNSUDO_FILE_READER)(
+    _In_ const std::wstring& FilePath,
+    _Out_ std::string& Content);
+
+/**
+ * Reads the whole file into the buffer.
+ *
+ * @param FilePath The path of the file.
+ * @param Content The content of the file.
+ * @return HRESULT. If the function succeeds, the return value is S_OK. If the
+ *         file does not exist, the return value is
+ *         HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND).
+ */
+HRESULT NSudoReadFile(
+    _In_ const std::wstring& FilePath,
+    _Out_ std::string& Content)
+{
+    Content.clear();
+
+    M2::CHandle FileHandle = CreateFileW(
+        FilePath.c_str(),
+        GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        nullptr,
+        OPEN_EXISTING,
+        FILE_FLAG_SEQUENTIAL_SCAN,
+        nullptr);
+    if (FileHandle.IsInvalid())
+        return M2GetLastHRESULTErrorKnownFailedCall();
+
+    ULONGLONG FileSize = 0;
+    HRESULT hr = M2GetFileSize(FileHandle, &FileSize);
+    if (FAILED(hr))
+        return hr;
+
+    if (FileSize > MAXDWORD)
+        return HRESULT_FROM_WIN32(ERROR_FILE_TOO_LARGE);
 
+    Content.resize(static_cast<size_t>(FileSize));
+
+    size_t Offset = 0;
+    while (Offset < Content.size())
+    {
+        DWORD NumberOfBytesRead = 0;
+        if (!ReadFile(
+            FileHandle,
+            &Content[Offset],
+            static_cast<DWORD>(Content.size() - Offset),
+            &NumberOfBytesRead,
+            nullptr))
+        {
+            Content.clear();
+            return M2GetLastHRESULTErrorKnownFailedCall();
+        }
+
+        // The file is shorter than its size when it was opened.
+        if (0 == NumberOfBytesRead)
+            break;
+
+        Offset += NumberOfBytesRead;
+    }
+
+    Content.resize(Offset);
+
+    return S_OK;
+}
+
+/**
+ * The shortcut list is stored in NSudo.json and all changes made after the
+ * last compaction are appended to NSudo.json.journal as JSON Lines. Each line
+ * is a self-contained record which sets or removes one shortcut, so replaying
+ * the journal twice gives the same result as replaying it once. That makes
+ * the compaction safe even if the process is terminated between replacing
+ * NSudo.json and deleting the journal.
+ *
+ * A record is only valid when its line feed is written. The replay skips the
+ * lines which cannot be parsed and ignores the unterminated tail, and the next
+ * append truncates the tail, so a record torn by a crash never merges with the
+ * record written after it.
+ */
 class CNSudoShortCutAdapter
 {
-public:
-    static void Read(
+private:
+    // The journal will be merged into NSudo.json when it reaches this size.
+    static const long long JournalCompactionThreshold = 256 * 1024;
+
+    // The offset of the byte locked by OpenJournal, which is never reached
+    // by the records.
+    static const DWORD JournalLockOffsetLow = 0xFFFFFFFE;
+    static const DWORD JournalLockOffsetHigh = 0x7FFFFFFF;
+
+    static std::wstring GetJournalPath(
+        const std::wstring& ShortCutListPath)
+    {
+        return ShortCutListPath + L".journal";
+    }
+
+    static bool WriteFileAndFlush(
+        FILE* FileStream,
+        const std::string& Content)
+    {
+        if (Content.size() != fwrite(
+            Content.data(), sizeof(char), Content.size(), FileStream))
+            return false;
+
+        if (0 != fflush(FileStream))
+            return false;
+
+        // Make sure the data reaches the disk before we report success.
+        return (0 == _commit(_fileno(FileStream)));
+    }
+
+    /**
+     * Gets the size of the complete records of the journal, which is the
+     * offset after its last line feed.
+     *
+     * @return The size, or -1 if the journal cannot be read.
+     */
+    static long long GetCompleteRecordsSize(
+        FILE* FileStream)
+    {
+        if (0 != _fseeki64(FileStream, 0, SEEK_END))
+            return -1;
+
+        long long End = _ftelli64(FileStream);
+
+        char Buffer[512];
+        while (End > 0)
+        {
+            long long Begin = End > static_cast<long long>(sizeof(Buffer))
+                ? End - static_cast<long long>(sizeof(Buffer))
+                : 0;
+            size_t Length = static_cast<size_t>(End - Begin);
+
+            if (0 != _fseeki64(FileStream, Begin, SEEK_SET))
+                return -1;
+            if (Length != fread(Buffer, sizeof(char), Length, FileStream))
+                return -1;
+
+            for (size_t i = Length; i > 0; --i)
+            {
+                if ('\n' == Buffer[i - 1])
+                    return Begin + static_cast<long long>(i);
+            }
+
+            End = Begin;
+        }
+
+        return End;
+    }
+
+    static void ApplyJournalRecord(
+        const nlohmann::json& Record,
+        std::map<std::wstring, std::wstring>& ShortCutList)
+    {
+        if (!Record.is_object())
+            return;
+
+        auto Operation = Record.find("Op");
+        auto Key = Record.find("Key");
+        if (Record.end() == Operation || !Operation->is_string() ||
+            Record.end() == Key || !Key->is_string())
+            return;
+
+        if ("Add" == Operation->get<std::string>())
+        {
+            auto Value = Record.find("Value");
+            if (Record.end() == Value || !Value->is_string())
+                return;
+
+            ShortCutList[M2MakeUTF16String(Key->get<std::string>())] =
+                M2MakeUTF16String(Value->get<std::string>());
+        }
+        else if ("Remove" == Operation->get<std::string>())
+        {
+            ShortCutList.erase(M2MakeUTF16String(Key->get<std::string>()));
+        }
+    }
+
+    static void ReplayJournal(
+        const std::string& Journal,
+        std::map<std::wstring, std::wstring>& ShortCutList)
+    {
+        // A trailing line without the line feed is the remnant of an append
+        // interrupted by a crash and is ignored on purpose.
+        for (size_t LineBegin = 0, LineEnd = Journal.find('\n');
+            std::string::npos != LineEnd;
+            LineBegin = LineEnd + 1, LineEnd = Journal.find('\n', LineBegin))
+        {
+            nlohmann::json Record = nlohmann::json::parse(
+                Journal.begin() + LineBegin,
+                Journal.begin() + LineEnd,
+                nullptr,
+                false);
+
+            // A damaged line only loses its own record.
+            if (Record.is_discarded())
+                continue;
+
+            CNSudoShortCutAdapter::ApplyJournalRecord(Record, ShortCutList);
+        }
+    }
+
+    static void ParseShortCutList(
+        const nlohmann::json& ConfigJSON,
+        std::map<std::wstring, std::wstring>& ShortCutList)
+    {
+        if (!ConfigJSON.is_object())
+            return;
+
+        auto ShortCutListJSON = ConfigJSON.find("ShortCutList_V2");
+        if (ConfigJSON.end() == ShortCutListJSON ||
+            !ShortCutListJSON->is_object())
+            return;
+
+        for (auto& Item : ShortCutListJSON->items())
+        {
+            if (!Item.value().is_string())
+                continue;
+
+            ShortCutList.insert(std::make_pair(
+                M2MakeUTF16String(Item.key()),
+                M2MakeUTF16String(Item.value().get<std::string>())));
+        }
+    }
+
+    /**
+     * Opens the journal and takes its exclusive lock, which serializes the
+     * appenders and the compactions of all NSudo processes. The lock covers
+     * a byte far beyond the end of the journal, so the readers are never
+     * blocked.
+     *
+     * @return The journal, or nullptr if it cannot be opened or locked.
+     *         Close it with CloseJournal.
+     */
+    static FILE* OpenJournal(
+        const std::wstring& ShortCutListPath)
+    {
+        FILE* FileStream = nullptr;
+        if (_wfopen_s(
+            &FileStream,
+            GetJournalPath(ShortCutListPath).c_str(),
+            L"a+b") != 0)
+            return nullptr;
+
+        OVERLAPPED Overlapped = { 0 };
+        Overlapped.Offset = JournalLockOffsetLow;
+        Overlapped.OffsetHigh = JournalLockOffsetHigh;
+
+        if (!LockFileEx(
+            reinterpret_cast<HANDLE>(_get_osfhandle(_fileno(FileStream))),
+            LOCKFILE_EXCLUSIVE_LOCK,
+            0,
+            1,
+            0,
+            &Overlapped))
+        {
+            fclose(FileStream);
+            return nullptr;
+        }
+
+        return FileStream;
+    }
+
+    static void CloseJournal(
+        FILE* FileStream)
+    {
+        OVERLAPPED Overlapped = { 0 };
+        Overlapped.Offset = JournalLockOffsetLow;
+        Overlapped.OffsetHigh = JournalLockOffsetHigh;
+
+        UnlockFileEx(
+            reinterpret_cast<HANDLE>(_get_osfhandle(_fileno(FileStream))),
+            0,
+            1,
+            0,
+            &Overlapped);
+
+        fclose(FileStream);
+    }
+
+    static bool AppendJournalRecord(
+        FILE* FileStream,
+        const nlohmann::json& Record,
+        long long& JournalSize)
+    {
+        long long CompleteRecordsSize =
+            CNSudoShortCutAdapter::GetCompleteRecordsSize(FileStream);
+
+        bool result = (-1 != CompleteRecordsSize &&
+            0 == _fseeki64(FileStream, 0, SEEK_END));
+
+        // Drop the tail torn by a crash, so the new record starts on its own
+        // line.
+        if (result && _ftelli64(FileStream) != CompleteRecordsSize)
+        {
+            result = (0 == _chsize_s(
+                _fileno(FileStream), CompleteRecordsSize) &&
+                0 == _fseeki64(FileStream, 0, SEEK_END));
+        }
+
+        if (result)
+        {
+            result = WriteFileAndFlush(FileStream, Record.dump() + "\n");
+        }
+
+        JournalSize = _ftelli64(FileStream);
+
+        return result;
+    }
+
+    /**
+     * Merges the journal into NSudo.json. The caller must hold the lock of
+     * the journal. The shortcut list is rebuilt from NSudo.json and the
+     * journal on disk, so the records appended by the other processes since
+     * the caller read them are kept.
+     */
+    static bool CompactJournal(
         const std::wstring& ShortCutListPath,
+        FILE* JournalStream,
         std::map<std::wstring, std::wstring>& ShortCutList)
     {
-        ShortCutList.clear();
+        nlohmann::json ConfigJSON = nlohmann::json::object();
+
+        std::string Content;
+        HRESULT hr = NSudoReadFile(ShortCutListPath, Content);
+        if (SUCCEEDED(hr))
+        {
+            ConfigJSON = nlohmann::json::parse(Content, nullptr, false);
+            if (!ConfigJSON.is_object())
+                return false;
+        }
+        else if (HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND) != hr)
+        {
+            return false;
+        }
+
+        std::string Journal;
+        if (0 != _fseeki64(JournalStream, 0, SEEK_END))
+            return false;
+        Journal.resize(static_cast<size_t>(_ftelli64(JournalStream)));
+        if (0 != _fseeki64(JournalStream, 0, SEEK_SET))
+            return false;
+        if (Journal.size() != fread(
+            &Journal[0], sizeof(char), Journal.size(), JournalStream))
+            return false;
+
+        std::map<std::wstring, std::wstring> CurrentShortCutList;
+        CNSudoShortCutAdapter::ParseShortCutList(
+            ConfigJSON, CurrentShortCutList);
+        CNSudoShortCutAdapter::ReplayJournal(Journal, CurrentShortCutList);
+
+        nlohmann::json ShortCutListJSON = nlohmann::json::object();
+        for (auto& Item : CurrentShortCutList)
+        {
+            ShortCutListJSON[M2MakeUTF8String(Item.first)] =
+                M2MakeUTF8String(Item.second);
+        }
+
+        ConfigJSON["ShortCutList_V2"] = ShortCutListJSON;
+
+        // The lock already serializes the compactions, but a unique name
+        // also keeps them apart from the writers which do not take it.
+        std::wstring TemporaryPath =
+            ShortCutListPath +
+            L"." + std::to_wstring(GetCurrentProcessId()) +
+            L"." + std::to_wstring(GetCurrentThreadId()) +
+            L".tmp";
 
         FILE* FileStream = nullptr;
+        if (_wfopen_s(&FileStream, TemporaryPath.c_str(), L"wb") != 0)
+            return false;
+
+        bool result = WriteFileAndFlush(
+            FileStream,
+            "\xEF\xBB\xBF" + ConfigJSON.dump(2) + "\n");
+
+        fclose(FileStream);
+
+        if (result)
+        {
+            result = (FALSE != MoveFileExW(
+                TemporaryPath.c_str(),
+                ShortCutListPath.c_str(),
+                MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH));
+        }
+
+        if (!result)
+        {
+            DeleteFileW(TemporaryPath.c_str());
+            return false;
+        }
 
-        if (_wfopen_s(&FileStream, ShortCutListPath.c_str(), L"r") == 0)
+        // The journal is emptied rather than deleted, because the other
+        // processes may be waiting for its lock. A crash before this point
+        // only replays the records again, which is idempotent.
+        if (0 != _chsize_s(_fileno(JournalStream), 0) ||
+            0 != _commit(_fileno(JournalStream)))
+            return false;
+
+        ShortCutList = std::move(CurrentShortCutList);
+
+        return true;
+    }
+
+    /**
+     * Appends one journal record under the lock of the journal, and merges
+     * the journal into NSudo.json when it passes the compaction threshold.
+     *
+     * @return If the record cannot be written, the return value is false. The
+     *         result of the compaction is not returned.
+     */
+    static bool Update(
+        const std::wstring& ShortCutListPath,
+        std::map<std::wstring, std::wstring>& ShortCutList,
+        const nlohmann::json& Record)
+    {
+        FILE* JournalStream = CNSudoShortCutAdapter::OpenJournal(
+            ShortCutListPath);
+        if (!JournalStream)
+            return false;
+
+        long long JournalSize = 0;
+        bool result = CNSudoShortCutAdapter::AppendJournalRecord(
+            JournalStream, Record, JournalSize);
+        if (result)
         {
-            nlohmann::json ConfigJSON = nlohmann::json::parse(FileStream);
+            CNSudoShortCutAdapter::ApplyJournalRecord(Record, ShortCutList);
 
-            for (auto& Item : ConfigJSON["ShortCutList_V2"].items())
+            // The record is already saved, so a failed compaction is only
+            // deferred to the next change or Write.
+            if (JournalSize > JournalCompactionThreshold)
             {
-                ShortCutList.insert(std::make_pair(
-                    M2MakeUTF16String(Item.key()),
-                    M2MakeUTF16String(Item.value())));
+                CNSudoShortCutAdapter::CompactJournal(
+                    ShortCutListPath, JournalStream, ShortCutList);
             }
+        }
 
-            fclose(FileStream);
+        CNSudoShortCutAdapter::CloseJournal(JournalStream);
+
+        return result;
+    }
+
+public:
+    static void Read(
+        const std::wstring& ShortCutListPath,
+        std::map<std::wstring, std::wstring>& ShortCutList,
+        _In_ PNSUDO_FILE_READER FileReader = NSudoReadFile)
+    {
+        ShortCutList.clear();
+
+        std::string Content;
+        if (SUCCEEDED(FileReader(ShortCutListPath, Content)))
+        {
+            CNSudoShortCutAdapter::ParseShortCutList(
+                nlohmann::json::parse(Content, nullptr, false),
+                ShortCutList);
+        }
+
+        std::string Journal;
+        if (SUCCEEDED(FileReader(GetJournalPath(ShortCutListPath), Journal)))
+        {
+            CNSudoShortCutAdapter::ReplayJournal(Journal, ShortCutList);
         }
     }
 
-    static void Write(
+    /**
+     * Compacts the shortcut list. Under the lock of the journal, the list is
+     * rebuilt from NSudo.json and the journal on disk and written to a
+     * temporary file which replaces NSudo.json atomically, and then the
+     * journal is emptied. The other settings in NSudo.json are kept, and a
+     * NSudo.json which cannot be parsed is never replaced.
+     *
+     * @param ShortCutList The rebuilt list if the function succeeds.
+     */
+    static bool Write(
         const std::wstring& ShortCutListPath,
-        const std::map<std::wstring, std::wstring>& ShortCutList)
+        std::map<std::wstring, std::wstring>& ShortCutList)
     {
-        ShortCutListPath;
-        ShortCutList;
+        FILE* JournalStream = CNSudoShortCutAdapter::OpenJournal(
+            ShortCutListPath);
+        if (!JournalStream)
+            return false;
+
+        bool result = CNSudoShortCutAdapter::CompactJournal(
+            ShortCutListPath, JournalStream, ShortCutList);
+
+        CNSudoShortCutAdapter::CloseJournal(JournalStream);
+
+        return result;
+    }
+
+    /**
+     * Adds or replaces a shortcut with one journal record.
+     *
+     * @return If the record cannot be written, the return value is false. If
+     *         only the compaction triggered by it fails, the change is kept in
+     *         the journal and the return value is true, and the compaction is
+     *         tried again by the next change or Write.
+     */
+    static bool Add(
+        const std::wstring& ShortCutListPath,
+        std::map<std::wstring, std::wstring>& ShortCutList,
+        const std::wstring& Name,
+        const std::wstring& CommandLine)
+    {
+        nlohmann::json Record;
+        Record["Op"] = "Add";
+        Record["Key"] = M2MakeUTF8String(Name);
+        Record["Value"] = M2MakeUTF8String(CommandLine);
+
+        return CNSudoShortCutAdapter::Update(
+            ShortCutListPath, ShortCutList, Record);
+    }
+
+    /**
+     * Removes a shortcut with one journal record.
+     *
+     * @return If the record cannot be written, the return value is false. If
+     *         only the compaction triggered by it fails, the change is kept in
+     *         the journal and the return value is true, and the compaction is
+     *         tried again by the next change or Write.
+     */
+    static bool Remove(
+        const std::wstring& ShortCutListPath,
+        std::map<std::wstring, std::wstring>& ShortCutList,
+        const std::wstring& Name)
+    {
+        nlohmann::json Record;
+        Record["Op"] = "Remove";
+        Record["Key"] = M2MakeUTF8String(Name);
+
+        return CNSudoShortCutAdapter::Update(
+            ShortCutListPath, ShortCutList, Record);
     }
 
     static std::wstring Translate(
@@ -810,100 +1384,343 @@ public:
     }
 };
 
+/**
+ * 复制当前进程的令牌，并尝试启用 SeDebugPrivilege 以判断当前进程是否已提权。
+ *
+ * Duplicates the token of the current process and tries to enable
+ * SeDebugPrivilege, which tells whether the current process is elevated.
+ *
+ * @param OriginalToken The duplicated token of the current process.
+ * @return If the current process is elevated, the return value is true.
+ */
+bool NSudoPrepareCurrentProcessToken(
+    _Out_ M2::CHandle& OriginalToken)
+{
+    M2::CHandle CurrentProcessToken;
+
+    M2_PROCESS_ACCESS_TOKEN_SOURCE TokenSource;
+    TokenSource.Type = M2_PROCESS_TOKEN_SOURCE_TYPE::Current;
+    if (FAILED(M2OpenProcessToken(
+        &CurrentProcessToken, &TokenSource, MAXIMUM_ALLOWED)))
+    {
+        return false;
+    }
+
+    if (!DuplicateTokenEx(
+        CurrentProcessToken,
+        MAXIMUM_ALLOWED,
+        nullptr,
+        SecurityIdentification,
+        TokenPrimary,
+        &OriginalToken))
+    {
+        return false;
+    }
+
+    return NSudoSetTokenPrivilege(
+        CurrentProcessToken,
+        SeDebugPrivilege,
+        true);
+}
+
+struct NSUDO_LAUNCH_REQUEST;
+
+NSUDO_MESSAGE NSudoCreateLaunchToken(
+    _In_ const NSUDO_LAUNCH_REQUEST& Request,
+    _In_ DWORD SessionID,
+    _Out_ M2::CHandle& Token);
+
+/**
+ * 平台层，即命令处理路径使用的资源、文件、令牌、WTS 和服务管理器相关的函数。
+ * 默认实现调用 Win32 API，单元测试和基准测试使用内存中的实现，因此可以在不
+ * 创建令牌和进程的情况下运行命令处理路径的全部逻辑。
+ *
+ * The platform layer, which is the resource, file, token, WTS and service
+ * manager functions used by the command paths. The default implementation
+ * calls Win32, and the unit tests and the benchmarks use an in-memory one, so
+ * the whole logic of the command paths can run without creating tokens or
+ * processes.
+ */
+struct NSUDO_PLATFORM
+{
+    // Gets the path of the current executable.
+    std::wstring(*GetExePath)();
+
+    // Loads the embedded resources.
+    PNSUDO_RESOURCE_LOADER LoadResource;
+
+    // Reads NSudo.json, its journal and the batch job files.
+    PNSUDO_FILE_READER ReadFile;
+
+    // Duplicates the token of the current process and tells whether the
+    // current process is elevated.
+    bool(*PrepareCurrentProcessToken)(
+        _Out_ M2::CHandle& OriginalToken);
+
+    // Gets the session ID of the current process.
+    BOOL(WINAPI* GetCurrentProcessSessionID)(
+        _Out_ PDWORD SessionID);
+
+    // Impersonates System on the current thread.
+    BOOL(WINAPI* ImpersonateAsSystem)();
+
+    // Stops the impersonation of the current thread.
+    BOOL(WINAPI* RevertToSelf)();
+
+    // Creates the token of the launch request, which starts the
+    // TrustedInstaller service or queries the WTS user token if needed.
+    NSUDO_MESSAGE(*CreateLaunchToken)(
+        _In_ const NSUDO_LAUNCH_REQUEST& Request,
+        _In_ DWORD SessionID,
+        _Out_ M2::CHandle& Token);
+
+    // Gets the environment block used to expand the command line.
+    bool(*AcquireEnvironmentBlock)(
+        _Out_ M2::CEnvironmentBlockReference& Environment);
+
+    // Creates the process with the expanded command line.
+    bool(*LaunchProcess)(
+        _In_opt_ HANDLE hToken,
+        _In_ LPCWSTR lpCommandLine,
+        _In_opt_ LPCWSTR lpCurrentDirectory,
+        _In_ LPVOID lpEnvironment,
+        _In_ DWORD WaitInterval,
+        _In_ DWORD ProcessPriority,
+        _In_ DWORD ShowWindowMode,
+        _In_ bool CreateNewConsole);
+};
+
+const NSUDO_PLATFORM g_NSudoWin32Platform =
+{
+    M2GetCurrentProcessModulePath,
+    NSudoLoadModuleResource,
+    NSudoReadFile,
+    NSudoPrepareCurrentProcessToken,
+    NSudoGetCurrentProcessSessionID,
+    NSudoImpersonateAsSystem,
+    RevertToSelf,
+    NSudoCreateLaunchToken,
+    NSudoAcquireEnvironmentBlock,
+    NSudoCreateProcessAsUser
+};
+
+/**
+ * The resources of NSudo are split into independent facets, and each facet is
+ * initialized once on first use. That keeps the expensive work, like loading
+ * the translations, parsing NSudo.json and preparing the process token, away
+ * from the command paths which do not need it.
+ */
 class CNSudoResourceManagement
 {
 private:
-    bool m_IsInitialized = false;
-
+    const NSUDO_PLATFORM* m_Platform;
 
+    std::once_flag m_PathsInitialized;
     HINSTANCE m_Instance = nullptr;
     std::wstring m_ExePath;
     std::wstring m_AppPath;
 
+    std::once_flag m_StringsInitialized;
     std::map<std::string, std::wstring> m_StringTranslations;
+
+    std::once_flag m_ShortCutsInitialized;
     std::map<std::wstring, std::wstring> m_ShortCutList;
 
+    std::once_flag m_TokenInitialized;
     bool m_IsElevated = false;
-    HANDLE m_OriginalCurrentProcessToken;
+    M2::CHandle m_OriginalCurrentProcessToken;
+    M2::CHandle m_TokenPreparationThread;
 
-public:
-    const HINSTANCE& Instance = this->m_Instance;
-    const std::wstring& ExePath = this->m_ExePath;
-    const std::wstring& AppPath = this->m_AppPath;
+    void InitializePaths()
+    {
+        std::call_once(this->m_PathsInitialized, [this]()
+        {
+            this->m_Instance = GetModuleHandleW(nullptr);
+
+            this->m_ExePath = this->m_Platform->GetExePath();
 
-    const std::map<std::wstring, std::wstring>& ShortCutList =
-        this->m_ShortCutList;
+            this->m_AppPath = this->m_ExePath;
+            wcsrchr(&this->m_AppPath[0], L'\\')[0] = L'\0';
+            this->m_AppPath.resize(wcslen(this->m_AppPath.c_str()));
+        });
+    }
+
+    void InitializeStrings()
+    {
+        std::call_once(this->m_StringsInitialized, [this]()
+        {
+            M2_TRACE_SCOPE("CNSudoResourceManagement::InitializeStrings");
+            M2_ALLOCATION_TAG("CNSudoResourceManagement::InitializeStrings");
+
+            CNSudoTranslationAdapter::Load(
+                this->m_StringTranslations,
+                this->m_Platform->LoadResource);
+        });
+    }
+
+    void InitializeShortCuts()
+    {
+        std::call_once(this->m_ShortCutsInitialized, [this]()
+        {
+            M2_TRACE_SCOPE("CNSudoResourceManagement::InitializeShortCuts");
+            M2_ALLOCATION_TAG("CNSudoResourceManagement::InitializeShortCuts");
 
-    const HANDLE& OriginalCurrentProcessToken =
-        this->m_OriginalCurrentProcessToken;
-    const bool& IsElevated = this->m_IsElevated;
+            CNSudoShortCutAdapter::Read(
+                this->GetShortCutListPath(),
+                this->m_ShortCutList,
+                this->m_Platform->ReadFile);
+        });
+    }
+
+    void InitializeToken()
+    {
+        std::call_once(this->m_TokenInitialized, [this]()
+        {
+            M2_TRACE_SCOPE("CNSudoResourceManagement::InitializeToken");
+
+            this->m_IsElevated = this->m_Platform->PrepareCurrentProcessToken(
+                this->m_OriginalCurrentProcessToken);
+        });
+    }
 
 public:
-    CNSudoResourceManagement() = default;
+    explicit CNSudoResourceManagement(
+        _In_ const NSUDO_PLATFORM& Platform = g_NSudoWin32Platform) :
+        m_Platform(&Platform)
+    {
+
+    }
 
     ~CNSudoResourceManagement()
     {
-        if (this->m_IsInitialized)
+        // Make sure the worker does not outlive the members it writes to.
+        this->WaitForTokenPreparation();
+    }
+
+    /**
+     * Waits for the worker thread started by PrepareTokenAsync to finish.
+     */
+    void WaitForTokenPreparation()
+    {
+        if (!this->m_TokenPreparationThread.IsInvalid())
         {
-            UnInitialize();
+            WaitForSingleObjectEx(
+                this->m_TokenPreparationThread, INFINITE, FALSE);
         }
     }
 
-    void Initialize()
+    /**
+     * Starts preparing the token state on a worker thread. The token state
+     * does not depend on the translations or NSudo.json, so the caller can
+     * continue with them while the token is duplicated and SeDebugPrivilege
+     * is enabled. The first caller of IsElevated or
+     * GetOriginalCurrentProcessToken waits for the worker via the once flag.
+     */
+    void PrepareTokenAsync()
     {
-        if (!this->m_IsInitialized)
+        if (!this->m_TokenPreparationThread.IsInvalid())
+            return;
+
+        M2::CThread TokenPreparationThread([this]()
         {
-            this->m_Instance = GetModuleHandleW(nullptr);
+            this->InitializeToken();
+        });
 
-            this->m_ExePath = M2GetCurrentProcessModulePath();
+        HANDLE ThreadHandle = TokenPreparationThread.Detach();
+        if (ThreadHandle)
+        {
+            this->m_TokenPreparationThread = ThreadHandle;
+        }
+    }
 
-            this->m_AppPath = this->m_ExePath;
-            wcsrchr(&this->m_AppPath[0], L'\\')[0] = L'\0';
-            this->m_AppPath.resize(wcslen(this->m_AppPath.c_str()));
+    /**
+     * Replaces the platform. The unit tests and the benchmarks call it before
+     * any facet is initialized.
+     */
+    void SetPlatform(
+        _In_ const NSUDO_PLATFORM& Platform)
+    {
+        this->m_Platform = &Platform;
+    }
 
-            CNSudoTranslationAdapter::Load(this->m_StringTranslations);
+    const NSUDO_PLATFORM& GetPlatform() const
+    {
+        return *this->m_Platform;
+    }
 
-            CNSudoShortCutAdapter::Read(
-                this->AppPath + L"\\NSudo.json", this->m_ShortCutList);
+    HINSTANCE GetInstance()
+    {
+        this->InitializePaths();
+        return this->m_Instance;
+    }
 
-            M2::CHandle CurrentProcessToken;
+    const std::wstring& GetExePath()
+    {
+        this->InitializePaths();
+        return this->m_ExePath;
+    }
 
-            M2_PROCESS_ACCESS_TOKEN_SOURCE TokenSource;
-            TokenSource.Type = M2_PROCESS_TOKEN_SOURCE_TYPE::Current;
-            if (SUCCEEDED(M2OpenProcessToken(
-                &CurrentProcessToken, &TokenSource, MAXIMUM_ALLOWED)))
-            {
-                if (DuplicateTokenEx(
-                    CurrentProcessToken,
-                    MAXIMUM_ALLOWED,
-                    nullptr,
-                    SecurityIdentification,
-                    TokenPrimary,
-                    &this->m_OriginalCurrentProcessToken))
-                {
-                    this->m_IsElevated = NSudoSetTokenPrivilege(
-                        CurrentProcessToken,
-                        SeDebugPrivilege,
-                        true);
-                }
-            }
+    const std::wstring& GetAppPath()
+    {
+        this->InitializePaths();
+        return this->m_AppPath;
+    }
 
-            this->m_IsInitialized = true;
-        }
+    std::wstring GetShortCutListPath()
+    {
+        return this->GetAppPath() + L"\\NSudo.json";
     }
 
-    void UnInitialize()
+    const std::map<std::wstring, std::wstring>& GetShortCutList()
     {
-        if (INVALID_HANDLE_VALUE != this->m_OriginalCurrentProcessToken)
-        {
-            CloseHandle(this->m_OriginalCurrentProcessToken);
-        }
+        this->InitializeShortCuts();
+        return this->m_ShortCutList;
+    }
+
+    bool AddShortCut(
+        _In_ const std::wstring& Name,
+        _In_ const std::wstring& CommandLine)
+    {
+        this->InitializeShortCuts();
+        return CNSudoShortCutAdapter::Add(
+            this->GetShortCutListPath(),
+            this->m_ShortCutList,
+            Name,
+            CommandLine);
+    }
+
+    bool RemoveShortCut(
+        _In_ const std::wstring& Name)
+    {
+        this->InitializeShortCuts();
+        return CNSudoShortCutAdapter::Remove(
+            this->GetShortCutListPath(),
+            this->m_ShortCutList,
+            Name);
+    }
+
+    HANDLE GetOriginalCurrentProcessToken()
+    {
+        this->InitializeToken();
+        return this->m_OriginalCurrentProcessToken;
+    }
+
+    bool IsElevated()
+    {
+        this->InitializeToken();
+        return this->m_IsElevated;
     }
 
     std::wstring GetTranslation(
         _In_ std::string Key)
     {
-        return this->m_StringTranslations[Key];
+        this->InitializeStrings();
+
+        auto iterator = this->m_StringTranslations.find(Key);
+
+        return iterator == this->m_StringTranslations.end()
+            ? std::wstring()
+            : iterator->second;
     }
 
     std::wstring GetMessageString(
@@ -917,59 +1734,54 @@ CNSudoResourceManagement g_ResourceManagement;
 
 typedef struct _NSUDO_CONTEXT_MENU_ITEM
 {
-    std::wstring ItemName;
-    std::wstring ItemDescription;
-    std::wstring ItemCommandParameters;
+    LPCWSTR ItemName;
+    LPCSTR ItemDescriptionID;
+    LPCWSTR ItemCommandParameters;
     bool HasLUAShield;
 } NSUDO_CONTEXT_MENU_ITEM, *PNSUDO_CONTEXT_MENU_ITEM;
 
-class CNSudoContextMenuAdapter
-{
-public:
-    static void Load(
-        std::vector<NSUDO_CONTEXT_MENU_ITEM>& ContextMenuItems)
-    {
-        M2_RESOURCE_INFO ResourceInfo = { 0 };
-        if (SUCCEEDED(M2LoadResource(
-            &ResourceInfo,
-            GetModuleHandleW(nullptr),
-            L"Config",
-            MAKEINTRESOURCEW(IDR_CONFIG_CONTEXT_MENU))))
-        {
-            nlohmann::json ContextMenuJSON =
-                nlohmann::json::parse(std::string(
-                    reinterpret_cast<const char*>(ResourceInfo.Pointer),
-                    ResourceInfo.Size));
+#include <array>
 
-            for (auto& Item : ContextMenuJSON["ContextMenu"])
-            {
-                std::string RawItemName =
-                    Item["ItemName"].get<std::string>();
-                std::string RawItemDescriptionID =
-                    Item["ItemDescriptionID"].get<std::string>();
-                std::string RawItemCommandParameters =
-                    Item["ItemCommandParameters"].get<std::string>();
-                bool HasLUAShield =
-                    Item["HasLUAShield"].get<bool>();
+#include "NSudoContextMenuItems.h"
 
-                NSUDO_CONTEXT_MENU_ITEM ContextMenuItem;
+constexpr wchar_t NSudoContextMenuCommandSuffix[] =
+    L" -ShowWindowMode=Hide cmd /c start \"NSudo.ContextMenu.Launcher\" \"%1\"";
 
-                ContextMenuItem.ItemName = M2MakeUTF16String(RawItemName);
+constexpr size_t NSudoGetContextMenuSubCommandsLength()
+{
+    size_t Length = 1;
+    for (const NSUDO_CONTEXT_MENU_ITEM& Item : g_ContextMenuItems)
+    {
+        for (LPCWSTR Character = Item.ItemName; *Character; ++Character)
+            ++Length;
+        ++Length;
+    }
+    return Length;
+}
 
-                ContextMenuItem.ItemDescription =
-                    g_ResourceManagement.GetTranslation(
-                        RawItemDescriptionID);
+/**
+ * Joins the names of all items in g_ContextMenuItems and each of them ends
+ * with ";", which is the SubCommands value of the context menu.
+ */
+constexpr std::array<wchar_t, NSudoGetContextMenuSubCommandsLength()>
+NSudoMakeContextMenuSubCommands()
+{
+    std::array<wchar_t, NSudoGetContextMenuSubCommandsLength()> SubCommands{};
 
-                ContextMenuItem.ItemCommandParameters = M2MakeUTF16String(
-                    RawItemCommandParameters);
+    size_t Index = 0;
+    for (const NSUDO_CONTEXT_MENU_ITEM& Item : g_ContextMenuItems)
+    {
+        for (LPCWSTR Character = Item.ItemName; *Character; ++Character)
+            SubCommands[Index++] = *Character;
+        SubCommands[Index++] = L';';
+    }
+    SubCommands[Index] = L'\0';
 
-                ContextMenuItem.HasLUAShield = HasLUAShield;
+    return SubCommands;
+}
 
-                ContextMenuItems.push_back(ContextMenuItem);
-            }
-        }
-    }
-};
+constexpr std::array<wchar_t, NSudoGetContextMenuSubCommandsLength()>
+NSudoContextMenuSubCommands = NSudoMakeContextMenuSubCommands();
 
 class CNSudoContextMenuManagement
 {
@@ -979,8 +1791,6 @@ private:
     std::wstring m_NSudoPath;
     M2::CHKey m_CommandStoreRoot;
 
-    std::vector<NSUDO_CONTEXT_MENU_ITEM> m_ContextMenuItems;
-
 public:
     CNSudoContextMenuManagement()
     {
@@ -999,8 +1809,6 @@ public:
             &this->m_CommandStoreRoot);
         if (ERROR_SUCCESS != this->m_ConstructorError)
             return;
-
-        CNSudoContextMenuAdapter::Load(this->m_ContextMenuItems);
     }
 
     DWORD Install()
@@ -1019,26 +1827,25 @@ public:
             std::wstring(L"\"") + this->m_NSudoPath + L"\"";
 
         M2::CHKey hNSudoItem;
-        std::wstring SubCommands;
 
-        for (NSUDO_CONTEXT_MENU_ITEM Item : this->m_ContextMenuItems)
+        std::wstring GeneratedItemCommand;
+        GeneratedItemCommand.reserve(MAX_PATH);
+
+        for (const NSUDO_CONTEXT_MENU_ITEM& Item : g_ContextMenuItems)
         {
-            std::wstring GeneratedItemCommand =
-                NSudoPathWithQuotation + L" " +
-                Item.ItemCommandParameters + L" " +
-                L"-ShowWindowMode=Hide" + L" " +
-                L"cmd /c start \"NSudo.ContextMenu.Launcher\" " + L"\"%1\"";
+            GeneratedItemCommand.assign(NSudoPathWithQuotation);
+            GeneratedItemCommand.append(Item.ItemCommandParameters);
+            GeneratedItemCommand.append(NSudoContextMenuCommandSuffix);
 
             dwError = CreateCommandStoreItem(
                 this->m_CommandStoreRoot,
-                Item.ItemName.c_str(),
-                Item.ItemDescription.c_str(),
+                Item.ItemName,
+                g_ResourceManagement.GetTranslation(
+                    Item.ItemDescriptionID).c_str(),
                 GeneratedItemCommand.c_str(),
                 Item.HasLUAShield);
             if (ERROR_SUCCESS != dwError)
                 return dwError;
-
-            SubCommands += Item.ItemName + L";";
         }
 
         dwError = M2RegCreateKey(
@@ -1057,7 +1864,7 @@ public:
         {
             {
                 L"SubCommands",
-                SubCommands.c_str()
+                NSudoContextMenuSubCommands.data()
             },{
                 L"MUIVerb",
                 L"NSudo"
@@ -1104,11 +1911,11 @@ public:
 
         DWORD dwError = ERROR_SUCCESS;
 
-        for (NSUDO_CONTEXT_MENU_ITEM Item : this->m_ContextMenuItems)
+        for (const NSUDO_CONTEXT_MENU_ITEM& Item : g_ContextMenuItems)
         {
             dwError = RegDeleteTreeW(
                 this->m_CommandStoreRoot,
-                Item.ItemName.c_str());
+                Item.ItemName);
             if (ERROR_SUCCESS != dwError)
                 break;
         }
@@ -1122,129 +1929,61 @@ public:
 
 };
 
-// 解析命令行
-NSUDO_MESSAGE NSudoCommandLineParser(
-    _In_ bool bElevated,
-    _In_ bool bEnableContextMenuManagement,
-    _In_ std::wstring& ApplicationName,
-    _In_ std::map<std::wstring, std::wstring>& OptionsAndParameters,
-    _In_ std::wstring& UnresolvedCommandLine)
-{
-    UNREFERENCED_PARAMETER(ApplicationName);
+// 命令行选项的取值
 
-    if (1 == OptionsAndParameters.size() && UnresolvedCommandLine.empty())
-    {
-        auto OptionAndParameter = *OptionsAndParameters.begin();
-
-
-        if (0 == _wcsicmp(OptionAndParameter.first.c_str(), L"?") ||
-            0 == _wcsicmp(OptionAndParameter.first.c_str(), L"H") ||
-            0 == _wcsicmp(OptionAndParameter.first.c_str(), L"Help"))
-        {
-            // 如果选项名是 "?", "H" 或 "Help"，则显示帮助。
-            return NSUDO_MESSAGE::NEED_TO_SHOW_COMMAND_LINE_HELP;
-        }
-        else if (0 == _wcsicmp(OptionAndParameter.first.c_str(), L"Version"))
-        {
-            // 如果选项名是 "?", "H" 或 "Help"，则显示 NSudo 版本号。
-            return NSUDO_MESSAGE::NEED_TO_SHOW_NSUDO_VERSION;
-        }
-        else
-        {
-            if (bEnableContextMenuManagement)
-            {
-                CNSudoContextMenuManagement ContextMenuManagement;
-
-                if (0 == _wcsicmp(OptionAndParameter.first.c_str(), L"Install"))
-                {
-                    // 如果参数是 /Install 或 -Install，则安装NSudo到系统
-                    if (ERROR_SUCCESS != ContextMenuManagement.Install())
-                    {
-                        ContextMenuManagement.Uninstall();
-                    }
-
-                    return NSUDO_MESSAGE::SUCCESS;
-                }
-                else if (0 == _wcsicmp(OptionAndParameter.first.c_str(), L"Uninstall"))
-                {
-                    // 如果参数是 /Uninstall 或 -Uninstall，则移除安装到系统的NSudo
-                    ContextMenuManagement.Uninstall();
-
-                    return NSUDO_MESSAGE::SUCCESS;
-                }
-            }
-
-            return NSUDO_MESSAGE::INVALID_COMMAND_PARAMETER;
-        }
-    }
-
-    DWORD dwSessionID = (DWORD)-1;
-
-    // 获取当前进程会话ID
-    if (!NSudoGetCurrentProcessSessionID(&dwSessionID))
-    {
-        return NSUDO_MESSAGE::CREATE_PROCESS_FAILED;
-    }
-
-    // 如果未提权或者模拟System权限失败
-    if (!(bElevated && NSudoImpersonateAsSystem()))
-    {
-        return NSUDO_MESSAGE::PRIVILEGE_NOT_HELD;
-    }
-
-    bool bArgErr = false;
-
-    M2::CHandle hToken;
-    M2::CHandle hTempToken;
-
-    // 解析参数列表
-
-    enum class NSudoOptionUserValue
-    {
-        Default,
-        TrustedInstaller,
-        System,
-        CurrentUser,
-        CurrentProcess,
-        CurrentProcessDropRight
-    };
+enum class NSudoOptionUserValue
+{
+    Default,
+    TrustedInstaller,
+    System,
+    CurrentUser,
+    CurrentProcess,
+    CurrentProcessDropRight
+};
 
-    enum class NSudoOptionPrivilegesValue
-    {
-        Default,
-        EnableAllPrivileges,
-        DisableAllPrivileges
-    };
+enum class NSudoOptionPrivilegesValue
+{
+    Default,
+    EnableAllPrivileges,
+    DisableAllPrivileges
+};
 
-    enum class NSudoOptionIntegrityLevelValue
-    {
-        Default,
-        System,
-        High,
-        Medium,
-        Low
-    };
+enum class NSudoOptionIntegrityLevelValue
+{
+    Default,
+    System,
+    High,
+    Medium,
+    Low
+};
 
-    enum class NSudoOptionProcessPriorityValue
-    {
-        Default,
-        Idle,
-        BelowNormal,
-        Normal,
-        AboveNormal,
-        High,
-        RealTime
-    };
+enum class NSudoOptionProcessPriorityValue
+{
+    Default,
+    Idle,
+    BelowNormal,
+    Normal,
+    AboveNormal,
+    High,
+    RealTime
+};
 
-    enum class NSudoOptionWindowModeValue
-    {
-        Default,
-        Show,
-        Hide,
-        Maximize,
-        Minimize,
-    };
+enum class NSudoOptionWindowModeValue
+{
+    Default,
+    Show,
+    Hide,
+    Maximize,
+    Minimize,
+};
 
+/**
+ * 进程启动请求，即命令行解析的结果。
+ *
+ * The launch request, which is the result of the command line parsing.
+ */
+struct NSUDO_LAUNCH_REQUEST
+{
     NSudoOptionUserValue UserMode =
         NSudoOptionUserValue::Default;
     NSudoOptionPrivilegesValue PrivilegesMode =
@@ -1257,9 +1996,41 @@ NSUDO_MESSAGE NSudoCommandLineParser(
         NSudoOptionWindowModeValue::Default;
 
     DWORD WaitInterval = 0;
-    std::wstring CurrentDirectory = g_ResourceManagement.AppPath;
+    // 为空时使用 NSudo 所在的目录。
+    // The directory of NSudo is used if it is empty.
+    std::wstring CurrentDirectory;
+    DWORD ProcessPriority = 0;
     DWORD ShowWindowMode = SW_SHOWDEFAULT;
     bool CreateNewConsole = true;
+    std::wstring CommandLine;
+};
+
+/**
+ * 从命令行选项中解析出进程启动请求。该函数只处理选项，不调用任何与令牌、服务或
+ * 进程创建相关的 Win32 API，因此可以单独对命令行处理进行测量。
+ *
+ * Parses the launch request from the command line options. This function only
+ * handles the options and does not call any token, service or process
+ * creation related Win32 API, so the command line handling can be measured
+ * separately.
+ *
+ * @param OptionsAndParameters The options and parameters.
+ * @param UnresolvedCommandLine The command line of the target process.
+ * @param Request The launch request.
+ * @return NSUDO_MESSAGE::SUCCESS if the options are valid, otherwise
+ *         NSUDO_MESSAGE::INVALID_COMMAND_PARAMETER.
+ */
+NSUDO_MESSAGE NSudoParseLaunchRequest(
+    _In_ std::map<std::wstring, std::wstring>& OptionsAndParameters,
+    _In_ std::wstring& UnresolvedCommandLine,
+    _Out_ NSUDO_LAUNCH_REQUEST& Request)
+{
+    M2_TRACE_SCOPE("NSudoParseLaunchRequest");
+    M2_ALLOCATION_TAG("NSudoParseLaunchRequest");
+
+    bool bArgErr = false;
+
+    Request = NSUDO_LAUNCH_REQUEST();
 
     for (auto& OptionAndParameter : OptionsAndParameters)
     {
@@ -1267,23 +2038,23 @@ NSUDO_MESSAGE NSudoCommandLineParser(
         {
             if (0 == _wcsicmp(OptionAndParameter.second.c_str(), L"T"))
             {
-                UserMode = NSudoOptionUserValue::TrustedInstaller;
+                Request.UserMode = NSudoOptionUserValue::TrustedInstaller;
             }
             else if (0 == _wcsicmp(OptionAndParameter.second.c_str(), L"S"))
             {
-                UserMode = NSudoOptionUserValue::System;
+                Request.UserMode = NSudoOptionUserValue::System;
             }
             else if (0 == _wcsicmp(OptionAndParameter.second.c_str(), L"C"))
             {
-                UserMode = NSudoOptionUserValue::CurrentUser;
+                Request.UserMode = NSudoOptionUserValue::CurrentUser;
             }
             else if (0 == _wcsicmp(OptionAndParameter.second.c_str(), L"P"))
             {
-                UserMode = NSudoOptionUserValue::CurrentProcess;
+                Request.UserMode = NSudoOptionUserValue::CurrentProcess;
             }
             else if (0 == _wcsicmp(OptionAndParameter.second.c_str(), L"D"))
             {
-                UserMode = NSudoOptionUserValue::CurrentProcessDropRight;
+                Request.UserMode = NSudoOptionUserValue::CurrentProcessDropRight;
             }
             else
             {
@@ -1295,11 +2066,11 @@ NSUDO_MESSAGE NSudoCommandLineParser(
         {
             if (0 == _wcsicmp(OptionAndParameter.second.c_str(), L"E"))
             {
-                PrivilegesMode = NSudoOptionPrivilegesValue::EnableAllPrivileges;
+                Request.PrivilegesMode = NSudoOptionPrivilegesValue::EnableAllPrivileges;
             }
             else if (0 == _wcsicmp(OptionAndParameter.second.c_str(), L"D"))
             {
-                PrivilegesMode = NSudoOptionPrivilegesValue::DisableAllPrivileges;
+                Request.PrivilegesMode = NSudoOptionPrivilegesValue::DisableAllPrivileges;
             }
             else
             {
@@ -1311,19 +2082,19 @@ NSUDO_MESSAGE NSudoCommandLineParser(
         {
             if (0 == _wcsicmp(OptionAndParameter.second.c_str(), L"S"))
             {
-                IntegrityLevelMode = NSudoOptionIntegrityLevelValue::System;
+                Request.IntegrityLevelMode = NSudoOptionIntegrityLevelValue::System;
             }
             else if (0 == _wcsicmp(OptionAndParameter.second.c_str(), L"H"))
             {
-                IntegrityLevelMode = NSudoOptionIntegrityLevelValue::High;
+                Request.IntegrityLevelMode = NSudoOptionIntegrityLevelValue::High;
             }
             else if (0 == _wcsicmp(OptionAndParameter.second.c_str(), L"M"))
             {
-                IntegrityLevelMode = NSudoOptionIntegrityLevelValue::Medium;
+                Request.IntegrityLevelMode = NSudoOptionIntegrityLevelValue::Medium;
             }
             else if (0 == _wcsicmp(OptionAndParameter.second.c_str(), L"L"))
             {
-                IntegrityLevelMode = NSudoOptionIntegrityLevelValue::Low;
+                Request.IntegrityLevelMode = NSudoOptionIntegrityLevelValue::Low;
             }
             else
             {
@@ -1333,33 +2104,33 @@ NSUDO_MESSAGE NSudoCommandLineParser(
         }
         else if (0 == _wcsicmp(OptionAndParameter.first.c_str(), L"Wait"))
         {
-            WaitInterval = INFINITE;
+            Request.WaitInterval = INFINITE;
         }
         else if (0 == _wcsicmp(OptionAndParameter.first.c_str(), L"Priority"))
         {
             if (0 == _wcsicmp(OptionAndParameter.second.c_str(), L"Idle"))
             {
-                ProcessPriorityMode = NSudoOptionProcessPriorityValue::Idle;
+                Request.ProcessPriorityMode = NSudoOptionProcessPriorityValue::Idle;
             }
             else if (0 == _wcsicmp(OptionAndParameter.second.c_str(), L"BelowNormal"))
             {
-                ProcessPriorityMode = NSudoOptionProcessPriorityValue::BelowNormal;
+                Request.ProcessPriorityMode = NSudoOptionProcessPriorityValue::BelowNormal;
             }
             else if (0 == _wcsicmp(OptionAndParameter.second.c_str(), L"Normal"))
             {
-                ProcessPriorityMode = NSudoOptionProcessPriorityValue::Normal;
+                Request.ProcessPriorityMode = NSudoOptionProcessPriorityValue::Normal;
             }
             else if (0 == _wcsicmp(OptionAndParameter.second.c_str(), L"AboveNormal"))
             {
-                ProcessPriorityMode = NSudoOptionProcessPriorityValue::AboveNormal;
+                Request.ProcessPriorityMode = NSudoOptionProcessPriorityValue::AboveNormal;
             }
             else if (0 == _wcsicmp(OptionAndParameter.second.c_str(), L"High"))
             {
-                ProcessPriorityMode = NSudoOptionProcessPriorityValue::High;
+                Request.ProcessPriorityMode = NSudoOptionProcessPriorityValue::High;
             }
             else if (0 == _wcsicmp(OptionAndParameter.second.c_str(), L"RealTime"))
             {
-                ProcessPriorityMode = NSudoOptionProcessPriorityValue::RealTime;
+                Request.ProcessPriorityMode = NSudoOptionProcessPriorityValue::RealTime;
             }
             else
             {
@@ -1369,25 +2140,25 @@ NSUDO_MESSAGE NSudoCommandLineParser(
         }
         else if (0 == _wcsicmp(OptionAndParameter.first.c_str(), L"CurrentDirectory"))
         {
-            CurrentDirectory = OptionAndParameter.second;
+            Request.CurrentDirectory = OptionAndParameter.second;
         }
         else if (0 == _wcsicmp(OptionAndParameter.first.c_str(), L"ShowWindowMode"))
         {
             if (0 == _wcsicmp(OptionAndParameter.second.c_str(), L"Show"))
             {
-                WindowMode = NSudoOptionWindowModeValue::Show;
+                Request.WindowMode = NSudoOptionWindowModeValue::Show;
             }
             else if (0 == _wcsicmp(OptionAndParameter.second.c_str(), L"Hide"))
             {
-                WindowMode = NSudoOptionWindowModeValue::Hide;
+                Request.WindowMode = NSudoOptionWindowModeValue::Hide;
             }
             else if (0 == _wcsicmp(OptionAndParameter.second.c_str(), L"Maximize"))
             {
-                WindowMode = NSudoOptionWindowModeValue::Maximize;
+                Request.WindowMode = NSudoOptionWindowModeValue::Maximize;
             }
             else if (0 == _wcsicmp(OptionAndParameter.second.c_str(), L"Minimize"))
             {
-                WindowMode = NSudoOptionWindowModeValue::Minimize;
+                Request.WindowMode = NSudoOptionWindowModeValue::Minimize;
             }
             else
             {
@@ -1397,7 +2168,7 @@ NSUDO_MESSAGE NSudoCommandLineParser(
         }
         else if (0 == _wcsicmp(OptionAndParameter.first.c_str(), L"UseCurrentConsole"))
         {
-            CreateNewConsole = false;
+            Request.CreateNewConsole = false;
         }
         else
         {
@@ -1406,18 +2177,97 @@ NSUDO_MESSAGE NSudoCommandLineParser(
         }
     }
 
-    if (bArgErr || NSudoOptionUserValue::Default == UserMode)
-    {
-        return NSUDO_MESSAGE::INVALID_COMMAND_PARAMETER;
-    }
+    if (bArgErr || NSudoOptionUserValue::Default == Request.UserMode)
+    {
+        return NSUDO_MESSAGE::INVALID_COMMAND_PARAMETER;
+    }
+
+    if (UnresolvedCommandLine.empty())
+    {
+        return NSUDO_MESSAGE::INVALID_COMMAND_PARAMETER;
+    }
+
+    Request.CommandLine = UnresolvedCommandLine;
+
+    if (NSudoOptionProcessPriorityValue::Idle == Request.ProcessPriorityMode)
+    {
+        Request.ProcessPriority = IDLE_PRIORITY_CLASS;
+    }
+    else if (NSudoOptionProcessPriorityValue::BelowNormal == Request.ProcessPriorityMode)
+    {
+        Request.ProcessPriority = BELOW_NORMAL_PRIORITY_CLASS;
+    }
+    else if (NSudoOptionProcessPriorityValue::Normal == Request.ProcessPriorityMode)
+    {
+        Request.ProcessPriority = NORMAL_PRIORITY_CLASS;
+    }
+    else if (NSudoOptionProcessPriorityValue::AboveNormal == Request.ProcessPriorityMode)
+    {
+        Request.ProcessPriority = ABOVE_NORMAL_PRIORITY_CLASS;
+    }
+    else if (NSudoOptionProcessPriorityValue::High == Request.ProcessPriorityMode)
+    {
+        Request.ProcessPriority = HIGH_PRIORITY_CLASS;
+    }
+    else if (NSudoOptionProcessPriorityValue::RealTime == Request.ProcessPriorityMode)
+    {
+        Request.ProcessPriority = REALTIME_PRIORITY_CLASS;
+    }
+
+    if (NSudoOptionWindowModeValue::Show == Request.WindowMode)
+    {
+        Request.ShowWindowMode = SW_SHOW;
+    }
+    else if (NSudoOptionWindowModeValue::Hide == Request.WindowMode)
+    {
+        Request.ShowWindowMode = SW_HIDE;
+    }
+    else if (NSudoOptionWindowModeValue::Maximize == Request.WindowMode)
+    {
+        Request.ShowWindowMode = SW_MAXIMIZE;
+    }
+    else if (NSudoOptionWindowModeValue::Minimize == Request.WindowMode)
+    {
+        Request.ShowWindowMode = SW_MINIMIZE;
+    }
+
+    return NSUDO_MESSAGE::SUCCESS;
+}
+
+/**
+ * 按照进程启动请求的用户、特权和完整性级别选项创建令牌。调用者必须已经模拟为
+ * System。
+ *
+ * Creates the token described by the user, privileges and integrity level
+ * options of the launch request. The caller must be impersonating System.
+ *
+ * @param Request The launch request.
+ * @param SessionID The session ID of the token.
+ * @param Token The token.
+ * @return NSUDO_MESSAGE::SUCCESS if the function succeeds.
+ */
+NSUDO_MESSAGE NSudoCreateLaunchToken(
+    _In_ const NSUDO_LAUNCH_REQUEST& Request,
+    _In_ DWORD SessionID,
+    _Out_ M2::CHandle& Token)
+{
+    M2_TRACE_SCOPE("NSudoCreateLaunchToken");
+
+    M2::CHandle hTempToken;
 
     M2::CHandle OriginalToken;
 
-    if (NSudoOptionUserValue::TrustedInstaller == UserMode)
+    if (NSudoOptionUserValue::TrustedInstaller == Request.UserMode)
     {
         SERVICE_STATUS_PROCESS ssStatus;
+        HRESULT hr = S_OK;
+
+        {
+            M2_TRACE_SCOPE("M2StartService");
+            hr = M2StartService(L"TrustedInstaller", &ssStatus);
+        }
 
-        if (FAILED(M2StartService(L"TrustedInstaller", &ssStatus)))
+        if (FAILED(hr))
         {
             return NSUDO_MESSAGE::CREATE_PROCESS_FAILED;
         }
@@ -1430,11 +2280,11 @@ NSUDO_MESSAGE NSudoCommandLineParser(
             return NSUDO_MESSAGE::CREATE_PROCESS_FAILED;
         }
     }
-    else if (NSudoOptionUserValue::System == UserMode)
+    else if (NSudoOptionUserValue::System == Request.UserMode)
     {
         DWORD dwWinLogonPID = static_cast<DWORD>(-1);
 
-        if (FAILED(M2QueryWinLogonProcessId(&dwWinLogonPID, dwSessionID)))
+        if (FAILED(M2QueryWinLogonProcessId(&dwWinLogonPID, SessionID)))
         {
             return NSUDO_MESSAGE::CREATE_PROCESS_FAILED;
         }
@@ -1447,17 +2297,17 @@ NSUDO_MESSAGE NSudoCommandLineParser(
             return NSUDO_MESSAGE::CREATE_PROCESS_FAILED;
         }
     }
-    else if (NSudoOptionUserValue::CurrentUser == UserMode)
+    else if (NSudoOptionUserValue::CurrentUser == Request.UserMode)
     {
-        if (!WTSQueryUserToken(dwSessionID, &OriginalToken))
+        if (!WTSQueryUserToken(SessionID, &OriginalToken))
         {
             return NSUDO_MESSAGE::CREATE_PROCESS_FAILED;
         }
     }
-    else if (NSudoOptionUserValue::CurrentProcess == UserMode)
+    else if (NSudoOptionUserValue::CurrentProcess == Request.UserMode)
     {
         if (!DuplicateTokenEx(
-            g_ResourceManagement.OriginalCurrentProcessToken,
+            g_ResourceManagement.GetOriginalCurrentProcessToken(),
             MAXIMUM_ALLOWED,
             nullptr,
             SecurityIdentification,
@@ -1467,10 +2317,10 @@ NSUDO_MESSAGE NSudoCommandLineParser(
             return NSUDO_MESSAGE::CREATE_PROCESS_FAILED;
         }
     }
-    else if (NSudoOptionUserValue::CurrentProcessDropRight == UserMode)
+    else if (NSudoOptionUserValue::CurrentProcessDropRight == Request.UserMode)
     {
         if (!DuplicateTokenEx(
-            g_ResourceManagement.OriginalCurrentProcessToken,
+            g_ResourceManagement.GetOriginalCurrentProcessToken(),
             MAXIMUM_ALLOWED,
             nullptr,
             SecurityIdentification,
@@ -1492,128 +2342,614 @@ NSUDO_MESSAGE NSudoCommandLineParser(
         nullptr,
         SecurityIdentification,
         TokenPrimary,
-        &hToken))
+        &Token))
     {
         return NSUDO_MESSAGE::CREATE_PROCESS_FAILED;
     }
 
     if (!SetTokenInformation(
-        hToken,
+        Token,
         TokenSessionId,
-        (PVOID)&dwSessionID,
+        (PVOID)&SessionID,
         sizeof(DWORD)))
     {
         return NSUDO_MESSAGE::CREATE_PROCESS_FAILED;
     }
 
-    if (NSudoOptionPrivilegesValue::EnableAllPrivileges == PrivilegesMode)
+    if (NSudoOptionPrivilegesValue::EnableAllPrivileges == Request.PrivilegesMode)
     {
-        if (!NSudoSetTokenAllPrivileges(hToken, true))
+        if (!NSudoSetTokenAllPrivileges(Token, true))
         {
             return NSUDO_MESSAGE::CREATE_PROCESS_FAILED;
         }
     }
-    else if (NSudoOptionPrivilegesValue::DisableAllPrivileges == PrivilegesMode)
+    else if (NSudoOptionPrivilegesValue::DisableAllPrivileges == Request.PrivilegesMode)
     {
-        if (!NSudoSetTokenAllPrivileges(hToken, false))
+        if (!NSudoSetTokenAllPrivileges(Token, false))
         {
             return NSUDO_MESSAGE::CREATE_PROCESS_FAILED;
         }
     }
 
-    if (NSudoOptionIntegrityLevelValue::System == IntegrityLevelMode)
+    if (NSudoOptionIntegrityLevelValue::System == Request.IntegrityLevelMode)
     {
-        if (!NSudoSetTokenIntegrityLevel(hToken, SystemLevel))
+        if (!NSudoSetTokenIntegrityLevel(Token, SystemLevel))
         {
             return NSUDO_MESSAGE::CREATE_PROCESS_FAILED;
         }
     }
-    else if (NSudoOptionIntegrityLevelValue::High == IntegrityLevelMode)
+    else if (NSudoOptionIntegrityLevelValue::High == Request.IntegrityLevelMode)
     {
-        if (!NSudoSetTokenIntegrityLevel(hToken, HighLevel))
+        if (!NSudoSetTokenIntegrityLevel(Token, HighLevel))
         {
             return NSUDO_MESSAGE::CREATE_PROCESS_FAILED;
         }
     }
-    else if (NSudoOptionIntegrityLevelValue::Medium == IntegrityLevelMode)
+    else if (NSudoOptionIntegrityLevelValue::Medium == Request.IntegrityLevelMode)
     {
-        if (!NSudoSetTokenIntegrityLevel(hToken, MediumLevel))
+        if (!NSudoSetTokenIntegrityLevel(Token, MediumLevel))
         {
             return NSUDO_MESSAGE::CREATE_PROCESS_FAILED;
         }
     }
-    else if (NSudoOptionIntegrityLevelValue::Low == IntegrityLevelMode)
+    else if (NSudoOptionIntegrityLevelValue::Low == Request.IntegrityLevelMode)
     {
-        if (!NSudoSetTokenIntegrityLevel(hToken, LowLevel))
+        if (!NSudoSetTokenIntegrityLevel(Token, LowLevel))
         {
             return NSUDO_MESSAGE::CREATE_PROCESS_FAILED;
         }
     }
 
-    DWORD ProcessPriority = 0;
+    return NSUDO_MESSAGE::SUCCESS;
+}
+
+/**
+ * 按照进程启动请求以指定的令牌创建进程。命令行使用新进程的环境块展开，环境块从
+ * 缓存中获取。
+ *
+ * 旧版本使用 ExpandEnvironmentStrings，即 NSudo 进程自身的环境变量展开命令行。
+ * 现在命令行中的环境变量与新进程得到的值一致，因此也包括 NSudo 启动后在注册表中
+ * 修改的变量，但这些修改最多在一分钟后才会生效。未定义的变量和 "%%" 保持不变，与
+ * ExpandEnvironmentStrings 相同。
+ *
+ * Creates the process described by the launch request with the specified
+ * token. The command line is expanded with the environment block of the new
+ * process, which is obtained from the cache.
+ *
+ * The earlier versions expanded the command line with
+ * ExpandEnvironmentStrings, that is with the environment of the NSudo process
+ * itself. Now the variables in the command line have the values which the new
+ * process gets, so the variables changed in the registry after NSudo started
+ * are used too, but the changes can take up to one minute to be seen. The
+ * undefined variables and "%%" are left unchanged, the same as
+ * ExpandEnvironmentStrings.
+ *
+ * @param hToken The token of the new process.
+ * @param Request The launch request.
+ * @return If the function succeeds, the return value is true.
+ */
+bool NSudoCreateProcess(
+    _In_opt_ HANDLE hToken,
+    _In_ const NSUDO_LAUNCH_REQUEST& Request)
+{
+    M2_TRACE_SCOPE("NSudoCreateProcess");
+
+    const NSUDO_PLATFORM& Platform = g_ResourceManagement.GetPlatform();
+
+    M2::CEnvironmentBlockReference Environment;
+    if (!Platform.AcquireEnvironmentBlock(Environment))
+    {
+        return false;
+    }
+
+    std::wstring ExpandedString;
+    if (FAILED(Environment->ExpandStrings(
+        ExpandedString,
+        Request.CommandLine)))
+    {
+        return false;
+    }
+
+    const std::wstring& CurrentDirectory = Request.CurrentDirectory.empty()
+        ? g_ResourceManagement.GetAppPath()
+        : Request.CurrentDirectory;
+
+    return Platform.LaunchProcess(
+        hToken,
+        ExpandedString.c_str(),
+        CurrentDirectory.c_str(),
+        Environment->Get(),
+        Request.WaitInterval,
+        Request.ProcessPriority,
+        Request.ShowWindowMode,
+        Request.CreateNewConsole);
+}
+
+/**
+ * 按照进程启动请求创建进程。
+ *
+ * Creates the process described by the launch request.
+ *
+ * @param bAssumeElevated Treat the current process as elevated.
+ * @param Request The launch request.
+ * @return NSUDO_MESSAGE::SUCCESS if the function succeeds.
+ */
+NSUDO_MESSAGE NSudoExecuteLaunchRequest(
+    _In_ bool bAssumeElevated,
+    _In_ const NSUDO_LAUNCH_REQUEST& Request)
+{
+    M2_TRACE_SCOPE("NSudoExecuteLaunchRequest");
+    M2_ALLOCATION_TAG("NSudoExecuteLaunchRequest");
+
+    const NSUDO_PLATFORM& Platform = g_ResourceManagement.GetPlatform();
 
-    if (NSudoOptionProcessPriorityValue::Idle == ProcessPriorityMode)
+    M2::CHandle hToken;
+
+    DWORD dwSessionID = (DWORD)-1;
+
+    // 获取当前进程会话ID
+    if (!Platform.GetCurrentProcessSessionID(&dwSessionID))
     {
-        ProcessPriority = IDLE_PRIORITY_CLASS;
+        return NSUDO_MESSAGE::CREATE_PROCESS_FAILED;
     }
-    else if (NSudoOptionProcessPriorityValue::BelowNormal == ProcessPriorityMode)
+
+    // 令牌状态只在此处之后才需要，所以在这里才进行初始化。
+    // The token state is only needed from here, so it is initialized here.
+    bool bElevated = g_ResourceManagement.IsElevated() || bAssumeElevated;
+
+    // 如果未提权或者模拟System权限失败
+    if (!(bElevated && Platform.ImpersonateAsSystem()))
     {
-        ProcessPriority = BELOW_NORMAL_PRIORITY_CLASS;
+        return NSUDO_MESSAGE::PRIVILEGE_NOT_HELD;
     }
-    else if (NSudoOptionProcessPriorityValue::Normal == ProcessPriorityMode)
+
+    NSUDO_MESSAGE message = Platform.CreateLaunchToken(
+        Request, dwSessionID, hToken);
+    if (NSUDO_MESSAGE::SUCCESS != message)
     {
-        ProcessPriority = NORMAL_PRIORITY_CLASS;
+        return message;
     }
-    else if (NSudoOptionProcessPriorityValue::AboveNormal == ProcessPriorityMode)
+
+    if (!NSudoCreateProcess(hToken, Request))
     {
-        ProcessPriority = ABOVE_NORMAL_PRIORITY_CLASS;
+        return NSUDO_MESSAGE::CREATE_PROCESS_FAILED;
     }
-    else if (NSudoOptionProcessPriorityValue::High == ProcessPriorityMode)
+
+    Platform.RevertToSelf();
+
+    return NSUDO_MESSAGE::SUCCESS;
+}
+
+/**
+ * 从批处理任务文件的一行中解析出进程启动请求。每行是一个 JSON 对象，除 "Id" 和
+ * "CommandLine" 以外的键与命令行选项同名，例如：
+ * {"Id":"1","U":"T","P":"E","Priority":"High","Wait":true,"CommandLine":"cmd"}
+ *
+ * Parses the launch request from a line of the batch job file. Each line is a
+ * JSON object, and the keys other than "Id" and "CommandLine" are the names of
+ * the command line options. The switches like "Wait" and "UseCurrentConsole"
+ * are booleans and the other options are strings.
+ *
+ * @param Line The line of the batch job file.
+ * @param Request The launch request.
+ * @param Id The identifier of the job, which is copied to the result.
+ * @return NSUDO_MESSAGE::SUCCESS if the job is valid, otherwise
+ *         NSUDO_MESSAGE::INVALID_COMMAND_PARAMETER.
+ */
+NSUDO_MESSAGE NSudoParseBatchJob(
+    _In_ const std::string& Line,
+    _Out_ NSUDO_LAUNCH_REQUEST& Request,
+    _Out_ std::string& Id)
+{
+    M2_TRACE_SCOPE("NSudoParseBatchJob");
+
+    Request = NSUDO_LAUNCH_REQUEST();
+    Id.clear();
+
+    nlohmann::json Job = nlohmann::json::parse(Line, nullptr, false);
+    if (Job.is_discarded() || !Job.is_object())
     {
-        ProcessPriority = HIGH_PRIORITY_CLASS;
+        return NSUDO_MESSAGE::INVALID_COMMAND_PARAMETER;
     }
-    else if (NSudoOptionProcessPriorityValue::RealTime == ProcessPriorityMode)
+
+    std::map<std::wstring, std::wstring> OptionsAndParameters;
+    std::wstring UnresolvedCommandLine;
+
+    for (auto& Item : Job.items())
     {
-        ProcessPriority = REALTIME_PRIORITY_CLASS;
+        const nlohmann::json& Value = Item.value();
+
+        if ("Id" == Item.key())
+        {
+            Id = Value.is_string() ? Value.get<std::string>() : Value.dump();
+        }
+        else if ("CommandLine" == Item.key())
+        {
+            if (!Value.is_string())
+            {
+                return NSUDO_MESSAGE::INVALID_COMMAND_PARAMETER;
+            }
+
+            UnresolvedCommandLine = M2MakeUTF16String(
+                Value.get<std::string>());
+        }
+        else if (Value.is_string())
+        {
+            OptionsAndParameters[M2MakeUTF16String(Item.key())] =
+                M2MakeUTF16String(Value.get<std::string>());
+        }
+        else if (Value.is_boolean())
+        {
+            if (Value.get<bool>())
+            {
+                OptionsAndParameters[M2MakeUTF16String(Item.key())] =
+                    std::wstring();
+            }
+        }
+        else
+        {
+            return NSUDO_MESSAGE::INVALID_COMMAND_PARAMETER;
+        }
     }
 
-    if (NSudoOptionWindowModeValue::Show == WindowMode)
+    if (!UnresolvedCommandLine.empty())
     {
-        ShowWindowMode = SW_SHOW;
+        UnresolvedCommandLine = CNSudoShortCutAdapter::Translate(
+            g_ResourceManagement.GetShortCutList(),
+            UnresolvedCommandLine);
     }
-    else if (NSudoOptionWindowModeValue::Hide == WindowMode)
+
+    return NSudoParseLaunchRequest(
+        OptionsAndParameters,
+        UnresolvedCommandLine,
+        Request);
+}
+
+/**
+ * 获取批处理模式中令牌缓存的键。用户、特权和完整性级别选项相同的任务共享同一
+ * 个令牌。
+ *
+ * Gets the key of the token cache of the batch mode. The jobs with the same
+ * user, privileges and integrity level options share one token.
+ *
+ * @param Request The launch request.
+ * @return The key of the token cache.
+ */
+DWORD NSudoGetLaunchTokenKey(
+    _In_ const NSUDO_LAUNCH_REQUEST& Request)
+{
+    return (static_cast<DWORD>(Request.UserMode) << 16) |
+        (static_cast<DWORD>(Request.PrivilegesMode) << 8) |
+        static_cast<DWORD>(Request.IntegrityLevelMode);
+}
+
+/**
+ * 依次执行批处理任务文件内容中的任务。进程只模拟一次 System，环境块由缓存共享，
+ * 并且每种令牌配置只创建一次令牌。每个任务的结果以 JSON 行的形式写入结果句柄。
+ *
+ * Executes the jobs in the content of a batch job file in order. The process
+ * impersonates System once, the environment block is shared by the cache and
+ * the token of each distinct configuration is created once. The result of
+ * each job is written to the result handle as a JSON line with the status and
+ * the timings in microseconds.
+ *
+ * @param bAssumeElevated Treat the current process as elevated.
+ * @param Jobs The content of the batch job file in the JSON Lines format. The
+ *             UTF-8 BOM, the empty lines and the CRLF line endings are
+ *             accepted.
+ * @param ResultHandle The handle which receives the results.
+ * @return NSUDO_MESSAGE::SUCCESS if all jobs succeed, otherwise the first
+ *         error.
+ */
+NSUDO_MESSAGE NSudoExecuteBatchJobs(
+    _In_ bool bAssumeElevated,
+    _In_ const std::string& Jobs,
+    _In_ HANDLE ResultHandle)
+{
+    M2_TRACE_SCOPE("NSudoExecuteBatchJobs");
+    M2_ALLOCATION_TAG("NSudoExecuteBatchJobs");
+
+    const NSUDO_PLATFORM& Platform = g_ResourceManagement.GetPlatform();
+
+    DWORD dwSessionID = (DWORD)-1;
+    if (!Platform.GetCurrentProcessSessionID(&dwSessionID))
     {
-        ShowWindowMode = SW_HIDE;
+        return NSUDO_MESSAGE::CREATE_PROCESS_FAILED;
     }
-    else if (NSudoOptionWindowModeValue::Maximize == WindowMode)
+
+    bool bElevated = g_ResourceManagement.IsElevated() || bAssumeElevated;
+    if (!(bElevated && Platform.ImpersonateAsSystem()))
     {
-        ShowWindowMode = SW_MAXIMIZE;
+        return NSUDO_MESSAGE::PRIVILEGE_NOT_HELD;
     }
-    else if (NSudoOptionWindowModeValue::Minimize == WindowMode)
+
+    std::map<DWORD, M2::CHandle> Tokens;
+    NSUDO_MESSAGE BatchMessage = NSUDO_MESSAGE::SUCCESS;
+
+    NSUDO_LAUNCH_REQUEST Request;
+    std::string Id;
+    std::string Line;
+    size_t LineNumber = 0;
+    size_t LineStart = 0;
+
+    // Skip the UTF-8 BOM of the file.
+    if (0 == Jobs.compare(0, 3, "\xEF\xBB\xBF"))
     {
-        ShowWindowMode = SW_MINIMIZE;
+        LineStart = 3;
     }
 
-    if (UnresolvedCommandLine.empty())
+    while (LineStart < Jobs.size())
+    {
+        size_t LineEnd = Jobs.find('\n', LineStart);
+        if (std::string::npos == LineEnd)
+        {
+            LineEnd = Jobs.size();
+        }
+
+        Line.assign(Jobs, LineStart, LineEnd - LineStart);
+        LineStart = LineEnd + 1;
+        ++LineNumber;
+
+        if (!Line.empty() && '\r' == Line.back())
+        {
+            Line.pop_back();
+        }
+
+        // Skip the empty lines.
+        if (Line.empty())
+        {
+            continue;
+        }
+
+        ULONGLONG StartTime = M2GetPerformanceCounter();
+
+        NSUDO_MESSAGE Message = NSudoParseBatchJob(Line, Request, Id);
+
+        ULONGLONG ParsedTime = M2GetPerformanceCounter();
+
+        bool IsTokenReused = false;
+        HANDLE Token = nullptr;
+
+        if (NSUDO_MESSAGE::SUCCESS == Message)
+        {
+            DWORD Key = NSudoGetLaunchTokenKey(Request);
+
+            auto Iterator = Tokens.find(Key);
+            if (Iterator != Tokens.end())
+            {
+                IsTokenReused = true;
+                Token = Iterator->second;
+            }
+            else
+            {
+                M2::CHandle NewToken;
+                Message = Platform.CreateLaunchToken(
+                    Request, dwSessionID, NewToken);
+                if (NSUDO_MESSAGE::SUCCESS == Message)
+                {
+                    Token = NewToken;
+                    Tokens.emplace(Key, std::move(NewToken));
+                }
+            }
+        }
+
+        ULONGLONG TokenTime = M2GetPerformanceCounter();
+
+        if (NSUDO_MESSAGE::SUCCESS == Message)
+        {
+            if (!NSudoCreateProcess(Token, Request))
+            {
+                Message = NSUDO_MESSAGE::CREATE_PROCESS_FAILED;
+            }
+        }
+
+        ULONGLONG LaunchedTime = M2GetPerformanceCounter();
+
+        if (NSUDO_MESSAGE::SUCCESS != Message &&
+            NSUDO_MESSAGE::SUCCESS == BatchMessage)
+        {
+            BatchMessage = Message;
+        }
+
+        nlohmann::json Result;
+        Result["Line"] = LineNumber;
+        Result["Id"] = Id;
+        Result["Status"] = NSudoMessageTranslationID[Message];
+        Result["TokenReused"] = IsTokenReused;
+        Result["ParseMicroseconds"] =
+            M2ConvertPerformanceCountToNanoseconds(
+                ParsedTime - StartTime) / 1000;
+        Result["TokenMicroseconds"] =
+            M2ConvertPerformanceCountToNanoseconds(
+                TokenTime - ParsedTime) / 1000;
+        Result["LaunchMicroseconds"] =
+            M2ConvertPerformanceCountToNanoseconds(
+                LaunchedTime - TokenTime) / 1000;
+
+        std::string ResultLine = Result.dump() + "\n";
+
+        DWORD NumberOfBytesWritten = 0;
+        WriteFile(
+            ResultHandle,
+            ResultLine.data(),
+            static_cast<DWORD>(ResultLine.size()),
+            &NumberOfBytesWritten,
+            nullptr);
+    }
+
+    Platform.RevertToSelf();
+
+    return BatchMessage;
+}
+
+/**
+ * 依次执行批处理任务文件中的任务。结果写入标准输出；NSudoG 等没有标准输出的进程
+ * 把结果写入任务文件旁边的 "<任务文件>.results.jsonl" 文件。
+ *
+ * Executes the jobs in the batch job file in order. The results are written
+ * to the standard output. The processes without the standard output, such as
+ * NSudoG, write them to "<JobFilePath>.results.jsonl" instead.
+ *
+ * @param bAssumeElevated Treat the current process as elevated.
+ * @param JobFilePath The path of the batch job file in the JSON Lines format.
+ * @return NSUDO_MESSAGE::SUCCESS if all jobs succeed, otherwise the first
+ *         error. If the job file cannot be read or the result file cannot be
+ *         created, the return value is
+ *         NSUDO_MESSAGE::INVALID_COMMAND_PARAMETER.
+ */
+NSUDO_MESSAGE NSudoExecuteBatch(
+    _In_ bool bAssumeElevated,
+    _In_ const std::wstring& JobFilePath)
+{
+    M2_TRACE_SCOPE("NSudoExecuteBatch");
+
+    // The whole file is read at once, and the lines are split in memory.
+    std::string Jobs;
+    if (FAILED(g_ResourceManagement.GetPlatform().ReadFile(JobFilePath, Jobs)))
     {
         return NSUDO_MESSAGE::INVALID_COMMAND_PARAMETER;
     }
 
-    if (!NSudoCreateProcess(
-        hToken,
-        UnresolvedCommandLine.c_str(),
-        CurrentDirectory.c_str(),
-        WaitInterval,
-        ProcessPriority,
-        ShowWindowMode,
-        CreateNewConsole))
+    M2::CHandle ResultFile;
+    HANDLE ResultHandle = GetStdHandle(STD_OUTPUT_HANDLE);
+    if (nullptr == ResultHandle || INVALID_HANDLE_VALUE == ResultHandle)
     {
-        return NSUDO_MESSAGE::CREATE_PROCESS_FAILED;
+        ResultFile = CreateFileW(
+            (JobFilePath + L".results.jsonl").c_str(),
+            GENERIC_WRITE,
+            FILE_SHARE_READ,
+            nullptr,
+            CREATE_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL,
+            nullptr);
+        if (ResultFile.IsInvalid())
+        {
+            return NSUDO_MESSAGE::INVALID_COMMAND_PARAMETER;
+        }
+
+        ResultHandle = ResultFile;
     }
 
-    RevertToSelf();
+    return NSudoExecuteBatchJobs(bAssumeElevated, Jobs, ResultHandle);
+}
 
-    return NSUDO_MESSAGE::SUCCESS;
+// 解析命令行
+NSUDO_MESSAGE NSudoCommandLineParser(
+    _In_ bool bAssumeElevated,
+    _In_ bool bEnableContextMenuManagement,
+    _In_ std::wstring& ApplicationName,
+    _In_ std::map<std::wstring, std::wstring>& OptionsAndParameters,
+    _In_ std::wstring& UnresolvedCommandLine)
+{
+    M2_TRACE_SCOPE("NSudoCommandLineParser");
+
+    UNREFERENCED_PARAMETER(ApplicationName);
+
+    if (1 == OptionsAndParameters.size() &&
+        0 == _wcsicmp(
+            OptionsAndParameters.begin()->first.c_str(), L"AddShortCut"))
+    {
+        // 如果选项名是 "AddShortCut"，则把命令行保存为以参数命名的快捷命令。
+        const std::wstring& Name = OptionsAndParameters.begin()->second;
+        if (Name.empty() || UnresolvedCommandLine.empty())
+        {
+            return NSUDO_MESSAGE::INVALID_COMMAND_PARAMETER;
+        }
+
+        return g_ResourceManagement.AddShortCut(Name, UnresolvedCommandLine)
+            ? NSUDO_MESSAGE::SUCCESS
+            : NSUDO_MESSAGE::SHORTCUT_UPDATE_FAILED;
+    }
+
+    if (1 == OptionsAndParameters.size() && UnresolvedCommandLine.empty())
+    {
+        auto OptionAndParameter = *OptionsAndParameters.begin();
+
+
+        if (0 == _wcsicmp(OptionAndParameter.first.c_str(), L"?") ||
+            0 == _wcsicmp(OptionAndParameter.first.c_str(), L"H") ||
+            0 == _wcsicmp(OptionAndParameter.first.c_str(), L"Help"))
+        {
+            // 如果选项名是 "?", "H" 或 "Help"，则显示帮助。
+            return NSUDO_MESSAGE::NEED_TO_SHOW_COMMAND_LINE_HELP;
+        }
+        else if (0 == _wcsicmp(OptionAndParameter.first.c_str(), L"Version"))
+        {
+            // 如果选项名是 "?", "H" 或 "Help"，则显示 NSudo 版本号。
+            return NSUDO_MESSAGE::NEED_TO_SHOW_NSUDO_VERSION;
+        }
+        else if (0 == _wcsicmp(OptionAndParameter.first.c_str(), L"Batch"))
+        {
+            // 如果选项名是 "Batch"，则依次执行任务文件中的任务。
+            return NSudoExecuteBatch(
+                bAssumeElevated,
+                OptionAndParameter.second);
+        }
+        else if (0 == _wcsicmp(OptionAndParameter.first.c_str(), L"RemoveShortCut"))
+        {
+            // 如果选项名是 "RemoveShortCut"，则删除以参数命名的快捷命令。
+            if (OptionAndParameter.second.empty())
+            {
+                return NSUDO_MESSAGE::INVALID_COMMAND_PARAMETER;
+            }
+
+            return g_ResourceManagement.RemoveShortCut(OptionAndParameter.second)
+                ? NSUDO_MESSAGE::SUCCESS
+                : NSUDO_MESSAGE::SHORTCUT_UPDATE_FAILED;
+        }
+        else
+        {
+            if (bEnableContextMenuManagement)
+            {
+                CNSudoContextMenuManagement ContextMenuManagement;
+
+                if (0 == _wcsicmp(OptionAndParameter.first.c_str(), L"Install"))
+                {
+                    // 如果参数是 /Install 或 -Install，则安装NSudo到系统
+                    if (ERROR_SUCCESS != ContextMenuManagement.Install())
+                    {
+                        ContextMenuManagement.Uninstall();
+                    }
+
+                    return NSUDO_MESSAGE::SUCCESS;
+                }
+                else if (0 == _wcsicmp(OptionAndParameter.first.c_str(), L"Uninstall"))
+                {
+                    // 如果参数是 /Uninstall 或 -Uninstall，则移除安装到系统的NSudo
+                    ContextMenuManagement.Uninstall();
+
+                    return NSUDO_MESSAGE::SUCCESS;
+                }
+            }
+
+            return NSUDO_MESSAGE::INVALID_COMMAND_PARAMETER;
+        }
+    }
+
+    NSUDO_LAUNCH_REQUEST Request;
+
+    NSUDO_MESSAGE message = NSudoParseLaunchRequest(
+        OptionsAndParameters,
+        UnresolvedCommandLine,
+        Request);
+    if (NSUDO_MESSAGE::SUCCESS != message)
+    {
+        return message;
+    }
+
+    // 选项有效时才需要令牌。令牌状态的准备与 NSudo.json 的解析互不依赖，所以
+    // 在转换快捷命令前启动，使两者并行执行。
+    g_ResourceManagement.PrepareTokenAsync();
+
+    Request.CommandLine = CNSudoShortCutAdapter::Translate(
+        g_ResourceManagement.GetShortCutList(),
+        Request.CommandLine);
+    if (Request.CommandLine.empty())
+    {
+        return NSUDO_MESSAGE::INVALID_COMMAND_PARAMETER;
+    }
+
+    return NSudoExecuteLaunchRequest(bAssumeElevated, Request);
 }
 
 void NSudoPrintMsg(
@@ -1669,7 +3005,7 @@ HRESULT NSudoShowAboutDialog(
         nullptr);
 #elif defined(NSUDO_GUI_WINDOWS)
     M2MessageDialog(
-        g_ResourceManagement.Instance,
+        g_ResourceManagement.GetInstance(),
         hwndParent,
         MAKEINTRESOURCE(IDI_NSUDO),
         L"NSudo",
@@ -1791,7 +3127,7 @@ private:
         }
 
         this->m_hNSudoIcon = (HICON)LoadImageW(
-            g_ResourceManagement.Instance,
+            g_ResourceManagement.GetInstance(),
             MAKEINTRESOURCE(IDI_NSUDO),
             IMAGE_ICON,
             256,
@@ -1820,7 +3156,7 @@ private:
         SendMessageW(this->m_hUserName, CB_SETCURSEL, 3, 0);
 
         for (std::pair<std::wstring, std::wstring> Item
-            : g_ResourceManagement.ShortCutList)
+            : g_ResourceManagement.GetShortCutList())
         {
             SendMessageW(
                 this->m_hszPath,
@@ -1986,7 +3322,7 @@ private:
             std::wstring Buffer = g_ResourceManagement.GetMessageString(
                 NSUDO_MESSAGE::INVALID_TEXTBOX_PARAMETER);
             NSudoPrintMsg(
-                g_ResourceManagement.Instance,
+                g_ResourceManagement.GetInstance(),
                 this->m_hWnd,
                 Buffer.c_str());
         }
@@ -2044,7 +3380,7 @@ private:
             UnresolvedCommandLine =
                 L"cmd /c start \"NSudo.Launcher\" " +
                 CNSudoShortCutAdapter::Translate(
-                    g_ResourceManagement.ShortCutList,
+                    g_ResourceManagement.GetShortCutList(),
                     UnresolvedCommandLine);
 
             NSUDO_MESSAGE message = NSudoCommandLineParser(
@@ -2058,7 +3394,7 @@ private:
                 std::wstring Buffer = g_ResourceManagement.GetMessageString(
                     message);
                 NSudoPrintMsg(
-                    g_ResourceManagement.Instance,
+                    g_ResourceManagement.GetInstance(),
                     this->m_hWnd,
                     Buffer.c_str());
             }
@@ -2153,6 +3489,8 @@ private:
 
 int NSudoMain()
 {
+    M2_TRACE_SCOPE("NSudoMain");
+
     //SetThreadUILanguage(MAKELANGID(LANG_ENGLISH, SUBLANG_ENGLISH_US));
 
     //SetThreadUILanguage(MAKELANGID(LANG_CHINESE, SUBLANG_CHINESE_TRADITIONAL));
@@ -2161,8 +3499,6 @@ int NSudoMain()
 
     CoInitializeEx(nullptr, COINIT_APARTMENTTHREADED | COINIT_DISABLE_OLE1DDE);
 
-    g_ResourceManagement.Initialize();
-
     std::wstring ApplicationName;
     std::map<std::wstring, std::wstring> OptionsAndParameters;
     std::wstring UnresolvedCommandLine;
@@ -2175,31 +3511,31 @@ int NSudoMain()
         OptionsAndParameters,
         UnresolvedCommandLine);
 
-    UnresolvedCommandLine = CNSudoShortCutAdapter::Translate(
-        g_ResourceManagement.ShortCutList,
-        UnresolvedCommandLine);
-
     if (OptionsAndParameters.empty() && UnresolvedCommandLine.empty())
     {
 #if defined(NSUDO_CUI_CONSOLE)
         NSudoShowAboutDialog(nullptr);
 #elif defined(NSUDO_GUI_WINDOWS)
+        g_ResourceManagement.PrepareTokenAsync();
+
         CNSudoMainWindow MainWindow;
         MainWindow.DoModal(nullptr);
 #endif
         return 0;
     }
 
+    // 不假定已提权，是否提权由创建进程前的令牌状态决定，所以帮助、版本和
+    // 参数错误的路径不会准备令牌。
 #if defined(NSUDO_CUI_CONSOLE)
     NSUDO_MESSAGE message = NSudoCommandLineParser(
-        g_ResourceManagement.IsElevated,
+        false,
         false,
         ApplicationName,
         OptionsAndParameters,
         UnresolvedCommandLine);
 #elif defined(NSUDO_GUI_WINDOWS)
     NSUDO_MESSAGE message = NSudoCommandLineParser(
-        g_ResourceManagement.IsElevated,
+        false,
         true,
         ApplicationName,
         OptionsAndParameters,
@@ -2213,7 +3549,7 @@ int NSudoMain()
     else if (NSUDO_MESSAGE::NEED_TO_SHOW_NSUDO_VERSION == message)
     {
         NSudoPrintMsg(
-            g_ResourceManagement.Instance,
+            g_ResourceManagement.GetInstance(),
             nullptr,
             g_ResourceManagement.GetTranslation("NSudo.VersionText").c_str());
     }
@@ -2222,7 +3558,7 @@ int NSudoMain()
         std::wstring Buffer = g_ResourceManagement.GetMessageString(
             message);
         NSudoPrintMsg(
-            g_ResourceManagement.Instance,
+            g_ResourceManagement.GetInstance(),
             nullptr,
             Buffer.c_str());
         return -1;
@@ -2232,6 +3568,9 @@ int NSudoMain()
 }
 
 
+// 单元测试和基准测试把本文件编译进自己的程序，并使用自己的入口点。
+#if !defined(NSUDO_NO_ENTRY_POINT)
+
 #if defined(NSUDO_CUI_CONSOLE)
 int main()
 #elif defined(NSUDO_GUI_WINDOWS)
@@ -2249,5 +3588,17 @@ int WINAPI wWinMain(
     UNREFERENCED_PARAMETER(nShowCmd);
 #endif
 
-    return NSudoMain();
+    // 如果定义了 NSUDO_TRACE_FILE 环境变量，则把 Chrome trace_event 格式的
+    // 启动跟踪记录写入该文件。
+    M2TraceInitialize(L"NSUDO_TRACE_FILE");
+
+    int Result = NSudoMain();
+
+    // 写入跟踪记录前必须确保令牌准备线程已结束。
+    g_ResourceManagement.WaitForTokenPreparation();
+    M2TraceUninitialize();
+
+    return Result;
 }
+
+#endif // !NSUDO_NO_ENTRY_POINT
@@ -0,0 +1,48 @@
+﻿/*
+ * PROJECT:   NSudo
+ * FILE:      NSudoContextMenuItems.h
+ * PURPOSE:   The install plan of the context menu
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+// This file is generated from Resources\NSudoContextMenuManagement.json by
+// Scripts\GenerateContextMenuItems.py. Do not edit it.
+
+#pragma once
+
+/**
+ * The install plan of the context menu. Each item becomes a CommandStore
+ * entry whose command is "<Quoted NSudo Path>" followed by the
+ * ItemCommandParameters and NSudoContextMenuCommandSuffix, so the installer
+ * only concatenates three fixed segments for each item.
+ */
+constexpr NSUDO_CONTEXT_MENU_ITEM g_ContextMenuItems[] =
+{
+    {
+        L"NSudo.RunAs.TrustedInstaller",
+        "ContextMenu.TI",
+        L" -U:T",
+        true
+    },
+    {
+        L"NSudo.RunAs.TrustedInstaller.EnableAllPrivileges",
+        "ContextMenu.TI.EnableAllPrivileges",
+        L" -U:T -P:E",
+        true
+    },
+    {
+        L"NSudo.RunAs.System",
+        "ContextMenu.System",
+        L" -U:S",
+        true
+    },
+    {
+        L"NSudo.RunAs.System.EnableAllPrivileges",
+        "ContextMenu.System.EnableAllPrivileges",
+        L" -U:S -P:E",
+        true
+    }
+};
@@ -25,6 +25,14 @@
 #include "M2BaseHelpers.h"
 #include "M2Win32Helpers.h"
 #include "M2Win32GUIHelpers.h"
+#include "M2TraceHelpers.h"
+#include "M2LockHelpers.h"
+#include "M2QueueHelpers.h"
+#include "M2AsyncHelpers.h"
+#include "M2CompletionHelpers.h"
+#include "M2SlotMapHelpers.h"
+#include "M2AllocationHelpers.h"
+#include "M2EnvironmentHelpers.h"
 
 #include <stdio.h>
 #include <tchar.h>
@@ -0,0 +1,125 @@
+﻿/*
+ * PROJECT:   NSudo
+ * FILE:      M2AsyncHelpersBenchmarks.cpp
+ * PURPOSE:   Benchmarks for the single-threaded event loop
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#include "stdafx.h"
+
+#include <string>
+
+#pragma region Event Loop
+
+namespace
+{
+    const ULONGLONG g_EventLoopCallbackCounts[] = { 1, 100, 10000 };
+
+    const DWORD g_EventLoopMessageSize = 64;
+}
+
+NSUDO_BENCHMARK(EventLoopPost)
+{
+    // The callbacks are posted from another thread, so each batch also pays
+    // for the wake of the loop thread.
+    for (ULONGLONG Count : g_EventLoopCallbackCounts)
+    {
+        Context.Measure(std::to_string(Count), Count, 200, [Count]()
+        {
+            M2::CEventLoop Loop;
+
+            ULONGLONG RunCount = 0;
+
+            M2::CHandle Poster = M2::CThread([&Loop, &RunCount, Count]()
+            {
+                for (ULONGLONG i = 0; i < Count; ++i)
+                {
+                    Loop.Post([&RunCount]() { ++RunCount; });
+                }
+            }).Detach();
+            if (!Poster)
+                throw std::exception("The thread cannot be created");
+
+            // The wait completes after the thread exits, so it keeps the
+            // loop running until all callbacks are posted.
+            Loop.WaitForHandleAsync(Poster, INFINITE, [](HRESULT) {});
+
+            if (S_OK != Loop.Run())
+                throw std::exception("CEventLoop::Run failed");
+
+            if (Count != RunCount)
+                throw std::exception("The callbacks are lost");
+        });
+    }
+}
+
+NSUDO_BENCHMARK(EventLoopPipeRoundTrip)
+{
+    wchar_t PipeName[64];
+    swprintf_s(
+        PipeName,
+        L"\\\\.\\pipe\\NSudoBenchmarks.%lu.%llu",
+        GetCurrentProcessId(),
+        M2GetPerformanceCounter());
+
+    M2::CHandle ServerHandle = CreateNamedPipeW(
+        PipeName,
+        PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+        PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT,
+        1,
+        4096,
+        4096,
+        0,
+        nullptr);
+    if (ServerHandle.IsInvalid())
+        throw std::exception("CreateNamedPipeW failed");
+
+    M2::CHandle ClientHandle = CreateFileW(
+        PipeName,
+        GENERIC_READ | GENERIC_WRITE,
+        0,
+        nullptr,
+        OPEN_EXISTING,
+        FILE_FLAG_OVERLAPPED,
+        nullptr);
+    if (ClientHandle.IsInvalid())
+        throw std::exception("CreateFileW failed");
+
+    char Message[g_EventLoopMessageSize];
+    memset(Message, 'N', sizeof(Message));
+    char Buffer[g_EventLoopMessageSize];
+
+    M2::CEventLoop Loop;
+
+    // Each sample is one message written by the client and read by the
+    // server through the completion routines, so the percentiles are the
+    // latencies of the round trips on the loop.
+    Context.Measure("Message", 1, 10000, [&]()
+    {
+        HRESULT ReadResult = E_PENDING;
+        HRESULT WriteResult = E_PENDING;
+
+        Loop.ReadFileAsync(
+            ServerHandle,
+            Buffer,
+            sizeof(Buffer),
+            [&ReadResult](HRESULT Result, DWORD) { ReadResult = Result; });
+        Loop.WriteFileAsync(
+            ClientHandle,
+            Message,
+            sizeof(Message),
+            [&WriteResult](HRESULT Result, DWORD) { WriteResult = Result; });
+
+        if (S_OK != Loop.Run() ||
+            S_OK != ReadResult ||
+            S_OK != WriteResult)
+        {
+            throw std::exception("The message is lost");
+        }
+    });
+}
+
+#pragma endregion
@@ -0,0 +1,286 @@
+﻿/*
+ * PROJECT:   NSudo
+ * FILE:      M2BaseHelpersBenchmarks.cpp
+ * PURPOSE:   Benchmarks for the base helpers
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#include "stdafx.h"
+
+#include <utility>
+#include <vector>
+
+#pragma region Singleton
+
+namespace
+{
+    const LONG g_SingletonThreadCount = MAXIMUM_WAIT_OBJECTS;
+
+    const DWORD g_SingletonSamples = 100;
+
+    typedef PVOID(*PNSUDO_SINGLETON_GETTER)();
+
+    template<size_t Index>
+    struct CSingletonObject
+    {
+        volatile LONG Value = static_cast<LONG>(Index);
+    };
+
+    template<size_t Index, bool DestroyOnExit>
+    PVOID NSudoGetSingleton()
+    {
+        return &M2::CSingleton<
+            CSingletonObject<Index>, DestroyOnExit>::Get();
+    }
+
+    /**
+     * Retrieves one getter for each singleton type. The first access case
+     * needs a singleton which is not created yet for each run, including the
+     * warm-up run.
+     */
+    template<bool DestroyOnExit, size_t... Indexes>
+    std::vector<PNSUDO_SINGLETON_GETTER> NSudoGetSingletonGetters(
+        _In_ std::index_sequence<Indexes...>)
+    {
+        return { &NSudoGetSingleton<Indexes, DestroyOnExit>... };
+    }
+
+    /**
+     * The threads which call the same getter together in each round. They
+     * are created once, so the rounds do not measure the thread creation.
+     */
+    class CSingletonThreads : M2::CDisableObjectCopying
+    {
+    private:
+        std::vector<HANDLE> m_Threads;
+        volatile LONG m_Round = 0;
+        volatile LONG m_CompletedCount = 0;
+        volatile LONG m_FailedCount = 0;
+        volatile LONG m_IsStopping = 0;
+        PNSUDO_SINGLETON_GETTER volatile m_Getter = nullptr;
+        PVOID volatile m_Instance = nullptr;
+
+        void ThreadLoop()
+        {
+            LONG Round = 0;
+
+            for (;;)
+            {
+                while (Round == this->m_Round)
+                {
+                    M2WaitOnAddress(&this->m_Round, Round);
+                }
+                Round = this->m_Round;
+
+                if (this->m_IsStopping)
+                    break;
+
+                // All threads must get the same instance.
+                PVOID Instance = this->m_Getter();
+                PVOID PreviousInstance = InterlockedCompareExchangePointer(
+                    &this->m_Instance, Instance, nullptr);
+                if (PreviousInstance && PreviousInstance != Instance)
+                    InterlockedIncrement(&this->m_FailedCount);
+
+                if (g_SingletonThreadCount == InterlockedIncrement(
+                    &this->m_CompletedCount))
+                {
+                    M2WakeByAddressSingle(&this->m_CompletedCount);
+                }
+            }
+        }
+
+    public:
+        CSingletonThreads()
+        {
+            for (LONG i = 0; i < g_SingletonThreadCount; ++i)
+            {
+                HANDLE ThreadHandle = M2::CThread([this]()
+                {
+                    this->ThreadLoop();
+                }).Detach();
+                if (!ThreadHandle)
+                    throw std::exception("The thread cannot be created");
+
+                this->m_Threads.push_back(ThreadHandle);
+            }
+        }
+
+        ~CSingletonThreads()
+        {
+            InterlockedExchange(&this->m_IsStopping, 1);
+            InterlockedIncrement(&this->m_Round);
+            M2WakeByAddressAll(&this->m_Round);
+
+            WaitForMultipleObjectsEx(
+                static_cast<DWORD>(this->m_Threads.size()),
+                this->m_Threads.data(),
+                TRUE,
+                INFINITE,
+                FALSE);
+
+            for (HANDLE ThreadHandle : this->m_Threads)
+                CloseHandle(ThreadHandle);
+        }
+
+        /**
+         * Wakes all threads to call the getter once, and waits for them.
+         *
+         * @param Getter The getter of the singleton.
+         */
+        void Run(
+            _In_ PNSUDO_SINGLETON_GETTER Getter)
+        {
+            this->m_Getter = Getter;
+            this->m_Instance = nullptr;
+            this->m_CompletedCount = 0;
+
+            InterlockedIncrement(&this->m_Round);
+            M2WakeByAddressAll(&this->m_Round);
+
+            for (;;)
+            {
+                LONG CompletedCount = this->m_CompletedCount;
+                if (g_SingletonThreadCount == CompletedCount)
+                    break;
+
+                M2WaitOnAddress(&this->m_CompletedCount, CompletedCount);
+            }
+
+            if (this->m_FailedCount)
+                throw std::exception("The threads got different instances");
+        }
+    };
+
+    template<bool DestroyOnExit>
+    void NSudoMeasureSingleton(
+        _In_ CNSudoBenchmarkContext& Context,
+        _In_ CSingletonThreads& Threads,
+        _In_ const std::string& Name)
+    {
+        std::vector<PNSUDO_SINGLETON_GETTER> Getters =
+            NSudoGetSingletonGetters<DestroyOnExit>(
+                std::make_index_sequence<g_SingletonSamples + 1>());
+
+        // All threads race to create the instance.
+        size_t NextGetter = 0;
+        Context.Measure(
+            Name + "/FirstAccess",
+            g_SingletonThreadCount,
+            g_SingletonSamples,
+            [&]()
+        {
+            if (NextGetter >= Getters.size())
+                throw std::exception("No singleton is left to create");
+
+            Threads.Run(Getters[NextGetter++]);
+        });
+
+        // The instance exists, so this case is the cost of waking the threads
+        // and of the lock-free path, which the case above is compared to.
+        Context.Measure(
+            Name + "/Created",
+            g_SingletonThreadCount,
+            g_SingletonSamples,
+            [&]()
+        {
+            Threads.Run(Getters[0]);
+        });
+    }
+}
+
+NSUDO_BENCHMARK(SingletonContendedGet)
+{
+    CSingletonThreads Threads;
+
+    NSudoMeasureSingleton<false>(Context, Threads, "Leaked");
+    NSudoMeasureSingleton<true>(Context, Threads, "DestroyOnExit");
+}
+
+#pragma endregion
+
+#pragma region Token Information
+
+namespace
+{
+    const DWORD g_TokenQuerySamples = 10000;
+
+    /**
+     * Queries the information which NSudoCreateLUAToken reads, and allocates
+     * the buffer of the new default DACL.
+     *
+     * @param TokenHandle The token to query.
+     * @param Arena The arena of the buffers, or nullptr to allocate each
+     *              buffer from the heap and free it, as the code before the
+     *              arena did.
+     */
+    void NSudoQueryLUATokenInformation(
+        _In_ HANDLE TokenHandle,
+        _In_opt_ M2::CArena* Arena)
+    {
+        PTOKEN_USER pTokenUser = nullptr;
+        PTOKEN_DEFAULT_DACL pTokenDacl = nullptr;
+        PVOID NewDacl = nullptr;
+
+        HRESULT hr = Arena
+            ? M2GetTokenInformation(pTokenUser, TokenHandle, TokenUser, *Arena)
+            : M2GetTokenInformation(pTokenUser, TokenHandle, TokenUser);
+        if (SUCCEEDED(hr))
+        {
+            hr = Arena
+                ? M2GetTokenInformation(
+                    pTokenDacl, TokenHandle, TokenDefaultDacl, *Arena)
+                : M2GetTokenInformation(
+                    pTokenDacl, TokenHandle, TokenDefaultDacl);
+        }
+        if (SUCCEEDED(hr))
+        {
+            SIZE_T Length = pTokenDacl->DefaultDacl->AclSize;
+            Length += GetLengthSid(pTokenUser->User.Sid);
+            Length += sizeof(ACCESS_ALLOWED_ACE);
+
+            hr = Arena
+                ? Arena->Allocate(&NewDacl, Length)
+                : M2AllocMemory(&NewDacl, Length);
+        }
+
+        if (!Arena)
+        {
+            if (NewDacl)
+                M2FreeMemory(NewDacl);
+            if (pTokenDacl)
+                M2FreeMemory(pTokenDacl);
+            if (pTokenUser)
+                M2FreeMemory(pTokenUser);
+        }
+
+        if (FAILED(hr))
+            throw std::exception("The token information cannot be queried");
+    }
+}
+
+NSUDO_BENCHMARK(TokenInformationArenaQuery)
+{
+    M2::CHandle TokenHandle;
+    M2_PROCESS_ACCESS_TOKEN_SOURCE TokenSource;
+    TokenSource.Type = M2_PROCESS_TOKEN_SOURCE_TYPE::Current;
+    if (FAILED(M2OpenProcessToken(&TokenHandle, &TokenSource, TOKEN_QUERY)))
+        throw std::exception("M2OpenProcessToken failed");
+
+    Context.Measure("Heap", 1, g_TokenQuerySamples, [&]()
+    {
+        NSudoQueryLUATokenInformation(TokenHandle, nullptr);
+    });
+
+    // The buffer has the size which NSudoCreateLUAToken uses.
+    Context.Measure("StackArena", 1, g_TokenQuerySamples, [&]()
+    {
+        M2::CStackArena<1024> Arena;
+        NSudoQueryLUATokenInformation(TokenHandle, &Arena);
+    });
+}
+
+#pragma endregion
@@ -0,0 +1,157 @@
+﻿/*
+ * PROJECT:   NSudo
+ * FILE:      M2CompletionHelpersBenchmarks.cpp
+ * PURPOSE:   Benchmarks for the I/O completion port engine
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#include "stdafx.h"
+
+#include <string>
+
+#pragma region Pipe Pump
+
+namespace
+{
+    const DWORD g_PipeMessageSize = 64;
+
+    const ULONGLONG g_PipeQueueDepths[] = { 1, 8, 64 };
+
+    /**
+     * Both ends of a message-mode named pipe, which are associated with one
+     * engine, so every write on the client is pumped to a read on the server
+     * through the completion port.
+     */
+    class CPipePump : M2::CDisableObjectCopying
+    {
+    private:
+        M2::CCompletionEngine m_Engine;
+        M2::CHandle m_ServerHandle;
+        M2::CHandle m_ClientHandle;
+        char m_Message[g_PipeMessageSize];
+
+    public:
+        CPipePump()
+        {
+            wchar_t PipeName[64];
+            swprintf_s(
+                PipeName,
+                L"\\\\.\\pipe\\NSudoBenchmarks.%lu.%llu",
+                GetCurrentProcessId(),
+                M2GetPerformanceCounter());
+
+            this->m_ServerHandle = CreateNamedPipeW(
+                PipeName,
+                PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+                PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT,
+                1,
+                64 * 1024,
+                64 * 1024,
+                0,
+                nullptr);
+            if (this->m_ServerHandle.IsInvalid())
+                throw std::exception("CreateNamedPipeW failed");
+
+            this->m_ClientHandle = CreateFileW(
+                PipeName,
+                GENERIC_READ | GENERIC_WRITE,
+                0,
+                nullptr,
+                OPEN_EXISTING,
+                FILE_FLAG_OVERLAPPED,
+                nullptr);
+            if (this->m_ClientHandle.IsInvalid())
+                throw std::exception("CreateFileW failed");
+
+            if (S_OK != this->m_Engine.Associate(this->m_ServerHandle) ||
+                S_OK != this->m_Engine.Associate(this->m_ClientHandle))
+            {
+                throw std::exception("The pipe cannot be associated");
+            }
+
+            memset(this->m_Message, 'N', sizeof(this->m_Message));
+        }
+
+        /**
+         * Submits the reads and the writes of the messages, and processes
+         * the completions until all of them are completed.
+         *
+         * @param QueueDepth The number of the messages in flight.
+         */
+        void Pump(
+            _In_ ULONGLONG QueueDepth)
+        {
+            ULONGLONG CompletedCount = 0;
+            ULONGLONG FailedCount = 0;
+
+            auto Callback = [&CompletedCount, &FailedCount](
+                HRESULT Result, DWORD Size, LPVOID)
+            {
+                ++CompletedCount;
+                if (S_OK != Result || g_PipeMessageSize != Size)
+                    ++FailedCount;
+            };
+
+            for (ULONGLONG i = 0; i < QueueDepth; ++i)
+            {
+                if (S_OK != this->m_Engine.SubmitRead(
+                    this->m_ServerHandle,
+                    nullptr,
+                    g_PipeMessageSize,
+                    0,
+                    Callback))
+                {
+                    throw std::exception("SubmitRead failed");
+                }
+
+                if (S_OK != this->m_Engine.SubmitWrite(
+                    this->m_ClientHandle,
+                    this->m_Message,
+                    g_PipeMessageSize,
+                    0,
+                    Callback))
+                {
+                    throw std::exception("SubmitWrite failed");
+                }
+            }
+
+            while (CompletedCount < QueueDepth * 2)
+            {
+                DWORD BatchCount = 0;
+                if (S_OK != this->m_Engine.ProcessCompletions(
+                    INFINITE, &BatchCount))
+                {
+                    throw std::exception("ProcessCompletions failed");
+                }
+            }
+
+            if (FailedCount)
+                throw std::exception("The messages are lost");
+        }
+    };
+}
+
+NSUDO_BENCHMARK(CompletionPipePump)
+{
+    CPipePump PipePump;
+
+    // Each sample is one batch of the messages, so the percentiles of the
+    // report are the tail latencies of the batches, and the items per
+    // second are the messages pumped per second.
+    for (ULONGLONG QueueDepth : g_PipeQueueDepths)
+    {
+        Context.Measure(
+            "QD" + std::to_string(QueueDepth),
+            QueueDepth,
+            10000,
+            [&]()
+        {
+            PipePump.Pump(QueueDepth);
+        });
+    }
+}
+
+#pragma endregion
@@ -0,0 +1,160 @@
+﻿/*
+ * PROJECT:   NSudo
+ * FILE:      M2LockHelpersBenchmarks.cpp
+ * PURPOSE:   Benchmarks for the lock helpers
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#include "stdafx.h"
+
+#include <shared_mutex>
+#include <vector>
+
+#pragma region Lock Contention
+
+namespace
+{
+    const DWORD g_LockThreadCounts[] = { 1, 2, 4, 8 };
+
+    // The percentages of the operations which only read the shared data.
+    const DWORD g_LockReaderPercentages[] = { 0, 50, 90, 99 };
+
+    const DWORD g_LockOperationsPerThread = 20000;
+
+    struct CAdaptiveSRWLockAdapter
+    {
+        M2::CAdaptiveSRWLock Lock;
+
+        void ExclusiveLock() { this->Lock.ExclusiveLock(); }
+        void ExclusiveUnlock() { this->Lock.ExclusiveUnlock(); }
+        void SharedLock() { this->Lock.SharedLock(); }
+        void SharedUnlock() { this->Lock.SharedUnlock(); }
+    };
+
+    struct CSharedMutexAdapter
+    {
+        std::shared_mutex Lock;
+
+        void ExclusiveLock() { this->Lock.lock(); }
+        void ExclusiveUnlock() { this->Lock.unlock(); }
+        void SharedLock() { this->Lock.lock_shared(); }
+        void SharedUnlock() { this->Lock.unlock_shared(); }
+    };
+
+    /**
+     * The data protected by the lock. The critical sections are short, like
+     * the lookups of the caches of NSudo.
+     */
+    template<typename TLock>
+    struct CLockContentionData
+    {
+        TLock Lock;
+        volatile LONG Start = 0;
+        volatile LONG Values[16] = { 0 };
+    };
+
+    template<typename TLock>
+    void NSudoRunLockContention(
+        _Inout_ CLockContentionData<TLock>& Data,
+        _In_ DWORD ThreadCount,
+        _In_ DWORD ReaderPercentage)
+    {
+        Data.Start = 0;
+
+        std::vector<HANDLE> Threads;
+        for (DWORD i = 0; i < ThreadCount; ++i)
+        {
+            M2::CThread Thread([&Data, ReaderPercentage, i]()
+            {
+                // The threads start together, so the creation of the threads
+                // does not hide the contention.
+                while (!Data.Start)
+                    YieldProcessor();
+
+                DWORD Random = 2463534242UL + i;
+                for (DWORD j = 0; j < g_LockOperationsPerThread; ++j)
+                {
+                    Random ^= Random << 13;
+                    Random ^= Random >> 17;
+                    Random ^= Random << 5;
+
+                    if (Random % 100 < ReaderPercentage)
+                    {
+                        Data.Lock.SharedLock();
+                        LONG Sum = 0;
+                        for (volatile LONG& Value : Data.Values)
+                            Sum += Value;
+                        UNREFERENCED_PARAMETER(Sum);
+                        Data.Lock.SharedUnlock();
+                    }
+                    else
+                    {
+                        Data.Lock.ExclusiveLock();
+                        ++Data.Values[Random % _countof(Data.Values)];
+                        Data.Lock.ExclusiveUnlock();
+                    }
+                }
+            });
+
+            HANDLE ThreadHandle = Thread.Detach();
+            if (!ThreadHandle)
+                throw std::exception("The thread cannot be created");
+
+            Threads.push_back(ThreadHandle);
+        }
+
+        InterlockedExchange(&Data.Start, 1);
+
+        WaitForMultipleObjectsEx(
+            static_cast<DWORD>(Threads.size()),
+            Threads.data(),
+            TRUE,
+            INFINITE,
+            FALSE);
+
+        for (HANDLE ThreadHandle : Threads)
+            CloseHandle(ThreadHandle);
+    }
+
+    template<typename TLock>
+    void NSudoMeasureLockContention(
+        _In_ CNSudoBenchmarkContext& Context,
+        _In_ const char* LockName)
+    {
+        CLockContentionData<TLock> Data;
+
+        for (DWORD ThreadCount : g_LockThreadCounts)
+        {
+            for (DWORD ReaderPercentage : g_LockReaderPercentages)
+            {
+                Context.Measure(
+                    std::string(LockName) +
+                    "/R" + std::to_string(ReaderPercentage) +
+                    "/T" + std::to_string(ThreadCount),
+                    ThreadCount * g_LockOperationsPerThread,
+                    10,
+                    [&]()
+                {
+                    NSudoRunLockContention(
+                        Data, ThreadCount, ReaderPercentage);
+                });
+            }
+        }
+    }
+}
+
+NSUDO_BENCHMARK(LockContention)
+{
+    // Before Windows 8 the waiters of CAdaptiveSRWLock poll, so the cases
+    // with more threads than processors show the cost of the fallback of
+    // M2WaitOnAddress there.
+    NSudoMeasureLockContention<CAdaptiveSRWLockAdapter>(
+        Context, "Adaptive");
+    NSudoMeasureLockContention<CSharedMutexAdapter>(
+        Context, "SharedMutex");
+}
+
+#pragma endregion
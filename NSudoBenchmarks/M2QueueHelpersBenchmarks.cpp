@@ -0,0 +1,217 @@
+﻿/*
+ * PROJECT:   NSudo
+ * FILE:      M2QueueHelpersBenchmarks.cpp
+ * PURPOSE:   Benchmarks for the multi-producer single-consumer queues
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#include "stdafx.h"
+
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#pragma region Queue Throughput
+
+namespace
+{
+    const ULONGLONG g_QueueProducerCounts[] = { 1, 2, 4, 8 };
+
+    const ULONGLONG g_QueueItemsPerProducer = 100000;
+
+    /**
+     * The locked std::deque, which is the baseline of the lock-free queues.
+     */
+    class CLockedQueue
+    {
+    private:
+        std::mutex m_Lock;
+        std::deque<ULONGLONG> m_Items;
+
+    public:
+        void Enqueue(
+            _In_ ULONGLONG Item)
+        {
+            std::lock_guard<std::mutex> Guard(this->m_Lock);
+            this->m_Items.push_back(Item);
+        }
+
+        bool TryDequeue(
+            _Out_ ULONGLONG& Item)
+        {
+            std::lock_guard<std::mutex> Guard(this->m_Lock);
+            if (this->m_Items.empty())
+                return false;
+
+            Item = this->m_Items.front();
+            this->m_Items.pop_front();
+            return true;
+        }
+    };
+
+    struct CQueueBenchmarkNode : M2::CMPSCQueueNode
+    {
+        ULONGLONG Item;
+    };
+
+    /**
+     * Runs the producers on their own threads and consumes all items on the
+     * current thread. The producers start together after they are created.
+     */
+    template<typename TProduce, typename TConsume>
+    void NSudoRunQueueThroughput(
+        _In_ ULONGLONG ProducerCount,
+        _In_ TProduce Produce,
+        _In_ TConsume Consume)
+    {
+        volatile LONG Start = 0;
+
+        std::vector<HANDLE> Producers;
+        for (ULONGLONG i = 0; i < ProducerCount; ++i)
+        {
+            M2::CThread Producer([&Start, Produce, i]()
+            {
+                while (!Start)
+                    YieldProcessor();
+
+                Produce(i);
+            });
+
+            HANDLE ProducerHandle = Producer.Detach();
+            if (!ProducerHandle)
+                throw std::exception("The thread cannot be created");
+
+            Producers.push_back(ProducerHandle);
+        }
+
+        InterlockedExchange(&Start, 1);
+
+        ULONGLONG Sum = 0;
+        for (ULONGLONG i = 0; i < ProducerCount * g_QueueItemsPerProducer; ++i)
+        {
+            Sum += Consume();
+        }
+
+        WaitForMultipleObjectsEx(
+            static_cast<DWORD>(Producers.size()),
+            Producers.data(),
+            TRUE,
+            INFINITE,
+            FALSE);
+
+        for (HANDLE ProducerHandle : Producers)
+            CloseHandle(ProducerHandle);
+
+        // Each producer sends 0 to N - 1.
+        if (Sum != ProducerCount *
+            (g_QueueItemsPerProducer * (g_QueueItemsPerProducer - 1) / 2))
+        {
+            throw std::exception("The items are lost");
+        }
+    }
+
+    std::string NSudoGetQueueCaseName(
+        _In_ const char* QueueName,
+        _In_ ULONGLONG ProducerCount)
+    {
+        return std::string(QueueName) + "/P" + std::to_string(ProducerCount);
+    }
+}
+
+NSUDO_BENCHMARK(QueueThroughput)
+{
+    for (ULONGLONG ProducerCount : g_QueueProducerCounts)
+    {
+        ULONGLONG Items = ProducerCount * g_QueueItemsPerProducer;
+
+        auto BoundedQueue =
+            std::make_unique<M2::CBoundedMPSCQueue<ULONGLONG, 1024>>();
+        Context.Measure(
+            NSudoGetQueueCaseName("Bounded", ProducerCount),
+            Items,
+            10,
+            [&]()
+        {
+            NSudoRunQueueThroughput(
+                ProducerCount,
+                [&BoundedQueue](ULONGLONG)
+            {
+                for (ULONGLONG i = 0; i < g_QueueItemsPerProducer; ++i)
+                {
+                    ULONGLONG Item = i;
+                    while (!BoundedQueue->TryEnqueue(Item))
+                        SwitchToThread();
+                }
+            },
+                [&BoundedQueue]() -> ULONGLONG
+            {
+                ULONGLONG Item = 0;
+                BoundedQueue->Dequeue(Item);
+                return Item;
+            });
+        });
+
+        std::vector<std::unique_ptr<CQueueBenchmarkNode[]>> Nodes;
+        for (ULONGLONG i = 0; i < ProducerCount; ++i)
+        {
+            Nodes.push_back(std::make_unique<CQueueBenchmarkNode[]>(
+                static_cast<size_t>(g_QueueItemsPerProducer)));
+        }
+
+        M2::CIntrusiveMPSCQueue<CQueueBenchmarkNode> IntrusiveQueue;
+        Context.Measure(
+            NSudoGetQueueCaseName("Intrusive", ProducerCount),
+            Items,
+            10,
+            [&]()
+        {
+            NSudoRunQueueThroughput(
+                ProducerCount,
+                [&IntrusiveQueue, &Nodes](ULONGLONG Producer)
+            {
+                CQueueBenchmarkNode* ProducerNodes =
+                    Nodes[static_cast<size_t>(Producer)].get();
+                for (ULONGLONG i = 0; i < g_QueueItemsPerProducer; ++i)
+                {
+                    ProducerNodes[i].Item = i;
+                    IntrusiveQueue.Push(&ProducerNodes[i]);
+                }
+            },
+                [&IntrusiveQueue]() -> ULONGLONG
+            {
+                return IntrusiveQueue.Pop()->Item;
+            });
+        });
+
+        CLockedQueue LockedQueue;
+        Context.Measure(
+            NSudoGetQueueCaseName("Locked", ProducerCount),
+            Items,
+            10,
+            [&]()
+        {
+            NSudoRunQueueThroughput(
+                ProducerCount,
+                [&LockedQueue](ULONGLONG)
+            {
+                for (ULONGLONG i = 0; i < g_QueueItemsPerProducer; ++i)
+                {
+                    LockedQueue.Enqueue(i);
+                }
+            },
+                [&LockedQueue]() -> ULONGLONG
+            {
+                ULONGLONG Item = 0;
+                while (!LockedQueue.TryDequeue(Item))
+                    YieldProcessor();
+                return Item;
+            });
+        });
+    }
+}
+
+#pragma endregion
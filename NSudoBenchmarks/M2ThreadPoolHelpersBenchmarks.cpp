@@ -0,0 +1,128 @@
+﻿/*
+ * PROJECT:   NSudo
+ * FILE:      M2ThreadPoolHelpersBenchmarks.cpp
+ * PURPOSE:   Benchmarks for the work-stealing thread pool
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#include "stdafx.h"
+
+#include "M2ThreadPoolHelpers.h"
+
+#pragma region Thread Pool
+
+namespace
+{
+    // The work of a leaf task, which is about one microsecond. The result
+    // is 0 or 1, so the sum of the results can be checked.
+    LONG NSudoRunLeafTask(
+        _In_ LONG Seed)
+    {
+        ULONG Value = static_cast<ULONG>(Seed);
+        for (int i = 0; i < 256; ++i)
+        {
+            Value = Value * 1103515245 + 12345;
+        }
+        return static_cast<LONG>(Value >> 31);
+    }
+
+    /**
+     * Splits the range into halves until the grain size, and runs the halves
+     * as the child tasks. The parent waits for its children in the task, so
+     * the stealing and the waiting paths of the pool are both used.
+     */
+    void NSudoRunForkJoin(
+        _In_ M2::CThreadPool& Pool,
+        _In_ LONG Begin,
+        _In_ LONG End,
+        _Inout_ volatile LONG* Result)
+    {
+        if (End - Begin <= 1)
+        {
+            InterlockedAdd(Result, NSudoRunLeafTask(Begin));
+            return;
+        }
+
+        LONG Middle = Begin + (End - Begin) / 2;
+
+        M2::CThreadPoolTaskGroup Group(Pool);
+        Group.Run([&Pool, Begin, Middle, Result]()
+        {
+            NSudoRunForkJoin(Pool, Begin, Middle, Result);
+        });
+        NSudoRunForkJoin(Pool, Middle, End, Result);
+        Group.Wait();
+    }
+
+    LONG NSudoGetExpectedResult(
+        _In_ LONG Count)
+    {
+        LONG Result = 0;
+        for (LONG i = 0; i < Count; ++i)
+        {
+            Result += NSudoRunLeafTask(i);
+        }
+        return Result;
+    }
+
+    const LONG g_ThreadPoolTaskCounts[] = { 100, 1000, 10000, 100000 };
+}
+
+NSUDO_BENCHMARK(ThreadPoolForkJoin)
+{
+    M2::CThreadPool Pool;
+
+    for (LONG Count : g_ThreadPoolTaskCounts)
+    {
+        LONG ExpectedResult = NSudoGetExpectedResult(Count);
+
+        Context.Measure("Serial/" + std::to_string(Count), Count, 20, [&]()
+        {
+            if (ExpectedResult != NSudoGetExpectedResult(Count))
+                throw std::exception("The result is wrong");
+        });
+
+        Context.Measure("Pool/" + std::to_string(Count), Count, 20, [&]()
+        {
+            volatile LONG Result = 0;
+            NSudoRunForkJoin(Pool, 0, Count, &Result);
+            if (ExpectedResult != Result)
+                throw std::exception("The result is wrong");
+        });
+    }
+}
+
+NSUDO_BENCHMARK(ThreadPoolFanOut)
+{
+    M2::CThreadPool Pool;
+
+    // All tasks are submitted from a thread outside the pool, so they go
+    // through the injection queue and are spread by stealing.
+    for (LONG Count : g_ThreadPoolTaskCounts)
+    {
+        LONG ExpectedResult = NSudoGetExpectedResult(Count);
+
+        Context.Measure(std::to_string(Count), Count, 20, [&]()
+        {
+            volatile LONG Result = 0;
+
+            M2::CThreadPoolTaskGroup Group(Pool);
+            for (LONG i = 0; i < Count; ++i)
+            {
+                Group.Run([i, &Result]()
+                {
+                    InterlockedAdd(&Result, NSudoRunLeafTask(i));
+                });
+            }
+            Group.Wait();
+
+            if (ExpectedResult != Result)
+                throw std::exception("The result is wrong");
+        });
+    }
+}
+
+#pragma endregion
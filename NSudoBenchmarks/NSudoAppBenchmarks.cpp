@@ -0,0 +1,481 @@
+﻿/*
+ * PROJECT:   NSudo
+ * FILE:      NSudoAppBenchmarks.cpp
+ * PURPOSE:   Benchmarks for the internals of NSudo
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#include "stdafx.h"
+
+// The internals of NSudo are not exported by any header, so NSudo.cpp is
+// compiled into this translation unit without its entry point.
+#include "../NSudo/NSudo.cpp"
+
+#include "../NSudoTests/NSudoStubPlatform.h"
+
+#pragma region Configuration Loading
+
+namespace
+{
+    // The sizes of the synthetic inputs from the smallest to the largest,
+    // because the peak working set is measured for the whole process.
+    const SIZE_T g_ConfigurationSizes[] = { 10, 100, 1000, 10000, 100000 };
+
+    DWORD NSudoGetConfigurationSamples(
+        _In_ SIZE_T Size)
+    {
+        return Size >= 10000 ? 5 : 50;
+    }
+
+    /**
+     * Generates the name of a synthetic item. Half of the names are ASCII and
+     * the others are CJK, so both the one byte and the three byte sequences
+     * of UTF-8 are converted.
+     */
+    std::wstring NSudoGetSyntheticName(
+        _In_ SIZE_T Index)
+    {
+        return (Index % 2)
+            ? L"Tool " + std::to_wstring(Index)
+            : L"管理工具" + std::to_wstring(Index);
+    }
+
+    std::wstring NSudoGetSyntheticCommandLine(
+        _In_ SIZE_T Index)
+    {
+        return (Index % 2)
+            ? L"cmd /c echo " + std::to_wstring(Index)
+            : L"notepad \"%SystemRoot%\\备份\\" + std::to_wstring(Index) + L"\"";
+    }
+
+    std::string NSudoGetSyntheticShortCutList(
+        _In_ SIZE_T Size)
+    {
+        nlohmann::json ConfigJSON;
+        nlohmann::json& ShortCutListJSON = ConfigJSON["ShortCutList_V2"];
+        for (SIZE_T i = 0; i < Size; ++i)
+        {
+            ShortCutListJSON[M2MakeUTF8String(NSudoGetSyntheticName(i))] =
+                M2MakeUTF8String(NSudoGetSyntheticCommandLine(i));
+        }
+
+        return "\xEF\xBB\xBF" + ConfigJSON.dump(2);
+    }
+
+    std::string NSudoGetSyntheticShortCutJournal(
+        _In_ SIZE_T Size)
+    {
+        std::string Journal;
+        for (SIZE_T i = 0; i < Size; ++i)
+        {
+            nlohmann::json Record;
+            Record["Op"] = "Add";
+            Record["Key"] = M2MakeUTF8String(NSudoGetSyntheticName(i));
+            Record["Value"] = M2MakeUTF8String(
+                NSudoGetSyntheticCommandLine(i));
+            Journal.append(Record.dump());
+            Journal.push_back('\n');
+        }
+
+        return Journal;
+    }
+
+    /**
+     * The string resources served by NSudoLoadSyntheticResource.
+     */
+    std::map<UINT, std::string> g_SyntheticResources;
+
+    HRESULT NSudoLoadSyntheticResource(
+        _Out_ PM2_RESOURCE_INFO ResourceInfo,
+        _In_ LPCWSTR Type,
+        _In_ LPCWSTR Name)
+    {
+        ResourceInfo->Size = 0;
+        ResourceInfo->Pointer = nullptr;
+
+        if (0 != _wcsicmp(Type, L"String") || !IS_INTRESOURCE(Name))
+            return HRESULT_FROM_WIN32(ERROR_RESOURCE_TYPE_NOT_FOUND);
+
+        auto Resource = g_SyntheticResources.find(
+            static_cast<UINT>(reinterpret_cast<ULONG_PTR>(Name)));
+        if (g_SyntheticResources.end() == Resource)
+            return HRESULT_FROM_WIN32(ERROR_RESOURCE_NAME_NOT_FOUND);
+
+        ResourceInfo->Size = static_cast<DWORD>(Resource->second.size());
+        ResourceInfo->Pointer = const_cast<char*>(Resource->second.data());
+
+        return S_OK;
+    }
+
+    /**
+     * Generates a translation bundle with the specified number of the
+     * translations and the lines of the command line help.
+     */
+    void NSudoSetSyntheticTranslations(
+        _In_ SIZE_T Size)
+    {
+        nlohmann::json TranslationsJSON;
+        nlohmann::json& Translations = TranslationsJSON["Translations"];
+
+        std::wstring CommandLineHelp;
+        for (SIZE_T i = 0; i < Size; ++i)
+        {
+            std::wstring Name = NSudoGetSyntheticName(i);
+
+            Translations["Benchmark.Item" + std::to_string(i)] =
+                M2MakeUTF8String(Name + L" 的说明 (Description)");
+
+            CommandLineHelp.append(L"-" + Name + L"\r\n    选项说明 Option\r\n");
+        }
+
+        g_SyntheticResources.clear();
+        g_SyntheticResources[IDR_String_Translations] =
+            "\xEF\xBB\xBF" + TranslationsJSON.dump(4);
+        g_SyntheticResources[IDR_String_CommandLineHelp] =
+            "\xEF\xBB\xBF" + M2MakeUTF8String(CommandLineHelp);
+        g_SyntheticResources[IDR_String_Links] =
+            "\xEF\xBB\xBF" "https://github.com/M2Team/NSudo\r\n";
+    }
+}
+
+NSUDO_BENCHMARK(ShortCutListRead)
+{
+    std::wstring DirectoryPath = NSudoCreateBenchmarkDirectory();
+    std::wstring ShortCutListPath = DirectoryPath + L"\\NSudo.json";
+
+    for (SIZE_T Size : g_ConfigurationSizes)
+    {
+        if (!NSudoWriteBenchmarkFile(
+            ShortCutListPath,
+            NSudoGetSyntheticShortCutList(Size)))
+        {
+            throw std::exception("NSudo.json cannot be written");
+        }
+
+        std::map<std::wstring, std::wstring> ShortCutList;
+        Context.Measure(
+            std::to_string(Size),
+            Size,
+            NSudoGetConfigurationSamples(Size),
+            [&]()
+        {
+            CNSudoShortCutAdapter::Read(ShortCutListPath, ShortCutList);
+        });
+
+        if (Size != ShortCutList.size())
+            throw std::exception("The shortcut list is incomplete");
+    }
+
+    NSudoDeleteBenchmarkDirectory(DirectoryPath);
+}
+
+NSUDO_BENCHMARK(ShortCutJournalReplay)
+{
+    std::wstring DirectoryPath = NSudoCreateBenchmarkDirectory();
+    std::wstring ShortCutListPath = DirectoryPath + L"\\NSudo.json";
+
+    // The journal is compacted at 256 KiB by NSudo, so the large cases show
+    // the cost of replaying a journal which was left by a crashed compaction.
+    for (SIZE_T Size : g_ConfigurationSizes)
+    {
+        if (!NSudoWriteBenchmarkFile(
+            ShortCutListPath + L".journal",
+            NSudoGetSyntheticShortCutJournal(Size)))
+        {
+            throw std::exception("NSudo.json.journal cannot be written");
+        }
+
+        std::map<std::wstring, std::wstring> ShortCutList;
+        Context.Measure(
+            std::to_string(Size),
+            Size,
+            NSudoGetConfigurationSamples(Size),
+            [&]()
+        {
+            CNSudoShortCutAdapter::Read(ShortCutListPath, ShortCutList);
+        });
+
+        if (Size != ShortCutList.size())
+            throw std::exception("The shortcut list is incomplete");
+    }
+
+    NSudoDeleteBenchmarkDirectory(DirectoryPath);
+}
+
+NSUDO_BENCHMARK(TranslationLoad)
+{
+    for (SIZE_T Size : g_ConfigurationSizes)
+    {
+        NSudoSetSyntheticTranslations(Size);
+
+        std::map<std::string, std::wstring> StringTranslations;
+        Context.Measure(
+            std::to_string(Size),
+            Size,
+            NSudoGetConfigurationSamples(Size),
+            [&]()
+        {
+            CNSudoTranslationAdapter::Load(
+                StringTranslations,
+                NSudoLoadSyntheticResource);
+        });
+
+        if (StringTranslations.size() < Size)
+            throw std::exception("The translations are incomplete");
+    }
+
+    g_SyntheticResources.clear();
+}
+
+#pragma endregion
+
+#pragma region Command Paths
+
+namespace
+{
+    struct NSUDO_COMMAND_PATH
+    {
+        const char* Name;
+        const wchar_t* Arguments;
+    };
+
+    // The help, version and parse error paths must not prepare the token,
+    // so they should be much faster than the launch path.
+    const NSUDO_COMMAND_PATH g_CommandPaths[] =
+    {
+        { "Help", L"-?" },
+        { "Version", L"-Version" },
+        { "ParseError", L"-U:Invalid cmd" },
+        { "Launch", L"-U:T -ShowWindowMode=Hide cmd /c exit" }
+    };
+
+    /**
+     * Runs the command line and waits for the process to exit. The output
+     * of the process is discarded.
+     */
+    void NSudoRunCommandLine(
+        _In_ const std::wstring& CommandLine,
+        _In_ HANDLE OutputHandle)
+    {
+        STARTUPINFOW StartupInfo = { 0 };
+        StartupInfo.cb = sizeof(STARTUPINFOW);
+        StartupInfo.dwFlags = STARTF_USESTDHANDLES;
+        StartupInfo.hStdInput = OutputHandle;
+        StartupInfo.hStdOutput = OutputHandle;
+        StartupInfo.hStdError = OutputHandle;
+
+        PROCESS_INFORMATION ProcessInformation = { 0 };
+
+        std::wstring Buffer = CommandLine;
+        if (!CreateProcessW(
+            nullptr,
+            &Buffer[0],
+            nullptr,
+            nullptr,
+            TRUE,
+            CREATE_NO_WINDOW,
+            nullptr,
+            nullptr,
+            &StartupInfo,
+            &ProcessInformation))
+        {
+            throw std::exception("CreateProcessW failed");
+        }
+
+        M2::CHandle ProcessHandle = ProcessInformation.hProcess;
+        M2::CHandle ThreadHandle = ProcessInformation.hThread;
+
+        WaitForSingleObjectEx(ProcessHandle, INFINITE, FALSE);
+    }
+}
+
+NSUDO_BENCHMARK(CommandPathLatency)
+{
+    // NSudoC.exe is built into the same output directory as the benchmarks.
+    std::wstring NSudoPath = M2GetCurrentProcessModulePath();
+    NSudoPath.resize(NSudoPath.find_last_of(L'\\'));
+    NSudoPath.append(L"\\NSudoC.exe");
+
+    if (INVALID_FILE_ATTRIBUTES == GetFileAttributesW(NSudoPath.c_str()))
+    {
+        printf("CommandPathLatency skipped: NSudoC.exe is not built.\n");
+        return;
+    }
+
+    SECURITY_ATTRIBUTES SecurityAttributes = { 0 };
+    SecurityAttributes.nLength = sizeof(SECURITY_ATTRIBUTES);
+    SecurityAttributes.bInheritHandle = TRUE;
+
+    M2::CHandle OutputHandle = CreateFileW(
+        L"NUL",
+        GENERIC_READ | GENERIC_WRITE,
+        FILE_SHARE_READ | FILE_SHARE_WRITE,
+        &SecurityAttributes,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr);
+    if (OutputHandle.IsInvalid())
+        throw std::exception("NUL cannot be opened");
+
+    for (const NSUDO_COMMAND_PATH& CommandPath : g_CommandPaths)
+    {
+        std::wstring CommandLine =
+            L"\"" + NSudoPath + L"\" " + CommandPath.Arguments;
+
+        Context.Measure(CommandPath.Name, 1, 20, [&]()
+        {
+            NSudoRunCommandLine(CommandLine, OutputHandle);
+        });
+    }
+}
+
+NSUDO_BENCHMARK(TokenFacetInitialization)
+{
+    // The work which the help, version and parse error paths skip.
+    Context.Measure("IsElevated", 1, 50, []()
+    {
+        CNSudoResourceManagement ResourceManagement;
+        ResourceManagement.IsElevated();
+    });
+}
+
+#pragma endregion
+
+#pragma region Startup Phases
+
+namespace
+{
+    // The size of the synthetic translations and shortcut list, which is
+    // about the size of the ones shipped with NSudo.
+    const SIZE_T g_StartupConfigurationSize = 100;
+
+    const wchar_t g_StartupCommandLine[] =
+        L"NSudo.exe -U:T -P:E -M:S -Priority:High Tool 1";
+
+    /**
+     * Installs the stub platform before any facet of g_ResourceManagement is
+     * initialized, so the launch path is measured without creating tokens or
+     * processes.
+     */
+    struct CNSudoBenchmarkStubPlatformInstaller
+    {
+        CNSudoBenchmarkStubPlatformInstaller()
+        {
+            NSUDO_STUB_PLATFORM_STATE& State = NSudoGetStubPlatformState();
+
+            NSudoSetSyntheticTranslations(g_StartupConfigurationSize);
+            State.Resources = g_SyntheticResources;
+            g_SyntheticResources.clear();
+
+            State.Files[L"C:\\NSudo\\NSudo.json"] =
+                NSudoGetSyntheticShortCutList(g_StartupConfigurationSize);
+
+            NSudoSetStubEnvironment({
+                L"ComSpec=C:\\Windows\\System32\\cmd.exe",
+                L"Path=C:\\Windows\\System32;C:\\Windows",
+                L"SystemRoot=C:\\Windows",
+                L"TEMP=C:\\Users\\User\\AppData\\Local\\Temp",
+                L"USERNAME=User" });
+
+            g_ResourceManagement.SetPlatform(g_NSudoStubPlatform);
+        }
+    };
+
+    CNSudoBenchmarkStubPlatformInstaller g_StubPlatformInstaller;
+
+    void NSudoSplitStartupCommandLine(
+        _Out_ std::wstring& ApplicationName,
+        _Out_ std::map<std::wstring, std::wstring>& OptionsAndParameters,
+        _Out_ std::wstring& UnresolvedCommandLine)
+    {
+        M2SpiltCommandLineEx(
+            std::wstring(g_StartupCommandLine),
+            std::vector<std::wstring>{ L"-", L"/", L"--" },
+            std::vector<std::wstring>{ L"=", L":" },
+            ApplicationName,
+            OptionsAndParameters,
+            UnresolvedCommandLine);
+    }
+}
+
+NSUDO_BENCHMARK(StartupPhases)
+{
+    // Each phase of the launch path of NSudoMain is measured separately with
+    // the stub platform, so a regression is attributed to its phase. The
+    // phases use the same inputs as the end to end case.
+    std::wstring ApplicationName;
+    std::map<std::wstring, std::wstring> OptionsAndParameters;
+    std::wstring UnresolvedCommandLine;
+
+    Context.Measure("SplitCommandLine", 1, 1000, [&]()
+    {
+        NSudoSplitStartupCommandLine(
+            ApplicationName,
+            OptionsAndParameters,
+            UnresolvedCommandLine);
+    });
+
+    Context.Measure("ResourceInitialization", 1, 200, []()
+    {
+        CNSudoResourceManagement ResourceManagement(g_NSudoStubPlatform);
+        ResourceManagement.GetTranslation("NSudo.LogoText");
+        ResourceManagement.GetShortCutList();
+        ResourceManagement.IsElevated();
+    });
+
+    std::wstring TranslatedCommandLine;
+    Context.Measure("ShortCutTranslation", 1, 1000, [&]()
+    {
+        TranslatedCommandLine = CNSudoShortCutAdapter::Translate(
+            g_ResourceManagement.GetShortCutList(),
+            UnresolvedCommandLine);
+    });
+
+    if (TranslatedCommandLine == UnresolvedCommandLine)
+        throw std::exception("The shortcut is not translated");
+
+    NSUDO_LAUNCH_REQUEST Request;
+    Context.Measure("ParseLaunchRequest", 1, 1000, [&]()
+    {
+        if (NSUDO_MESSAGE::SUCCESS != NSudoParseLaunchRequest(
+            OptionsAndParameters,
+            TranslatedCommandLine,
+            Request))
+        {
+            throw std::exception("NSudoParseLaunchRequest failed");
+        }
+    });
+
+    Context.Measure("ExecuteLaunchRequest", 1, 1000, [&]()
+    {
+        if (NSUDO_MESSAGE::SUCCESS != NSudoExecuteLaunchRequest(
+            false,
+            Request))
+        {
+            throw std::exception("NSudoExecuteLaunchRequest failed");
+        }
+    });
+
+    Context.Measure("EndToEnd", 1, 1000, [&]()
+    {
+        NSudoSplitStartupCommandLine(
+            ApplicationName,
+            OptionsAndParameters,
+            UnresolvedCommandLine);
+
+        if (NSUDO_MESSAGE::SUCCESS != NSudoCommandLineParser(
+            false,
+            false,
+            ApplicationName,
+            OptionsAndParameters,
+            UnresolvedCommandLine))
+        {
+            throw std::exception("NSudoCommandLineParser failed");
+        }
+    });
+}
+
+#pragma endregion
@@ -0,0 +1,445 @@
+﻿/*
+ * PROJECT:   NSudo
+ * FILE:      NSudoBenchmark.cpp
+ * PURPOSE:   Implementation for the benchmark framework
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#include "stdafx.h"
+
+#include <Psapi.h>
+#pragma comment(lib, "psapi.lib")
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <exception>
+#include <string>
+#include <vector>
+
+namespace
+{
+    struct NSUDO_BENCHMARK
+    {
+        const char* Name;
+        PNSUDO_BENCHMARK_FUNCTION Function;
+    };
+
+    std::vector<NSUDO_BENCHMARK>& NSudoGetBenchmarks()
+    {
+        // The registrations run during the static initialization of the
+        // translation units, so the list is created on first use.
+        static std::vector<NSUDO_BENCHMARK> Benchmarks;
+        return Benchmarks;
+    }
+
+    nlohmann::json g_BenchmarkResults = nlohmann::json::array();
+
+    volatile LONG g_BenchmarkDirectoryCount = 0;
+
+    /**
+     * Retrieves the percentile of the sorted samples with the nearest-rank
+     * method.
+     */
+    ULONGLONG NSudoGetPercentile(
+        _In_ const std::vector<ULONGLONG>& SortedSamples,
+        _In_ ULONGLONG Percentile)
+    {
+        SIZE_T Rank = static_cast<SIZE_T>(
+            (Percentile * SortedSamples.size() + 99) / 100);
+        return SortedSamples[Rank ? Rank - 1 : 0];
+    }
+
+    SIZE_T NSudoGetPeakWorkingSetSize()
+    {
+        PROCESS_MEMORY_COUNTERS Counters = { 0 };
+        Counters.cb = sizeof(PROCESS_MEMORY_COUNTERS);
+        if (!GetProcessMemoryInfo(
+            GetCurrentProcess(),
+            &Counters,
+            sizeof(PROCESS_MEMORY_COUNTERS)))
+        {
+            return 0;
+        }
+
+        return Counters.PeakWorkingSetSize;
+    }
+
+    /**
+     * Compares the medians of the results with the ones of the baseline
+     * report, which is written by -Output. The cases are matched by the name
+     * of the benchmark and the case, and the cases which are not in the
+     * baseline are skipped.
+     *
+     * @param Baseline The baseline report.
+     * @param Threshold The allowed increase of the median, in percent.
+     * @return The number of the cases whose medians exceed the threshold.
+     */
+    int NSudoCompareWithBaseline(
+        _In_ const nlohmann::json& Baseline,
+        _In_ double Threshold)
+    {
+        int RegressionCount = 0;
+
+        auto BaselineResults = Baseline.find("Results");
+        if (Baseline.end() == BaselineResults || !BaselineResults->is_array())
+            return RegressionCount;
+
+        for (const nlohmann::json& Result : g_BenchmarkResults)
+        {
+            for (const nlohmann::json& BaselineResult : *BaselineResults)
+            {
+                if (BaselineResult.value("Benchmark", "") != Result["Benchmark"] ||
+                    BaselineResult.value("Case", "") != Result["Case"])
+                {
+                    continue;
+                }
+
+                ULONGLONG BaselineMedian = BaselineResult.value(
+                    "Nanoseconds",
+                    nlohmann::json::object()).value("Median", 0ULL);
+                ULONGLONG Median =
+                    Result["Nanoseconds"]["Median"].get<ULONGLONG>();
+
+                double Change = BaselineMedian
+                    ? (static_cast<double>(Median) - BaselineMedian) * 100.0 /
+                        BaselineMedian
+                    : 0.0;
+
+                bool IsRegression = Change > Threshold;
+                if (IsRegression)
+                    ++RegressionCount;
+
+                printf(
+                    "%-36s %-20s median %+8.1f%% %s\n",
+                    Result["Benchmark"].get<std::string>().c_str(),
+                    Result["Case"].get<std::string>().c_str(),
+                    Change,
+                    IsRegression ? "REGRESSION" : "ok");
+
+                break;
+            }
+        }
+
+        return RegressionCount;
+    }
+}
+
+void NSudoRegisterBenchmark(
+    _In_z_ const char* Name,
+    _In_ PNSUDO_BENCHMARK_FUNCTION Function)
+{
+    NSudoGetBenchmarks().push_back({ Name, Function });
+}
+
+void CNSudoBenchmarkContext::Measure(
+    _In_ const std::string& Case,
+    _In_ ULONGLONG Items,
+    _In_ DWORD Samples,
+    _In_ const std::function<void()>& Operation)
+{
+    if (0 == Samples)
+        Samples = 1;
+
+    // The first run fills the caches and the heap, so it is not a sample.
+    Operation();
+
+    std::vector<ULONGLONG> Durations;
+    Durations.reserve(Samples);
+
+#ifdef M2_ENABLE_ALLOCATION_ACCOUNTING
+    ULONGLONG StartAllocationCount = 0;
+    ULONGLONG StartAllocatedBytes = 0;
+    ULONGLONG StartFreeCount = 0;
+    M2GetAllocationTotals(
+        &StartAllocationCount,
+        &StartAllocatedBytes,
+        &StartFreeCount);
+#endif // M2_ENABLE_ALLOCATION_ACCOUNTING
+
+    for (DWORD i = 0; i < Samples; ++i)
+    {
+        ULONGLONG StartTime = M2GetPerformanceCounter();
+        Operation();
+        Durations.push_back(M2ConvertPerformanceCountToNanoseconds(
+            M2GetPerformanceCounter() - StartTime));
+    }
+
+    nlohmann::json Result;
+    Result["Benchmark"] = this->m_Name;
+    Result["Case"] = Case;
+    Result["Items"] = Items;
+    Result["Samples"] = Samples;
+
+#ifdef M2_ENABLE_ALLOCATION_ACCOUNTING
+    ULONGLONG AllocationCount = 0;
+    ULONGLONG AllocatedBytes = 0;
+    ULONGLONG FreeCount = 0;
+    M2GetAllocationTotals(
+        &AllocationCount,
+        &AllocatedBytes,
+        &FreeCount);
+
+    Result["AllocationsPerSample"] =
+        (AllocationCount - StartAllocationCount) / Samples;
+    Result["AllocatedBytesPerSample"] =
+        (AllocatedBytes - StartAllocatedBytes) / Samples;
+#endif // M2_ENABLE_ALLOCATION_ACCOUNTING
+
+    ULONGLONG TotalDuration = 0;
+    for (ULONGLONG Duration : Durations)
+        TotalDuration += Duration;
+
+    std::sort(Durations.begin(), Durations.end());
+
+    ULONGLONG Median = NSudoGetPercentile(Durations, 50);
+
+    Result["Nanoseconds"] =
+    {
+        { "Min", Durations.front() },
+        { "Median", Median },
+        { "Mean", TotalDuration / Samples },
+        { "P90", NSudoGetPercentile(Durations, 90) },
+        { "P99", NSudoGetPercentile(Durations, 99) },
+        { "Max", Durations.back() }
+    };
+
+    double ItemsPerSecond = Median
+        ? static_cast<double>(Items) * 1000000000.0 / Median
+        : 0.0;
+    Result["ItemsPerSecond"] = ItemsPerSecond;
+
+    // The peak of the whole process, so the cases of a benchmark should be
+    // measured from the smallest input to the largest one.
+    SIZE_T PeakWorkingSetSize = NSudoGetPeakWorkingSetSize();
+    Result["PeakWorkingSetBytes"] = PeakWorkingSetSize;
+
+    printf(
+        "%-36s %-20s median %12.3f us  p99 %12.3f us  %14.0f items/s",
+        this->m_Name,
+        Case.c_str(),
+        Median / 1000.0,
+        NSudoGetPercentile(Durations, 99) / 1000.0,
+        ItemsPerSecond);
+
+    if (Result.count("AllocationsPerSample"))
+    {
+        printf(
+            "  %10llu allocs",
+            Result["AllocationsPerSample"].get<ULONGLONG>());
+    }
+
+    printf("  %8.1f MiB peak\n", PeakWorkingSetSize / 1048576.0);
+
+    g_BenchmarkResults.push_back(Result);
+}
+
+std::wstring NSudoCreateBenchmarkDirectory()
+{
+    wchar_t TemporaryPath[MAX_PATH];
+    DWORD Length = GetTempPathW(MAX_PATH, TemporaryPath);
+    if (0 == Length || Length >= MAX_PATH)
+        throw std::exception("GetTempPathW failed");
+
+    wchar_t Name[64];
+    swprintf_s(
+        Name,
+        L"NSudoBenchmarks.%lu.%ld",
+        GetCurrentProcessId(),
+        InterlockedIncrement(&g_BenchmarkDirectoryCount));
+
+    std::wstring DirectoryPath = std::wstring(TemporaryPath) + Name;
+
+    if (!CreateDirectoryW(DirectoryPath.c_str(), nullptr))
+        throw std::exception("CreateDirectoryW failed");
+
+    return DirectoryPath;
+}
+
+void NSudoDeleteBenchmarkDirectory(
+    _In_ const std::wstring& DirectoryPath)
+{
+    WIN32_FIND_DATAW FindData;
+    HANDLE FindHandle = FindFirstFileW(
+        (DirectoryPath + L"\\*").c_str(), &FindData);
+    if (INVALID_HANDLE_VALUE != FindHandle)
+    {
+        do
+        {
+            if (!(FindData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+            {
+                DeleteFileW(
+                    (DirectoryPath + L"\\" + FindData.cFileName).c_str());
+            }
+        } while (FindNextFileW(FindHandle, &FindData));
+
+        FindClose(FindHandle);
+    }
+
+    RemoveDirectoryW(DirectoryPath.c_str());
+}
+
+bool NSudoWriteBenchmarkFile(
+    _In_ const std::wstring& FilePath,
+    _In_ const std::string& Content)
+{
+    FILE* FileStream = nullptr;
+    if (0 != _wfopen_s(&FileStream, FilePath.c_str(), L"wb"))
+        return false;
+
+    size_t NumberOfBytesWritten = fwrite(
+        Content.data(), sizeof(char), Content.size(), FileStream);
+
+    return 0 == fclose(FileStream) && Content.size() == NumberOfBytesWritten;
+}
+
+bool NSudoReadBenchmarkFile(
+    _In_ const std::wstring& FilePath,
+    _Out_ std::string& Content)
+{
+    Content.clear();
+
+    FILE* FileStream = nullptr;
+    if (0 != _wfopen_s(&FileStream, FilePath.c_str(), L"rb"))
+        return false;
+
+    char Buffer[4096];
+    size_t NumberOfBytesRead = 0;
+    while (0 != (NumberOfBytesRead = fread(
+        Buffer, sizeof(char), sizeof(Buffer), FileStream)))
+    {
+        Content.append(Buffer, NumberOfBytesRead);
+    }
+
+    bool Result = !ferror(FileStream);
+
+    fclose(FileStream);
+
+    return Result;
+}
+
+/**
+ * Runs the benchmarks and prints their results.
+ *
+ * Options:
+ *   -Filter=<Text>       Runs only the benchmarks whose names contain the
+ *                        text.
+ *   -Output=<Path>       Writes the results to the file as JSON.
+ *   -Baseline=<Path>     Compares the medians with the results in the file,
+ *                        which is written by -Output.
+ *   -Threshold=<Percent> The allowed increase of the medians compared with
+ *                        the baseline. The default is 10 percent.
+ *
+ * @return The number of the benchmarks which failed plus the number of the
+ *         cases which regressed, or -1 if the options are invalid.
+ */
+int wmain(int argc, wchar_t* argv[])
+{
+    std::string Filter;
+    std::wstring OutputPath;
+    std::wstring BaselinePath;
+    double Threshold = 10.0;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::wstring Option = argv[i];
+
+        if (0 == Option.compare(0, 8, L"-Filter="))
+        {
+            Filter = M2MakeUTF8String(Option.substr(8));
+        }
+        else if (0 == Option.compare(0, 8, L"-Output="))
+        {
+            OutputPath = Option.substr(8);
+        }
+        else if (0 == Option.compare(0, 10, L"-Baseline="))
+        {
+            BaselinePath = Option.substr(10);
+        }
+        else if (0 == Option.compare(0, 11, L"-Threshold=") &&
+            1 == swscanf_s(Option.c_str() + 11, L"%lf", &Threshold) &&
+            Threshold >= 0.0)
+        {
+            // The threshold is parsed by the condition.
+        }
+        else
+        {
+            printf(
+                "Usage: NSudoBenchmarks [-Filter=<Text>] [-Output=<Path>] "
+                "[-Baseline=<Path>] [-Threshold=<Percent>]\n");
+            return -1;
+        }
+    }
+
+    nlohmann::json Baseline;
+    if (!BaselinePath.empty())
+    {
+        std::string Content;
+        if (NSudoReadBenchmarkFile(BaselinePath, Content))
+        {
+            Baseline = nlohmann::json::parse(Content, nullptr, false);
+        }
+
+        if (!Baseline.is_object())
+        {
+            printf("The baseline cannot be read.\n");
+            return -1;
+        }
+    }
+
+    int FailedCount = 0;
+
+    for (const NSUDO_BENCHMARK& Benchmark : NSudoGetBenchmarks())
+    {
+        if (std::string::npos == std::string(Benchmark.Name).find(Filter))
+            continue;
+
+        CNSudoBenchmarkContext Context(Benchmark.Name);
+
+        try
+        {
+            Benchmark.Function(Context);
+        }
+        catch (const std::exception& Exception)
+        {
+            printf("%s failed: %s\n", Benchmark.Name, Exception.what());
+            ++FailedCount;
+        }
+        catch (...)
+        {
+            printf("%s failed: unknown exception\n", Benchmark.Name);
+            ++FailedCount;
+        }
+    }
+
+    if (Baseline.is_object())
+    {
+        FailedCount += NSudoCompareWithBaseline(Baseline, Threshold);
+    }
+
+    if (!OutputPath.empty())
+    {
+        SYSTEM_INFO SystemInfo = { 0 };
+        GetNativeSystemInfo(&SystemInfo);
+
+        nlohmann::json Report;
+        Report["ProcessorCount"] = SystemInfo.dwNumberOfProcessors;
+#ifdef M2_ENABLE_ALLOCATION_ACCOUNTING
+        Report["AllocationAccounting"] = true;
+#else
+        Report["AllocationAccounting"] = false;
+#endif // M2_ENABLE_ALLOCATION_ACCOUNTING
+        Report["Results"] = g_BenchmarkResults;
+
+        if (!NSudoWriteBenchmarkFile(OutputPath, Report.dump(2) + "\n"))
+        {
+            printf("The results cannot be written.\n");
+            ++FailedCount;
+        }
+    }
+
+    return FailedCount;
+}
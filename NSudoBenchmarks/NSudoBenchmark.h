@@ -0,0 +1,138 @@
+﻿/*
+ * PROJECT:   NSudo
+ * FILE:      NSudoBenchmark.h
+ * PURPOSE:   Definition for the benchmark framework
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#pragma once
+
+#ifndef _NSUDO_BENCHMARK_
+#define _NSUDO_BENCHMARK_
+
+#include <Windows.h>
+
+#include "M2BaseHelpers.h"
+
+#include <functional>
+#include <string>
+
+class CNSudoBenchmarkContext;
+
+/**
+ * The function of a benchmark, which measures its cases with the context.
+ */
+typedef void(*PNSUDO_BENCHMARK_FUNCTION)(
+    _In_ CNSudoBenchmarkContext& Context);
+
+/**
+ * Registers a benchmark. Use NSUDO_BENCHMARK instead of calling this
+ * function.
+ *
+ * @param Name The name of the benchmark. It must be a string literal.
+ * @param Function The function of the benchmark.
+ */
+void NSudoRegisterBenchmark(
+    _In_z_ const char* Name,
+    _In_ PNSUDO_BENCHMARK_FUNCTION Function);
+
+/**
+ * The registration of a benchmark, which runs before main.
+ */
+struct CNSudoBenchmarkRegistration
+{
+    CNSudoBenchmarkRegistration(
+        _In_z_ const char* Name,
+        _In_ PNSUDO_BENCHMARK_FUNCTION Function)
+    {
+        NSudoRegisterBenchmark(Name, Function);
+    }
+};
+
+/**
+ * Measures the cases of a benchmark and records their results.
+ */
+class CNSudoBenchmarkContext : M2::CDisableObjectCopying
+{
+private:
+    const char* m_Name;
+
+public:
+    explicit CNSudoBenchmarkContext(
+        _In_z_ const char* Name) :
+        m_Name(Name)
+    {
+
+    }
+
+    /**
+     * Measures a case. The operation runs once to warm up, and then once for
+     * each sample. The result has the distribution of the sample times, the
+     * allocations per sample when the allocation accounting is enabled, and
+     * the peak working set of the process after the case.
+     *
+     * @param Case The name of the case, such as the size of the input.
+     * @param Items The number of the items processed by one run of the
+     *              operation, which is used to compute the throughput.
+     * @param Samples The number of the samples.
+     * @param Operation The operation.
+     */
+    void Measure(
+        _In_ const std::string& Case,
+        _In_ ULONGLONG Items,
+        _In_ DWORD Samples,
+        _In_ const std::function<void()>& Operation);
+};
+
+/**
+ * Creates an empty directory under the temporary directory for the input
+ * files of a benchmark.
+ *
+ * @return The path of the directory.
+ */
+std::wstring NSudoCreateBenchmarkDirectory();
+
+/**
+ * Deletes the files in the directory and the directory itself.
+ *
+ * @param DirectoryPath The path of the directory.
+ */
+void NSudoDeleteBenchmarkDirectory(
+    _In_ const std::wstring& DirectoryPath);
+
+/**
+ * Writes the content to the file, and replaces the file if it exists.
+ *
+ * @param FilePath The path of the file.
+ * @param Content The content of the file.
+ * @return If the file cannot be written, the return value is false.
+ */
+bool NSudoWriteBenchmarkFile(
+    _In_ const std::wstring& FilePath,
+    _In_ const std::string& Content);
+
+/**
+ * Reads the whole file.
+ *
+ * @param FilePath The path of the file.
+ * @param Content The content of the file.
+ * @return If the file cannot be read, the return value is false.
+ */
+bool NSudoReadBenchmarkFile(
+    _In_ const std::wstring& FilePath,
+    _Out_ std::string& Content);
+
+/**
+ * Defines and registers a benchmark.
+ *
+ * @param Name The name of the benchmark.
+ */
+#define NSUDO_BENCHMARK(Name) \
+    static void Name(CNSudoBenchmarkContext& Context); \
+    static CNSudoBenchmarkRegistration Name##Registration(#Name, Name); \
+    static void Name(CNSudoBenchmarkContext& Context)
+
+#endif // _NSUDO_BENCHMARK_
@@ -0,0 +1,19 @@
+﻿/*
+ * PROJECT:   NSudo
+ * FILE:      stdafx.h
+ * PURPOSE:   Precompiled Header for the benchmarks
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#pragma once
+
+// The benchmarks use the same headers as NSudo, so the SDK and NSudo.cpp are
+// compiled with the same definitions as in NSudo itself.
+#include "../NSudo/stdafx.h"
+
+#include "../NSudo/ThirdParty/json.hpp"
+
+#include "NSudoBenchmark.h"
@@ -0,0 +1,669 @@
+﻿/*
+ * PROJECT:   M2-Team Common Library
+ * FILE:      M2AllocationHelpers.cpp
+ * PURPOSE:   Implementation for the allocation accounting helpers
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#include "stdafx.h"
+
+#include <Windows.h>
+
+#include "M2AllocationHelpers.h"
+
+#ifdef M2_ENABLE_ALLOCATION_ACCOUNTING
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <new>
+#include <string>
+
+namespace
+{
+    /**
+     * The counts of one tag and source pair.
+     */
+    struct M2_ALLOCATION_COUNTS
+    {
+        volatile LONG64 AllocationCount;
+        volatile LONG64 AllocatedBytes;
+        volatile LONG64 FreeCount;
+    };
+
+    /**
+     * The statistics of one tag and source pair. The registry never
+     * allocates, because it is also used by operator new. The counts of the
+     * pair are kept per thread, and the shared counts are only used by the
+     * threads which have no counters.
+     */
+    struct M2_ALLOCATION_SITE
+    {
+        const char* Tag;
+        const char* Source;
+        M2_ALLOCATION_COUNTS SharedCounts;
+    };
+
+    /**
+     * The counts of all sites written by one thread, so the threads which
+     * allocate at the same time do not contend on the cache lines of the
+     * counts. The block of an exited thread is reused by the next new
+     * thread, and the counts keep adding up. The blocks are never freed.
+     */
+    struct M2_ALLOCATION_THREAD_COUNTERS
+    {
+        M2_ALLOCATION_THREAD_COUNTERS* Next;
+        volatile LONG IsInUse;
+
+        // The last counts are of the unattributed site.
+        M2_ALLOCATION_COUNTS Sites[M2_ALLOCATION_SITE_COUNT + 1];
+    };
+
+    M2_ALLOCATION_SITE g_AllocationSites[M2_ALLOCATION_SITE_COUNT];
+
+    // The number of the sites whose Tag and Source are written. The sites
+    // are only appended, so the readers can scan them without the lock.
+    volatile LONG g_AllocationSiteCount = 0;
+
+    SRWLOCK g_AllocationSitesLock = SRWLOCK_INIT;
+
+    M2_ALLOCATION_SITE g_UnattributedAllocationSite =
+    {
+        "(unattributed)", "(any)", { 0, 0, 0 }
+    };
+
+    // The counters of all threads. The blocks are only prepended, so the
+    // readers can scan them without the lock.
+    M2_ALLOCATION_THREAD_COUNTERS* volatile g_AllocationThreadCounters =
+        nullptr;
+
+    // The fiber local storage whose callback releases the counters of the
+    // exiting thread.
+    volatile LONG g_AllocationCountersFlsIndex =
+        static_cast<LONG>(FLS_OUT_OF_INDEXES);
+
+    const char* const g_UntaggedAllocationTag = "(untagged)";
+
+    volatile LONG g_IsReportRegistered = 0;
+
+    thread_local const char* t_AllocationTag = nullptr;
+    thread_local M2_ALLOCATION_SITE* t_LastAllocationSite = nullptr;
+    thread_local M2_ALLOCATION_THREAD_COUNTERS* t_AllocationCounters = nullptr;
+
+    // The counters of the thread are released, or cannot be created, so the
+    // thread uses the shared counts.
+    thread_local bool t_IsUsingSharedAllocationCounts = false;
+
+    void __cdecl M2WriteAllocationStatisticsReportAtExit()
+    {
+        wchar_t FilePath[MAX_PATH];
+        DWORD Length = GetEnvironmentVariableW(
+            L"M2_ALLOCATION_STATISTICS_FILE", FilePath, MAX_PATH);
+        if (0 == Length || Length >= MAX_PATH)
+            return;
+
+        FILE* FileStream = nullptr;
+        if (0 != _wfopen_s(&FileStream, FilePath, L"w"))
+            return;
+
+        fputs(M2GetAllocationStatisticsReport().c_str(), FileStream);
+
+        fclose(FileStream);
+    }
+
+    /**
+     * Adds the value to a count of the current thread. Only the owner thread
+     * writes its counts, and the aligned 64-bit accesses are atomic on 64-bit
+     * processors, so the readers never see a torn value. The 32-bit
+     * processors need the interlocked operation for that, which is not
+     * contended because the cache line is not shared.
+     */
+    void M2AddThreadAllocationCount(
+        _Inout_ volatile LONG64* Count,
+        _In_ LONG64 Value)
+    {
+#ifdef _WIN64
+        *Count = *Count + Value;
+#else
+        InterlockedExchangeAdd64(Count, Value);
+#endif
+    }
+
+    LONG64 M2ReadAllocationCount(
+        _In_ volatile LONG64* Count)
+    {
+#ifdef _WIN64
+        return *Count;
+#else
+        return InterlockedCompareExchange64(Count, 0, 0);
+#endif
+    }
+
+    /**
+     * Releases the counters of the exiting thread for the next new thread.
+     * The allocations made by the thread after this use the shared counts.
+     */
+    VOID NTAPI M2ReleaseAllocationThreadCounters(
+        _In_opt_ PVOID Data)
+    {
+        if (!Data)
+            return;
+
+        t_AllocationCounters = nullptr;
+        t_IsUsingSharedAllocationCounts = true;
+
+        InterlockedExchange(
+            &static_cast<M2_ALLOCATION_THREAD_COUNTERS*>(Data)->IsInUse, 0);
+    }
+
+    /**
+     * Retrieves the counters of the current thread, which are created or
+     * reused at the first call.
+     *
+     * @return The counters, or nullptr if the thread uses the shared counts.
+     */
+    M2_ALLOCATION_THREAD_COUNTERS* M2GetAllocationThreadCounters()
+    {
+        M2_ALLOCATION_THREAD_COUNTERS* Counters = t_AllocationCounters;
+        if (Counters || t_IsUsingSharedAllocationCounts)
+            return Counters;
+
+        // Without the callback the counters of the exited threads are never
+        // reused, so the shared counts are used instead.
+        DWORD FlsIndex = static_cast<DWORD>(g_AllocationCountersFlsIndex);
+        if (FLS_OUT_OF_INDEXES == FlsIndex)
+        {
+            FlsIndex = FlsAlloc(M2ReleaseAllocationThreadCounters);
+            if (FLS_OUT_OF_INDEXES == FlsIndex)
+            {
+                t_IsUsingSharedAllocationCounts = true;
+                return nullptr;
+            }
+
+            DWORD PreviousFlsIndex = static_cast<DWORD>(
+                InterlockedCompareExchange(
+                    &g_AllocationCountersFlsIndex,
+                    static_cast<LONG>(FlsIndex),
+                    static_cast<LONG>(FLS_OUT_OF_INDEXES)));
+            if (FLS_OUT_OF_INDEXES != PreviousFlsIndex)
+            {
+                FlsFree(FlsIndex);
+                FlsIndex = PreviousFlsIndex;
+            }
+        }
+
+        for (Counters = g_AllocationThreadCounters;
+            Counters;
+            Counters = Counters->Next)
+        {
+            if (0 == Counters->IsInUse &&
+                0 == InterlockedCompareExchange(&Counters->IsInUse, 1, 0))
+            {
+                break;
+            }
+        }
+
+        if (!Counters)
+        {
+            // The heap is used directly, because the caller can be
+            // operator new.
+            Counters = static_cast<M2_ALLOCATION_THREAD_COUNTERS*>(HeapAlloc(
+                GetProcessHeap(),
+                HEAP_ZERO_MEMORY,
+                sizeof(M2_ALLOCATION_THREAD_COUNTERS)));
+            if (!Counters)
+                return nullptr;
+
+            Counters->IsInUse = 1;
+
+            M2_ALLOCATION_THREAD_COUNTERS* Head = nullptr;
+            do
+            {
+                Head = g_AllocationThreadCounters;
+                Counters->Next = Head;
+            } while (Head != InterlockedCompareExchangePointer(
+                reinterpret_cast<PVOID volatile*>(
+                    &g_AllocationThreadCounters),
+                Counters,
+                Head));
+        }
+
+        if (!FlsSetValue(FlsIndex, Counters))
+        {
+            InterlockedExchange(&Counters->IsInUse, 0);
+            t_IsUsingSharedAllocationCounts = true;
+            return nullptr;
+        }
+
+        t_AllocationCounters = Counters;
+        return Counters;
+    }
+
+    SIZE_T M2GetAllocationSiteIndex(
+        _In_ const M2_ALLOCATION_SITE* Site)
+    {
+        if (&g_UnattributedAllocationSite == Site)
+            return M2_ALLOCATION_SITE_COUNT;
+
+        return static_cast<SIZE_T>(Site - g_AllocationSites);
+    }
+
+    /**
+     * Adds the counts of the site from the current thread.
+     */
+    void M2AddAllocationCounts(
+        _In_ M2_ALLOCATION_SITE* Site,
+        _In_ LONG64 AllocationCount,
+        _In_ LONG64 AllocatedBytes,
+        _In_ LONG64 FreeCount)
+    {
+        M2_ALLOCATION_THREAD_COUNTERS* Counters =
+            M2GetAllocationThreadCounters();
+        if (!Counters)
+        {
+            M2_ALLOCATION_COUNTS& Counts = Site->SharedCounts;
+            if (AllocationCount)
+            {
+                InterlockedExchangeAdd64(
+                    &Counts.AllocationCount, AllocationCount);
+                InterlockedExchangeAdd64(
+                    &Counts.AllocatedBytes, AllocatedBytes);
+            }
+            if (FreeCount)
+                InterlockedExchangeAdd64(&Counts.FreeCount, FreeCount);
+            return;
+        }
+
+        M2_ALLOCATION_COUNTS& Counts =
+            Counters->Sites[M2GetAllocationSiteIndex(Site)];
+        if (AllocationCount)
+        {
+            M2AddThreadAllocationCount(
+                &Counts.AllocationCount, AllocationCount);
+            M2AddThreadAllocationCount(
+                &Counts.AllocatedBytes, AllocatedBytes);
+        }
+        if (FreeCount)
+            M2AddThreadAllocationCount(&Counts.FreeCount, FreeCount);
+    }
+
+    /**
+     * The sum of the counts of a site, or of all sites.
+     */
+    struct M2_ALLOCATION_TOTALS
+    {
+        ULONGLONG AllocationCount = 0;
+        ULONGLONG AllocatedBytes = 0;
+        ULONGLONG FreeCount = 0;
+    };
+
+    void M2AddAllocationTotals(
+        _Inout_ M2_ALLOCATION_TOTALS& Totals,
+        _In_ M2_ALLOCATION_COUNTS& Counts)
+    {
+        Totals.AllocationCount += static_cast<ULONGLONG>(
+            M2ReadAllocationCount(&Counts.AllocationCount));
+        Totals.AllocatedBytes += static_cast<ULONGLONG>(
+            M2ReadAllocationCount(&Counts.AllocatedBytes));
+        Totals.FreeCount += static_cast<ULONGLONG>(
+            M2ReadAllocationCount(&Counts.FreeCount));
+    }
+
+    /**
+     * Adds up the shared counts and the counts of all threads of the site.
+     */
+    void M2GetAllocationSiteTotals(
+        _In_ M2_ALLOCATION_SITE& Site,
+        _Inout_ M2_ALLOCATION_TOTALS& Totals)
+    {
+        SIZE_T Index = M2GetAllocationSiteIndex(&Site);
+
+        M2AddAllocationTotals(Totals, Site.SharedCounts);
+
+        for (M2_ALLOCATION_THREAD_COUNTERS* Counters =
+            g_AllocationThreadCounters;
+            Counters;
+            Counters = Counters->Next)
+        {
+            M2AddAllocationTotals(Totals, Counters->Sites[Index]);
+        }
+    }
+
+    M2_ALLOCATION_SITE* M2FindAllocationSite(
+        _In_z_ const char* Tag,
+        _In_z_ const char* Source)
+    {
+        LONG Count = g_AllocationSiteCount;
+        for (LONG i = 0; i < Count; ++i)
+        {
+            M2_ALLOCATION_SITE* Site = &g_AllocationSites[i];
+            if (Site->Tag == Tag && Site->Source == Source)
+                return Site;
+        }
+
+        return nullptr;
+    }
+
+    M2_ALLOCATION_SITE* M2GetAllocationSite(
+        _In_z_ const char* Source)
+    {
+        const char* Tag =
+            t_AllocationTag ? t_AllocationTag : g_UntaggedAllocationTag;
+
+        M2_ALLOCATION_SITE* Site = t_LastAllocationSite;
+        if (Site && Site->Tag == Tag && Site->Source == Source)
+            return Site;
+
+        Site = M2FindAllocationSite(Tag, Source);
+        if (!Site)
+        {
+            if (0 == InterlockedExchange(&g_IsReportRegistered, 1))
+            {
+                atexit(M2WriteAllocationStatisticsReportAtExit);
+            }
+
+            AcquireSRWLockExclusive(&g_AllocationSitesLock);
+
+            Site = M2FindAllocationSite(Tag, Source);
+            if (!Site && g_AllocationSiteCount < M2_ALLOCATION_SITE_COUNT)
+            {
+                Site = &g_AllocationSites[g_AllocationSiteCount];
+                Site->Tag = Tag;
+                Site->Source = Source;
+
+                // Publish the site after it is written.
+                InterlockedIncrement(&g_AllocationSiteCount);
+            }
+
+            ReleaseSRWLockExclusive(&g_AllocationSitesLock);
+
+            if (!Site)
+                return &g_UnattributedAllocationSite;
+        }
+
+        t_LastAllocationSite = Site;
+        return Site;
+    }
+
+    void M2AppendAllocationSiteReport(
+        _Inout_ std::string& Report,
+        _In_ M2_ALLOCATION_SITE& Site)
+    {
+        M2_ALLOCATION_TOTALS Totals;
+        M2GetAllocationSiteTotals(Site, Totals);
+        if (!Totals.AllocationCount && !Totals.FreeCount)
+            return;
+
+        char Buffer[256];
+        sprintf_s(
+            Buffer,
+            "%s [%s]: allocations=%llu bytes=%llu frees=%llu\n",
+            Site.Tag,
+            Site.Source,
+            Totals.AllocationCount,
+            Totals.AllocatedBytes,
+            Totals.FreeCount);
+        Report += Buffer;
+    }
+}
+
+/**
+ * Sets the allocation tag of the current thread. The allocations of the
+ * thread are counted under the tag until it is changed.
+ *
+ * @param Tag The tag. It must be a string literal because only the pointer is
+ *            saved. If this parameter is nullptr, the allocations are counted
+ *            as untagged.
+ * @return The previous tag of the current thread.
+ */
+const char* M2SetAllocationTag(
+    _In_opt_z_ const char* Tag)
+{
+    const char* PreviousTag = t_AllocationTag;
+    t_AllocationTag = Tag;
+    return PreviousTag;
+}
+
+/**
+ * Counts an allocation under the tag of the current thread. This function
+ * does not call operator new, so it can be called from operator new.
+ *
+ * @param Source The allocation function. It must be a string literal.
+ * @param Size The number of the bytes allocated.
+ */
+void M2RecordAllocation(
+    _In_z_ const char* Source,
+    _In_ SIZE_T Size)
+{
+    M2AddAllocationCounts(
+        M2GetAllocationSite(Source), 1, static_cast<LONG64>(Size), 0);
+}
+
+/**
+ * Counts a free under the tag of the current thread, which can be different
+ * from the tag of the allocation.
+ *
+ * @param Source The allocation function. It must be a string literal.
+ */
+void M2RecordFree(
+    _In_z_ const char* Source)
+{
+    M2AddAllocationCounts(M2GetAllocationSite(Source), 0, 0, 1);
+}
+
+/**
+ * Retrieves the totals of all tags, which lets a benchmark compare the
+ * allocations of an operation with a baseline.
+ *
+ * @param AllocationCount The number of the allocations.
+ * @param AllocatedBytes The number of the bytes allocated.
+ * @param FreeCount The number of the frees.
+ */
+void M2GetAllocationTotals(
+    _Out_ PULONGLONG AllocationCount,
+    _Out_ PULONGLONG AllocatedBytes,
+    _Out_ PULONGLONG FreeCount)
+{
+    M2_ALLOCATION_TOTALS Totals;
+
+    M2GetAllocationSiteTotals(g_UnattributedAllocationSite, Totals);
+
+    LONG Count = g_AllocationSiteCount;
+    for (LONG i = 0; i < Count; ++i)
+    {
+        M2GetAllocationSiteTotals(g_AllocationSites[i], Totals);
+    }
+
+    *AllocationCount = Totals.AllocationCount;
+    *AllocatedBytes = Totals.AllocatedBytes;
+    *FreeCount = Totals.FreeCount;
+}
+
+/**
+ * Retrieves the statistics of a tag and allocation function pair, which lets
+ * the tests check the accounting of an operation. The strings are compared by
+ * content, so the caller does not need the pointers which were recorded.
+ *
+ * @param Tag The tag, or nullptr for the untagged allocations. The pairs
+ *            beyond M2_ALLOCATION_SITE_COUNT are counted under the
+ *            "(unattributed)" tag and the "(any)" function.
+ * @param Source The allocation function.
+ * @param AllocationCount The number of the allocations.
+ * @param AllocatedBytes The number of the bytes allocated.
+ * @param FreeCount The number of the frees.
+ * @return true if the pair has counted an allocation or a free, otherwise
+ *         false and the statistics are zero.
+ */
+bool M2GetAllocationSiteStatistics(
+    _In_opt_z_ const char* Tag,
+    _In_z_ const char* Source,
+    _Out_ PULONGLONG AllocationCount,
+    _Out_ PULONGLONG AllocatedBytes,
+    _Out_ PULONGLONG FreeCount)
+{
+    *AllocationCount = 0;
+    *AllocatedBytes = 0;
+    *FreeCount = 0;
+
+    if (!Tag)
+        Tag = g_UntaggedAllocationTag;
+
+    M2_ALLOCATION_SITE* Site = nullptr;
+
+    LONG Count = g_AllocationSiteCount;
+    for (LONG i = 0; i < Count && !Site; ++i)
+    {
+        if (0 == strcmp(g_AllocationSites[i].Tag, Tag) &&
+            0 == strcmp(g_AllocationSites[i].Source, Source))
+        {
+            Site = &g_AllocationSites[i];
+        }
+    }
+
+    if (!Site &&
+        0 == strcmp(g_UnattributedAllocationSite.Tag, Tag) &&
+        0 == strcmp(g_UnattributedAllocationSite.Source, Source))
+    {
+        Site = &g_UnattributedAllocationSite;
+    }
+
+    if (!Site)
+        return false;
+
+    M2_ALLOCATION_TOTALS Totals;
+    M2GetAllocationSiteTotals(*Site, Totals);
+    if (!Totals.AllocationCount && !Totals.FreeCount)
+        return false;
+
+    *AllocationCount = Totals.AllocationCount;
+    *AllocatedBytes = Totals.AllocatedBytes;
+    *FreeCount = Totals.FreeCount;
+    return true;
+}
+
+/**
+ * Formats the statistics of all tags as a text report. The report is also
+ * written at exit to the file specified by the M2_ALLOCATION_STATISTICS_FILE
+ * environment variable if it is defined.
+ *
+ * @return The text report.
+ */
+std::string M2GetAllocationStatisticsReport()
+{
+    // Take the snapshot of the totals before the report allocates.
+    ULONGLONG AllocationCount = 0;
+    ULONGLONG AllocatedBytes = 0;
+    ULONGLONG FreeCount = 0;
+    M2GetAllocationTotals(&AllocationCount, &AllocatedBytes, &FreeCount);
+
+    std::string Report;
+
+    char Buffer[256];
+    sprintf_s(
+        Buffer,
+        "total: allocations=%llu bytes=%llu frees=%llu\n",
+        AllocationCount,
+        AllocatedBytes,
+        FreeCount);
+    Report += Buffer;
+
+    LONG Count = g_AllocationSiteCount;
+    for (LONG i = 0; i < Count; ++i)
+    {
+        M2AppendAllocationSiteReport(Report, g_AllocationSites[i]);
+    }
+
+    M2AppendAllocationSiteReport(Report, g_UnattributedAllocationSite);
+
+    return Report;
+}
+
+#ifdef M2_ENABLE_OPERATOR_NEW_ACCOUNTING
+
+// The replacements of the global operator new and delete, which count the
+// allocations of the standard containers and the JSON library. Only the
+// operators without the alignment are replaced, and the aligned operators
+// keep using their own allocation functions.
+
+void* __cdecl operator new(size_t Size)
+{
+    for (;;)
+    {
+        void* Block = malloc(Size ? Size : 1);
+        if (Block)
+        {
+            M2RecordAllocation("operator new", Size);
+            return Block;
+        }
+
+        std::new_handler Handler = std::get_new_handler();
+        if (!Handler)
+            throw std::bad_alloc();
+
+        Handler();
+    }
+}
+
+void* __cdecl operator new[](size_t Size)
+{
+    return operator new(Size);
+}
+
+void* __cdecl operator new(size_t Size, const std::nothrow_t&) noexcept
+{
+    try
+    {
+        return operator new(Size);
+    }
+    catch (...)
+    {
+        return nullptr;
+    }
+}
+
+void* __cdecl operator new[](size_t Size, const std::nothrow_t&) noexcept
+{
+    return operator new(Size, std::nothrow);
+}
+
+void __cdecl operator delete(void* Block) noexcept
+{
+    if (Block)
+    {
+        M2RecordFree("operator new");
+        free(Block);
+    }
+}
+
+void __cdecl operator delete[](void* Block) noexcept
+{
+    operator delete(Block);
+}
+
+void __cdecl operator delete(void* Block, size_t) noexcept
+{
+    operator delete(Block);
+}
+
+void __cdecl operator delete[](void* Block, size_t) noexcept
+{
+    operator delete(Block);
+}
+
+void __cdecl operator delete(void* Block, const std::nothrow_t&) noexcept
+{
+    operator delete(Block);
+}
+
+void __cdecl operator delete[](void* Block, const std::nothrow_t&) noexcept
+{
+    operator delete(Block);
+}
+
+#endif // M2_ENABLE_OPERATOR_NEW_ACCOUNTING
+
+#endif // M2_ENABLE_ALLOCATION_ACCOUNTING
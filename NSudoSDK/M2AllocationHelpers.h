@@ -0,0 +1,155 @@
+﻿/*
+ * PROJECT:   M2-Team Common Library
+ * FILE:      M2AllocationHelpers.h
+ * PURPOSE:   Definition for the allocation accounting helpers
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#pragma once
+
+#ifndef _M2_ALLOCATION_HELPERS_
+#define _M2_ALLOCATION_HELPERS_
+
+#include <Windows.h>
+
+#ifdef M2_ENABLE_ALLOCATION_ACCOUNTING
+
+#include <string>
+
+/**
+ * The maximum number of the distinct tag and source pairs. The allocations
+ * of the pairs beyond the limit are counted as unattributed.
+ */
+#define M2_ALLOCATION_SITE_COUNT 256
+
+/**
+ * Sets the allocation tag of the current thread. The allocations of the
+ * thread are counted under the tag until it is changed.
+ *
+ * @param Tag The tag. It must be a string literal because only the pointer is
+ *            saved. If this parameter is nullptr, the allocations are counted
+ *            as untagged.
+ * @return The previous tag of the current thread.
+ */
+const char* M2SetAllocationTag(
+    _In_opt_z_ const char* Tag);
+
+/**
+ * Counts an allocation under the tag of the current thread. This function
+ * does not allocate, so it can be called from operator new.
+ *
+ * @param Source The allocation function. It must be a string literal.
+ * @param Size The number of the bytes allocated.
+ */
+void M2RecordAllocation(
+    _In_z_ const char* Source,
+    _In_ SIZE_T Size);
+
+/**
+ * Counts a free under the tag of the current thread, which can be different
+ * from the tag of the allocation.
+ *
+ * @param Source The allocation function. It must be a string literal.
+ */
+void M2RecordFree(
+    _In_z_ const char* Source);
+
+/**
+ * Retrieves the totals of all tags, which lets a benchmark compare the
+ * allocations of an operation with a baseline.
+ *
+ * @param AllocationCount The number of the allocations.
+ * @param AllocatedBytes The number of the bytes allocated.
+ * @param FreeCount The number of the frees.
+ */
+void M2GetAllocationTotals(
+    _Out_ PULONGLONG AllocationCount,
+    _Out_ PULONGLONG AllocatedBytes,
+    _Out_ PULONGLONG FreeCount);
+
+/**
+ * Retrieves the statistics of a tag and allocation function pair, which lets
+ * the tests check the accounting of an operation. The strings are compared by
+ * content, so the caller does not need the pointers which were recorded.
+ *
+ * @param Tag The tag, or nullptr for the untagged allocations. The pairs
+ *            beyond M2_ALLOCATION_SITE_COUNT are counted under the
+ *            "(unattributed)" tag and the "(any)" function.
+ * @param Source The allocation function.
+ * @param AllocationCount The number of the allocations.
+ * @param AllocatedBytes The number of the bytes allocated.
+ * @param FreeCount The number of the frees.
+ * @return true if the pair has counted an allocation or a free, otherwise
+ *         false and the statistics are zero.
+ */
+bool M2GetAllocationSiteStatistics(
+    _In_opt_z_ const char* Tag,
+    _In_z_ const char* Source,
+    _Out_ PULONGLONG AllocationCount,
+    _Out_ PULONGLONG AllocatedBytes,
+    _Out_ PULONGLONG FreeCount);
+
+/**
+ * Formats the statistics of all tags as a text report. The report is also
+ * written at exit to the file specified by the M2_ALLOCATION_STATISTICS_FILE
+ * environment variable if it is defined.
+ *
+ * @return The text report.
+ */
+std::string M2GetAllocationStatisticsReport();
+
+namespace M2
+{
+    /**
+     * Sets the allocation tag of the current thread for the lifetime of the
+     * object, and restores the previous tag when it is destroyed.
+     */
+    class CAllocationTagScope
+    {
+    private:
+        const char* m_PreviousTag;
+
+        CAllocationTagScope(const CAllocationTagScope&) = delete;
+        CAllocationTagScope& operator=(const CAllocationTagScope&) = delete;
+
+    public:
+        explicit CAllocationTagScope(
+            _In_z_ const char* Tag) :
+            m_PreviousTag(M2SetAllocationTag(Tag))
+        {
+
+        }
+
+        ~CAllocationTagScope()
+        {
+            M2SetAllocationTag(this->m_PreviousTag);
+        }
+    };
+}
+
+#define M2_ALLOCATION_CONCAT_INTERNAL(x, y) x##y
+#define M2_ALLOCATION_CONCAT(x, y) M2_ALLOCATION_CONCAT_INTERNAL(x, y)
+
+/**
+ * Counts the allocations of the rest of the current scope under the
+ * specified tag when M2_ENABLE_ALLOCATION_ACCOUNTING is defined.
+ */
+#define M2_ALLOCATION_TAG(Tag) \
+    M2::CAllocationTagScope M2_ALLOCATION_CONCAT( \
+        M2AllocationTagScope, __LINE__)(Tag)
+
+#define M2_RECORD_ALLOCATION(Source, Size) M2RecordAllocation(Source, Size)
+#define M2_RECORD_FREE(Source) M2RecordFree(Source)
+
+#else
+
+#define M2_ALLOCATION_TAG(Tag)
+#define M2_RECORD_ALLOCATION(Source, Size) ((void)0)
+#define M2_RECORD_FREE(Source) ((void)0)
+
+#endif // M2_ENABLE_ALLOCATION_ACCOUNTING
+
+#endif // _M2_ALLOCATION_HELPERS_
@@ -0,0 +1,491 @@
+﻿/*
+ * PROJECT:   M2-Team Common Library
+ * FILE:      M2AsyncHelpers.cpp
+ * PURPOSE:   Implementation for the single-threaded event loop helpers
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#include "stdafx.h"
+
+#include <Windows.h>
+
+#include "M2BaseHelpers.h"
+#include "M2Win32Helpers.h"
+#include "M2LockHelpers.h"
+#include "M2AsyncHelpers.h"
+
+namespace
+{
+    struct CHandleWait
+    {
+        M2::CEventLoop* Loop;
+        HANDLE WaitObject;
+        std::function<void(HRESULT)> Callback;
+    };
+
+    struct CFileOperation : OVERLAPPED
+    {
+        M2::CEventLoop* Loop;
+        std::function<void(HRESULT, DWORD)> Callback;
+    };
+
+    /**
+     * The state of a service start. It is the same state machine as
+     * M2StartService, but each 250ms wait is a timer of the event loop.
+     */
+    struct CServiceStartOperation
+    {
+        M2::CEventLoop* Loop;
+        M2::CServiceHandle SCM;
+        M2::CServiceHandle Service;
+        LPSERVICE_STATUS_PROCESS Status;
+        DWORD OldCheckPoint;
+        ULONGLONG LastTick;
+        bool StartServiceCalled;
+        std::function<void(HRESULT)> Callback;
+
+        void Complete(
+            _In_ HRESULT hr)
+        {
+            std::function<void(HRESULT)> CompletionCallback =
+                std::move(this->Callback);
+            delete this;
+            CompletionCallback(hr);
+        }
+
+        void Step()
+        {
+            for (;;)
+            {
+                DWORD nBytesNeeded = 0;
+
+                if (!QueryServiceStatusEx(
+                    this->Service,
+                    SC_STATUS_PROCESS_INFO,
+                    reinterpret_cast<LPBYTE>(this->Status),
+                    sizeof(SERVICE_STATUS_PROCESS),
+                    &nBytesNeeded))
+                {
+                    this->Complete(M2GetLastHRESULTErrorKnownFailedCall());
+                    return;
+                }
+
+                if (SERVICE_STOPPED == this->Status->dwCurrentState)
+                {
+                    // Failed if the service had stopped again.
+                    if (this->StartServiceCalled)
+                    {
+                        this->Complete(E_FAIL);
+                        return;
+                    }
+
+                    if (!StartServiceW(this->Service, 0, nullptr))
+                    {
+                        this->Complete(
+                            M2GetLastHRESULTErrorKnownFailedCall());
+                        return;
+                    }
+
+                    this->StartServiceCalled = true;
+                }
+                else if (
+                    SERVICE_STOP_PENDING == this->Status->dwCurrentState ||
+                    SERVICE_START_PENDING == this->Status->dwCurrentState)
+                {
+                    ULONGLONG nCurrentTick = M2GetTickCount();
+
+                    if (!this->LastTick)
+                    {
+                        this->LastTick = nCurrentTick;
+                        this->OldCheckPoint = this->Status->dwCheckPoint;
+
+                        // Same as the .Net System.ServiceProcess, wait 250ms.
+                        this->Loop->DelayAsync(250, [this]()
+                        {
+                            this->Step();
+                        });
+                        return;
+                    }
+
+                    // Check the timeout if the checkpoint is not increased.
+                    if (this->Status->dwCheckPoint <= this->OldCheckPoint)
+                    {
+                        ULONGLONG nDiff = nCurrentTick - this->LastTick;
+                        if (nDiff > this->Status->dwWaitHint)
+                        {
+                            this->Complete(
+                                __HRESULT_FROM_WIN32(ERROR_TIMEOUT));
+                            return;
+                        }
+                    }
+
+                    // Continue looping.
+                    this->LastTick = 0;
+                }
+                else
+                {
+                    this->Complete(S_OK);
+                    return;
+                }
+            }
+        }
+    };
+}
+
+M2::CEventLoop::CEventLoop() :
+    m_ThreadId(GetCurrentThreadId()),
+    m_WakeEventResult(S_OK)
+{
+    this->m_WakeEvent = CreateEventW(nullptr, FALSE, FALSE, nullptr);
+    if (!this->m_WakeEvent)
+    {
+        this->m_WakeEventResult = M2GetLastHRESULTErrorKnownFailedCall();
+    }
+}
+
+/**
+ * Queues a callback to the loop thread. This function can be called from any
+ * thread.
+ *
+ * @param Callback The callback.
+ */
+void M2::CEventLoop::Post(
+    _In_ std::function<void()>&& Callback)
+{
+    {
+        AutoCriticalSectionLock Lock(this->m_PostedCallbacksLock);
+        this->m_PostedCallbacks.push_back(std::move(Callback));
+    }
+
+    if (GetCurrentThreadId() != this->m_ThreadId)
+    {
+        SetEvent(this->m_WakeEvent);
+    }
+}
+
+/**
+ * Calls the callback after the specified interval.
+ *
+ * @param Milliseconds The interval in milliseconds.
+ * @param Callback The callback.
+ */
+void M2::CEventLoop::DelayAsync(
+    _In_ DWORD Milliseconds,
+    _In_ std::function<void()>&& Callback)
+{
+    CTimer Timer;
+    Timer.DueTime = M2GetTickCount() + Milliseconds;
+    Timer.Sequence = this->m_TimerSequence++;
+    Timer.Callback = std::move(Callback);
+
+    this->m_Timers.push(std::move(Timer));
+    ++this->m_PendingCount;
+}
+
+/**
+ * Waits for the handle to be signaled. The wait is done by the system thread
+ * pool, so the number of the handles is not limited by MAXIMUM_WAIT_OBJECTS.
+ *
+ * @param Handle The handle. It must stay valid until the callback is called.
+ * @param Milliseconds The time-out interval in milliseconds.
+ * @param Callback The callback. Its parameter is S_OK if the handle is
+ *                 signaled, or the error code if the wait failed or timed
+ *                 out.
+ */
+void M2::CEventLoop::WaitForHandleAsync(
+    _In_ HANDLE Handle,
+    _In_ DWORD Milliseconds,
+    _In_ std::function<void(HRESULT)>&& Callback)
+{
+    CHandleWait* Wait = new CHandleWait();
+    Wait->Loop = this;
+    Wait->WaitObject = nullptr;
+    Wait->Callback = std::move(Callback);
+
+    ++this->m_PendingCount;
+
+    // The callback of the wait is posted to this thread, so it cannot run
+    // before WaitObject is saved.
+    if (!RegisterWaitForSingleObject(
+        &Wait->WaitObject,
+        Handle,
+        HandleWaitCallback,
+        Wait,
+        Milliseconds,
+        WT_EXECUTEONLYONCE))
+    {
+        HRESULT hr = M2GetLastHRESULTErrorKnownFailedCall();
+
+        this->Post([this, Wait, hr]()
+        {
+            --this->m_PendingCount;
+            Wait->Callback(hr);
+            delete Wait;
+        });
+    }
+}
+
+/**
+ * Reads from the file or the pipe. The handle must be opened with
+ * FILE_FLAG_OVERLAPPED.
+ *
+ * @param FileHandle The handle of the file or the pipe.
+ * @param Buffer The buffer. It must stay valid until the callback is called.
+ * @param Size The size of the buffer in bytes.
+ * @param Callback The callback. Its parameters are the result and the number
+ *                 of the bytes read.
+ */
+void M2::CEventLoop::ReadFileAsync(
+    _In_ HANDLE FileHandle,
+    _Out_writes_bytes_(Size) LPVOID Buffer,
+    _In_ DWORD Size,
+    _In_ std::function<void(HRESULT, DWORD)>&& Callback)
+{
+    this->StartFileOperation(
+        false, FileHandle, Buffer, Size, std::move(Callback));
+}
+
+/**
+ * Writes to the file or the pipe. The handle must be opened with
+ * FILE_FLAG_OVERLAPPED.
+ *
+ * @param FileHandle The handle of the file or the pipe.
+ * @param Buffer The buffer. It must stay valid until the callback is called.
+ * @param Size The size of the data in bytes.
+ * @param Callback The callback. Its parameters are the result and the number
+ *                 of the bytes written.
+ */
+void M2::CEventLoop::WriteFileAsync(
+    _In_ HANDLE FileHandle,
+    _In_reads_bytes_(Size) LPCVOID Buffer,
+    _In_ DWORD Size,
+    _In_ std::function<void(HRESULT, DWORD)>&& Callback)
+{
+    this->StartFileOperation(
+        true,
+        FileHandle,
+        const_cast<LPVOID>(Buffer),
+        Size,
+        std::move(Callback));
+}
+
+/**
+ * Starts a service if not started and waits for it to leave the pending
+ * states. The status is polled with timers, so the loop thread is not blocked.
+ *
+ * @param ServiceName The name of the service to be started.
+ * @param ServiceStatus The status of the service. It must stay valid until the
+ *                      callback is called.
+ * @param Callback The callback. Its parameter is S_OK if the service is
+ *                 started, or the error code.
+ */
+void M2::CEventLoop::StartServiceAsync(
+    _In_ LPCWSTR ServiceName,
+    _Out_ LPSERVICE_STATUS_PROCESS ServiceStatus,
+    _In_ std::function<void(HRESULT)>&& Callback)
+{
+    CServiceStartOperation* Operation = new CServiceStartOperation();
+    Operation->Loop = this;
+    Operation->Status = ServiceStatus;
+    Operation->OldCheckPoint = 0;
+    Operation->LastTick = 0;
+    Operation->StartServiceCalled = false;
+    Operation->Callback = std::move(Callback);
+
+    HRESULT hr = S_OK;
+
+    Operation->SCM = OpenSCManagerW(
+        nullptr,
+        nullptr,
+        SC_MANAGER_CONNECT);
+    if (!Operation->SCM)
+    {
+        hr = M2GetLastHRESULTErrorKnownFailedCall();
+    }
+    else
+    {
+        Operation->Service = OpenServiceW(
+            Operation->SCM,
+            ServiceName,
+            SERVICE_QUERY_STATUS | SERVICE_START);
+        if (!Operation->Service)
+        {
+            hr = M2GetLastHRESULTErrorKnownFailedCall();
+        }
+    }
+
+    this->Post([Operation, hr]()
+    {
+        if (SUCCEEDED(hr))
+        {
+            Operation->Step();
+        }
+        else
+        {
+            Operation->Complete(hr);
+        }
+    });
+}
+
+/**
+ * Runs the callbacks until no operation is pending and no callback is queued.
+ * The thread waits alertably only while a file operation is pending, so a loop
+ * without them never runs the user APCs queued to the thread by others.
+ *
+ * @return HRESULT. If the function succeeds, the return value is S_OK.
+ */
+HRESULT M2::CEventLoop::Run()
+{
+    if (FAILED(this->m_WakeEventResult))
+        return this->m_WakeEventResult;
+
+    for (;;)
+    {
+        bool HasRunCallbacks = this->RunPostedCallbacks();
+        if (this->RunDueTimers())
+            HasRunCallbacks = true;
+
+        if (HasRunCallbacks)
+            continue;
+
+        if (0 == this->m_PendingCount)
+            break;
+
+        DWORD Timeout = INFINITE;
+        if (!this->m_Timers.empty())
+        {
+            ULONGLONG DueTime = this->m_Timers.top().DueTime;
+            ULONGLONG CurrentTick = M2GetTickCount();
+
+            Timeout = 0;
+            if (DueTime > CurrentTick)
+            {
+                ULONGLONG Interval = DueTime - CurrentTick;
+                Timeout = static_cast<DWORD>(
+                    Interval < INFINITE ? Interval : INFINITE - 1);
+            }
+        }
+
+        // The completion routines of the file operations run in an alertable
+        // wait. The other operations complete through the wake event, so the
+        // wait is not alertable without a file operation.
+        WaitForSingleObjectEx(
+            this->m_WakeEvent,
+            Timeout,
+            this->m_PendingFileOperationCount ? TRUE : FALSE);
+    }
+
+    return S_OK;
+}
+
+bool M2::CEventLoop::RunPostedCallbacks()
+{
+    std::vector<std::function<void()>> Callbacks;
+
+    {
+        AutoCriticalSectionLock Lock(this->m_PostedCallbacksLock);
+        Callbacks.swap(this->m_PostedCallbacks);
+    }
+
+    for (auto& Callback : Callbacks)
+    {
+        Callback();
+    }
+
+    return !Callbacks.empty();
+}
+
+bool M2::CEventLoop::RunDueTimers()
+{
+    bool HasRunTimers = false;
+    ULONGLONG CurrentTick = M2GetTickCount();
+
+    while (!this->m_Timers.empty() &&
+        this->m_Timers.top().DueTime <= CurrentTick)
+    {
+        std::function<void()> Callback = this->m_Timers.top().Callback;
+        this->m_Timers.pop();
+        --this->m_PendingCount;
+
+        Callback();
+        HasRunTimers = true;
+    }
+
+    return HasRunTimers;
+}
+
+VOID CALLBACK M2::CEventLoop::HandleWaitCallback(
+    _In_ PVOID lpParameter,
+    _In_ BOOLEAN TimerOrWaitFired)
+{
+    CHandleWait* Wait = reinterpret_cast<CHandleWait*>(lpParameter);
+    HRESULT hr = TimerOrWaitFired ? __HRESULT_FROM_WIN32(ERROR_TIMEOUT) : S_OK;
+
+    Wait->Loop->Post([Wait, hr]()
+    {
+        // The wait is executed only once, so it does not need to be
+        // canceled, and the function does not block.
+        UnregisterWaitEx(Wait->WaitObject, nullptr);
+
+        --Wait->Loop->m_PendingCount;
+        Wait->Callback(hr);
+        delete Wait;
+    });
+}
+
+VOID CALLBACK M2::CEventLoop::FileCompletionRoutine(
+    _In_ DWORD dwErrorCode,
+    _In_ DWORD dwNumberOfBytesTransfered,
+    _Inout_ LPOVERLAPPED lpOverlapped)
+{
+    CFileOperation* Operation = static_cast<CFileOperation*>(lpOverlapped);
+
+    --Operation->Loop->m_PendingCount;
+    --Operation->Loop->m_PendingFileOperationCount;
+    Operation->Callback(
+        (ERROR_SUCCESS == dwErrorCode)
+        ? S_OK
+        : __HRESULT_FROM_WIN32(dwErrorCode),
+        dwNumberOfBytesTransfered);
+
+    delete Operation;
+}
+
+HRESULT M2::CEventLoop::StartFileOperation(
+    _In_ bool IsWrite,
+    _In_ HANDLE FileHandle,
+    _In_ LPVOID Buffer,
+    _In_ DWORD Size,
+    _In_ std::function<void(HRESULT, DWORD)>&& Callback)
+{
+    // Value-initialized, so the OVERLAPPED part is zeroed.
+    CFileOperation* Operation = new CFileOperation();
+    Operation->Loop = this;
+    Operation->Callback = std::move(Callback);
+
+    ++this->m_PendingCount;
+    ++this->m_PendingFileOperationCount;
+
+    BOOL Result = IsWrite
+        ? WriteFileEx(
+            FileHandle, Buffer, Size, Operation, FileCompletionRoutine)
+        : ReadFileEx(
+            FileHandle, Buffer, Size, Operation, FileCompletionRoutine);
+    if (Result)
+        return S_OK;
+
+    HRESULT hr = M2GetLastHRESULTErrorKnownFailedCall();
+
+    this->Post([this, Operation, hr]()
+    {
+        --this->m_PendingCount;
+        --this->m_PendingFileOperationCount;
+        Operation->Callback(hr, 0);
+        delete Operation;
+    });
+
+    return hr;
+}
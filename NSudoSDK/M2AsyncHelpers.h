@@ -0,0 +1,200 @@
+﻿/*
+ * PROJECT:   M2-Team Common Library
+ * FILE:      M2AsyncHelpers.h
+ * PURPOSE:   Definition for the single-threaded event loop helpers
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#pragma once
+
+#ifndef _M2_ASYNC_HELPERS_
+#define _M2_ASYNC_HELPERS_
+
+#include <Windows.h>
+
+#include "M2BaseHelpers.h"
+#include "M2LockHelpers.h"
+
+#include <functional>
+#include <queue>
+#include <vector>
+
+namespace M2
+{
+    /**
+     * The single-threaded event loop. The asynchronous operations report
+     * their results by calling the completion callbacks on the loop thread,
+     * so many service starts, process waits and pipe transfers can be in
+     * flight at the same time without blocking the thread or adding locks to
+     * the callbacks.
+     *
+     * The loop thread is the thread which creates the loop. Only Post can be
+     * called from the other threads, and the other functions must be called
+     * on the loop thread, for example from a completion callback. The loop
+     * must not be destroyed while Run has not returned.
+     */
+    class CEventLoop : CDisableObjectCopying
+    {
+    private:
+        struct CTimer
+        {
+            ULONGLONG DueTime;
+            ULONGLONG Sequence;
+            std::function<void()> Callback;
+
+            bool operator>(const CTimer& Other) const
+            {
+                if (this->DueTime != Other.DueTime)
+                    return this->DueTime > Other.DueTime;
+                return this->Sequence > Other.Sequence;
+            }
+        };
+
+        DWORD m_ThreadId;
+        CHandle m_WakeEvent;
+        HRESULT m_WakeEventResult;
+
+        M2_DECLARE_LOCK(
+            CAdaptiveLock,
+            m_PostedCallbacksLock,
+            "M2::CEventLoop::PostedCallbacks");
+        std::vector<std::function<void()>> m_PostedCallbacks;
+
+        std::priority_queue<
+            CTimer,
+            std::vector<CTimer>,
+            std::greater<CTimer>> m_Timers;
+        ULONGLONG m_TimerSequence = 0;
+
+        // The number of the started operations which have not completed.
+        size_t m_PendingCount = 0;
+
+        // The number of the file operations among them, whose completion
+        // routines need an alertable wait.
+        size_t m_PendingFileOperationCount = 0;
+
+        bool RunPostedCallbacks();
+
+        bool RunDueTimers();
+
+        static VOID CALLBACK HandleWaitCallback(
+            _In_ PVOID lpParameter,
+            _In_ BOOLEAN TimerOrWaitFired);
+
+        static VOID CALLBACK FileCompletionRoutine(
+            _In_ DWORD dwErrorCode,
+            _In_ DWORD dwNumberOfBytesTransfered,
+            _Inout_ LPOVERLAPPED lpOverlapped);
+
+        HRESULT StartFileOperation(
+            _In_ bool IsWrite,
+            _In_ HANDLE FileHandle,
+            _In_ LPVOID Buffer,
+            _In_ DWORD Size,
+            _In_ std::function<void(HRESULT, DWORD)>&& Callback);
+
+    public:
+        CEventLoop();
+
+        /**
+         * Queues a callback to the loop thread. This function can be called
+         * from any thread.
+         *
+         * @param Callback The callback.
+         */
+        void Post(
+            _In_ std::function<void()>&& Callback);
+
+        /**
+         * Calls the callback after the specified interval.
+         *
+         * @param Milliseconds The interval in milliseconds.
+         * @param Callback The callback.
+         */
+        void DelayAsync(
+            _In_ DWORD Milliseconds,
+            _In_ std::function<void()>&& Callback);
+
+        /**
+         * Waits for the handle to be signaled. The wait is done by the system
+         * thread pool, so the number of the handles is not limited by
+         * MAXIMUM_WAIT_OBJECTS.
+         *
+         * @param Handle The handle. It must stay valid until the callback is
+         *               called.
+         * @param Milliseconds The time-out interval in milliseconds.
+         * @param Callback The callback. Its parameter is S_OK if the handle is
+         *                 signaled, or the error code if the wait failed or
+         *                 timed out.
+         */
+        void WaitForHandleAsync(
+            _In_ HANDLE Handle,
+            _In_ DWORD Milliseconds,
+            _In_ std::function<void(HRESULT)>&& Callback);
+
+        /**
+         * Reads from the file or the pipe. The handle must be opened with
+         * FILE_FLAG_OVERLAPPED.
+         *
+         * @param FileHandle The handle of the file or the pipe.
+         * @param Buffer The buffer. It must stay valid until the callback is
+         *               called.
+         * @param Size The size of the buffer in bytes.
+         * @param Callback The callback. Its parameters are the result and the
+         *                 number of the bytes read.
+         */
+        void ReadFileAsync(
+            _In_ HANDLE FileHandle,
+            _Out_writes_bytes_(Size) LPVOID Buffer,
+            _In_ DWORD Size,
+            _In_ std::function<void(HRESULT, DWORD)>&& Callback);
+
+        /**
+         * Writes to the file or the pipe. The handle must be opened with
+         * FILE_FLAG_OVERLAPPED.
+         *
+         * @param FileHandle The handle of the file or the pipe.
+         * @param Buffer The buffer. It must stay valid until the callback is
+         *               called.
+         * @param Size The size of the data in bytes.
+         * @param Callback The callback. Its parameters are the result and the
+         *                 number of the bytes written.
+         */
+        void WriteFileAsync(
+            _In_ HANDLE FileHandle,
+            _In_reads_bytes_(Size) LPCVOID Buffer,
+            _In_ DWORD Size,
+            _In_ std::function<void(HRESULT, DWORD)>&& Callback);
+
+        /**
+         * Starts a service if not started and waits for it to leave the
+         * pending states. The status is polled with timers, so the loop
+         * thread is not blocked.
+         *
+         * @param ServiceName The name of the service to be started.
+         * @param ServiceStatus The status of the service. It must stay valid
+         *                      until the callback is called.
+         * @param Callback The callback. Its parameter is S_OK if the service
+         *                 is started, or the error code.
+         */
+        void StartServiceAsync(
+            _In_ LPCWSTR ServiceName,
+            _Out_ LPSERVICE_STATUS_PROCESS ServiceStatus,
+            _In_ std::function<void(HRESULT)>&& Callback);
+
+        /**
+         * Runs the callbacks until no operation is pending and no callback is
+         * queued. The thread waits alertably only while a file operation is
+         * pending, so a loop without them never runs the user APCs queued to
+         * the thread by others.
+         *
+         * @return HRESULT. If the function succeeds, the return value is S_OK.
+         */
+        HRESULT Run();
+    };
+}
+
+#endif // _M2_ASYNC_HELPERS_
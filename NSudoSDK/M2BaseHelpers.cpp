@@ -61,6 +61,91 @@ std::wstring M2FormatString(
     return L"N/A";
 }
 
+/**
+ * Retrieves the current value of the performance counter, which is a
+ * monotonic time stamp. Use M2ConvertPerformanceCountToNanoseconds to convert
+ * the difference of two values to nanoseconds.
+ *
+ * @return The current performance counter value.
+ */
+ULONGLONG M2GetPerformanceCounter()
+{
+    // QueryPerformanceCounter always succeeds on Windows XP or later.
+    LARGE_INTEGER PerformanceCount;
+    QueryPerformanceCounter(&PerformanceCount);
+    return static_cast<ULONGLONG>(PerformanceCount.QuadPart);
+}
+
+/**
+ * Retrieves the frequency of the performance counter. The frequency is fixed
+ * at system boot, so it is only queried once.
+ *
+ * @return The frequency of the performance counter in counts per second.
+ */
+ULONGLONG M2GetPerformanceFrequency()
+{
+    static const ULONGLONG CachedFrequency = []() -> ULONGLONG
+    {
+        LARGE_INTEGER Frequency;
+        QueryPerformanceFrequency(&Frequency);
+        return static_cast<ULONGLONG>(Frequency.QuadPart);
+    }();
+
+    return CachedFrequency;
+}
+
+/**
+ * Converts the performance counter value to nanoseconds without overflowing
+ * the intermediate result.
+ *
+ * @param PerformanceCount The performance counter value.
+ * @return The number of nanoseconds.
+ */
+ULONGLONG M2ConvertPerformanceCountToNanoseconds(
+    _In_ ULONGLONG PerformanceCount)
+{
+    return M2ConvertPerformanceCountToNanoseconds(
+        PerformanceCount, M2GetPerformanceFrequency());
+}
+
+/**
+ * Converts the counter value with the specified frequency to nanoseconds
+ * without overflowing the intermediate result.
+ *
+ * @param PerformanceCount The counter value.
+ * @param Frequency The frequency of the counter in counts per second. It must
+ *                  not be zero or greater than 18 GHz.
+ * @return The number of nanoseconds, which is rounded down.
+ */
+ULONGLONG M2ConvertPerformanceCountToNanoseconds(
+    _In_ ULONGLONG PerformanceCount,
+    _In_ ULONGLONG Frequency)
+{
+    const ULONGLONG NanosecondsPerSecond = 1000000000;
+
+    // Multiplying the whole count first overflows after about 30 minutes of
+    // uptime with a 10 MHz counter, so the seconds and the remainder are
+    // scaled separately. The remainder is less than the frequency, so the
+    // product cannot overflow.
+    ULONGLONG Seconds = PerformanceCount / Frequency;
+    ULONGLONG Remainder = PerformanceCount % Frequency;
+
+    return Seconds * NanosecondsPerSecond +
+        Remainder * NanosecondsPerSecond / Frequency;
+}
+
+/**
+ * Retrieves the number of nanoseconds that have elapsed since the system was
+ * started. This is the monotonic clock used by the M2 helpers for tracing and
+ * timeouts.
+ *
+ * @return The number of nanoseconds.
+ */
+ULONGLONG M2GetNanosecondCount()
+{
+    return M2ConvertPerformanceCountToNanoseconds(M2GetPerformanceCounter());
+}
+
 /**
  * Retrieves the number of milliseconds that have elapsed since the system was
  * started.
@@ -69,17 +154,7 @@ std::wstring M2FormatString(
  */
 ULONGLONG M2GetTickCount()
 {
-    LARGE_INTEGER Frequency = { 0 }, PerformanceCount = { 0 };
-
-    if (QueryPerformanceFrequency(&Frequency))
-    {
-        if (QueryPerformanceCounter(&PerformanceCount))
-        {
-            return (PerformanceCount.QuadPart * 1000 / Frequency.QuadPart);
-        }
-    }
-
-    return GetTickCount64();
+    return M2GetNanosecondCount() / 1000000;
 }
 
 /**
@@ -90,6 +165,8 @@ ULONGLONG M2GetTickCount()
  */
 std::wstring M2MakeUTF16String(const std::string& UTF8String)
 {
+    M2_ALLOCATION_TAG("M2MakeUTF16String");
+
     std::wstring UTF16String;
 
     int UTF16StringLength = MultiByteToWideChar(
@@ -211,7 +288,7 @@ HRESULT M2GetProcAddress(
     _In_ LPCSTR lpProcName)
 {
     *lpProcAddress = GetProcAddress(hModule, lpProcName);
-    return (!*lpProcAddress) ? S_OK : M2GetLastHRESULTErrorKnownFailedCall();
+    return (*lpProcAddress) ? S_OK : M2GetLastHRESULTErrorKnownFailedCall();
 }
 
 /**
@@ -842,25 +919,30 @@ HRESULT M2OpenProcessToken(
 
 /**
  * Allocates a block of memory from the default heap of the calling process.
- * The allocated memory will be initialized to zero. The allocated memory is
- * not movable.
+ * The allocated memory will be initialized to zero unless the caller opts
+ * out. The allocated memory is not movable.
  *
  * @param AllocatedMemoryBlock A pointer to the allocated memory block.
  * @param MemoryBlockSize The number of bytes to be allocated.
+ * @param ZeroInitialize Set this parameter to false if the caller overwrites
+ *                       the whole memory block, which saves the cost of
+ *                       zeroing it.
  * @return HRESULT. If the function succeeds, the return value is S_OK.
  */
 HRESULT M2AllocMemory(
     _Out_ PVOID* AllocatedMemoryBlock,
-    _In_ SIZE_T MemoryBlockSize)
+    _In_ SIZE_T MemoryBlockSize,
+    _In_ bool ZeroInitialize)
 {
     *AllocatedMemoryBlock = HeapAlloc(
         GetProcessHeap(),
-        HEAP_ZERO_MEMORY,
+        ZeroInitialize ? HEAP_ZERO_MEMORY : 0,
         MemoryBlockSize);
+    if (!*AllocatedMemoryBlock)
+        return __HRESULT_FROM_WIN32(ERROR_NOT_ENOUGH_MEMORY);
 
-    return *AllocatedMemoryBlock
-        ? S_OK
-        : __HRESULT_FROM_WIN32(ERROR_NOT_ENOUGH_MEMORY);
+    M2_RECORD_ALLOCATION("M2AllocMemory", MemoryBlockSize);
+    return S_OK;
 }
 
 /**
@@ -892,10 +974,14 @@ HRESULT M2ReAllocMemory(
         HEAP_ZERO_MEMORY,
         OldAllocatedMemoryBlock,
         NewMemoryBlockSize);
+    if (!*NewAllocatedMemoryBlock)
+        return __HRESULT_FROM_WIN32(ERROR_NOT_ENOUGH_MEMORY);
 
-    return *NewAllocatedMemoryBlock
-        ? S_OK
-        : __HRESULT_FROM_WIN32(ERROR_NOT_ENOUGH_MEMORY);
+    // The reallocation is counted as a free of the old block and an
+    // allocation of the new block.
+    M2_RECORD_FREE("M2AllocMemory");
+    M2_RECORD_ALLOCATION("M2AllocMemory", NewMemoryBlockSize);
+    return S_OK;
 }
 
 /**
@@ -913,9 +999,129 @@ HRESULT M2FreeMemory(
     if (!HeapFree(GetProcessHeap(), 0, AllocatedMemoryBlock))
         return M2GetLastHRESULTErrorKnownFailedCall();
 
+    M2_RECORD_FREE("M2AllocMemory");
     return S_OK;
 }
 
+namespace
+{
+    // The largest sizes seen for each token information class.
+    volatile LONG g_TokenInformationSizeHints[MaxTokenInfoClass];
+
+    volatile LONG64 g_TokenInformationSizeHintHitCount;
+    volatile LONG64 g_TokenInformationSizeHintMissCount;
+
+    PM2_TOKEN_INFORMATION_QUERY volatile g_TokenInformationQuery =
+        GetTokenInformation;
+}
+
+/**
+ * Replaces the function which M2GetTokenInformation calls, so the size hints
+ * can be tested without real tokens. It is not synchronized with the queries
+ * in flight.
+ *
+ * @param Query The function, or nullptr for GetTokenInformation.
+ * @return The previous function.
+ */
+PM2_TOKEN_INFORMATION_QUERY M2SetTokenInformationQuery(
+    _In_opt_ PM2_TOKEN_INFORMATION_QUERY Query)
+{
+    return reinterpret_cast<PM2_TOKEN_INFORMATION_QUERY>(
+        InterlockedExchangePointer(
+            reinterpret_cast<PVOID volatile*>(&g_TokenInformationQuery),
+            reinterpret_cast<PVOID>(Query ? Query : GetTokenInformation)));
+}
+
+/**
+ * Clears the size hints and the statistics of the token information queries.
+ */
+void M2ResetTokenInformationSizeHints()
+{
+    for (LONG i = 0; i < MaxTokenInfoClass; ++i)
+    {
+        InterlockedExchange(&g_TokenInformationSizeHints[i], 0);
+    }
+
+    InterlockedExchange64(&g_TokenInformationSizeHintHitCount, 0);
+    InterlockedExchange64(&g_TokenInformationSizeHintMissCount, 0);
+}
+
+/**
+ * Retrieves the largest size of the information of the specified class seen
+ * by the token information queries of the current process. The queries try
+ * this size first, so they usually need one call of GetTokenInformation
+ * instead of a size query and a second call.
+ *
+ * @param TokenInformationClass The class of the token information.
+ * @return The size hint in bytes, or zero if there is no hint.
+ */
+DWORD M2GetTokenInformationSizeHint(
+    _In_ TOKEN_INFORMATION_CLASS TokenInformationClass)
+{
+    if (TokenInformationClass < 0 ||
+        TokenInformationClass >= MaxTokenInfoClass)
+    {
+        return 0;
+    }
+
+    return static_cast<DWORD>(
+        g_TokenInformationSizeHints[TokenInformationClass]);
+}
+
+/**
+ * Records the result of a token information query in the size hints.
+ *
+ * @param TokenInformationClass The class of the token information.
+ * @param Length The size of the information in bytes.
+ * @param IsHit Set this parameter to true if the query succeeded at the first
+ *              call of GetTokenInformation.
+ */
+void M2RecordTokenInformationSize(
+    _In_ TOKEN_INFORMATION_CLASS TokenInformationClass,
+    _In_ DWORD Length,
+    _In_ bool IsHit)
+{
+    InterlockedIncrement64(IsHit
+        ? &g_TokenInformationSizeHintHitCount
+        : &g_TokenInformationSizeHintMissCount);
+
+    if (TokenInformationClass < 0 ||
+        TokenInformationClass >= MaxTokenInfoClass ||
+        Length > MAXLONG)
+    {
+        return;
+    }
+
+    volatile LONG* SizeHint =
+        &g_TokenInformationSizeHints[TokenInformationClass];
+
+    LONG CurrentSize = *SizeHint;
+    while (CurrentSize < static_cast<LONG>(Length))
+    {
+        LONG PreviousSize = InterlockedCompareExchange(
+            SizeHint, static_cast<LONG>(Length), CurrentSize);
+        if (PreviousSize == CurrentSize)
+            break;
+
+        CurrentSize = PreviousSize;
+    }
+}
+
+/**
+ * Retrieves the numbers of the token information queries which succeeded at
+ * the first call of GetTokenInformation and which needed more calls.
+ *
+ * @param HitCount The number of the queries which needed one call.
+ * @param MissCount The number of the queries which needed more calls.
+ */
+void M2GetTokenInformationSizeHintStatistics(
+    _Out_ PULONGLONG HitCount,
+    _Out_ PULONGLONG MissCount)
+{
+    *HitCount = static_cast<ULONGLONG>(g_TokenInformationSizeHintHitCount);
+    *MissCount = static_cast<ULONGLONG>(g_TokenInformationSizeHintMissCount);
+}
+
 /**
  * Retrieves a specified type of information about an access token. The calling
  * process must have appropriate access rights to obtain the information.
@@ -943,7 +1149,7 @@ HRESULT M2GetTokenInformation(
     _In_ DWORD TokenInformationLength,
     _Out_ PDWORD ReturnLength)
 {
-    if (GetTokenInformation(
+    if (g_TokenInformationQuery(
         TokenHandle,
         TokenInformationClass,
         TokenInformation,
@@ -979,35 +1185,294 @@ HRESULT M2GetTokenInformation(
     _In_ HANDLE TokenHandle,
     _In_ TOKEN_INFORMATION_CLASS TokenInformationClass)
 {
+    *OutputInformation = nullptr;
+
+    DWORD Length = M2GetTokenInformationSizeHint(TokenInformationClass);
+    bool IsHit = true;
+
+    HRESULT hr = S_OK;
+
+    if (!Length)
+    {
+        hr = M2GetTokenInformation(
+            TokenHandle,
+            TokenInformationClass,
+            nullptr,
+            0,
+            &Length);
+        if (hr != __HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER))
+            return hr;
+
+        IsHit = false;
+    }
+
+    for (;;)
+    {
+        // The buffer is filled by GetTokenInformation, so it is not zeroed.
+        hr = M2AllocMemory(OutputInformation, Length, false);
+        if (FAILED(hr))
+            return hr;
+
+        DWORD ReturnLength = 0;
+
+        hr = M2GetTokenInformation(
+            TokenHandle,
+            TokenInformationClass,
+            *OutputInformation,
+            Length,
+            &ReturnLength);
+        if (SUCCEEDED(hr))
+        {
+            M2RecordTokenInformationSize(
+                TokenInformationClass, ReturnLength, IsHit);
+            return hr;
+        }
+
+        // Keep the error of the query rather than the result of the
+        // cleanup.
+        M2FreeMemory(*OutputInformation);
+        *OutputInformation = nullptr;
+
+        // Retry once with the reported size if the size hint was too small.
+        if (!IsHit ||
+            hr != __HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER) ||
+            ReturnLength <= Length)
+        {
+            return hr;
+        }
+
+        Length = ReturnLength;
+        IsHit = false;
+    }
+}
+
+/**
+ * Retrieves a specified type of information about an access token into the
+ * memory of an arena. The calling process must have appropriate access rights
+ * to obtain the information.
+ *
+ * @param OutputInformation A pointer to a buffer the function fills with the
+ *                          requested information. The buffer is freed with
+ *                          the arena.
+ * @param TokenHandle A handle to an access token from which information is
+ *                    retrieved.
+ * @param TokenInformationClass Specifies a value from the
+ *                              TOKEN_INFORMATION_CLASS enumerated type to
+ *                              identify the type of information the function
+ *                              retrieves.
+ * @param Arena The arena which allocates the buffer.
+ * @return HRESULT. If the function succeeds, the return value is S_OK.
+ * @remark For more information, see GetTokenInformation.
+ */
+HRESULT M2GetTokenInformation(
+    _Out_ PVOID* OutputInformation,
+    _In_ HANDLE TokenHandle,
+    _In_ TOKEN_INFORMATION_CLASS TokenInformationClass,
+    _Inout_ M2::CArena& Arena)
+{
+    *OutputInformation = nullptr;
+
+    PVOID Buffer = nullptr;
+    SIZE_T AvailableSize = 0;
+    bool IsAllocated = false;
+
+    HRESULT hr = S_OK;
+
+    // Query into the unused space of the arena first, which saves the size
+    // query when the information fits. If the size hint does not fit in the
+    // unused space, allocate the size hint instead.
+    Arena.GetAvailableSpace(&Buffer, &AvailableSize);
+
+    DWORD SizeHint = M2GetTokenInformationSizeHint(TokenInformationClass);
+    if (AvailableSize < SizeHint)
+    {
+        hr = Arena.Allocate(&Buffer, SizeHint);
+        if (FAILED(hr))
+            return hr;
+
+        AvailableSize = SizeHint;
+        IsAllocated = true;
+    }
+
+    if (AvailableSize > MAXDWORD)
+        AvailableSize = MAXDWORD;
+
     DWORD Length = 0;
 
-    HRESULT hr = M2GetTokenInformation(
+    hr = M2GetTokenInformation(
         TokenHandle,
         TokenInformationClass,
-        nullptr,
-        0,
+        AvailableSize ? Buffer : nullptr,
+        static_cast<DWORD>(AvailableSize),
         &Length);
-    if (hr == __HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER))
+    if (SUCCEEDED(hr))
     {
-        hr = M2AllocMemory(OutputInformation, Length);
+        // Allocate returns the same address because the information fits.
+        if (!IsAllocated)
+            hr = Arena.Allocate(&Buffer, Length);
+
         if (SUCCEEDED(hr))
         {
-            hr = M2GetTokenInformation(
-                TokenHandle,
-                TokenInformationClass,
-                *OutputInformation,
-                Length,
-                &Length);
-            if (FAILED(hr))
-            {
-                hr = M2FreeMemory(*OutputInformation);
-            }
+            M2RecordTokenInformationSize(TokenInformationClass, Length, true);
+            *OutputInformation = Buffer;
         }
+
+        return hr;
+    }
+
+    if (hr != __HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER) &&
+        hr != __HRESULT_FROM_WIN32(ERROR_BAD_LENGTH))
+    {
+        return hr;
+    }
+
+    hr = Arena.Allocate(&Buffer, Length);
+    if (FAILED(hr))
+        return hr;
+
+    hr = M2GetTokenInformation(
+        TokenHandle,
+        TokenInformationClass,
+        Buffer,
+        Length,
+        &Length);
+    if (SUCCEEDED(hr))
+    {
+        M2RecordTokenInformationSize(TokenInformationClass, Length, false);
+        *OutputInformation = Buffer;
     }
 
     return hr;
 }
 
+M2::CArena::CArena(
+    _In_opt_ PVOID InitialBuffer,
+    _In_ SIZE_T InitialSize) :
+    m_InitialBuffer(reinterpret_cast<PBYTE>(InitialBuffer)),
+    m_InitialSize(InitialBuffer ? InitialSize : 0),
+    m_Current(m_InitialBuffer),
+    m_End(m_InitialBuffer + m_InitialSize)
+{
+
+}
+
+M2::CArena::~CArena()
+{
+    this->Reset();
+}
+
+/**
+ * Allocates a block of memory from the arena. The block is aligned to
+ * MEMORY_ALLOCATION_ALIGNMENT and lives until the arena is reset or
+ * destroyed.
+ *
+ * @param AllocatedMemoryBlock A pointer to the allocated memory block.
+ * @param MemoryBlockSize The number of bytes to be allocated.
+ * @return HRESULT. If the function succeeds, the return value is S_OK.
+ */
+HRESULT M2::CArena::Allocate(
+    _Out_ PVOID* AllocatedMemoryBlock,
+    _In_ SIZE_T MemoryBlockSize)
+{
+    const ULONG_PTR AlignmentMask = MEMORY_ALLOCATION_ALIGNMENT - 1;
+
+    *AllocatedMemoryBlock = nullptr;
+
+    if (this->m_Current)
+    {
+        PBYTE Block = reinterpret_cast<PBYTE>(
+            (reinterpret_cast<ULONG_PTR>(this->m_Current) + AlignmentMask) &
+            ~AlignmentMask);
+
+        if (Block <= this->m_End &&
+            MemoryBlockSize <= static_cast<SIZE_T>(this->m_End - Block))
+        {
+            this->m_Current = Block + MemoryBlockSize;
+            *AllocatedMemoryBlock = Block;
+            return S_OK;
+        }
+    }
+
+    // The header is padded to the alignment, so the block after it is
+    // aligned as well.
+    const SIZE_T HeaderSize =
+        (sizeof(CBlockHeader) + AlignmentMask) & ~AlignmentMask;
+
+    if (MemoryBlockSize > MAXSIZE_T - HeaderSize)
+        return __HRESULT_FROM_WIN32(ERROR_NOT_ENOUGH_MEMORY);
+
+    SIZE_T BlockSize = this->m_NextOverflowBlockSize;
+    if (BlockSize < HeaderSize + MemoryBlockSize)
+        BlockSize = HeaderSize + MemoryBlockSize;
+
+    PVOID Buffer = nullptr;
+    HRESULT hr = M2AllocMemory(&Buffer, BlockSize, false);
+    if (FAILED(hr))
+        return hr;
+
+    CBlockHeader* Header = reinterpret_cast<CBlockHeader*>(Buffer);
+    Header->Next = this->m_OverflowBlocks;
+    this->m_OverflowBlocks = Header;
+
+    if (this->m_NextOverflowBlockSize < MaximumOverflowBlockSize)
+        this->m_NextOverflowBlockSize *= 2;
+
+    PBYTE Block = reinterpret_cast<PBYTE>(Buffer) + HeaderSize;
+    this->m_Current = Block + MemoryBlockSize;
+    this->m_End = reinterpret_cast<PBYTE>(Buffer) + BlockSize;
+
+    *AllocatedMemoryBlock = Block;
+    return S_OK;
+}
+
+/**
+ * Retrieves the unused space of the current block. The space can be written
+ * speculatively, and Allocate returns the same address for a size which is
+ * not larger than the space.
+ *
+ * @param AvailableMemoryBlock A pointer to the unused space.
+ * @param AvailableSize The number of bytes of the unused space.
+ */
+void M2::CArena::GetAvailableSpace(
+    _Out_ PVOID* AvailableMemoryBlock,
+    _Out_ PSIZE_T AvailableSize)
+{
+    const ULONG_PTR AlignmentMask = MEMORY_ALLOCATION_ALIGNMENT - 1;
+
+    *AvailableMemoryBlock = nullptr;
+    *AvailableSize = 0;
+
+    if (!this->m_Current)
+        return;
+
+    PBYTE Block = reinterpret_cast<PBYTE>(
+        (reinterpret_cast<ULONG_PTR>(this->m_Current) + AlignmentMask) &
+        ~AlignmentMask);
+    if (Block > this->m_End)
+        return;
+
+    *AvailableMemoryBlock = Block;
+    *AvailableSize = static_cast<SIZE_T>(this->m_End - Block);
+}
+
+/**
+ * Frees the overflow blocks and makes the initial buffer available again. The
+ * blocks allocated before are no longer valid.
+ */
+void M2::CArena::Reset()
+{
+    while (this->m_OverflowBlocks)
+    {
+        CBlockHeader* Next = this->m_OverflowBlocks->Next;
+        M2FreeMemory(this->m_OverflowBlocks);
+        this->m_OverflowBlocks = Next;
+    }
+
+    this->m_Current = this->m_InitialBuffer;
+    this->m_End = this->m_InitialBuffer + this->m_InitialSize;
+    this->m_NextOverflowBlockSize = MinimumOverflowBlockSize;
+}
+
 /**
  * Expands environment-variable strings and replaces them with the values
  * defined for the current user.
@@ -19,9 +19,12 @@
 #include <process.h>
 
 #include <map>
+#include <memory>
 #include <string>
 #include <vector>
 
+#include "M2AllocationHelpers.h"
+
 /**
  * If the type T is a reference type, provides the member typedef type which is
  * the type referred to by T. Otherwise type is T.
@@ -68,11 +71,52 @@ namespace M2
             this->Close();
         }
 
+        CObject(CObject&& Other) noexcept :
+            CDisableObjectCopying(),
+            m_Object(Other.Detach())
+        {
+
+        }
+
+        CObject& operator=(CObject&& Other) noexcept
+        {
+            // operator& is overloaded, so use std::addressof to compare.
+            if (std::addressof(Other) != this)
+            {
+                this->Close();
+                this->m_Object = Other.Detach();
+            }
+            return *this;
+        }
+
         TObject* operator&()
         {
             return &this->m_Object;
         }
 
+        /**
+         * Retrieves the object without changing the ownership.
+         *
+         * @return The object.
+         */
+        TObject Get() const
+        {
+            return this->m_Object;
+        }
+
+        /**
+         * Closes the current object and retrieves the address of the object
+         * for the functions which return a new object through an output
+         * parameter.
+         *
+         * @return The address of the object.
+         */
+        TObject* Put()
+        {
+            this->Close();
+            return &this->m_Object;
+        }
+
         TObject operator=(TObject Object)
         {
             if (Object != this->m_Object)
@@ -83,12 +127,12 @@ namespace M2
             return (this->m_Object);
         }
 
-        operator TObject()
+        operator TObject() const
         {
             return this->m_Object;
         }
 
-        bool IsInvalid()
+        bool IsInvalid() const
         {
             return (this->m_Object == TObjectDefiner::GetInvalidValue());
         }
@@ -179,6 +223,7 @@ namespace M2
 
         static inline void Close(TMemory Object)
         {
+            M2_RECORD_FREE("CMemory");
             free(Object);
         }
     };
@@ -197,7 +242,11 @@ namespace M2
         {
             this->Free();
             this->m_Object = reinterpret_cast<TMemory>(malloc(Size));
-            return (nullptr != this->m_Object);
+            if (nullptr == this->m_Object)
+                return false;
+
+            M2_RECORD_ALLOCATION("CMemory", Size);
+            return true;
         }
 
         void Free()
@@ -332,14 +381,15 @@ namespace M2
      *
      * @remarks The AutoLock object must go out of scope before the CritSec.
      */
+    template<typename LockType = CCriticalSection>
     class AutoCriticalSectionLock
     {
     private:
-        CCriticalSection* m_pCriticalSection;
+        LockType* m_pCriticalSection;
 
     public:
         _Acquires_lock_(m_pCriticalSection) AutoCriticalSectionLock(
-            CCriticalSection& CriticalSection) :
+            LockType& CriticalSection) :
             m_pCriticalSection(&CriticalSection)
         {
             m_pCriticalSection->Lock();
@@ -356,15 +406,16 @@ namespace M2
      *
      * @remarks The AutoLock object must go out of scope before the CritSec.
      */
+    template<typename LockType = CCriticalSection>
     class AutoTryCriticalSectionLock
     {
     private:
-        CCriticalSection* m_pCriticalSection;
+        LockType* m_pCriticalSection;
         bool m_IsLocked = false;
 
     public:
         _Acquires_lock_(m_pCriticalSection) AutoTryCriticalSectionLock(
-            CCriticalSection& CriticalSection) :
+            LockType& CriticalSection) :
             m_pCriticalSection(&CriticalSection)
         {
             this->m_IsLocked = m_pCriticalSection->TryLock();
@@ -372,7 +423,10 @@ namespace M2
 
         _Releases_lock_(m_pCriticalSection) ~AutoTryCriticalSectionLock()
         {
-            m_pCriticalSection->Unlock();
+            if (this->m_IsLocked)
+            {
+                m_pCriticalSection->Unlock();
+            }
         }
 
         bool IsLocked() const
@@ -432,14 +486,15 @@ namespace M2
      *
      * @remarks The AutoLock object must go out of scope before the CritSec.
      */
+    template<typename LockType = CSRWLock>
     class AutoSRWExclusiveLock
     {
     private:
-        CSRWLock* m_SRWLock;
+        LockType* m_SRWLock;
 
     public:
         _Acquires_lock_(m_pCriticalSection) AutoSRWExclusiveLock(
-            CSRWLock& SRWLock) :
+            LockType& SRWLock) :
             m_SRWLock(&SRWLock)
         {
             m_SRWLock->ExclusiveLock();
@@ -457,15 +512,16 @@ namespace M2
      *
      * @remarks The AutoLock object must go out of scope before the CritSec.
      */
+    template<typename LockType = CSRWLock>
     class AutoTrySRWExclusiveLock
     {
     private:
-        CSRWLock* m_SRWLock;
+        LockType* m_SRWLock;
         bool m_IsLocked = false;
 
     public:
         _Acquires_lock_(m_pCriticalSection) AutoTrySRWExclusiveLock(
-            CSRWLock& SRWLock) :
+            LockType& SRWLock) :
             m_SRWLock(&SRWLock)
         {
             this->m_IsLocked = m_SRWLock->TryExclusiveLock();
@@ -473,7 +529,10 @@ namespace M2
 
         _Releases_lock_(m_pCriticalSection) ~AutoTrySRWExclusiveLock()
         {
-            m_SRWLock->ExclusiveUnlock();
+            if (this->m_IsLocked)
+            {
+                m_SRWLock->ExclusiveUnlock();
+            }
         }
 
         bool IsLocked() const
@@ -488,14 +547,15 @@ namespace M2
      *
      * @remarks The AutoLock object must go out of scope before the CritSec.
      */
+    template<typename LockType = CSRWLock>
     class AutoSRWSharedLock
     {
     private:
-        CSRWLock* m_SRWLock;
+        LockType* m_SRWLock;
 
     public:
         _Acquires_lock_(m_pCriticalSection) AutoSRWSharedLock(
-            CSRWLock& SRWLock) :
+            LockType& SRWLock) :
             m_SRWLock(&SRWLock)
         {
             m_SRWLock->SharedLock();
@@ -513,15 +573,16 @@ namespace M2
      *
      * @remarks The AutoLock object must go out of scope before the CritSec.
      */
+    template<typename LockType = CSRWLock>
     class AutoTrySRWSharedLock
     {
     private:
-        CSRWLock* m_SRWLock;
+        LockType* m_SRWLock;
         bool m_IsLocked = false;
 
     public:
         _Acquires_lock_(m_pCriticalSection) AutoTrySRWSharedLock(
-            CSRWLock& SRWLock) :
+            LockType& SRWLock) :
             m_SRWLock(&SRWLock)
         {
             this->m_IsLocked = m_SRWLock->TrySharedLock();
@@ -529,7 +590,10 @@ namespace M2
 
         _Releases_lock_(m_pCriticalSection) ~AutoTrySRWSharedLock()
         {
-            m_SRWLock->SharedUnlock();
+            if (this->m_IsLocked)
+            {
+                m_SRWLock->SharedUnlock();
+            }
         }
 
         bool IsLocked() const
@@ -542,15 +606,18 @@ namespace M2
      * A template for implementing an object which the type is a singleton. I
      * do not need to free the memory of the object because the OS releases all
      * the unshared memory associated with the process after the process is
-     * terminated.
+     * terminated. Set DestroyOnExit to true if the object needs to be
+     * destroyed when the process exits, in the reverse order of construction
+     * like other static objects.
+     *
+     * @remarks The instance is created by the first call to Get with the
+     *          thread-safe initialization of the local static variable, so
+     *          the following calls only check an initialization flag and do
+     *          not take any lock.
      */
-    template<class ClassType>
+    template<class ClassType, bool DestroyOnExit = false>
     class CSingleton : CDisableObjectCopying
     {
-    private:
-        static CCriticalSection m_SingletonCS;
-        static ClassType* volatile m_Instance = nullptr;
-
     protected:
         CSingleton() = default;
         ~CSingleton() = default;
@@ -558,14 +625,16 @@ namespace M2
     public:
         static ClassType& Get()
         {
-            M2::AutoCriticalSectionLock Lock(this->m_SingletonCS);
-
-            if (nullptr == this->m_Instance)
+            if constexpr (DestroyOnExit)
             {
-                this->m_Instance = new ClassType();
+                static ClassType Instance;
+                return Instance;
+            }
+            else
+            {
+                static ClassType* const Instance = new ClassType();
+                return *Instance;
             }
-
-            return *this->m_Instance;
         }
     };
 
@@ -594,6 +663,55 @@ std::wstring M2FormatString(
     _In_z_ _Printf_format_string_ wchar_t const* const Format,
     ...);
 
+/**
+ * Retrieves the current value of the performance counter, which is a
+ * monotonic time stamp. Use M2ConvertPerformanceCountToNanoseconds to convert
+ * the difference of two values to nanoseconds.
+ *
+ * @return The current performance counter value.
+ */
+ULONGLONG M2GetPerformanceCounter();
+
+/**
+ * Retrieves the frequency of the performance counter. The frequency is fixed
+ * at system boot, so it is only queried once.
+ *
+ * @return The frequency of the performance counter in counts per second.
+ */
+ULONGLONG M2GetPerformanceFrequency();
+
+/**
+ * Converts the performance counter value to nanoseconds without overflowing
+ * the intermediate result.
+ *
+ * @param PerformanceCount The performance counter value.
+ * @return The number of nanoseconds.
+ */
+ULONGLONG M2ConvertPerformanceCountToNanoseconds(
+    _In_ ULONGLONG PerformanceCount);
+
+/**
+ * Converts the counter value with the specified frequency to nanoseconds
+ * without overflowing the intermediate result.
+ *
+ * @param PerformanceCount The counter value.
+ * @param Frequency The frequency of the counter in counts per second. It must
+ *                  not be zero or greater than 18 GHz.
+ * @return The number of nanoseconds, which is rounded down.
+ */
+ULONGLONG M2ConvertPerformanceCountToNanoseconds(
+    _In_ ULONGLONG PerformanceCount,
+    _In_ ULONGLONG Frequency);
+
+/**
+ * Retrieves the number of nanoseconds that have elapsed since the system was
+ * started. This is the monotonic clock used by the M2 helpers for tracing and
+ * timeouts.
+ *
+ * @return The number of nanoseconds.
+ */
+ULONGLONG M2GetNanosecondCount();
+
 /**
  * Retrieves the number of milliseconds that have elapsed since the system was
  * started.
@@ -972,16 +1090,20 @@ HRESULT M2OpenProcessToken(
 
 /**
  * Allocates a block of memory from the default heap of the calling process.
- * The allocated memory will be initialized to zero. The allocated memory is
- * not movable.
+ * The allocated memory will be initialized to zero unless the caller opts
+ * out. The allocated memory is not movable.
  *
  * @param AllocatedMemoryBlock A pointer to the allocated memory block.
  * @param MemoryBlockSize The number of bytes to be allocated.
+ * @param ZeroInitialize Set this parameter to false if the caller overwrites
+ *                       the whole memory block, which saves the cost of
+ *                       zeroing it.
  * @return HRESULT. If the function succeeds, the return value is S_OK.
  */
 HRESULT M2AllocMemory(
     _Out_ PVOID* AllocatedMemoryBlock,
-    _In_ SIZE_T MemoryBlockSize);
+    _In_ SIZE_T MemoryBlockSize,
+    _In_ bool ZeroInitialize = true);
 
 /**
  * Reallocates a block of memory from the default heap of the calling process.
@@ -1048,9 +1170,170 @@ namespace M2
 
     };
 
+#pragma endregion
+
+    /**
+     * The monotonic arena for the short-lived buffers of one operation. The
+     * allocations are bump pointers into the current block, and all memory is
+     * freed at once when the arena is destroyed. The memory is not zeroed.
+     */
+#pragma region CArena
+
+    class CArena : CDisableObjectCopying
+    {
+    private:
+        struct CBlockHeader
+        {
+            CBlockHeader* Next;
+        };
+
+        static const SIZE_T MinimumOverflowBlockSize = 4096;
+        static const SIZE_T MaximumOverflowBlockSize = 1024 * 1024;
+
+        PBYTE m_InitialBuffer;
+        SIZE_T m_InitialSize;
+        PBYTE m_Current;
+        PBYTE m_End;
+        CBlockHeader* m_OverflowBlocks = nullptr;
+        SIZE_T m_NextOverflowBlockSize = MinimumOverflowBlockSize;
+
+    protected:
+        CArena(
+            _In_opt_ PVOID InitialBuffer,
+            _In_ SIZE_T InitialSize);
+
+    public:
+        CArena() : CArena(nullptr, 0)
+        {
+
+        }
+
+        ~CArena();
+
+        /**
+         * Allocates a block of memory from the arena. The block is aligned to
+         * MEMORY_ALLOCATION_ALIGNMENT and lives until the arena is reset or
+         * destroyed.
+         *
+         * @param AllocatedMemoryBlock A pointer to the allocated memory block.
+         * @param MemoryBlockSize The number of bytes to be allocated.
+         * @return HRESULT. If the function succeeds, the return value is S_OK.
+         */
+        HRESULT Allocate(
+            _Out_ PVOID* AllocatedMemoryBlock,
+            _In_ SIZE_T MemoryBlockSize);
+
+        /**
+         * Retrieves the unused space of the current block. The space can be
+         * written speculatively, and Allocate returns the same address for a
+         * size which is not larger than the space.
+         *
+         * @param AvailableMemoryBlock A pointer to the unused space.
+         * @param AvailableSize The number of bytes of the unused space.
+         */
+        void GetAvailableSpace(
+            _Out_ PVOID* AvailableMemoryBlock,
+            _Out_ PSIZE_T AvailableSize);
+
+        /**
+         * Frees the overflow blocks and makes the initial buffer available
+         * again. The blocks allocated before are no longer valid.
+         */
+        void Reset();
+    };
+
+    /**
+     * The arena whose first block is a buffer inside the object, so an
+     * operation which fits in it does not allocate from the heap.
+     */
+#if _MSC_VER >= 1200
+#pragma warning(push)
+#pragma warning(disable:4324) // structure was padded due to alignment specifier
+#endif
+
+    template<SIZE_T InitialSize>
+    class CStackArena : public CArena
+    {
+    private:
+        alignas(MEMORY_ALLOCATION_ALIGNMENT) BYTE m_Buffer[InitialSize];
+
+    public:
+        CStackArena() : CArena(m_Buffer, InitialSize)
+        {
+
+        }
+    };
+
+#if _MSC_VER >= 1200
+#pragma warning(pop)
+#endif
+
 #pragma endregion
 }
 
+/**
+ * The function which queries the token information, with the signature of
+ * GetTokenInformation.
+ */
+typedef BOOL(WINAPI* PM2_TOKEN_INFORMATION_QUERY)(
+    _In_ HANDLE TokenHandle,
+    _In_ TOKEN_INFORMATION_CLASS TokenInformationClass,
+    _Out_opt_ LPVOID TokenInformation,
+    _In_ DWORD TokenInformationLength,
+    _Out_ PDWORD ReturnLength);
+
+/**
+ * Replaces the function which M2GetTokenInformation calls, so the size hints
+ * can be tested without real tokens. It is not synchronized with the queries
+ * in flight.
+ *
+ * @param Query The function, or nullptr for GetTokenInformation.
+ * @return The previous function.
+ */
+PM2_TOKEN_INFORMATION_QUERY M2SetTokenInformationQuery(
+    _In_opt_ PM2_TOKEN_INFORMATION_QUERY Query);
+
+/**
+ * Clears the size hints and the statistics of the token information queries.
+ */
+void M2ResetTokenInformationSizeHints();
+
+/**
+ * Retrieves the largest size of the information of the specified class seen
+ * by the token information queries of the current process. The queries try
+ * this size first, so they usually need one call of GetTokenInformation
+ * instead of a size query and a second call.
+ *
+ * @param TokenInformationClass The class of the token information.
+ * @return The size hint in bytes, or zero if there is no hint.
+ */
+DWORD M2GetTokenInformationSizeHint(
+    _In_ TOKEN_INFORMATION_CLASS TokenInformationClass);
+
+/**
+ * Records the result of a token information query in the size hints.
+ *
+ * @param TokenInformationClass The class of the token information.
+ * @param Length The size of the information in bytes.
+ * @param IsHit Set this parameter to true if the query succeeded at the first
+ *              call of GetTokenInformation.
+ */
+void M2RecordTokenInformationSize(
+    _In_ TOKEN_INFORMATION_CLASS TokenInformationClass,
+    _In_ DWORD Length,
+    _In_ bool IsHit);
+
+/**
+ * Retrieves the numbers of the token information queries which succeeded at
+ * the first call of GetTokenInformation and which needed more calls.
+ *
+ * @param HitCount The number of the queries which needed one call.
+ * @param MissCount The number of the queries which needed more calls.
+ */
+void M2GetTokenInformationSizeHintStatistics(
+    _Out_ PULONGLONG HitCount,
+    _Out_ PULONGLONG MissCount);
+
 /**
  * Retrieves a specified type of information about an access token. The calling
  * process must have appropriate access rights to obtain the information.
@@ -1131,6 +1414,190 @@ HRESULT M2GetTokenInformation(
         TokenInformationClass);
 }
 
+/**
+ * Retrieves a specified type of information about an access token into the
+ * memory of an arena. The calling process must have appropriate access rights
+ * to obtain the information.
+ *
+ * @param OutputInformation A pointer to a buffer the function fills with the
+ *                          requested information. The buffer is freed with
+ *                          the arena.
+ * @param TokenHandle A handle to an access token from which information is
+ *                    retrieved.
+ * @param TokenInformationClass Specifies a value from the
+ *                              TOKEN_INFORMATION_CLASS enumerated type to
+ *                              identify the type of information the function
+ *                              retrieves.
+ * @param Arena The arena which allocates the buffer.
+ * @return HRESULT. If the function succeeds, the return value is S_OK.
+ * @remark For more information, see GetTokenInformation.
+ */
+HRESULT M2GetTokenInformation(
+    _Out_ PVOID* OutputInformation,
+    _In_ HANDLE TokenHandle,
+    _In_ TOKEN_INFORMATION_CLASS TokenInformationClass,
+    _Inout_ M2::CArena& Arena);
+
+/**
+ * Retrieves a specified type of information about an access token into the
+ * memory of an arena. The calling process must have appropriate access rights
+ * to obtain the information.
+ *
+ * @param OutputInformation A pointer to a buffer the function fills with the
+ *                          requested information. The buffer is freed with
+ *                          the arena.
+ * @param TokenHandle A handle to an access token from which information is
+ *                    retrieved.
+ * @param TokenInformationClass Specifies a value from the
+ *                              TOKEN_INFORMATION_CLASS enumerated type to
+ *                              identify the type of information the function
+ *                              retrieves.
+ * @param Arena The arena which allocates the buffer.
+ * @return HRESULT. If the function succeeds, the return value is S_OK.
+ * @remark For more information, see GetTokenInformation.
+ */
+template<typename InformationType>
+HRESULT M2GetTokenInformation(
+    _Out_ InformationType& OutputInformation,
+    _In_ HANDLE TokenHandle,
+    _In_ TOKEN_INFORMATION_CLASS TokenInformationClass,
+    _Inout_ M2::CArena& Arena)
+{
+    return M2GetTokenInformation(
+        reinterpret_cast<PVOID*>(&OutputInformation),
+        TokenHandle,
+        TokenInformationClass,
+        Arena);
+}
+
+namespace M2
+{
+    /**
+     * The result of a token information query with in-object storage. The
+     * query is tried into the inline buffer first, so the information which
+     * fits needs neither the size query nor a heap allocation.
+     */
+#pragma region CTokenInfo
+
+#if _MSC_VER >= 1200
+#pragma warning(push)
+#pragma warning(disable:4324) // structure was padded due to alignment specifier
+#endif
+
+    template<typename InformationType, DWORD InlineSize = 256>
+    class CTokenInfo : CDisableObjectCopying
+    {
+    private:
+        alignas(MEMORY_ALLOCATION_ALIGNMENT) BYTE m_InlineBuffer[InlineSize];
+        CM2Memory<PVOID> m_HeapBuffer;
+        DWORD m_HeapBufferSize = 0;
+        InformationType* m_Information = nullptr;
+
+    public:
+        CTokenInfo() = default;
+
+        /**
+         * Retrieves a specified type of information about an access token.
+         * The query starts with the size hint of the class, and the heap
+         * buffer of the previous query is reused if it is large enough.
+         *
+         * @param TokenHandle A handle to an access token from which
+         *                    information is retrieved.
+         * @param TokenInformationClass Specifies a value from the
+         *                              TOKEN_INFORMATION_CLASS enumerated
+         *                              type to identify the type of
+         *                              information the function retrieves.
+         * @return HRESULT. If the function succeeds, the return value is
+         *         S_OK.
+         */
+        HRESULT Query(
+            _In_ HANDLE TokenHandle,
+            _In_ TOKEN_INFORMATION_CLASS TokenInformationClass)
+        {
+            this->m_Information = nullptr;
+
+            DWORD RequiredSize = M2GetTokenInformationSizeHint(
+                TokenInformationClass);
+            bool IsHit = true;
+
+            for (;;)
+            {
+                PVOID Buffer = this->m_InlineBuffer;
+                DWORD BufferSize = InlineSize;
+
+                if (RequiredSize > InlineSize)
+                {
+                    if (RequiredSize > this->m_HeapBufferSize)
+                    {
+                        this->m_HeapBufferSize = 0;
+
+                        HRESULT hr = M2AllocMemory(
+                            this->m_HeapBuffer.Put(), RequiredSize, false);
+                        if (FAILED(hr))
+                            return hr;
+
+                        this->m_HeapBufferSize = RequiredSize;
+                    }
+
+                    Buffer = this->m_HeapBuffer.Get();
+                    BufferSize = this->m_HeapBufferSize;
+                }
+
+                DWORD Length = 0;
+
+                HRESULT hr = M2GetTokenInformation(
+                    TokenHandle,
+                    TokenInformationClass,
+                    Buffer,
+                    BufferSize,
+                    &Length);
+                if (SUCCEEDED(hr))
+                {
+                    M2RecordTokenInformationSize(
+                        TokenInformationClass, Length, IsHit);
+
+                    this->m_Information =
+                        reinterpret_cast<InformationType*>(Buffer);
+                    return S_OK;
+                }
+
+                // The information can grow between the calls, so retry until
+                // the buffer is large enough.
+                if ((hr != __HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER) &&
+                    hr != __HRESULT_FROM_WIN32(ERROR_BAD_LENGTH)) ||
+                    Length <= BufferSize)
+                {
+                    return hr;
+                }
+
+                RequiredSize = Length;
+                IsHit = false;
+            }
+        }
+
+        /**
+         * Retrieves the information.
+         *
+         * @return The information, or nullptr if the last query failed.
+         */
+        InformationType* Get() const
+        {
+            return this->m_Information;
+        }
+
+        InformationType* operator->() const
+        {
+            return this->m_Information;
+        }
+    };
+
+#if _MSC_VER >= 1200
+#pragma warning(pop)
+#endif
+
+#pragma endregion
+}
+
 /**
  * Expands environment-variable strings and replaces them with the values
  * defined for the current user.
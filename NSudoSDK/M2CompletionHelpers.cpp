@@ -0,0 +1,459 @@
+﻿/*
+ * PROJECT:   M2-Team Common Library
+ * FILE:      M2CompletionHelpers.cpp
+ * PURPOSE:   Implementation for the I/O completion port engine helpers
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#include "stdafx.h"
+
+#include <Windows.h>
+
+#include "M2BaseHelpers.h"
+#include "M2LockHelpers.h"
+#include "M2CompletionHelpers.h"
+
+/**
+ * Creates the completion port.
+ *
+ * @param ConcurrentThreads The maximum number of the threads which process
+ *                          the completions concurrently. If this parameter is
+ *                          zero, the number of the processors is used.
+ */
+M2::CCompletionEngine::CCompletionEngine(
+    _In_ DWORD ConcurrentThreads) :
+    m_PortResult(S_OK)
+{
+    this->m_Port = CreateIoCompletionPort(
+        INVALID_HANDLE_VALUE, nullptr, 0, ConcurrentThreads);
+    if (!this->m_Port)
+    {
+        this->m_PortResult = M2GetLastHRESULTErrorKnownFailedCall();
+    }
+}
+
+/**
+ * Frees the reusable operations. All submitted operations must be completed
+ * before the engine is destroyed.
+ */
+M2::CCompletionEngine::~CCompletionEngine()
+{
+    for (COperation* Operation : this->m_FreeOperations)
+    {
+        delete Operation;
+    }
+}
+
+/**
+ * Associates the file or the pipe with the engine. The handle must be opened
+ * with FILE_FLAG_OVERLAPPED and must not skip the completion port on success,
+ * otherwise the callbacks of the operations which complete synchronously are
+ * never called.
+ *
+ * The engine remembers the handle value until it is destroyed, and the
+ * submissions on the handles which are not associated are rejected. The
+ * engine cannot tell a closed handle from a new handle with the same value,
+ * so close the handle only when the engine is not used with that value any
+ * more.
+ *
+ * @param FileHandle The handle of the file or the pipe.
+ * @return HRESULT. If the function succeeds, the return value is S_OK.
+ */
+HRESULT M2::CCompletionEngine::Associate(
+    _In_ HANDLE FileHandle)
+{
+    if (FAILED(this->m_PortResult))
+        return this->m_PortResult;
+
+    AutoSRWExclusiveLock Lock(this->m_AssociatedHandlesLock);
+
+    // A handle cannot be associated with a port twice.
+    if (this->m_AssociatedHandles.count(FileHandle))
+        return S_OK;
+
+    if (!CreateIoCompletionPort(FileHandle, this->m_Port, 0, 0))
+        return M2GetLastHRESULTErrorKnownFailedCall();
+
+    this->m_AssociatedHandles.insert(FileHandle);
+
+    return S_OK;
+}
+
+/**
+ * Submits a read.
+ *
+ * @param FileHandle The handle associated with the engine.
+ * @param Buffer The buffer which must stay valid until the callback is
+ *               called. If this parameter is nullptr, the data is read into
+ *               the buffer of the operation, and Size is limited to
+ *               M2_COMPLETION_INLINE_BUFFER_SIZE.
+ * @param Size The number of the bytes to read.
+ * @param Offset The file offset. It is ignored by the pipes.
+ * @param Callback The callback.
+ * @return HRESULT. If the function succeeds, the return value is S_OK and the
+ *         callback will be called once. Otherwise the callback will not be
+ *         called. If the handle is not associated with the engine, the
+ *         return value is HRESULT_FROM_WIN32(ERROR_INVALID_HANDLE).
+ */
+HRESULT M2::CCompletionEngine::SubmitRead(
+    _In_ HANDLE FileHandle,
+    _Out_writes_bytes_opt_(Size) LPVOID Buffer,
+    _In_ DWORD Size,
+    _In_ ULONGLONG Offset,
+    _In_ CCompletionCallback&& Callback)
+{
+    return this->SubmitFileOperation(
+        COperationType::Read,
+        FileHandle,
+        Buffer,
+        Size,
+        Offset,
+        std::move(Callback));
+}
+
+/**
+ * Submits a write. The data which fits in the buffer of the operation is
+ * copied, so the caller buffer can be freed when the function returns. The
+ * larger data must stay valid until the callback is called.
+ *
+ * @param FileHandle The handle associated with the engine.
+ * @param Buffer The data.
+ * @param Size The number of the bytes to write.
+ * @param Offset The file offset. It is ignored by the pipes.
+ * @param Callback The callback.
+ * @return HRESULT. If the function succeeds, the return value is S_OK and the
+ *         callback will be called once. Otherwise the callback will not be
+ *         called. If the handle is not associated with the engine, the
+ *         return value is HRESULT_FROM_WIN32(ERROR_INVALID_HANDLE).
+ */
+HRESULT M2::CCompletionEngine::SubmitWrite(
+    _In_ HANDLE FileHandle,
+    _In_reads_bytes_(Size) LPCVOID Buffer,
+    _In_ DWORD Size,
+    _In_ ULONGLONG Offset,
+    _In_ CCompletionCallback&& Callback)
+{
+    return this->SubmitFileOperation(
+        COperationType::Write,
+        FileHandle,
+        const_cast<LPVOID>(Buffer),
+        Size,
+        Offset,
+        std::move(Callback));
+}
+
+/**
+ * Submits a wait for the handle to be signaled, for example for a process to
+ * exit. The number of the handles is not limited by MAXIMUM_WAIT_OBJECTS.
+ *
+ * @param Handle The handle. It must stay valid until the callback is called.
+ * @param Milliseconds The time-out interval in milliseconds.
+ * @param Callback The callback. Its result is S_OK if the handle is signaled,
+ *                 or the error code if the wait timed out. If the completion
+ *                 cannot be queued, it is called on the wait thread with the
+ *                 error code instead.
+ * @return HRESULT. If the function succeeds, the return value is S_OK and the
+ *         callback will be called once. Otherwise the callback will not be
+ *         called.
+ */
+HRESULT M2::CCompletionEngine::SubmitWait(
+    _In_ HANDLE Handle,
+    _In_ DWORD Milliseconds,
+    _In_ CCompletionCallback&& Callback)
+{
+    if (FAILED(this->m_PortResult))
+        return this->m_PortResult;
+
+    COperation* Operation = this->AllocateOperation(
+        COperationType::Wait, std::move(Callback));
+    Operation->Handle = Handle;
+
+    // The registering thread and the completion both hold a reference,
+    // because the wait can complete before RegisterWaitForSingleObject
+    // returns the wait object.
+    Operation->WaitReferenceCount = 2;
+
+    if (!RegisterWaitForSingleObject(
+        &Operation->WaitObject,
+        Handle,
+        WaitCallback,
+        Operation,
+        Milliseconds,
+        WT_EXECUTEONLYONCE))
+    {
+        HRESULT hr = M2GetLastHRESULTErrorKnownFailedCall();
+        this->FreeOperation(Operation);
+        return hr;
+    }
+
+    this->ReleaseWaitOperation(Operation);
+
+    return S_OK;
+}
+
+/**
+ * Queues a callback to the threads which process the completions. This
+ * function can be called from any thread.
+ *
+ * @param Callback The callback.
+ * @return HRESULT. If the function succeeds, the return value is S_OK.
+ */
+HRESULT M2::CCompletionEngine::Post(
+    _In_ CCompletionCallback&& Callback)
+{
+    if (FAILED(this->m_PortResult))
+        return this->m_PortResult;
+
+    COperation* Operation = this->AllocateOperation(
+        COperationType::Callback, std::move(Callback));
+
+    if (!PostQueuedCompletionStatus(this->m_Port, 0, 0, Operation))
+    {
+        HRESULT hr = M2GetLastHRESULTErrorKnownFailedCall();
+        this->FreeOperation(Operation);
+        return hr;
+    }
+
+    return S_OK;
+}
+
+/**
+ * Dequeues up to M2_COMPLETION_BATCH_SIZE completions and calls their
+ * callbacks.
+ *
+ * @param Milliseconds The time-out interval in milliseconds.
+ * @param CompletedCount The number of the processed completions. It is zero
+ *                       if the time-out interval elapsed.
+ * @return HRESULT. If the function succeeds, the return value is S_OK.
+ */
+HRESULT M2::CCompletionEngine::ProcessCompletions(
+    _In_ DWORD Milliseconds,
+    _Out_ PDWORD CompletedCount)
+{
+    *CompletedCount = 0;
+
+    if (FAILED(this->m_PortResult))
+        return this->m_PortResult;
+
+    OVERLAPPED_ENTRY Entries[M2_COMPLETION_BATCH_SIZE];
+    ULONG EntryCount = 0;
+
+    if (!GetQueuedCompletionStatusEx(
+        this->m_Port,
+        Entries,
+        M2_COMPLETION_BATCH_SIZE,
+        &EntryCount,
+        Milliseconds,
+        FALSE))
+    {
+        DWORD LastError = GetLastError();
+        if (WAIT_TIMEOUT == LastError)
+            return S_OK;
+
+        return __HRESULT_FROM_WIN32(LastError);
+    }
+
+    for (ULONG i = 0; i < EntryCount; ++i)
+    {
+        COperation* Operation =
+            static_cast<COperation*>(Entries[i].lpOverlapped);
+
+        HRESULT hr = S_OK;
+        DWORD NumberOfBytesTransferred =
+            Entries[i].dwNumberOfBytesTransferred;
+
+        if (COperationType::Read == Operation->Type ||
+            COperationType::Write == Operation->Type)
+        {
+            // Converts the status saved in the OVERLAPPED to the Win32 error.
+            if (!GetOverlappedResult(
+                Operation->Handle,
+                Operation,
+                &NumberOfBytesTransferred,
+                FALSE))
+            {
+                hr = M2GetLastHRESULTErrorKnownFailedCall();
+            }
+        }
+        else if (COperationType::Wait == Operation->Type)
+        {
+            // The wait callback passes the time-out flag as the number of
+            // the bytes transferred.
+            if (NumberOfBytesTransferred)
+            {
+                hr = __HRESULT_FROM_WIN32(ERROR_TIMEOUT);
+            }
+            NumberOfBytesTransferred = 0;
+        }
+
+        Operation->Callback(
+            hr, NumberOfBytesTransferred, Operation->Buffer);
+
+        if (COperationType::Wait == Operation->Type)
+        {
+            this->ReleaseWaitOperation(Operation);
+        }
+        else
+        {
+            this->FreeOperation(Operation);
+        }
+    }
+
+    *CompletedCount = EntryCount;
+
+    return S_OK;
+}
+
+M2::CCompletionEngine::COperation* M2::CCompletionEngine::AllocateOperation(
+    _In_ COperationType Type,
+    _In_ CCompletionCallback&& Callback)
+{
+    COperation* Operation = nullptr;
+
+    {
+        AutoCriticalSectionLock Lock(this->m_FreeOperationsLock);
+        if (!this->m_FreeOperations.empty())
+        {
+            Operation = this->m_FreeOperations.back();
+            this->m_FreeOperations.pop_back();
+        }
+    }
+
+    if (!Operation)
+    {
+        Operation = new COperation();
+    }
+
+    ZeroMemory(static_cast<LPOVERLAPPED>(Operation), sizeof(OVERLAPPED));
+    Operation->Engine = this;
+    Operation->Type = Type;
+    Operation->Handle = nullptr;
+    Operation->WaitObject = nullptr;
+    Operation->WaitReferenceCount = 0;
+    Operation->Buffer = nullptr;
+    Operation->Callback = std::move(Callback);
+
+    return Operation;
+}
+
+void M2::CCompletionEngine::FreeOperation(
+    _In_ COperation* Operation)
+{
+    // Release the captures of the callback now rather than at the reuse.
+    Operation->Callback = nullptr;
+
+    {
+        AutoCriticalSectionLock Lock(this->m_FreeOperationsLock);
+        if (this->m_FreeOperations.size() < MaximumFreeOperationCount)
+        {
+            this->m_FreeOperations.push_back(Operation);
+            return;
+        }
+    }
+
+    delete Operation;
+}
+
+void M2::CCompletionEngine::ReleaseWaitOperation(
+    _In_ COperation* Operation)
+{
+    if (0 == InterlockedDecrement(&Operation->WaitReferenceCount))
+    {
+        // The wait is executed only once, so it does not need to be
+        // canceled, and the function does not block.
+        UnregisterWaitEx(Operation->WaitObject, nullptr);
+        this->FreeOperation(Operation);
+    }
+}
+
+HRESULT M2::CCompletionEngine::SubmitFileOperation(
+    _In_ COperationType Type,
+    _In_ HANDLE FileHandle,
+    _In_opt_ LPVOID Buffer,
+    _In_ DWORD Size,
+    _In_ ULONGLONG Offset,
+    _In_ CCompletionCallback&& Callback)
+{
+    if (FAILED(this->m_PortResult))
+        return this->m_PortResult;
+
+    if (!Buffer && COperationType::Read == Type)
+    {
+        if (Size > M2_COMPLETION_INLINE_BUFFER_SIZE)
+            return E_INVALIDARG;
+    }
+
+    {
+        // The I/O on a handle which is not associated with the port never
+        // queues a completion, so the callback would never be called.
+        AutoSRWSharedLock Lock(this->m_AssociatedHandlesLock);
+        if (!this->m_AssociatedHandles.count(FileHandle))
+            return __HRESULT_FROM_WIN32(ERROR_INVALID_HANDLE);
+    }
+
+    COperation* Operation = this->AllocateOperation(
+        Type, std::move(Callback));
+    Operation->Handle = FileHandle;
+    Operation->Offset = static_cast<DWORD>(Offset);
+    Operation->OffsetHigh = static_cast<DWORD>(Offset >> 32);
+
+    if (COperationType::Read == Type)
+    {
+        Operation->Buffer = Buffer ? Buffer : Operation->InlineBuffer;
+    }
+    else if (Size <= M2_COMPLETION_INLINE_BUFFER_SIZE)
+    {
+        memcpy(Operation->InlineBuffer, Buffer, Size);
+        Operation->Buffer = Operation->InlineBuffer;
+    }
+    else
+    {
+        Operation->Buffer = Buffer;
+    }
+
+    // The completion is queued to the port even if the operation completes
+    // synchronously, so the callback always runs in ProcessCompletions.
+    BOOL Result = (COperationType::Read == Type)
+        ? ReadFile(FileHandle, Operation->Buffer, Size, nullptr, Operation)
+        : WriteFile(FileHandle, Operation->Buffer, Size, nullptr, Operation);
+    if (!Result)
+    {
+        DWORD LastError = GetLastError();
+
+        // A read of a longer message on a message-mode pipe fails with
+        // ERROR_MORE_DATA, but the status is only a warning and the
+        // completion is still queued, so the operation belongs to the port
+        // and the callback gets the error from the completion.
+        if (ERROR_IO_PENDING != LastError && ERROR_MORE_DATA != LastError)
+        {
+            this->FreeOperation(Operation);
+            return __HRESULT_FROM_WIN32(LastError);
+        }
+    }
+
+    return S_OK;
+}
+
+VOID CALLBACK M2::CCompletionEngine::WaitCallback(
+    _In_ PVOID lpParameter,
+    _In_ BOOLEAN TimerOrWaitFired)
+{
+    COperation* Operation = reinterpret_cast<COperation*>(lpParameter);
+
+    if (!PostQueuedCompletionStatus(
+        Operation->Engine->m_Port,
+        TimerOrWaitFired ? 1 : 0,
+        0,
+        Operation))
+    {
+        // The completion is lost, so the callback gets the error here rather
+        // than never being called, and the reference of the completion is
+        // dropped here.
+        Operation->Callback(
+            M2GetLastHRESULTErrorKnownFailedCall(), 0, Operation->Buffer);
+        Operation->Engine->ReleaseWaitOperation(Operation);
+    }
+}
@@ -0,0 +1,247 @@
+﻿/*
+ * PROJECT:   M2-Team Common Library
+ * FILE:      M2CompletionHelpers.h
+ * PURPOSE:   Definition for the I/O completion port engine helpers
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#pragma once
+
+#ifndef _M2_COMPLETION_HELPERS_
+#define _M2_COMPLETION_HELPERS_
+
+#include <Windows.h>
+
+#include "M2BaseHelpers.h"
+#include "M2LockHelpers.h"
+
+#include <functional>
+#include <set>
+#include <vector>
+
+/**
+ * The size of the buffer owned by each operation. The reads without a caller
+ * buffer and the writes which fit are done in this buffer, so the caller does
+ * not need to keep a buffer alive for them.
+ */
+#define M2_COMPLETION_INLINE_BUFFER_SIZE 4096
+
+/**
+ * The maximum number of the completions dequeued by one call of
+ * CCompletionEngine::ProcessCompletions.
+ */
+#define M2_COMPLETION_BATCH_SIZE 64
+
+namespace M2
+{
+    /**
+     * The callback of a completed operation. Its parameters are the result,
+     * the number of the bytes transferred and the buffer of the operation.
+     * The buffer is only valid during the call.
+     */
+    typedef std::function<void(HRESULT, DWORD, LPVOID)> CCompletionCallback;
+
+    /**
+     * The completion engine built on an I/O completion port. The reads, the
+     * writes and the handle waits share one submit and complete interface,
+     * and the completions are dequeued in batches. The callbacks run on the
+     * threads which call ProcessCompletions.
+     */
+    class CCompletionEngine : CDisableObjectCopying
+    {
+    private:
+        enum class COperationType
+        {
+            Read,
+            Write,
+            Wait,
+            Callback,
+        };
+
+        struct COperation : OVERLAPPED
+        {
+            CCompletionEngine* Engine;
+            COperationType Type;
+            HANDLE Handle;
+            HANDLE WaitObject;
+            volatile LONG WaitReferenceCount;
+            LPVOID Buffer;
+            CCompletionCallback Callback;
+            BYTE InlineBuffer[M2_COMPLETION_INLINE_BUFFER_SIZE];
+        };
+
+        // The completed operations are reused, so a steady stream of
+        // operations does not allocate.
+        static const size_t MaximumFreeOperationCount = 256;
+
+        CHandle m_Port;
+        HRESULT m_PortResult;
+
+        M2_DECLARE_LOCK(
+            CAdaptiveLock,
+            m_FreeOperationsLock,
+            "M2::CCompletionEngine::FreeOperations");
+        std::vector<COperation*> m_FreeOperations;
+
+        M2_DECLARE_LOCK(
+            CAdaptiveSRWLock,
+            m_AssociatedHandlesLock,
+            "M2::CCompletionEngine::AssociatedHandles");
+        std::set<HANDLE> m_AssociatedHandles;
+
+        COperation* AllocateOperation(
+            _In_ COperationType Type,
+            _In_ CCompletionCallback&& Callback);
+
+        void FreeOperation(
+            _In_ COperation* Operation);
+
+        void ReleaseWaitOperation(
+            _In_ COperation* Operation);
+
+        HRESULT SubmitFileOperation(
+            _In_ COperationType Type,
+            _In_ HANDLE FileHandle,
+            _In_opt_ LPVOID Buffer,
+            _In_ DWORD Size,
+            _In_ ULONGLONG Offset,
+            _In_ CCompletionCallback&& Callback);
+
+        static VOID CALLBACK WaitCallback(
+            _In_ PVOID lpParameter,
+            _In_ BOOLEAN TimerOrWaitFired);
+
+    public:
+        /**
+         * Creates the completion port.
+         *
+         * @param ConcurrentThreads The maximum number of the threads which
+         *                          process the completions concurrently. If
+         *                          this parameter is zero, the number of the
+         *                          processors is used.
+         */
+        explicit CCompletionEngine(
+            _In_ DWORD ConcurrentThreads = 0);
+
+        /**
+         * Frees the reusable operations. All submitted operations must be
+         * completed before the engine is destroyed.
+         */
+        ~CCompletionEngine();
+
+        /**
+         * Associates the file or the pipe with the engine. The handle must be
+         * opened with FILE_FLAG_OVERLAPPED and must not skip the completion
+         * port on success, otherwise the callbacks of the operations which
+         * complete synchronously are never called.
+         *
+         * The engine remembers the handle value until it is destroyed, and
+         * the submissions on the handles which are not associated are
+         * rejected. The engine cannot tell a closed handle from a new handle
+         * with the same value, so close the handle only when the engine is
+         * not used with that value any more.
+         *
+         * @param FileHandle The handle of the file or the pipe.
+         * @return HRESULT. If the function succeeds, the return value is S_OK.
+         */
+        HRESULT Associate(
+            _In_ HANDLE FileHandle);
+
+        /**
+         * Submits a read.
+         *
+         * @param FileHandle The handle associated with the engine.
+         * @param Buffer The buffer which must stay valid until the callback
+         *               is called. If this parameter is nullptr, the data is
+         *               read into the buffer of the operation, and Size is
+         *               limited to M2_COMPLETION_INLINE_BUFFER_SIZE.
+         * @param Size The number of the bytes to read.
+         * @param Offset The file offset. It is ignored by the pipes.
+         * @param Callback The callback.
+         * @return HRESULT. If the function succeeds, the return value is S_OK
+         *         and the callback will be called once. Otherwise the
+         *         callback will not be called. If the handle is not
+         *         associated with the engine, the return value is
+         *         HRESULT_FROM_WIN32(ERROR_INVALID_HANDLE).
+         */
+        HRESULT SubmitRead(
+            _In_ HANDLE FileHandle,
+            _Out_writes_bytes_opt_(Size) LPVOID Buffer,
+            _In_ DWORD Size,
+            _In_ ULONGLONG Offset,
+            _In_ CCompletionCallback&& Callback);
+
+        /**
+         * Submits a write. The data which fits in the buffer of the operation
+         * is copied, so the caller buffer can be freed when the function
+         * returns. The larger data must stay valid until the callback is
+         * called.
+         *
+         * @param FileHandle The handle associated with the engine.
+         * @param Buffer The data.
+         * @param Size The number of the bytes to write.
+         * @param Offset The file offset. It is ignored by the pipes.
+         * @param Callback The callback.
+         * @return HRESULT. If the function succeeds, the return value is S_OK
+         *         and the callback will be called once. Otherwise the
+         *         callback will not be called. If the handle is not
+         *         associated with the engine, the return value is
+         *         HRESULT_FROM_WIN32(ERROR_INVALID_HANDLE).
+         */
+        HRESULT SubmitWrite(
+            _In_ HANDLE FileHandle,
+            _In_reads_bytes_(Size) LPCVOID Buffer,
+            _In_ DWORD Size,
+            _In_ ULONGLONG Offset,
+            _In_ CCompletionCallback&& Callback);
+
+        /**
+         * Submits a wait for the handle to be signaled, for example for a
+         * process to exit. The number of the handles is not limited by
+         * MAXIMUM_WAIT_OBJECTS.
+         *
+         * @param Handle The handle. It must stay valid until the callback is
+         *               called.
+         * @param Milliseconds The time-out interval in milliseconds.
+         * @param Callback The callback. Its result is S_OK if the handle is
+         *                 signaled, or the error code if the wait timed out.
+         *                 If the completion cannot be queued, it is called on
+         *                 the wait thread with the error code instead.
+         * @return HRESULT. If the function succeeds, the return value is S_OK
+         *         and the callback will be called once. Otherwise the
+         *         callback will not be called.
+         */
+        HRESULT SubmitWait(
+            _In_ HANDLE Handle,
+            _In_ DWORD Milliseconds,
+            _In_ CCompletionCallback&& Callback);
+
+        /**
+         * Queues a callback to the threads which process the completions.
+         * This function can be called from any thread.
+         *
+         * @param Callback The callback.
+         * @return HRESULT. If the function succeeds, the return value is S_OK.
+         */
+        HRESULT Post(
+            _In_ CCompletionCallback&& Callback);
+
+        /**
+         * Dequeues up to M2_COMPLETION_BATCH_SIZE completions and calls their
+         * callbacks.
+         *
+         * @param Milliseconds The time-out interval in milliseconds.
+         * @param CompletedCount The number of the processed completions. It
+         *                       is zero if the time-out interval elapsed.
+         * @return HRESULT. If the function succeeds, the return value is S_OK.
+         */
+        HRESULT ProcessCompletions(
+            _In_ DWORD Milliseconds,
+            _Out_ PDWORD CompletedCount);
+    };
+}
+
+#endif // _M2_COMPLETION_HELPERS_
@@ -0,0 +1,356 @@
+﻿/*
+ * PROJECT:   M2-Team Common Library
+ * FILE:      M2EnvironmentHelpers.cpp
+ * PURPOSE:   Implementation for the environment block cache helpers
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#include "stdafx.h"
+
+#include <Windows.h>
+
+#include "M2BaseHelpers.h"
+#include "M2LockHelpers.h"
+#include "M2EnvironmentHelpers.h"
+
+#include <Userenv.h>
+#pragma comment(lib, "Userenv.lib")
+
+#include <algorithm>
+
+namespace
+{
+    int M2CompareEnvironmentVariableNames(
+        _In_ std::wstring_view Left,
+        _In_ std::wstring_view Right)
+    {
+        int Result = _wcsnicmp(
+            Left.data(),
+            Right.data(),
+            (std::min)(Left.size(), Right.size()));
+        if (0 != Result)
+            return Result;
+
+        if (Left.size() == Right.size())
+            return 0;
+
+        return Left.size() < Right.size() ? -1 : 1;
+    }
+}
+
+/**
+ * Creates the environment block of the user with the CreateEnvironmentBlock
+ * function, and copies it to the caller's buffer.
+ *
+ * @param Block The environment block, which is a sequence of the
+ *              null-terminated "Name=Value" strings ended by an empty string.
+ * @param TokenHandle The token of the user, or nullptr for the system
+ *                    variables only.
+ * @param Inherit Set this parameter to true to inherit the environment of the
+ *                current process.
+ * @return HRESULT. If the function succeeds, the return value is S_OK.
+ */
+HRESULT M2CreateEnvironmentBlock(
+    _Out_ std::vector<wchar_t>& Block,
+    _In_opt_ HANDLE TokenHandle,
+    _In_ bool Inherit)
+{
+    Block.clear();
+
+    LPVOID Environment = nullptr;
+    if (!CreateEnvironmentBlock(&Environment, TokenHandle, Inherit))
+        return M2GetLastHRESULTErrorKnownFailedCall();
+
+    const wchar_t* Begin = reinterpret_cast<const wchar_t*>(Environment);
+
+    // The block ends with an empty string, so the end is the first pair of
+    // the null characters.
+    const wchar_t* End = Begin;
+    while (End[0] || End[1])
+        ++End;
+
+    Block.assign(Begin, End + 2);
+
+    DestroyEnvironmentBlock(Environment);
+
+    return S_OK;
+}
+
+/**
+ * Takes the environment block and indexes its variables.
+ *
+ * @param Block The environment block, which is a sequence of the
+ *              null-terminated "Name=Value" strings ended by an empty string.
+ * @param CreationTime The time when the block was created, in milliseconds.
+ */
+M2::CEnvironmentBlock::CEnvironmentBlock(
+    _In_ std::vector<wchar_t>&& Block,
+    _In_ ULONGLONG CreationTime) :
+    m_Block(std::move(Block)),
+    m_CreationTime(CreationTime)
+{
+    // Make sure the block is terminated even if the creator omits it.
+    this->m_Block.push_back(L'\0');
+    this->m_Block.push_back(L'\0');
+
+    for (const wchar_t* Variable = this->m_Block.data();
+        *Variable;
+        Variable += wcslen(Variable) + 1)
+    {
+        std::wstring_view Entry(Variable);
+
+        // The names of the per-drive current directories start with "=",
+        // such as "=C:=C:\Windows", so the separator is searched from the
+        // second character.
+        size_t Separator = Entry.find(L'=', 1);
+        if (std::wstring_view::npos == Separator)
+            continue;
+
+        CVariable Item;
+        Item.Name = Entry.substr(0, Separator);
+        Item.Value = Entry.substr(Separator + 1);
+        this->m_Variables.push_back(Item);
+    }
+
+    // The first definition wins if a name is defined more than once.
+    std::stable_sort(
+        this->m_Variables.begin(),
+        this->m_Variables.end(),
+        [](const CVariable& Left, const CVariable& Right)
+    {
+        return M2CompareEnvironmentVariableNames(Left.Name, Right.Name) < 0;
+    });
+}
+
+/**
+ * Finds the value of the variable. The names are case-insensitive.
+ *
+ * @param Name The name of the variable.
+ * @param Value The value of the variable, which is valid as long as the
+ *              block.
+ * @return If the variable is not defined, the return value is false.
+ */
+bool M2::CEnvironmentBlock::Find(
+    _In_ std::wstring_view Name,
+    _Out_ std::wstring_view& Value) const
+{
+    auto Iterator = std::lower_bound(
+        this->m_Variables.begin(),
+        this->m_Variables.end(),
+        Name,
+        [](const CVariable& Left, std::wstring_view Right)
+    {
+        return M2CompareEnvironmentVariableNames(Left.Name, Right) < 0;
+    });
+
+    if (Iterator == this->m_Variables.end() ||
+        0 != M2CompareEnvironmentVariableNames(Iterator->Name, Name))
+    {
+        Value = std::wstring_view();
+        return false;
+    }
+
+    Value = Iterator->Value;
+    return true;
+}
+
+/**
+ * Expands the environment-variable strings with the variables of the block.
+ * It matches the ExpandEnvironmentStrings function, but reads the block
+ * instead of the environment of the current process:
+ *
+ * - The names are case-insensitive.
+ * - The undefined variables, including "%%", are left unchanged, and the
+ *   closing "%" of an undefined variable can open the next one.
+ * - The names which start with "=", such as "=C:", are expanded.
+ * - The values are not expanded again.
+ *
+ * @param ExpandedString The expanded string.
+ * @param Source The environment-variable string you need to expand.
+ * @return HRESULT. If the function succeeds, the return value is S_OK.
+ */
+HRESULT M2::CEnvironmentBlock::ExpandStrings(
+    _Out_ std::wstring& ExpandedString,
+    _In_ const std::wstring& Source) const
+{
+    ExpandedString.clear();
+    ExpandedString.reserve(Source.size());
+
+    size_t Position = 0;
+
+    while (Position < Source.size())
+    {
+        size_t Begin = Source.find(L'%', Position);
+        size_t End = (std::wstring::npos == Begin)
+            ? std::wstring::npos
+            : Source.find(L'%', Begin + 1);
+        if (std::wstring::npos == End)
+        {
+            ExpandedString.append(Source, Position, std::wstring::npos);
+            break;
+        }
+
+        ExpandedString.append(Source, Position, Begin - Position);
+
+        std::wstring_view Name(&Source[Begin + 1], End - Begin - 1);
+        std::wstring_view Value;
+
+        if (!Name.empty() && this->Find(Name, Value))
+        {
+            ExpandedString.append(Value.data(), Value.size());
+            Position = End + 1;
+        }
+        else
+        {
+            // The closing "%" of an undefined variable can start the next
+            // reference, so only the part before it is copied.
+            ExpandedString.append(Source, Begin, End - Begin);
+            Position = End;
+        }
+    }
+
+    return S_OK;
+}
+
+/**
+ * Creates the cache.
+ *
+ * @param MaximumAge The age after which a block is created again, in
+ *                   milliseconds. If this parameter is zero, the blocks are
+ *                   kept until the cache is invalidated.
+ * @param Creator The function used to create the blocks.
+ * @param Clock The function used to get the current time.
+ */
+M2::CEnvironmentBlockCache::CEnvironmentBlockCache(
+    _In_ ULONGLONG MaximumAge,
+    _In_ PM2_ENVIRONMENT_BLOCK_CREATOR Creator,
+    _In_ PM2_ENVIRONMENT_BLOCK_CLOCK Clock) :
+    m_Creator(Creator),
+    m_Clock(Clock),
+    m_MaximumAge(MaximumAge)
+{
+
+}
+
+HRESULT M2::CEnvironmentBlockCache::GetKey(
+    _Out_ std::string& Key,
+    _In_opt_ HANDLE TokenHandle,
+    _In_ bool Inherit)
+{
+    Key.assign(1, Inherit ? '1' : '0');
+
+    if (!TokenHandle)
+        return S_OK;
+
+    DWORD SessionId = 0;
+    DWORD Length = 0;
+    HRESULT hr = M2GetTokenInformation(
+        TokenHandle,
+        TokenSessionId,
+        &SessionId,
+        sizeof(SessionId),
+        &Length);
+    if (FAILED(hr))
+        return hr;
+
+    M2::CTokenInfo<TOKEN_USER> User;
+    hr = User.Query(TokenHandle, TokenUser);
+    if (FAILED(hr))
+        return hr;
+
+    Key.append(
+        reinterpret_cast<const char*>(&SessionId),
+        sizeof(SessionId));
+    Key.append(
+        reinterpret_cast<const char*>(User->User.Sid),
+        GetLengthSid(User->User.Sid));
+
+    return S_OK;
+}
+
+bool M2::CEnvironmentBlockCache::IsExpired(
+    _In_ const CEnvironmentBlockReference& Block,
+    _In_ ULONGLONG CurrentTime) const
+{
+    return this->m_MaximumAge &&
+        CurrentTime - Block->GetCreationTime() >= this->m_MaximumAge;
+}
+
+/**
+ * Retrieves the environment block of the token. The block is created without
+ * holding the lock of the cache if it is not cached or is expired.
+ *
+ * @param Block The environment block.
+ * @param TokenHandle The token of the user, or nullptr for the system
+ *                    variables only.
+ * @param Inherit Set this parameter to true to inherit the environment of the
+ *                current process.
+ * @return HRESULT. If the function succeeds, the return value is S_OK.
+ */
+HRESULT M2::CEnvironmentBlockCache::Acquire(
+    _Out_ CEnvironmentBlockReference& Block,
+    _In_opt_ HANDLE TokenHandle,
+    _In_ bool Inherit)
+{
+    Block.reset();
+
+    std::string Key;
+    HRESULT hr = GetKey(Key, TokenHandle, Inherit);
+    if (FAILED(hr))
+        return hr;
+
+    {
+        AutoCriticalSectionLock Lock(this->m_BlocksLock);
+
+        auto Iterator = this->m_Blocks.find(Key);
+        if (Iterator != this->m_Blocks.end() &&
+            !this->IsExpired(Iterator->second, this->m_Clock()))
+        {
+            Block = Iterator->second;
+            return S_OK;
+        }
+    }
+
+    std::vector<wchar_t> Environment;
+    hr = this->m_Creator(Environment, TokenHandle, Inherit);
+    if (FAILED(hr))
+        return hr;
+
+    CEnvironmentBlockReference NewBlock =
+        std::make_shared<const CEnvironmentBlock>(
+            std::move(Environment), this->m_Clock());
+
+    AutoCriticalSectionLock Lock(this->m_BlocksLock);
+
+    // Another thread may have created the block in the meantime, and the
+    // cached one is kept so all callers share it.
+    CEnvironmentBlockReference& CachedBlock = this->m_Blocks[Key];
+    if (!CachedBlock || this->IsExpired(CachedBlock, this->m_Clock()))
+    {
+        CachedBlock = NewBlock;
+    }
+
+    Block = CachedBlock;
+
+    return S_OK;
+}
+
+/**
+ * Removes all blocks, for example after the environment variables of the
+ * system or the users are changed. The blocks still referenced by the callers
+ * stay valid.
+ */
+void M2::CEnvironmentBlockCache::Invalidate()
+{
+    std::map<std::string, CEnvironmentBlockReference> Blocks;
+
+    {
+        AutoCriticalSectionLock Lock(this->m_BlocksLock);
+        Blocks.swap(this->m_Blocks);
+    }
+
+    // The blocks are released here, outside the lock.
+}
@@ -0,0 +1,243 @@
+﻿/*
+ * PROJECT:   M2-Team Common Library
+ * FILE:      M2EnvironmentHelpers.h
+ * PURPOSE:   Definition for the environment block cache helpers
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#pragma once
+
+#ifndef _M2_ENVIRONMENT_HELPERS_
+#define _M2_ENVIRONMENT_HELPERS_
+
+#include <Windows.h>
+
+#include "M2BaseHelpers.h"
+#include "M2LockHelpers.h"
+
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * The function used by M2::CEnvironmentBlockCache to create the environment
+ * blocks. The default implementation is M2CreateEnvironmentBlock, and another
+ * implementation can be passed to feed the cache with external data.
+ *
+ * @param Block The environment block, which is a sequence of the
+ *              null-terminated "Name=Value" strings ended by an empty string.
+ * @param TokenHandle The token of the user, or nullptr for the system
+ *                    variables only.
+ * @param Inherit Set this parameter to true to inherit the environment of the
+ *                current process.
+ * @return HRESULT. If the function succeeds, the return value is S_OK.
+ */
+typedef HRESULT(*PM2_ENVIRONMENT_BLOCK_CREATOR)(
+    _Out_ std::vector<wchar_t>& Block,
+    _In_opt_ HANDLE TokenHandle,
+    _In_ bool Inherit);
+
+/**
+ * Creates the environment block of the user with the CreateEnvironmentBlock
+ * function, and copies it to the caller's buffer.
+ *
+ * @param Block The environment block, which is a sequence of the
+ *              null-terminated "Name=Value" strings ended by an empty string.
+ * @param TokenHandle The token of the user, or nullptr for the system
+ *                    variables only.
+ * @param Inherit Set this parameter to true to inherit the environment of the
+ *                current process.
+ * @return HRESULT. If the function succeeds, the return value is S_OK.
+ */
+HRESULT M2CreateEnvironmentBlock(
+    _Out_ std::vector<wchar_t>& Block,
+    _In_opt_ HANDLE TokenHandle,
+    _In_ bool Inherit);
+
+/**
+ * The function used by M2::CEnvironmentBlockCache to get the current time in
+ * milliseconds. The default implementation is M2GetTickCount, and another
+ * implementation can be passed to control the expiration of the blocks.
+ *
+ * @return The current time in milliseconds.
+ */
+typedef ULONGLONG(*PM2_ENVIRONMENT_BLOCK_CLOCK)();
+
+namespace M2
+{
+    /**
+     * The immutable environment block with an index of its variables. It is
+     * shared by reference counting, so it can be used by several threads
+     * while the cache which created it is invalidated.
+     */
+#pragma region CEnvironmentBlock
+
+    class CEnvironmentBlock : CDisableObjectCopying
+    {
+    private:
+        struct CVariable
+        {
+            std::wstring_view Name;
+            std::wstring_view Value;
+        };
+
+        std::vector<wchar_t> m_Block;
+        std::vector<CVariable> m_Variables;
+        ULONGLONG m_CreationTime;
+
+    public:
+        /**
+         * Takes the environment block and indexes its variables.
+         *
+         * @param Block The environment block, which is a sequence of the
+         *              null-terminated "Name=Value" strings ended by an empty
+         *              string.
+         * @param CreationTime The time when the block was created, in
+         *                     milliseconds.
+         */
+        explicit CEnvironmentBlock(
+            _In_ std::vector<wchar_t>&& Block,
+            _In_ ULONGLONG CreationTime = M2GetTickCount());
+
+        /**
+         * Retrieves the environment block, which can be passed to the
+         * CreateProcessAsUserW function with CREATE_UNICODE_ENVIRONMENT.
+         *
+         * @return The environment block.
+         */
+        LPVOID Get() const
+        {
+            return const_cast<wchar_t*>(this->m_Block.data());
+        }
+
+        /**
+         * Retrieves the time when the block was created, in milliseconds
+         * returned by M2GetTickCount or the clock of the cache.
+         *
+         * @return The creation time.
+         */
+        ULONGLONG GetCreationTime() const
+        {
+            return this->m_CreationTime;
+        }
+
+        /**
+         * Finds the value of the variable. The names are case-insensitive.
+         *
+         * @param Name The name of the variable.
+         * @param Value The value of the variable, which is valid as long as
+         *              the block.
+         * @return If the variable is not defined, the return value is false.
+         */
+        bool Find(
+            _In_ std::wstring_view Name,
+            _Out_ std::wstring_view& Value) const;
+
+        /**
+         * Expands the environment-variable strings with the variables of the
+         * block. It matches the ExpandEnvironmentStrings function, but reads
+         * the block instead of the environment of the current process:
+         *
+         * - The names are case-insensitive.
+         * - The undefined variables, including "%%", are left unchanged, and
+         *   the closing "%" of an undefined variable can open the next one.
+         * - The names which start with "=", such as "=C:", are expanded.
+         * - The values are not expanded again.
+         *
+         * @param ExpandedString The expanded string.
+         * @param Source The environment-variable string you need to expand.
+         * @return HRESULT. If the function succeeds, the return value is S_OK.
+         */
+        HRESULT ExpandStrings(
+            _Out_ std::wstring& ExpandedString,
+            _In_ const std::wstring& Source) const;
+    };
+
+#pragma endregion
+
+    /**
+     * The reference to a shared environment block.
+     */
+    typedef std::shared_ptr<const CEnvironmentBlock> CEnvironmentBlockReference;
+
+    /**
+     * The cache of the environment blocks keyed by the user SID and the
+     * session ID of the token and the inherit flag. Creating an environment
+     * block reads the user profile and the registry, so the processes
+     * launched with the same identity share one block. The cache is
+     * thread-safe.
+     */
+#pragma region CEnvironmentBlockCache
+
+    class CEnvironmentBlockCache : CDisableObjectCopying
+    {
+    private:
+        PM2_ENVIRONMENT_BLOCK_CREATOR m_Creator;
+        PM2_ENVIRONMENT_BLOCK_CLOCK m_Clock;
+        ULONGLONG m_MaximumAge;
+
+        M2_DECLARE_LOCK(
+            CAdaptiveLock,
+            m_BlocksLock,
+            "M2::CEnvironmentBlockCache::Blocks");
+        std::map<std::string, CEnvironmentBlockReference> m_Blocks;
+
+        static HRESULT GetKey(
+            _Out_ std::string& Key,
+            _In_opt_ HANDLE TokenHandle,
+            _In_ bool Inherit);
+
+        bool IsExpired(
+            _In_ const CEnvironmentBlockReference& Block,
+            _In_ ULONGLONG CurrentTime) const;
+
+    public:
+        /**
+         * Creates the cache.
+         *
+         * @param MaximumAge The age after which a block is created again, in
+         *                   milliseconds. If this parameter is zero, the
+         *                   blocks are kept until the cache is invalidated.
+         * @param Creator The function used to create the blocks.
+         * @param Clock The function used to get the current time.
+         */
+        explicit CEnvironmentBlockCache(
+            _In_ ULONGLONG MaximumAge = 0,
+            _In_ PM2_ENVIRONMENT_BLOCK_CREATOR Creator =
+                M2CreateEnvironmentBlock,
+            _In_ PM2_ENVIRONMENT_BLOCK_CLOCK Clock = M2GetTickCount);
+
+        /**
+         * Retrieves the environment block of the token. The block is created
+         * without holding the lock of the cache if it is not cached or is
+         * expired.
+         *
+         * @param Block The environment block.
+         * @param TokenHandle The token of the user, or nullptr for the system
+         *                    variables only.
+         * @param Inherit Set this parameter to true to inherit the
+         *                environment of the current process.
+         * @return HRESULT. If the function succeeds, the return value is S_OK.
+         */
+        HRESULT Acquire(
+            _Out_ CEnvironmentBlockReference& Block,
+            _In_opt_ HANDLE TokenHandle,
+            _In_ bool Inherit);
+
+        /**
+         * Removes all blocks, for example after the environment variables of
+         * the system or the users are changed. The blocks still referenced by
+         * the callers stay valid.
+         */
+        void Invalidate();
+    };
+
+#pragma endregion
+}
+
+#endif // _M2_ENVIRONMENT_HELPERS_
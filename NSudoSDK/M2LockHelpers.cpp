@@ -0,0 +1,404 @@
+﻿/*
+ * PROJECT:   M2-Team Common Library
+ * FILE:      M2LockHelpers.cpp
+ * PURPOSE:   Implementation for the word-sized adaptive lock helpers
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#include "stdafx.h"
+
+#include <Windows.h>
+
+#include "M2BaseHelpers.h"
+#include "M2Win32Helpers.h"
+#include "M2LockHelpers.h"
+
+#include <stdio.h>
+
+#include <map>
+#include <memory>
+#include <string>
+
+namespace
+{
+    // WaitOnAddress and WakeByAddress* are available in Windows 8 or later.
+    M2::CImportedProcedure<decltype(WaitOnAddress)*> g_WaitOnAddress(
+        L"api-ms-win-core-synch-l1-2-0.dll", "WaitOnAddress");
+    M2::CImportedProcedure<decltype(WakeByAddressSingle)*>
+        g_WakeByAddressSingle(
+            L"api-ms-win-core-synch-l1-2-0.dll", "WakeByAddressSingle");
+    M2::CImportedProcedure<decltype(WakeByAddressAll)*> g_WakeByAddressAll(
+        L"api-ms-win-core-synch-l1-2-0.dll", "WakeByAddressAll");
+
+    volatile bool g_IsWaitOnAddressFallbackForced = false;
+}
+
+/**
+ * Blocks the calling thread while the value at the specified address equals
+ * the compare value. The function uses WaitOnAddress when it is available and
+ * falls back to yielding the processor in earlier versions of Windows, so the
+ * caller must recheck the value after the function returns.
+ *
+ * Before Windows 8 the waiting threads poll instead of parking. Each call
+ * returns after SwitchToThread, or after SleepEx(1) if no other thread is
+ * ready, and the wake functions do nothing. A waiter therefore uses some
+ * processor time while the lock is held, and it may notice the release up to
+ * one timer tick late, which is 15.6 ms unless the timer resolution is
+ * raised. The LockContention benchmark shows the cost against
+ * std::shared_mutex.
+ *
+ * @param Address The address of the value to wait on.
+ * @param CompareValue The value which makes the calling thread to wait.
+ */
+void M2WaitOnAddress(
+    _In_ volatile LONG* Address,
+    _In_ LONG CompareValue)
+{
+    decltype(WaitOnAddress)* pFunc = nullptr;
+    if (!g_IsWaitOnAddressFallbackForced &&
+        SUCCEEDED(g_WaitOnAddress.Get(pFunc)))
+    {
+        pFunc(Address, &CompareValue, sizeof(LONG), INFINITE);
+    }
+    else if (CompareValue == *Address)
+    {
+        // Give up the rest of the time slice, and sleep if no other thread
+        // is ready to run on the current processor.
+        if (!SwitchToThread())
+        {
+            SleepEx(1, FALSE);
+        }
+    }
+}
+
+/**
+ * Wakes one thread that is waiting for the value at the specified address to
+ * change.
+ *
+ * @param Address The address of the value.
+ */
+void M2WakeByAddressSingle(
+    _In_ volatile LONG* Address)
+{
+    decltype(WakeByAddressSingle)* pFunc = nullptr;
+    if (!g_IsWaitOnAddressFallbackForced &&
+        SUCCEEDED(g_WakeByAddressSingle.Get(pFunc)))
+    {
+        pFunc(const_cast<LONG*>(Address));
+    }
+}
+
+/**
+ * Wakes all threads that are waiting for the value at the specified address
+ * to change.
+ *
+ * @param Address The address of the value.
+ */
+void M2WakeByAddressAll(
+    _In_ volatile LONG* Address)
+{
+    decltype(WakeByAddressAll)* pFunc = nullptr;
+    if (!g_IsWaitOnAddressFallbackForced &&
+        SUCCEEDED(g_WakeByAddressAll.Get(pFunc)))
+    {
+        pFunc(const_cast<LONG*>(Address));
+    }
+}
+
+/**
+ * Makes M2WaitOnAddress and the wake functions use the polling fallback of
+ * the earlier versions of Windows, so the fallback can be tested in Windows 8
+ * or later. It must not be called while a thread is waiting.
+ *
+ * @param IsForced If this parameter is true, the fallback is used.
+ * @return The previous setting.
+ */
+bool M2ForceWaitOnAddressFallback(
+    _In_ bool IsForced)
+{
+    bool PreviousValue = g_IsWaitOnAddressFallbackForced;
+    g_IsWaitOnAddressFallbackForced = IsForced;
+    return PreviousValue;
+}
+
+void M2::CAdaptiveLock::LockSlow()
+{
+    // Spin a little longer than the recent acquisitions needed, which keeps
+    // short critical sections away from the park path.
+    LONG SpinLimit = this->m_SpinCount * 2 + 10;
+    if (SpinLimit > MaximumSpinCount)
+        SpinLimit = MaximumSpinCount;
+
+    LONG Spins = 0;
+    for (; Spins < SpinLimit; ++Spins)
+    {
+        if (Unlocked == this->m_State && Unlocked ==
+            InterlockedCompareExchange(&this->m_State, Locked, Unlocked))
+        {
+            this->m_SpinCount += (Spins - this->m_SpinCount) / 8;
+            return;
+        }
+
+        YieldProcessor();
+    }
+
+    this->m_SpinCount += (Spins - this->m_SpinCount) / 8;
+
+    // Mark the lock as contended before parking, so the owner wakes a waiter
+    // when it unlocks. A thread which acquires the lock here keeps the mark,
+    // which may cause one unnecessary wake.
+    while (Unlocked != InterlockedExchange(
+        &this->m_State, LockedWithWaiters))
+    {
+        M2WaitOnAddress(&this->m_State, LockedWithWaiters);
+    }
+}
+
+void M2::CAdaptiveSRWLock::ExclusiveLockSlow()
+{
+    for (LONG Spins = 0; Spins < MaximumSpinCount; ++Spins)
+    {
+        YieldProcessor();
+
+        if (this->TryExclusiveLock())
+            return;
+    }
+
+    // Register as a waiting writer, which blocks the new readers.
+    InterlockedExchangeAdd(&this->m_State, WriterWaitingUnit);
+
+    for (;;)
+    {
+        LONG State = this->m_State;
+
+        if (0 == (State & (WriterLocked | ReaderMask)))
+        {
+            if (State == InterlockedCompareExchange(
+                &this->m_State,
+                (State - WriterWaitingUnit) | WriterLocked,
+                State))
+            {
+                return;
+            }
+        }
+        else
+        {
+            M2WaitOnAddress(&this->m_State, State);
+        }
+    }
+}
+
+void M2::CAdaptiveSRWLock::SharedLockSlow()
+{
+    for (LONG Spins = 0; Spins < MaximumSpinCount; ++Spins)
+    {
+        YieldProcessor();
+
+        if (this->TrySharedLock())
+            return;
+    }
+
+    for (;;)
+    {
+        if (this->TrySharedLock())
+            return;
+
+        LONG State = this->m_State;
+
+        if (0 == (State & (WriterLocked | WriterWaitingMask)))
+            continue;
+
+        // Tell the writer to wake the parked readers when it unlocks.
+        if (0 == (State & ReadersParked))
+        {
+            if (State != InterlockedCompareExchange(
+                &this->m_State, State | ReadersParked, State))
+            {
+                continue;
+            }
+
+            State |= ReadersParked;
+        }
+
+        M2WaitOnAddress(&this->m_State, State);
+    }
+}
+
+void M2::CAdaptiveSRWLock::ExclusiveUnlock()
+{
+    LONG State = this->m_State;
+
+    for (;;)
+    {
+        LONG PreviousState = InterlockedCompareExchange(
+            &this->m_State,
+            State & ~(WriterLocked | ReadersParked),
+            State);
+        if (PreviousState == State)
+            break;
+
+        State = PreviousState;
+    }
+
+    if (0 != (State & (WriterWaitingMask | ReadersParked)))
+    {
+        M2WakeByAddressAll(&this->m_State);
+    }
+}
+
+#ifdef M2_ENABLE_LOCK_INSTRUMENTATION
+
+namespace
+{
+    /**
+     * The statistics of all lock sites. It is created at the first use
+     * because the locks can be static objects of other translation units.
+     */
+    struct M2_LOCK_STATISTICS_REGISTRY
+    {
+        M2::CCriticalSection Lock;
+        std::map<std::string, std::unique_ptr<M2_LOCK_STATISTICS>> Sites;
+    };
+
+    M2_LOCK_STATISTICS_REGISTRY& M2GetLockStatisticsRegistry()
+    {
+        // Leaked on purpose, so the report written at exit can still use it.
+        static M2_LOCK_STATISTICS_REGISTRY* Registry =
+            new M2_LOCK_STATISTICS_REGISTRY();
+        return *Registry;
+    }
+
+    void __cdecl M2WriteLockStatisticsReportAtExit()
+    {
+        wchar_t FilePath[MAX_PATH];
+        DWORD Length = GetEnvironmentVariableW(
+            L"M2_LOCK_STATISTICS_FILE", FilePath, MAX_PATH);
+        if (0 == Length || Length >= MAX_PATH)
+            return;
+
+        FILE* FileStream = nullptr;
+        if (0 != _wfopen_s(&FileStream, FilePath, L"w"))
+            return;
+
+        fputs(M2GetLockStatisticsReport().c_str(), FileStream);
+
+        fclose(FileStream);
+    }
+
+    void M2FormatLockHistogram(
+        _Inout_ std::string& Report,
+        _In_z_ const char* Title,
+        _In_ const volatile LONG64* Histogram)
+    {
+        Report += "  ";
+        Report += Title;
+        Report += ":";
+
+        for (int i = 0; i < M2_LOCK_HISTOGRAM_BUCKET_COUNT; ++i)
+        {
+            if (Histogram[i])
+            {
+                char Buffer[64];
+                sprintf_s(
+                    Buffer,
+                    " [2^%d ns]=%lld",
+                    i,
+                    static_cast<long long>(Histogram[i]));
+                Report += Buffer;
+            }
+        }
+
+        Report += "\n";
+    }
+}
+
+/**
+ * Retrieves the statistics of the specified lock site. The statistics are
+ * created at the first call and live until the process exits.
+ *
+ * @param SiteName The name of the lock site. It must be a string literal
+ *                 because only the pointer is saved.
+ * @return The statistics of the lock site.
+ */
+PM2_LOCK_STATISTICS M2GetLockStatistics(
+    _In_z_ const char* SiteName)
+{
+    static bool IsReportRegistered =
+        (0 == atexit(M2WriteLockStatisticsReportAtExit));
+    UNREFERENCED_PARAMETER(IsReportRegistered);
+
+    M2_LOCK_STATISTICS_REGISTRY& Registry = M2GetLockStatisticsRegistry();
+
+    M2::AutoCriticalSectionLock Lock(Registry.Lock);
+
+    std::unique_ptr<M2_LOCK_STATISTICS>& Statistics = Registry.Sites[SiteName];
+    if (!Statistics)
+    {
+        Statistics.reset(new M2_LOCK_STATISTICS());
+    }
+
+    return Statistics.get();
+}
+
+/**
+ * Adds a duration to the lock time histogram.
+ *
+ * @param Histogram The histogram.
+ * @param Nanoseconds The duration in nanoseconds.
+ */
+void M2AddLockHistogramSample(
+    _Inout_ volatile LONG64* Histogram,
+    _In_ ULONGLONG Nanoseconds)
+{
+    int Bucket = 0;
+    while (Nanoseconds > 1 && Bucket < M2_LOCK_HISTOGRAM_BUCKET_COUNT - 1)
+    {
+        Nanoseconds >>= 1;
+        ++Bucket;
+    }
+
+    InterlockedIncrement64(&Histogram[Bucket]);
+}
+
+/**
+ * Formats the statistics of all lock sites as a text report. The report is
+ * also written at exit to the file specified by the M2_LOCK_STATISTICS_FILE
+ * environment variable if it is defined.
+ *
+ * @return The text report.
+ */
+std::string M2GetLockStatisticsReport()
+{
+    M2_LOCK_STATISTICS_REGISTRY& Registry = M2GetLockStatisticsRegistry();
+
+    M2::AutoCriticalSectionLock Lock(Registry.Lock);
+
+    std::string Report;
+
+    for (auto& Site : Registry.Sites)
+    {
+        const M2_LOCK_STATISTICS& Statistics = *Site.second;
+
+        char Buffer[256];
+        sprintf_s(
+            Buffer,
+            "%s: acquisitions=%lld contended=%lld "
+            "wait_ns=%lld hold_ns=%lld\n",
+            Site.first.c_str(),
+            static_cast<long long>(Statistics.Acquisitions),
+            static_cast<long long>(Statistics.ContendedAcquisitions),
+            static_cast<long long>(Statistics.TotalWaitNanoseconds),
+            static_cast<long long>(Statistics.TotalHoldNanoseconds));
+        Report += Buffer;
+
+        M2FormatLockHistogram(Report, "wait", Statistics.WaitHistogram);
+        M2FormatLockHistogram(Report, "hold", Statistics.HoldHistogram);
+    }
+
+    return Report;
+}
+
+#endif // M2_ENABLE_LOCK_INSTRUMENTATION
@@ -0,0 +1,408 @@
+﻿/*
+ * PROJECT:   M2-Team Common Library
+ * FILE:      M2LockHelpers.h
+ * PURPOSE:   Definition for the word-sized adaptive lock helpers
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#pragma once
+
+#ifndef _M2_LOCK_HELPERS_
+#define _M2_LOCK_HELPERS_
+
+#include <Windows.h>
+
+#include "M2BaseHelpers.h"
+
+/**
+ * Blocks the calling thread while the value at the specified address equals
+ * the compare value. The function uses WaitOnAddress when it is available and
+ * falls back to yielding the processor in earlier versions of Windows, so the
+ * caller must recheck the value after the function returns.
+ *
+ * Before Windows 8 the waiting threads poll instead of parking. Each call
+ * returns after SwitchToThread, or after SleepEx(1) if no other thread is
+ * ready, and the wake functions do nothing. A waiter therefore uses some
+ * processor time while the lock is held, and it may notice the release up to
+ * one timer tick late, which is 15.6 ms unless the timer resolution is
+ * raised. The LockContention benchmark shows the cost against
+ * std::shared_mutex.
+ *
+ * @param Address The address of the value to wait on.
+ * @param CompareValue The value which makes the calling thread to wait.
+ */
+void M2WaitOnAddress(
+    _In_ volatile LONG* Address,
+    _In_ LONG CompareValue);
+
+/**
+ * Wakes one thread that is waiting for the value at the specified address to
+ * change.
+ *
+ * @param Address The address of the value.
+ */
+void M2WakeByAddressSingle(
+    _In_ volatile LONG* Address);
+
+/**
+ * Wakes all threads that are waiting for the value at the specified address
+ * to change.
+ *
+ * @param Address The address of the value.
+ */
+void M2WakeByAddressAll(
+    _In_ volatile LONG* Address);
+
+/**
+ * Makes M2WaitOnAddress and the wake functions use the polling fallback of
+ * the earlier versions of Windows, so the fallback can be tested in Windows 8
+ * or later. It must not be called while a thread is waiting.
+ *
+ * @param IsForced If this parameter is true, the fallback is used.
+ * @return The previous setting.
+ */
+bool M2ForceWaitOnAddressFallback(
+    _In_ bool IsForced);
+
+namespace M2
+{
+    /**
+     * A word-sized lock with the same interface as CCriticalSection. The lock
+     * spins for an adaptive period before the waiting thread is parked. The
+     * lock is not recursive.
+     */
+    class CAdaptiveLock : CDisableObjectCopying
+    {
+    private:
+        static const LONG Unlocked = 0;
+        static const LONG Locked = 1;
+        static const LONG LockedWithWaiters = 2;
+        static const LONG MaximumSpinCount = 4000;
+
+        volatile LONG m_State = Unlocked;
+
+        // The moving average of the spins needed by the recent acquisitions.
+        // It is only a hint, so the racy updates are acceptable.
+        volatile LONG m_SpinCount = 0;
+
+        void LockSlow();
+
+    public:
+        CAdaptiveLock() = default;
+
+        _Acquires_lock_(m_State) void Lock()
+        {
+            if (Unlocked != InterlockedCompareExchange(
+                &this->m_State, Locked, Unlocked))
+            {
+                this->LockSlow();
+            }
+        }
+
+        _Releases_lock_(m_State) void Unlock()
+        {
+            if (LockedWithWaiters == InterlockedExchange(
+                &this->m_State, Unlocked))
+            {
+                M2WakeByAddressSingle(&this->m_State);
+            }
+        }
+
+        _Acquires_lock_(m_State) bool TryLock()
+        {
+            return (Unlocked == InterlockedCompareExchange(
+                &this->m_State, Locked, Unlocked));
+        }
+    };
+
+    /**
+     * A word-sized reader/writer lock with the same interface as CSRWLock.
+     * The waiting writers block the new readers, so the writers are not
+     * starved by a continuous stream of readers. The lock is not recursive.
+     */
+    class CAdaptiveSRWLock : CDisableObjectCopying
+    {
+    private:
+        static const LONG WriterLocked = 0x00000001;
+        static const LONG ReadersParked = 0x00000002;
+        static const LONG WriterWaitingUnit = 0x00000004;
+        static const LONG WriterWaitingMask = 0x0000FFFC;
+        static const LONG ReaderUnit = 0x00010000;
+        static const LONG ReaderMask = 0x7FFF0000;
+        static const LONG MaximumSpinCount = 4000;
+
+        volatile LONG m_State = 0;
+
+        void ExclusiveLockSlow();
+        void SharedLockSlow();
+
+    public:
+        CAdaptiveSRWLock() = default;
+
+        _Acquires_lock_(m_State) void ExclusiveLock()
+        {
+            if (!this->TryExclusiveLock())
+            {
+                this->ExclusiveLockSlow();
+            }
+        }
+
+        _Acquires_lock_(m_State) bool TryExclusiveLock()
+        {
+            LONG State = this->m_State;
+            return (0 == (State & (WriterLocked | ReaderMask)) &&
+                State == InterlockedCompareExchange(
+                    &this->m_State, State | WriterLocked, State));
+        }
+
+        _Releases_lock_(m_State) void ExclusiveUnlock();
+
+        _Acquires_lock_(m_State) void SharedLock()
+        {
+            if (!this->TrySharedLock())
+            {
+                this->SharedLockSlow();
+            }
+        }
+
+        _Acquires_lock_(m_State) bool TrySharedLock()
+        {
+            LONG State = this->m_State;
+            return (0 == (State & (WriterLocked | WriterWaitingMask)) &&
+                ReaderMask != (State & ReaderMask) &&
+                State == InterlockedCompareExchange(
+                    &this->m_State, State + ReaderUnit, State));
+        }
+
+        _Releases_lock_(m_State) void SharedUnlock()
+        {
+            LONG State = InterlockedExchangeAdd(
+                &this->m_State, -ReaderUnit);
+
+            // Wake the waiting writers when the last reader leaves.
+            if (ReaderUnit == (State & ReaderMask) &&
+                0 != (State & WriterWaitingMask))
+            {
+                M2WakeByAddressAll(&this->m_State);
+            }
+        }
+    };
+}
+
+#ifdef M2_ENABLE_LOCK_INSTRUMENTATION
+
+/**
+ * The number of the buckets of the lock time histograms. The bucket N counts
+ * the durations from 2^N to 2^(N+1) - 1 nanoseconds.
+ */
+#define M2_LOCK_HISTOGRAM_BUCKET_COUNT 40
+
+/**
+ * The statistics of the locks which share the same site name.
+ */
+typedef struct _M2_LOCK_STATISTICS
+{
+    volatile LONG64 Acquisitions;
+    volatile LONG64 ContendedAcquisitions;
+    volatile LONG64 TotalWaitNanoseconds;
+    volatile LONG64 TotalHoldNanoseconds;
+    volatile LONG64 WaitHistogram[M2_LOCK_HISTOGRAM_BUCKET_COUNT];
+    volatile LONG64 HoldHistogram[M2_LOCK_HISTOGRAM_BUCKET_COUNT];
+} M2_LOCK_STATISTICS, *PM2_LOCK_STATISTICS;
+
+/**
+ * Retrieves the statistics of the specified lock site. The statistics are
+ * created at the first call and live until the process exits.
+ *
+ * @param SiteName The name of the lock site. It must be a string literal
+ *                 because only the pointer is saved.
+ * @return The statistics of the lock site.
+ */
+PM2_LOCK_STATISTICS M2GetLockStatistics(
+    _In_z_ const char* SiteName);
+
+/**
+ * Adds a duration to the lock time histogram.
+ *
+ * @param Histogram The histogram.
+ * @param Nanoseconds The duration in nanoseconds.
+ */
+void M2AddLockHistogramSample(
+    _Inout_ volatile LONG64* Histogram,
+    _In_ ULONGLONG Nanoseconds);
+
+/**
+ * Formats the statistics of all lock sites as a text report. The report is
+ * also written at exit to the file specified by the M2_LOCK_STATISTICS_FILE
+ * environment variable if it is defined.
+ *
+ * @return The text report.
+ */
+std::string M2GetLockStatisticsReport();
+
+namespace M2
+{
+    /**
+     * Wraps a lock with the interface of CCriticalSection or CSRWLock and
+     * records the acquisitions, the contended acquisitions and the wait and
+     * hold time histograms of the lock site. Only the exclusive acquisitions
+     * have the hold time recorded.
+     */
+    template<typename LockType>
+    class CInstrumentedLock : CDisableObjectCopying
+    {
+    private:
+        LockType m_Lock;
+        PM2_LOCK_STATISTICS m_Statistics;
+        DWORD m_RecursionCount = 0;
+        ULONGLONG m_AcquiredCount = 0;
+
+        template<typename TryFunction, typename LockFunction>
+        void Acquire(
+            _In_ TryFunction&& Try,
+            _In_ LockFunction&& Lock)
+        {
+            InterlockedIncrement64(&this->m_Statistics->Acquisitions);
+
+            if (!Try())
+            {
+                ULONGLONG StartCount = M2GetPerformanceCounter();
+                Lock();
+                ULONGLONG WaitNanoseconds =
+                    M2ConvertPerformanceCountToNanoseconds(
+                        M2GetPerformanceCounter() - StartCount);
+
+                InterlockedIncrement64(
+                    &this->m_Statistics->ContendedAcquisitions);
+                InterlockedExchangeAdd64(
+                    &this->m_Statistics->TotalWaitNanoseconds,
+                    static_cast<LONG64>(WaitNanoseconds));
+                M2AddLockHistogramSample(
+                    this->m_Statistics->WaitHistogram, WaitNanoseconds);
+            }
+        }
+
+        void OnExclusiveAcquired()
+        {
+            // CCriticalSection is recursive, so only the outermost
+            // acquisition is timed.
+            if (0 == this->m_RecursionCount++)
+            {
+                this->m_AcquiredCount = M2GetPerformanceCounter();
+            }
+        }
+
+        void OnExclusiveReleasing()
+        {
+            if (0 == --this->m_RecursionCount)
+            {
+                ULONGLONG HoldNanoseconds =
+                    M2ConvertPerformanceCountToNanoseconds(
+                        M2GetPerformanceCounter() - this->m_AcquiredCount);
+
+                InterlockedExchangeAdd64(
+                    &this->m_Statistics->TotalHoldNanoseconds,
+                    static_cast<LONG64>(HoldNanoseconds));
+                M2AddLockHistogramSample(
+                    this->m_Statistics->HoldHistogram, HoldNanoseconds);
+            }
+        }
+
+    public:
+        explicit CInstrumentedLock(
+            _In_z_ const char* SiteName) :
+            m_Statistics(M2GetLockStatistics(SiteName))
+        {
+
+        }
+
+        void Lock()
+        {
+            this->Acquire(
+                [this]() { return this->m_Lock.TryLock(); },
+                [this]() { this->m_Lock.Lock(); });
+            this->OnExclusiveAcquired();
+        }
+
+        void Unlock()
+        {
+            this->OnExclusiveReleasing();
+            this->m_Lock.Unlock();
+        }
+
+        bool TryLock()
+        {
+            if (!this->m_Lock.TryLock())
+                return false;
+
+            InterlockedIncrement64(&this->m_Statistics->Acquisitions);
+            this->OnExclusiveAcquired();
+            return true;
+        }
+
+        void ExclusiveLock()
+        {
+            this->Acquire(
+                [this]() { return this->m_Lock.TryExclusiveLock(); },
+                [this]() { this->m_Lock.ExclusiveLock(); });
+            this->OnExclusiveAcquired();
+        }
+
+        bool TryExclusiveLock()
+        {
+            if (!this->m_Lock.TryExclusiveLock())
+                return false;
+
+            InterlockedIncrement64(&this->m_Statistics->Acquisitions);
+            this->OnExclusiveAcquired();
+            return true;
+        }
+
+        void ExclusiveUnlock()
+        {
+            this->OnExclusiveReleasing();
+            this->m_Lock.ExclusiveUnlock();
+        }
+
+        void SharedLock()
+        {
+            this->Acquire(
+                [this]() { return this->m_Lock.TrySharedLock(); },
+                [this]() { this->m_Lock.SharedLock(); });
+        }
+
+        bool TrySharedLock()
+        {
+            if (!this->m_Lock.TrySharedLock())
+                return false;
+
+            InterlockedIncrement64(&this->m_Statistics->Acquisitions);
+            return true;
+        }
+
+        void SharedUnlock()
+        {
+            this->m_Lock.SharedUnlock();
+        }
+    };
+}
+
+/**
+ * Declares a lock which is instrumented with the specified site name when
+ * M2_ENABLE_LOCK_INSTRUMENTATION is defined. Otherwise the declaration is the
+ * same as a plain declaration of the lock.
+ */
+#define M2_DECLARE_LOCK(LockType, Variable, SiteName) \
+    M2::CInstrumentedLock<LockType> Variable{ SiteName }
+
+#else
+
+#define M2_DECLARE_LOCK(LockType, Variable, SiteName) \
+    LockType Variable
+
+#endif // M2_ENABLE_LOCK_INSTRUMENTATION
+
+#endif // _M2_LOCK_HELPERS_
@@ -0,0 +1,398 @@
+﻿/*
+ * PROJECT:   M2-Team Common Library
+ * FILE:      M2QueueHelpers.h
+ * PURPOSE:   Definition for the multi-producer single-consumer queue helpers
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#pragma once
+
+#ifndef _M2_QUEUE_HELPERS_
+#define _M2_QUEUE_HELPERS_
+
+#include <Windows.h>
+
+#include "M2BaseHelpers.h"
+#include "M2LockHelpers.h"
+
+#include <atomic>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// The positions and the cells of the queues are aligned to the cache lines on
+// purpose, and the warning is also raised when the templates are instantiated.
+#if _MSC_VER >= 1200
+#pragma warning(push)
+#pragma warning(disable:4324) // structure was padded due to alignment specifier
+#endif
+
+namespace M2
+{
+    /**
+     * Lets the single consumer of a queue sleep until a producer publishes a
+     * new item. The consumer reads the version before checking the queue and
+     * passes it to Wait, so a notification between the check and the wait is
+     * not lost.
+     */
+    class CQueueConsumerNotifier : CDisableObjectCopying
+    {
+    private:
+        alignas(64) volatile LONG m_Version = 0;
+        volatile LONG m_IsConsumerWaiting = 0;
+
+    public:
+        LONG GetVersion() const
+        {
+            return this->m_Version;
+        }
+
+        void Notify()
+        {
+            // Both interlocked operations are full barriers, so the consumer
+            // either sees the new version or is marked as waiting here.
+            InterlockedIncrement(&this->m_Version);
+            if (0 != InterlockedCompareExchange(
+                &this->m_IsConsumerWaiting, 0, 0))
+            {
+                M2WakeByAddressSingle(&this->m_Version);
+            }
+        }
+
+        void Wait(
+            _In_ LONG Version)
+        {
+            InterlockedExchange(&this->m_IsConsumerWaiting, 1);
+            if (Version == InterlockedCompareExchange(
+                &this->m_Version, 0, 0))
+            {
+                M2WaitOnAddress(&this->m_Version, Version);
+            }
+            InterlockedExchange(&this->m_IsConsumerWaiting, 0);
+        }
+    };
+
+    /**
+     * The bounded multi-producer single-consumer ring queue. Each cell has a
+     * sequence number which tells the producers and the consumer whether the
+     * cell is free or published, so the queue needs no lock. The items can be
+     * move-only types.
+     */
+    template<typename ItemType, size_t Capacity>
+    class CBoundedMPSCQueue : CDisableObjectCopying
+    {
+    private:
+        static_assert(
+            0 != Capacity && 0 == (Capacity & (Capacity - 1)),
+            "The capacity must be a power of two.");
+
+        struct alignas(64) CCell
+        {
+            std::atomic<size_t> Sequence;
+            typename std::aligned_storage<
+                sizeof(ItemType), alignof(ItemType)>::type Storage;
+        };
+
+        CCell m_Cells[Capacity];
+        alignas(64) std::atomic<size_t> m_EnqueuePosition{ 0 };
+        alignas(64) size_t m_DequeuePosition = 0;
+        CQueueConsumerNotifier m_Notifier;
+
+        ItemType* GetItem(
+            _In_ CCell& Cell)
+        {
+            return reinterpret_cast<ItemType*>(&Cell.Storage);
+        }
+
+    public:
+        CBoundedMPSCQueue()
+        {
+            for (size_t i = 0; i < Capacity; ++i)
+            {
+                this->m_Cells[i].Sequence.store(
+                    i, std::memory_order_relaxed);
+            }
+        }
+
+        ~CBoundedMPSCQueue()
+        {
+            // Destroy the items which were never dequeued.
+            for (;;)
+            {
+                CCell& Cell = this->m_Cells[
+                    this->m_DequeuePosition & (Capacity - 1)];
+                if (Cell.Sequence.load(std::memory_order_acquire) !=
+                    this->m_DequeuePosition + 1)
+                {
+                    break;
+                }
+
+                this->GetItem(Cell)->~ItemType();
+                ++this->m_DequeuePosition;
+            }
+        }
+
+        /**
+         * Enqueues the item. Any thread can call this function.
+         *
+         * @param Item The item. It is moved into the queue only if the
+         *             function succeeds.
+         * @return If the queue is full, the return value is false.
+         */
+        bool TryEnqueue(
+            _Inout_ ItemType& Item)
+        {
+            size_t Position = this->m_EnqueuePosition.load(
+                std::memory_order_relaxed);
+
+            for (;;)
+            {
+                CCell& Cell = this->m_Cells[Position & (Capacity - 1)];
+                size_t Sequence = Cell.Sequence.load(
+                    std::memory_order_acquire);
+                intptr_t Difference = static_cast<intptr_t>(Sequence) -
+                    static_cast<intptr_t>(Position);
+
+                if (0 == Difference)
+                {
+                    if (this->m_EnqueuePosition.compare_exchange_weak(
+                        Position, Position + 1, std::memory_order_relaxed))
+                    {
+                        new (&Cell.Storage) ItemType(std::move(Item));
+                        Cell.Sequence.store(
+                            Position + 1, std::memory_order_release);
+                        this->m_Notifier.Notify();
+                        return true;
+                    }
+                }
+                else if (Difference < 0)
+                {
+                    // The consumer has not freed this cell yet.
+                    return false;
+                }
+                else
+                {
+                    Position = this->m_EnqueuePosition.load(
+                        std::memory_order_relaxed);
+                }
+            }
+        }
+
+        /**
+         * Dequeues an item. Only the consumer thread can call this function.
+         *
+         * @param Item The dequeued item.
+         * @return If the queue is empty, the return value is false.
+         */
+        bool TryDequeue(
+            _Out_ ItemType& Item)
+        {
+            CCell& Cell = this->m_Cells[
+                this->m_DequeuePosition & (Capacity - 1)];
+            size_t Sequence = Cell.Sequence.load(std::memory_order_acquire);
+
+            if (Sequence != this->m_DequeuePosition + 1)
+                return false;
+
+            ItemType* Stored = this->GetItem(Cell);
+            Item = std::move(*Stored);
+            Stored->~ItemType();
+
+            Cell.Sequence.store(
+                this->m_DequeuePosition + Capacity,
+                std::memory_order_release);
+            ++this->m_DequeuePosition;
+
+            return true;
+        }
+
+        /**
+         * Dequeues up to the specified number of items. Only the consumer
+         * thread can call this function.
+         *
+         * @param Items The array which receives the dequeued items.
+         * @param MaximumCount The maximum number of items to dequeue.
+         * @return The number of the dequeued items.
+         */
+        size_t DequeueBatch(
+            _Out_writes_to_(MaximumCount, return) ItemType* Items,
+            _In_ size_t MaximumCount)
+        {
+            size_t Count = 0;
+            while (Count < MaximumCount && this->TryDequeue(Items[Count]))
+                ++Count;
+            return Count;
+        }
+
+        /**
+         * Dequeues an item, and waits until an item is enqueued if the queue
+         * is empty. Only the consumer thread can call this function.
+         *
+         * @param Item The dequeued item.
+         */
+        void Dequeue(
+            _Out_ ItemType& Item)
+        {
+            for (;;)
+            {
+                LONG Version = this->m_Notifier.GetVersion();
+                if (this->TryDequeue(Item))
+                    return;
+                this->m_Notifier.Wait(Version);
+            }
+        }
+    };
+
+    /**
+     * The node of the intrusive multi-producer single-consumer queue. Derive
+     * the item type from this struct.
+     */
+    struct CMPSCQueueNode
+    {
+        std::atomic<CMPSCQueueNode*> Next{ nullptr };
+    };
+
+    /**
+     * The unbounded intrusive multi-producer single-consumer queue. The queue
+     * does not own the nodes, and the producers never allocate, so a push is
+     * one atomic exchange.
+     */
+    template<typename NodeType>
+    class CIntrusiveMPSCQueue : CDisableObjectCopying
+    {
+    private:
+        static_assert(
+            std::is_base_of<CMPSCQueueNode, NodeType>::value,
+            "The node type must derive from M2::CMPSCQueueNode.");
+
+        alignas(64) std::atomic<CMPSCQueueNode*> m_Head;
+        alignas(64) CMPSCQueueNode* m_Tail;
+        CMPSCQueueNode m_Stub;
+        CQueueConsumerNotifier m_Notifier;
+
+        void PushNode(
+            _In_ CMPSCQueueNode* Node)
+        {
+            Node->Next.store(nullptr, std::memory_order_relaxed);
+            CMPSCQueueNode* Previous = this->m_Head.exchange(
+                Node, std::memory_order_acq_rel);
+            Previous->Next.store(Node, std::memory_order_release);
+        }
+
+    public:
+        CIntrusiveMPSCQueue() :
+            m_Head(&m_Stub),
+            m_Tail(&m_Stub)
+        {
+
+        }
+
+        /**
+         * Pushes the node. Any thread can call this function.
+         *
+         * @param Node The node. It must stay valid until it is popped.
+         */
+        void Push(
+            _In_ NodeType* Node)
+        {
+            this->PushNode(Node);
+            this->m_Notifier.Notify();
+        }
+
+        /**
+         * Pops a node. Only the consumer thread can call this function.
+         *
+         * @return The node, or nullptr if the queue is empty or a producer
+         *         has not finished linking the next node yet.
+         */
+        NodeType* TryPop()
+        {
+            CMPSCQueueNode* Tail = this->m_Tail;
+            CMPSCQueueNode* Next = Tail->Next.load(std::memory_order_acquire);
+
+            if (&this->m_Stub == Tail)
+            {
+                if (!Next)
+                    return nullptr;
+
+                this->m_Tail = Next;
+                Tail = Next;
+                Next = Next->Next.load(std::memory_order_acquire);
+            }
+
+            if (Next)
+            {
+                this->m_Tail = Next;
+                return static_cast<NodeType*>(Tail);
+            }
+
+            if (Tail != this->m_Head.load(std::memory_order_acquire))
+            {
+                // A producer is between the exchange and the link.
+                return nullptr;
+            }
+
+            // Put the stub back, so the last node can be returned.
+            this->PushNode(&this->m_Stub);
+
+            Next = Tail->Next.load(std::memory_order_acquire);
+            if (Next)
+            {
+                this->m_Tail = Next;
+                return static_cast<NodeType*>(Tail);
+            }
+
+            return nullptr;
+        }
+
+        /**
+         * Pops up to the specified number of nodes. Only the consumer thread
+         * can call this function.
+         *
+         * @param Nodes The array which receives the nodes.
+         * @param MaximumCount The maximum number of nodes to pop.
+         * @return The number of the popped nodes.
+         */
+        size_t PopBatch(
+            _Out_writes_to_(MaximumCount, return) NodeType** Nodes,
+            _In_ size_t MaximumCount)
+        {
+            size_t Count = 0;
+            while (Count < MaximumCount)
+            {
+                NodeType* Node = this->TryPop();
+                if (!Node)
+                    break;
+                Nodes[Count++] = Node;
+            }
+            return Count;
+        }
+
+        /**
+         * Pops a node, and waits until a node is pushed if the queue is
+         * empty. Only the consumer thread can call this function.
+         *
+         * @return The node.
+         */
+        NodeType* Pop()
+        {
+            for (;;)
+            {
+                LONG Version = this->m_Notifier.GetVersion();
+                NodeType* Node = this->TryPop();
+                if (Node)
+                    return Node;
+                this->m_Notifier.Wait(Version);
+            }
+        }
+    };
+}
+
+#if _MSC_VER >= 1200
+#pragma warning(pop)
+#endif
+
+#endif // _M2_QUEUE_HELPERS_
@@ -0,0 +1,180 @@
+﻿/*
+ * PROJECT:   M2-Team Common Library
+ * FILE:      M2SlotMapHelpers.h
+ * PURPOSE:   Definition for the generational slot map helpers
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#pragma once
+
+#ifndef _M2_SLOT_MAP_HELPERS_
+#define _M2_SLOT_MAP_HELPERS_
+
+#include <Windows.h>
+
+#include "M2BaseHelpers.h"
+
+#include <optional>
+#include <utility>
+#include <vector>
+
+/**
+ * The identifier of a value in M2::CSlotMap. The low 32 bits are the index of
+ * the slot and the high 32 bits are the generation of the slot.
+ */
+typedef ULONGLONG M2_SLOT_ID;
+
+/**
+ * The identifier which never refers to a value.
+ */
+#define M2_INVALID_SLOT_ID 0ULL
+
+namespace M2
+{
+    /**
+     * The generational slot map. The values, such as CHandle or CSID, are
+     * referenced by compact identifiers with constant-time insert, erase and
+     * lookup. Erasing a value changes the generation of its slot, so the
+     * stale identifiers are detected instead of referring to a reused slot.
+     * The map is not thread-safe.
+     *
+     * The generation of a slot wraps to 1 after MaximumGeneration, so an
+     * identifier which is kept while its slot is erased MaximumGeneration
+     * times refers to the slot again. The parameter is only lowered by the
+     * tests of the wrap.
+     */
+    template<typename ValueType, DWORD MaximumGeneration = MAXDWORD>
+    class CSlotMap : CDisableObjectCopying
+    {
+    private:
+        static const DWORD InvalidIndex = MAXDWORD;
+
+        struct CSlot
+        {
+            DWORD Generation;
+            DWORD NextFreeIndex;
+            std::optional<ValueType> Value;
+        };
+
+        std::vector<CSlot> m_Slots;
+        DWORD m_FreeListHead = InvalidIndex;
+        size_t m_Count = 0;
+
+        static M2_SLOT_ID MakeId(
+            _In_ DWORD Index,
+            _In_ DWORD Generation)
+        {
+            return (static_cast<M2_SLOT_ID>(Generation) << 32) | Index;
+        }
+
+        CSlot* GetSlot(
+            _In_ M2_SLOT_ID Id)
+        {
+            DWORD Index = static_cast<DWORD>(Id);
+            DWORD Generation = static_cast<DWORD>(Id >> 32);
+
+            if (Index >= this->m_Slots.size())
+                return nullptr;
+
+            CSlot& Slot = this->m_Slots[Index];
+            if (Slot.Generation != Generation || !Slot.Value)
+                return nullptr;
+
+            return &Slot;
+        }
+
+    public:
+        CSlotMap() = default;
+
+        /**
+         * Inserts the value.
+         *
+         * @param Value The value which is moved into the map.
+         * @return The identifier of the value.
+         */
+        M2_SLOT_ID Insert(
+            _In_ ValueType&& Value)
+        {
+            DWORD Index = this->m_FreeListHead;
+
+            if (InvalidIndex != Index)
+            {
+                this->m_FreeListHead = this->m_Slots[Index].NextFreeIndex;
+            }
+            else
+            {
+                Index = static_cast<DWORD>(this->m_Slots.size());
+
+                CSlot Slot;
+                Slot.Generation = 1;
+                Slot.NextFreeIndex = InvalidIndex;
+                this->m_Slots.push_back(std::move(Slot));
+            }
+
+            CSlot& Slot = this->m_Slots[Index];
+            Slot.Value.emplace(std::move(Value));
+            ++this->m_Count;
+
+            return MakeId(Index, Slot.Generation);
+        }
+
+        /**
+         * Erases the value.
+         *
+         * @param Id The identifier of the value.
+         * @return If the identifier is stale or invalid, the return value is
+         *         false.
+         */
+        bool Erase(
+            _In_ M2_SLOT_ID Id)
+        {
+            CSlot* Slot = this->GetSlot(Id);
+            if (!Slot)
+                return false;
+
+            Slot->Value.reset();
+
+            // The generation 0 is skipped, so M2_INVALID_SLOT_ID is never a
+            // valid identifier.
+            if (MaximumGeneration == Slot->Generation)
+                Slot->Generation = 1;
+            else
+                ++Slot->Generation;
+
+            Slot->NextFreeIndex = this->m_FreeListHead;
+            this->m_FreeListHead = static_cast<DWORD>(Id);
+            --this->m_Count;
+
+            return true;
+        }
+
+        /**
+         * Finds the value. The pointer is invalidated by the next insert.
+         *
+         * @param Id The identifier of the value.
+         * @return The value, or nullptr if the identifier is stale or
+         *         invalid.
+         */
+        ValueType* Find(
+            _In_ M2_SLOT_ID Id)
+        {
+            CSlot* Slot = this->GetSlot(Id);
+            return Slot ? &*Slot->Value : nullptr;
+        }
+
+        /**
+         * Retrieves the number of the values in the map.
+         *
+         * @return The number of the values.
+         */
+        size_t GetCount() const
+        {
+            return this->m_Count;
+        }
+    };
+}
+
+#endif // _M2_SLOT_MAP_HELPERS_
@@ -0,0 +1,525 @@
+﻿/*
+ * PROJECT:   M2-Team Common Library
+ * FILE:      M2ThreadPoolHelpers.cpp
+ * PURPOSE:   Implementation for the work-stealing thread pool helpers
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#include "stdafx.h"
+
+#include <Windows.h>
+
+#include "M2BaseHelpers.h"
+#include "M2Win32Helpers.h"
+#include "M2LockHelpers.h"
+#include "M2ThreadPoolHelpers.h"
+
+namespace
+{
+    // The worker of the thread pool which owns the current thread.
+    thread_local void* t_CurrentThreadPool = nullptr;
+    thread_local void* t_CurrentWorker = nullptr;
+}
+
+/**
+ * Retrieves the group affinity of each worker thread of the thread pool.
+ *
+ * @param Topology The processor topology of the system.
+ * @param BindWorkersToCores If this parameter is true, each worker is bound to
+ *                           one processor core. Otherwise, the workers are
+ *                           spread over the processor groups in proportion to
+ *                           their logical processors.
+ * @param WorkerCount The number of the worker threads.
+ * @param Affinities The group affinity of each worker thread. It is empty if
+ *                   the workers need no affinity, because the system has only
+ *                   one processor group and the workers are not bound.
+ */
+void M2GetThreadPoolWorkerAffinities(
+    _In_ const M2_PROCESSOR_TOPOLOGY& Topology,
+    _In_ bool BindWorkersToCores,
+    _In_ DWORD WorkerCount,
+    _Out_ std::vector<GROUP_AFFINITY>& Affinities)
+{
+    Affinities.clear();
+
+    if (Topology.Cores.empty())
+        return;
+
+    if (BindWorkersToCores)
+    {
+        for (DWORD i = 0; i < WorkerCount; ++i)
+        {
+            Affinities.push_back(
+                Topology.Cores[i % Topology.Cores.size()].GroupMask);
+        }
+
+        return;
+    }
+
+    // Merge the cores of each processor group.
+    std::vector<GROUP_AFFINITY> Groups;
+    std::vector<DWORD> GroupProcessorCounts;
+    for (auto& Core : Topology.Cores)
+    {
+        WORD Group = Core.GroupMask.Group;
+        if (Groups.size() <= Group)
+        {
+            GROUP_AFFINITY EmptyAffinity = { 0 };
+            Groups.resize(Group + 1, EmptyAffinity);
+            GroupProcessorCounts.resize(Group + 1, 0);
+        }
+
+        Groups[Group].Group = Group;
+        Groups[Group].Mask |= Core.GroupMask.Mask;
+        GroupProcessorCounts[Group] += Core.LogicalProcessorCount;
+    }
+
+    // The threads of a process start in its primary group, which is the only
+    // group of the system in this case.
+    if (Groups.size() < 2)
+        return;
+
+    // Each worker goes to the group with the lowest ratio of the assigned
+    // workers to its logical processors, so the first workers already cover
+    // all groups.
+    std::vector<DWORD> AssignedCounts(Groups.size(), 0);
+    for (DWORD i = 0; i < WorkerCount; ++i)
+    {
+        size_t Target = Groups.size();
+        for (size_t Group = 0; Group < Groups.size(); ++Group)
+        {
+            if (0 == GroupProcessorCounts[Group])
+                continue;
+
+            if (Target == Groups.size() ||
+                static_cast<ULONGLONG>(AssignedCounts[Group]) *
+                GroupProcessorCounts[Target] <
+                static_cast<ULONGLONG>(AssignedCounts[Target]) *
+                GroupProcessorCounts[Group])
+            {
+                Target = Group;
+            }
+        }
+
+        ++AssignedCounts[Target];
+        Affinities.push_back(Groups[Target]);
+    }
+}
+
+M2::CWorkStealingDeque::CWorkStealingDeque()
+{
+    for (auto& Item : this->m_Buffer)
+    {
+        Item.store(nullptr, std::memory_order_relaxed);
+    }
+}
+
+/**
+ * Pushes the task to the bottom of the deque. Only the owner worker can call
+ * this function.
+ *
+ * @param Task The task.
+ * @return If the deque is full, the return value is false.
+ */
+bool M2::CWorkStealingDeque::Push(
+    _In_ CThreadPoolTask* Task)
+{
+    LONG64 Bottom = this->m_Bottom.load(std::memory_order_relaxed);
+    LONG64 Top = this->m_Top.load(std::memory_order_acquire);
+
+    if (Bottom - Top >= Capacity)
+        return false;
+
+    this->m_Buffer[Bottom & CapacityMask].store(
+        Task, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    this->m_Bottom.store(Bottom + 1, std::memory_order_relaxed);
+
+    return true;
+}
+
+/**
+ * Pops the task from the bottom of the deque. Only the owner worker can call
+ * this function.
+ *
+ * @return The task, or nullptr if the deque is empty.
+ */
+M2::CThreadPoolTask* M2::CWorkStealingDeque::Pop()
+{
+    LONG64 Bottom = this->m_Bottom.load(std::memory_order_relaxed) - 1;
+    this->m_Bottom.store(Bottom, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    LONG64 Top = this->m_Top.load(std::memory_order_relaxed);
+
+    if (Top > Bottom)
+    {
+        // The deque is empty.
+        this->m_Bottom.store(Bottom + 1, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    CThreadPoolTask* Task = this->m_Buffer[Bottom & CapacityMask].load(
+        std::memory_order_relaxed);
+
+    if (Top == Bottom)
+    {
+        // This is the last task, so race with the thieves for it.
+        if (!this->m_Top.compare_exchange_strong(
+            Top,
+            Top + 1,
+            std::memory_order_seq_cst,
+            std::memory_order_relaxed))
+        {
+            Task = nullptr;
+        }
+
+        this->m_Bottom.store(Bottom + 1, std::memory_order_relaxed);
+    }
+
+    return Task;
+}
+
+/**
+ * Steals the task from the top of the deque.
+ *
+ * @return The task, or nullptr if the deque is empty or another thread won the
+ *         race.
+ */
+M2::CThreadPoolTask* M2::CWorkStealingDeque::Steal()
+{
+    LONG64 Top = this->m_Top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    LONG64 Bottom = this->m_Bottom.load(std::memory_order_acquire);
+
+    if (Top >= Bottom)
+        return nullptr;
+
+    CThreadPoolTask* Task = this->m_Buffer[Top & CapacityMask].load(
+        std::memory_order_relaxed);
+
+    if (!this->m_Top.compare_exchange_strong(
+        Top,
+        Top + 1,
+        std::memory_order_seq_cst,
+        std::memory_order_relaxed))
+    {
+        return nullptr;
+    }
+
+    return Task;
+}
+
+/**
+ * Creates the worker threads.
+ *
+ * @param Options The options of the thread pool. If this parameter is
+ *                nullptr, the default options are used.
+ */
+M2::CThreadPool::CThreadPool(
+    _In_opt_ const M2_THREAD_POOL_OPTIONS* Options)
+{
+    M2_THREAD_POOL_OPTIONS DefaultOptions = { 0 };
+    if (!Options)
+        Options = &DefaultOptions;
+
+    M2_PROCESSOR_TOPOLOGY Topology;
+    bool HasTopology = SUCCEEDED(M2GetProcessorTopology(Topology));
+
+    DWORD WorkerCount = Options->WorkerCount;
+    if (0 == WorkerCount)
+    {
+        WorkerCount = HasTopology
+            ? Topology.LogicalProcessorCount
+            : M2GetNumberOfHardwareThreads();
+    }
+    if (0 == WorkerCount)
+        WorkerCount = 1;
+
+    // Without an affinity, all workers would start in the primary group of
+    // the process, so they are spread over the groups even if they are not
+    // bound to the cores.
+    std::vector<GROUP_AFFINITY> Affinities;
+    if (HasTopology)
+    {
+        M2GetThreadPoolWorkerAffinities(
+            Topology,
+            Options->BindWorkersToCores,
+            WorkerCount,
+            Affinities);
+    }
+
+    size_t GroupCount = 1;
+
+    for (DWORD i = 0; i < WorkerCount; ++i)
+    {
+        std::unique_ptr<CWorker> Worker(new CWorker());
+        Worker->HasGroupAffinity = false;
+        Worker->Group = 0;
+
+        if (!Affinities.empty())
+        {
+            Worker->GroupAffinity = Affinities[i];
+            Worker->HasGroupAffinity = true;
+            Worker->Group = Affinities[i].Group;
+
+            if (GroupCount <= Worker->Group)
+                GroupCount = Worker->Group + 1;
+        }
+
+        this->m_Workers.push_back(std::move(Worker));
+    }
+
+    this->m_GroupInjectionQueues.resize(GroupCount);
+
+    // Start the workers after the worker list is complete, because the
+    // workers steal from each other.
+    for (auto& Worker : this->m_Workers)
+    {
+        CWorker* CurrentWorker = Worker.get();
+
+        CThread WorkerThread([this, CurrentWorker]()
+        {
+            this->WorkerLoop(CurrentWorker);
+        });
+
+        HANDLE ThreadHandle = WorkerThread.Detach();
+        if (ThreadHandle)
+        {
+            Worker->Thread = ThreadHandle;
+        }
+    }
+}
+
+/**
+ * Runs the remaining tasks and waits for the worker threads to exit.
+ */
+M2::CThreadPool::~CThreadPool()
+{
+    InterlockedExchange(&this->m_IsStopping, 1);
+    InterlockedIncrement(&this->m_WorkVersion);
+    M2WakeByAddressAll(&this->m_WorkVersion);
+
+    for (auto& Worker : this->m_Workers)
+    {
+        if (!Worker->Thread.IsInvalid())
+        {
+            WaitForSingleObjectEx(Worker->Thread, INFINITE, FALSE);
+        }
+    }
+
+    // Run the tasks left in the deques of the workers which failed to start.
+    while (this->RunOneTask());
+}
+
+M2::CThreadPool::CWorker* M2::CThreadPool::GetCurrentWorker()
+{
+    return (this == t_CurrentThreadPool)
+        ? reinterpret_cast<CWorker*>(t_CurrentWorker)
+        : nullptr;
+}
+
+void M2::CThreadPool::Submit(
+    _In_ CThreadPoolTask* Task)
+{
+    CWorker* CurrentWorker = this->GetCurrentWorker();
+
+    // The task stays on the current worker unless it prefers another group.
+    bool IsLocal = CurrentWorker && (
+        NoAffinityHint == Task->PreferredGroup ||
+        CurrentWorker->Group == Task->PreferredGroup);
+
+    if (!IsLocal || !CurrentWorker->Deque.Push(Task))
+    {
+        AutoCriticalSectionLock Lock(this->m_InjectionQueueLock);
+        if (Task->PreferredGroup < this->m_GroupInjectionQueues.size())
+        {
+            this->m_GroupInjectionQueues[Task->PreferredGroup].push_back(Task);
+        }
+        else
+        {
+            this->m_InjectionQueue.push_back(Task);
+        }
+    }
+
+    // Both interlocked operations are full barriers, so a worker which is
+    // going to sleep either sees the new version or is counted here.
+    InterlockedIncrement(&this->m_WorkVersion);
+    if (0 != InterlockedCompareExchange(&this->m_SleepingWorkerCount, 0, 0))
+    {
+        M2WakeByAddressSingle(&this->m_WorkVersion);
+    }
+}
+
+M2::CThreadPoolTask* M2::CThreadPool::PopInjectedTask(
+    _In_opt_ CWorker* CurrentWorker)
+{
+    AutoCriticalSectionLock Lock(this->m_InjectionQueueLock);
+
+    std::deque<CThreadPoolTask*>* Queue = nullptr;
+
+    if (CurrentWorker &&
+        !this->m_GroupInjectionQueues[CurrentWorker->Group].empty())
+    {
+        Queue = &this->m_GroupInjectionQueues[CurrentWorker->Group];
+    }
+    else if (!this->m_InjectionQueue.empty())
+    {
+        Queue = &this->m_InjectionQueue;
+    }
+
+    if (!Queue)
+        return nullptr;
+
+    CThreadPoolTask* Task = Queue->front();
+    Queue->pop_front();
+    return Task;
+}
+
+M2::CThreadPoolTask* M2::CThreadPool::FindTask(
+    _In_opt_ CWorker* CurrentWorker)
+{
+    CThreadPoolTask* Task = nullptr;
+
+    if (CurrentWorker)
+    {
+        Task = CurrentWorker->Deque.Pop();
+        if (Task)
+            return Task;
+    }
+
+    Task = this->PopInjectedTask(CurrentWorker);
+    if (Task)
+        return Task;
+
+    // Start stealing from a different worker for each thread, which spreads
+    // the thieves over the victims.
+    size_t WorkerCount = this->m_Workers.size();
+    size_t Start = static_cast<size_t>(GetCurrentThreadId()) % WorkerCount;
+
+    for (size_t i = 0; i < WorkerCount; ++i)
+    {
+        CWorker* Victim = this->m_Workers[(Start + i) % WorkerCount].get();
+        if (Victim == CurrentWorker)
+            continue;
+
+        Task = Victim->Deque.Steal();
+        if (Task)
+            return Task;
+    }
+
+    // The tasks which prefer the other groups are run last, so a hint is only
+    // ignored when there is nothing else to do.
+    {
+        AutoCriticalSectionLock Lock(this->m_InjectionQueueLock);
+        for (auto& Queue : this->m_GroupInjectionQueues)
+        {
+            if (!Queue.empty())
+            {
+                Task = Queue.front();
+                Queue.pop_front();
+                return Task;
+            }
+        }
+    }
+
+    return nullptr;
+}
+
+bool M2::CThreadPool::RunOneTask()
+{
+    CThreadPoolTask* Task = this->FindTask(this->GetCurrentWorker());
+    if (!Task)
+        return false;
+
+    CThreadPoolTaskGroup* Group = Task->Group;
+
+    if (!Group || !Group->IsCanceled())
+    {
+        Task->Function();
+    }
+
+    delete Task;
+
+    if (Group)
+    {
+        Group->CompleteTask();
+    }
+
+    return true;
+}
+
+void M2::CThreadPool::WorkerLoop(
+    _In_ CWorker* Worker)
+{
+    // Resolved at run time because it is not available in Windows Vista.
+    static CImportedProcedure<decltype(SetThreadGroupAffinity)*>
+        SetThreadGroupAffinityProcedure(
+            L"kernel32.dll", "SetThreadGroupAffinity");
+
+    t_CurrentThreadPool = this;
+    t_CurrentWorker = Worker;
+
+    if (Worker->HasGroupAffinity)
+    {
+        decltype(SetThreadGroupAffinity)* pFunc = nullptr;
+        if (SUCCEEDED(SetThreadGroupAffinityProcedure.Get(pFunc)))
+        {
+            pFunc(GetCurrentThread(), &Worker->GroupAffinity, nullptr);
+        }
+    }
+
+    for (;;)
+    {
+        LONG WorkVersion = this->m_WorkVersion;
+
+        if (this->RunOneTask())
+            continue;
+
+        if (this->m_IsStopping)
+            break;
+
+        InterlockedIncrement(&this->m_SleepingWorkerCount);
+
+        if (WorkVersion == InterlockedCompareExchange(
+            &this->m_WorkVersion, 0, 0) && !this->m_IsStopping)
+        {
+            M2WaitOnAddress(&this->m_WorkVersion, WorkVersion);
+        }
+
+        InterlockedDecrement(&this->m_SleepingWorkerCount);
+    }
+
+    t_CurrentWorker = nullptr;
+    t_CurrentThreadPool = nullptr;
+}
+
+void M2::CThreadPoolTaskGroup::CompleteTask()
+{
+    if (0 == InterlockedDecrement(&this->m_PendingCount))
+    {
+        M2WakeByAddressAll(&this->m_PendingCount);
+    }
+}
+
+/**
+ * Waits for all tasks of the group to complete. The calling thread runs the
+ * queued tasks while waiting, so a task can wait for its child tasks without
+ * blocking a worker thread.
+ */
+void M2::CThreadPoolTaskGroup::Wait()
+{
+    for (;;)
+    {
+        LONG PendingCount = this->m_PendingCount;
+        if (0 == PendingCount)
+            break;
+
+        if (!this->m_Pool.RunOneTask())
+        {
+            M2WaitOnAddress(&this->m_PendingCount, PendingCount);
+        }
+    }
+}
@@ -0,0 +1,297 @@
+﻿/*
+ * PROJECT:   M2-Team Common Library
+ * FILE:      M2ThreadPoolHelpers.h
+ * PURPOSE:   Definition for the work-stealing thread pool helpers
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#pragma once
+
+#ifndef _M2_THREAD_POOL_HELPERS_
+#define _M2_THREAD_POOL_HELPERS_
+
+#include <Windows.h>
+
+#include "M2BaseHelpers.h"
+#include "M2LockHelpers.h"
+#include "M2Win32Helpers.h"
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+
+/**
+ * The options of the work-stealing thread pool.
+ */
+typedef struct _M2_THREAD_POOL_OPTIONS
+{
+    // The number of the worker threads. If this member is zero, the number
+    // of the logical processors of all processor groups is used.
+    DWORD WorkerCount;
+
+    // Binds each worker thread to one processor core, which keeps the
+    // workers from migrating between packages and NUMA nodes. If this member
+    // is false, the workers are only spread over the processor groups.
+    bool BindWorkersToCores;
+} M2_THREAD_POOL_OPTIONS, *PM2_THREAD_POOL_OPTIONS;
+
+/**
+ * Retrieves the group affinity of each worker thread of the thread pool.
+ *
+ * @param Topology The processor topology of the system.
+ * @param BindWorkersToCores If this parameter is true, each worker is bound
+ *                           to one processor core. Otherwise, the workers are
+ *                           spread over the processor groups in proportion to
+ *                           their logical processors.
+ * @param WorkerCount The number of the worker threads.
+ * @param Affinities The group affinity of each worker thread. It is empty if
+ *                   the workers need no affinity, because the system has only
+ *                   one processor group and the workers are not bound.
+ */
+void M2GetThreadPoolWorkerAffinities(
+    _In_ const M2_PROCESSOR_TOPOLOGY& Topology,
+    _In_ bool BindWorkersToCores,
+    _In_ DWORD WorkerCount,
+    _Out_ std::vector<GROUP_AFFINITY>& Affinities);
+
+// The indexes of the deque are aligned to the cache lines on purpose.
+#if _MSC_VER >= 1200
+#pragma warning(push)
+#pragma warning(disable:4324) // structure was padded due to alignment specifier
+#endif
+
+namespace M2
+{
+    class CThreadPool;
+    class CThreadPoolTaskGroup;
+
+    /**
+     * The task queued into the thread pool.
+     */
+    struct CThreadPoolTask
+    {
+        std::function<void()> Function;
+        CThreadPoolTaskGroup* Group;
+        WORD PreferredGroup;
+    };
+
+    /**
+     * The fixed-capacity Chase-Lev work-stealing deque. Only the owner worker
+     * pushes and pops at the bottom, and the other threads steal from the
+     * top.
+     */
+    class CWorkStealingDeque : CDisableObjectCopying
+    {
+    private:
+        static const LONG64 Capacity = 1024;
+        static const LONG64 CapacityMask = Capacity - 1;
+
+        // Keep the indexes of the owner and the thieves on separate cache
+        // lines.
+        alignas(64) std::atomic<LONG64> m_Top{ 0 };
+        alignas(64) std::atomic<LONG64> m_Bottom{ 0 };
+        alignas(64) std::atomic<CThreadPoolTask*> m_Buffer[Capacity];
+
+    public:
+        CWorkStealingDeque();
+
+        /**
+         * Pushes the task to the bottom of the deque. Only the owner worker
+         * can call this function.
+         *
+         * @param Task The task.
+         * @return If the deque is full, the return value is false.
+         */
+        bool Push(
+            _In_ CThreadPoolTask* Task);
+
+        /**
+         * Pops the task from the bottom of the deque. Only the owner worker
+         * can call this function.
+         *
+         * @return The task, or nullptr if the deque is empty.
+         */
+        CThreadPoolTask* Pop();
+
+        /**
+         * Steals the task from the top of the deque.
+         *
+         * @return The task, or nullptr if the deque is empty or another
+         *         thread won the race.
+         */
+        CThreadPoolTask* Steal();
+    };
+
+    /**
+     * The work-stealing thread pool. Each worker is a CThread with its own
+     * deque, and the tasks submitted from the other threads go to the shared
+     * injection queue, or to the injection queue of their preferred processor
+     * group.
+     */
+    class CThreadPool : CDisableObjectCopying
+    {
+    private:
+        friend class CThreadPoolTaskGroup;
+
+        struct CWorker
+        {
+            CWorkStealingDeque Deque;
+            CHandle Thread;
+            GROUP_AFFINITY GroupAffinity;
+            bool HasGroupAffinity;
+            WORD Group;
+        };
+
+        std::vector<std::unique_ptr<CWorker>> m_Workers;
+
+        M2_DECLARE_LOCK(
+            CAdaptiveLock,
+            m_InjectionQueueLock,
+            "M2::CThreadPool::InjectionQueue");
+        std::deque<CThreadPoolTask*> m_InjectionQueue;
+        std::vector<std::deque<CThreadPoolTask*>> m_GroupInjectionQueues;
+
+        volatile LONG m_WorkVersion = 0;
+        volatile LONG m_SleepingWorkerCount = 0;
+        volatile LONG m_IsStopping = 0;
+
+        CWorker* GetCurrentWorker();
+
+        void Submit(
+            _In_ CThreadPoolTask* Task);
+
+        CThreadPoolTask* PopInjectedTask(
+            _In_opt_ CWorker* CurrentWorker);
+
+        CThreadPoolTask* FindTask(
+            _In_opt_ CWorker* CurrentWorker);
+
+        bool RunOneTask();
+
+        void WorkerLoop(
+            _In_ CWorker* Worker);
+
+    public:
+        /**
+         * The preferred processor group of the tasks which have no affinity
+         * hint.
+         */
+        static const WORD NoAffinityHint = 0xFFFF;
+
+        /**
+         * Creates the worker threads.
+         *
+         * @param Options The options of the thread pool. If this parameter is
+         *                nullptr, the default options are used.
+         */
+        explicit CThreadPool(
+            _In_opt_ const M2_THREAD_POOL_OPTIONS* Options = nullptr);
+
+        /**
+         * Runs the remaining tasks and waits for the worker threads to exit.
+         */
+        ~CThreadPool();
+
+        /**
+         * Retrieves the number of the worker threads.
+         *
+         * @return The number of the worker threads.
+         */
+        size_t GetWorkerCount() const
+        {
+            return this->m_Workers.size();
+        }
+    };
+
+    /**
+     * A group of tasks which can be waited for and canceled together.
+     */
+    class CThreadPoolTaskGroup : CDisableObjectCopying
+    {
+    private:
+        friend class CThreadPool;
+
+        CThreadPool& m_Pool;
+        volatile LONG m_PendingCount = 0;
+        volatile LONG m_IsCanceled = 0;
+
+        void CompleteTask();
+
+    public:
+        explicit CThreadPoolTaskGroup(
+            _In_ CThreadPool& Pool) :
+            m_Pool(Pool)
+        {
+
+        }
+
+        ~CThreadPoolTaskGroup()
+        {
+            this->Wait();
+        }
+
+        /**
+         * Queues a function into the thread pool as a task of the group. The
+         * function must not throw exceptions.
+         *
+         * @param Function The function.
+         * @param PreferredGroup The processor group whose workers should run
+         *                       the task. It is only a hint, so the other
+         *                       workers still run the task when they have
+         *                       nothing else to do, and an unknown group is
+         *                       ignored.
+         */
+        template<class TFunction>
+        void Run(
+            _In_ TFunction&& Function,
+            _In_ WORD PreferredGroup = CThreadPool::NoAffinityHint)
+        {
+            InterlockedIncrement(&this->m_PendingCount);
+
+            CThreadPoolTask* Task = new CThreadPoolTask();
+            Task->Function = std::forward<TFunction>(Function);
+            Task->Group = this;
+            Task->PreferredGroup = PreferredGroup;
+
+            this->m_Pool.Submit(Task);
+        }
+
+        /**
+         * Cancels the tasks of the group which have not started yet. The
+         * canceled tasks are still counted as completed by Wait.
+         */
+        void Cancel()
+        {
+            InterlockedExchange(&this->m_IsCanceled, 1);
+        }
+
+        /**
+         * Checks whether the group is canceled. A long-running task can use
+         * this function to stop early.
+         *
+         * @return If the group is canceled, the return value is true.
+         */
+        bool IsCanceled() const
+        {
+            return (0 != this->m_IsCanceled);
+        }
+
+        /**
+         * Waits for all tasks of the group to complete. The calling thread
+         * runs the queued tasks while waiting, so a task can wait for its
+         * child tasks without blocking a worker thread.
+         */
+        void Wait();
+    };
+}
+
+#if _MSC_VER >= 1200
+#pragma warning(pop)
+#endif
+
+#endif // _M2_THREAD_POOL_HELPERS_
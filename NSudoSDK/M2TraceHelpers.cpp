@@ -0,0 +1,234 @@
+﻿/*
+ * PROJECT:   M2-Team Common Library
+ * FILE:      M2TraceHelpers.cpp
+ * PURPOSE:   Implementation for the scoped tracing helper functions
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#include "stdafx.h"
+
+#include <Windows.h>
+
+#include "M2BaseHelpers.h"
+#include "M2LockHelpers.h"
+#include "M2TraceHelpers.h"
+
+#include <stdio.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+volatile bool g_M2TraceEnabled = false;
+
+namespace
+{
+    /**
+     * The trace event with the "X" (complete) phase.
+     */
+    struct M2_TRACE_EVENT
+    {
+        const char* Name;
+        ULONGLONG StartCount;
+        ULONGLONG EndCount;
+    };
+
+    /**
+     * The trace events recorded by one thread. The buffers are owned by
+     * g_TraceThreadBuffers and are never freed before M2TraceUninitialize, so
+     * each thread can append to its own buffer without taking a lock.
+     */
+    struct M2_TRACE_THREAD_BUFFER
+    {
+        DWORD ThreadId;
+        std::vector<M2_TRACE_EVENT> Events;
+    };
+
+    M2_DECLARE_LOCK(
+        M2::CCriticalSection,
+        g_TraceThreadBuffersLock,
+        "M2TraceHelpers::ThreadBuffers");
+    std::vector<std::unique_ptr<M2_TRACE_THREAD_BUFFER>> g_TraceThreadBuffers;
+    std::wstring g_TraceFilePath;
+    ULONGLONG g_TraceBaseCount = 0;
+
+    thread_local M2_TRACE_THREAD_BUFFER* t_TraceThreadBuffer = nullptr;
+
+    /**
+     * Writes the string as a JSON string literal. The quotation marks, the
+     * backslashes and the control characters are escaped, and the other
+     * bytes are written as is because the names are UTF-8.
+     */
+    void M2TraceWriteJSONString(
+        _In_ FILE* FileStream,
+        _In_z_ const char* String)
+    {
+        fputc('"', FileStream);
+
+        for (const char* Current = String; *Current; ++Current)
+        {
+            unsigned char Character = static_cast<unsigned char>(*Current);
+
+            if ('"' == Character || '\\' == Character)
+            {
+                fputc('\\', FileStream);
+                fputc(Character, FileStream);
+            }
+            else if (Character < 0x20)
+            {
+                fprintf(FileStream, "\\u%04x", Character);
+            }
+            else
+            {
+                fputc(Character, FileStream);
+            }
+        }
+
+        fputc('"', FileStream);
+    }
+
+    /**
+     * Removes the written events, so they are not written again if the
+     * tracing is enabled again. The buffers are kept because the threads
+     * still point to them. The caller must hold g_TraceThreadBuffersLock.
+     */
+    void M2TraceClearThreadBuffers()
+    {
+        for (auto& ThreadBuffer : g_TraceThreadBuffers)
+        {
+            ThreadBuffer->Events.clear();
+        }
+    }
+}
+
+/**
+ * Enables the tracing if the specified environment variable is defined. The
+ * value of the environment variable is the path of the Chrome trace_event
+ * JSON file written by M2TraceUninitialize.
+ *
+ * @param EnvironmentVariableName The name of the environment variable.
+ * @return HRESULT. If the function succeeds, the return value is S_OK. If the
+ *         environment variable is not defined, the return value is S_FALSE.
+ */
+HRESULT M2TraceInitialize(
+    _In_ LPCWSTR EnvironmentVariableName)
+{
+    DWORD Length = GetEnvironmentVariableW(
+        EnvironmentVariableName, nullptr, 0);
+    if (0 == Length)
+    {
+        return (ERROR_ENVVAR_NOT_FOUND == GetLastError())
+            ? S_FALSE
+            : M2GetLastHRESULTErrorKnownFailedCall();
+    }
+
+    g_TraceFilePath.resize(Length - 1);
+    Length = GetEnvironmentVariableW(
+        EnvironmentVariableName,
+        &g_TraceFilePath[0],
+        static_cast<DWORD>(g_TraceFilePath.size() + 1));
+    if (g_TraceFilePath.size() != Length || g_TraceFilePath.empty())
+    {
+        g_TraceFilePath.clear();
+        return S_FALSE;
+    }
+
+    g_TraceBaseCount = M2GetPerformanceCounter();
+
+    g_M2TraceEnabled = true;
+
+    return S_OK;
+}
+
+/**
+ * Writes all recorded trace events to the file specified when calling
+ * M2TraceInitialize and disables the tracing. You should call this function
+ * after all traced threads are finished.
+ *
+ * @return HRESULT. If the function succeeds, the return value is S_OK.
+ */
+HRESULT M2TraceUninitialize()
+{
+    if (!g_M2TraceEnabled)
+        return S_FALSE;
+
+    g_M2TraceEnabled = false;
+
+    M2::AutoCriticalSectionLock Lock(g_TraceThreadBuffersLock);
+
+    FILE* FileStream = nullptr;
+    if (0 != _wfopen_s(&FileStream, g_TraceFilePath.c_str(), L"w"))
+    {
+        M2TraceClearThreadBuffers();
+        return E_FAIL;
+    }
+
+    DWORD ProcessId = GetCurrentProcessId();
+
+    fputs("{\"traceEvents\":[", FileStream);
+
+    bool IsFirstEvent = true;
+    for (auto& ThreadBuffer : g_TraceThreadBuffers)
+    {
+        for (auto& Event : ThreadBuffer->Events)
+        {
+            // The scope was started before the tracing was enabled again.
+            if (Event.StartCount < g_TraceBaseCount)
+                continue;
+
+            fputs(IsFirstEvent ? "\n{\"name\":" : ",\n{\"name\":", FileStream);
+            M2TraceWriteJSONString(FileStream, Event.Name);
+            fprintf(
+                FileStream,
+                ",\"ph\":\"X\",\"ts\":%.3f,"
+                "\"dur\":%.3f,\"pid\":%lu,\"tid\":%lu}",
+                static_cast<double>(M2ConvertPerformanceCountToNanoseconds(
+                    Event.StartCount - g_TraceBaseCount)) / 1000.0,
+                static_cast<double>(M2ConvertPerformanceCountToNanoseconds(
+                    Event.EndCount - Event.StartCount)) / 1000.0,
+                ProcessId,
+                ThreadBuffer->ThreadId);
+
+            IsFirstEvent = false;
+        }
+    }
+
+    fputs("\n],\"displayTimeUnit\":\"ms\"}\n", FileStream);
+
+    fclose(FileStream);
+
+    M2TraceClearThreadBuffers();
+
+    return S_OK;
+}
+
+/**
+ * Records a complete trace event into the buffer of the calling thread.
+ *
+ * @param Name The name of the event. It must be a string literal because only
+ *             the pointer is saved.
+ * @param StartCount The performance counter value when the event started.
+ * @param EndCount The performance counter value when the event ended.
+ */
+void M2TraceRecordEvent(
+    _In_z_ const char* Name,
+    _In_ ULONGLONG StartCount,
+    _In_ ULONGLONG EndCount)
+{
+    if (!t_TraceThreadBuffer)
+    {
+        std::unique_ptr<M2_TRACE_THREAD_BUFFER> ThreadBuffer(
+            new M2_TRACE_THREAD_BUFFER());
+        ThreadBuffer->ThreadId = GetCurrentThreadId();
+        ThreadBuffer->Events.reserve(64);
+
+        M2::AutoCriticalSectionLock Lock(g_TraceThreadBuffersLock);
+        t_TraceThreadBuffer = ThreadBuffer.get();
+        g_TraceThreadBuffers.push_back(std::move(ThreadBuffer));
+    }
+
+    t_TraceThreadBuffer->Events.push_back({ Name, StartCount, EndCount });
+}
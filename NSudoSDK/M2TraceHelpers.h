@@ -0,0 +1,110 @@
+﻿/*
+ * PROJECT:   M2-Team Common Library
+ * FILE:      M2TraceHelpers.h
+ * PURPOSE:   Definition for the scoped tracing helper functions
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#pragma once
+
+#ifndef _M2_TRACE_HELPERS_
+#define _M2_TRACE_HELPERS_
+
+#include <Windows.h>
+
+#include "M2BaseHelpers.h"
+
+/**
+ * Indicates whether the trace events are recorded. Use M2TraceInitialize to
+ * enable the tracing instead of modifying this variable directly.
+ */
+extern volatile bool g_M2TraceEnabled;
+
+/**
+ * Enables the tracing if the specified environment variable is defined. The
+ * value of the environment variable is the path of the Chrome trace_event
+ * JSON file written by M2TraceUninitialize.
+ *
+ * @param EnvironmentVariableName The name of the environment variable.
+ * @return HRESULT. If the function succeeds, the return value is S_OK. If the
+ *         environment variable is not defined, the return value is S_FALSE.
+ */
+HRESULT M2TraceInitialize(
+    _In_ LPCWSTR EnvironmentVariableName);
+
+/**
+ * Writes all recorded trace events to the file specified when calling
+ * M2TraceInitialize and disables the tracing. You should call this function
+ * after all traced threads are finished.
+ *
+ * @return HRESULT. If the function succeeds, the return value is S_OK.
+ */
+HRESULT M2TraceUninitialize();
+
+/**
+ * Records a complete trace event into the buffer of the calling thread.
+ *
+ * @param Name The name of the event. It must be a string literal because only
+ *             the pointer is saved.
+ * @param StartCount The performance counter value when the event started.
+ * @param EndCount The performance counter value when the event ended.
+ */
+void M2TraceRecordEvent(
+    _In_z_ const char* Name,
+    _In_ ULONGLONG StartCount,
+    _In_ ULONGLONG EndCount);
+
+namespace M2
+{
+    /**
+     * Records the lifetime of the object as a trace event. When the tracing
+     * is disabled, the only cost is checking g_M2TraceEnabled once.
+     */
+    class CTraceScope : CDisableObjectCopying
+    {
+    private:
+        const char* m_Name = nullptr;
+        ULONGLONG m_StartCount = 0;
+
+    public:
+        explicit CTraceScope(
+            _In_z_ const char* Name)
+        {
+            if (g_M2TraceEnabled)
+            {
+                this->m_Name = Name;
+                this->m_StartCount = M2GetPerformanceCounter();
+            }
+        }
+
+        ~CTraceScope()
+        {
+            if (this->m_Name)
+            {
+                M2TraceRecordEvent(
+                    this->m_Name,
+                    this->m_StartCount,
+                    M2GetPerformanceCounter());
+            }
+        }
+    };
+}
+
+#define M2_TRACE_CONCAT_INTERNAL(x, y) x##y
+#define M2_TRACE_CONCAT(x, y) M2_TRACE_CONCAT_INTERNAL(x, y)
+
+/**
+ * Traces the rest of the current scope with the specified name. Define
+ * M2_DISABLE_TRACING to remove all trace scopes at compile time.
+ */
+#ifdef M2_DISABLE_TRACING
+#define M2_TRACE_SCOPE(Name)
+#else
+#define M2_TRACE_SCOPE(Name) \
+    M2::CTraceScope M2_TRACE_CONCAT(M2TraceScope, __LINE__)(Name)
+#endif
+
+#endif // _M2_TRACE_HELPERS_
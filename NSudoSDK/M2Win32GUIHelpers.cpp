@@ -25,20 +25,18 @@
  */
 INT M2EnablePerMonitorDialogScaling()
 {
-    // Fix for Windows Vista and Server 2008.
-    if (!IsWindowsVersionOrGreater(10, 0, 0)) return -1;
-
     typedef INT(WINAPI *PFN_EnablePerMonitorDialogScaling)();
 
-    HMODULE hModule = nullptr;
-    PFN_EnablePerMonitorDialogScaling pFunc = nullptr;
+    static M2::CImportedProcedure<PFN_EnablePerMonitorDialogScaling>
+        EnablePerMonitorDialogScaling(L"user32.dll", (LPCSTR)2577);
 
-    hModule = GetModuleHandleW(L"user32.dll");
-    if (!hModule) return -1;
+    // Fix for Windows Vista and Server 2008. The ordinal may refer to another
+    // function in the earlier versions of Windows.
+    static const bool IsSupported = IsWindowsVersionOrGreater(10, 0, 0);
+    if (!IsSupported) return -1;
 
-    pFunc = reinterpret_cast<PFN_EnablePerMonitorDialogScaling>(
-        GetProcAddress(hModule, (LPCSTR)2577));
-    if (!pFunc) return -1;
+    PFN_EnablePerMonitorDialogScaling pFunc = nullptr;
+    if (FAILED(EnablePerMonitorDialogScaling.Get(pFunc))) return -1;
 
     return pFunc();
 }
@@ -179,21 +177,14 @@ HRESULT M2GetDpiForMonitor(
     _Out_ UINT *dpiX,
     _Out_ UINT *dpiY)
 {
-    HMODULE hModule = nullptr;
-    HRESULT hr = M2LoadLibraryEx(
-        hModule,
-        L"SHCore.dll",
-        LOAD_LIBRARY_SEARCH_SYSTEM32);
+    static M2::CImportedProcedure<decltype(GetDpiForMonitor)*>
+        GetDpiForMonitorProcedure(L"SHCore.dll", "GetDpiForMonitor");
+
+    decltype(GetDpiForMonitor)* pFunc = nullptr;
+    HRESULT hr = GetDpiForMonitorProcedure.Get(pFunc);
     if (SUCCEEDED(hr))
     {
-        decltype(GetDpiForMonitor)* pFunc = nullptr;
-        hr = M2GetProcAddress(pFunc, hModule, "GetDpiForMonitor");
-        if (SUCCEEDED(hr))
-        {
-            hr = pFunc(hmonitor, dpiType, dpiX, dpiY);
-        }
-
-        FreeLibrary(hModule);
+        hr = pFunc(hmonitor, dpiType, dpiX, dpiY);
     }
 
     return hr;
@@ -14,6 +14,10 @@
 #include <VersionHelpers.h>
 
 #include "M2Win32Helpers.h"
+#include "M2AsyncHelpers.h"
+
+#include <algorithm>
+#include <tuple>
 
 /**
  * Obtain the best matching resource with the specified type and name in the
@@ -60,6 +64,303 @@ HRESULT M2LoadResource(
     return S_OK;
 }
 
+std::wstring M2::CResourceCatalog::NormalizeIdentifier(
+    _In_ LPCWSTR Identifier)
+{
+    // The string identifiers are case insensitive, so they are stored in
+    // upper case. The integer identifiers use the "#ID" form, which cannot
+    // collide with a string identifier because FindResource treats such a
+    // string as an integer identifier too.
+    if (IS_INTRESOURCE(Identifier))
+    {
+        return L"#" + std::to_wstring(
+            static_cast<WORD>(reinterpret_cast<ULONG_PTR>(Identifier)));
+    }
+
+    if (L'#' == Identifier[0])
+    {
+        return L"#" + std::to_wstring(
+            static_cast<WORD>(wcstoul(Identifier + 1, nullptr, 10)));
+    }
+
+    std::wstring Result(Identifier);
+    CharUpperBuffW(&Result[0], static_cast<DWORD>(Result.size()));
+    return Result;
+}
+
+BOOL CALLBACK M2::CResourceCatalog::EnumerateNamesCallback(
+    _In_opt_ HMODULE hModule,
+    _In_ LPCWSTR lpType,
+    _In_ LPWSTR lpName,
+    _In_ LONG_PTR lParam)
+{
+    EnumResourceLanguagesW(
+        hModule,
+        lpType,
+        lpName,
+        CResourceCatalog::EnumerateLanguagesCallback,
+        lParam);
+
+    return TRUE;
+}
+
+BOOL CALLBACK M2::CResourceCatalog::EnumerateLanguagesCallback(
+    _In_opt_ HMODULE hModule,
+    _In_ LPCWSTR lpType,
+    _In_ LPCWSTR lpName,
+    _In_ WORD wLanguage,
+    _In_ LONG_PTR lParam)
+{
+    CResourceCatalog* Catalog = reinterpret_cast<CResourceCatalog*>(lParam);
+
+    HRSRC ResourceFind = FindResourceExW(hModule, lpType, lpName, wLanguage);
+    if (!ResourceFind)
+        return TRUE;
+
+    HGLOBAL ResourceLoad = LoadResource(hModule, ResourceFind);
+    if (!ResourceLoad)
+        return TRUE;
+
+    M2_RESOURCE_INFO ResourceInfo;
+    ResourceInfo.Size = SizeofResource(hModule, ResourceFind);
+    ResourceInfo.Pointer = LockResource(ResourceLoad);
+
+    Catalog->AddResource(lpType, lpName, wLanguage, ResourceInfo);
+
+    return TRUE;
+}
+
+/**
+ * Indexes all resources of the specified types in the specified module.
+ *
+ * @param hModule A handle to the module. If this parameter is NULL, the module
+ *                used to create the current process is used.
+ * @param Types The resource types to index.
+ * @param TypeCount The number of the resource types.
+ * @return HRESULT. If the function succeeds, the return value is S_OK.
+ */
+HRESULT M2::CResourceCatalog::AddModule(
+    _In_opt_ HMODULE hModule,
+    _In_ const LPCWSTR* Types,
+    _In_ size_t TypeCount)
+{
+    if (!hModule)
+        hModule = GetModuleHandleW(nullptr);
+
+    for (size_t i = 0; i < TypeCount; ++i)
+    {
+        if (!EnumResourceNamesW(
+            hModule,
+            Types[i],
+            CResourceCatalog::EnumerateNamesCallback,
+            reinterpret_cast<LONG_PTR>(this)))
+        {
+            // A module without any resource of this type is not an error.
+            DWORD Error = M2GetLastErrorKnownFailedCall();
+            if (ERROR_RESOURCE_TYPE_NOT_FOUND != Error &&
+                ERROR_RESOURCE_DATA_NOT_FOUND != Error)
+            {
+                return __HRESULT_FROM_WIN32(Error);
+            }
+        }
+    }
+
+    return S_OK;
+}
+
+/**
+ * Adds a resource which is already in memory to the catalog, which makes it
+ * possible to serve the lookups from an in-memory image instead of a module.
+ * The memory must outlive the catalog.
+ *
+ * @param Type The resource type. It can be MAKEINTRESOURCE(ID).
+ * @param Name The resource name. It can be MAKEINTRESOURCE(ID).
+ * @param Language The language identifier of the resource.
+ * @param ResourceInfo The pointer and the size of the resource.
+ * @return HRESULT. If the function succeeds, the return value is S_OK.
+ */
+HRESULT M2::CResourceCatalog::AddResource(
+    _In_ LPCWSTR Type,
+    _In_ LPCWSTR Name,
+    _In_ WORD Language,
+    _In_ const M2_RESOURCE_INFO& ResourceInfo)
+{
+    if (!Type || !Name)
+        return E_INVALIDARG;
+
+    CEntry Entry;
+    Entry.Type = CResourceCatalog::NormalizeIdentifier(Type);
+    Entry.Name = CResourceCatalog::NormalizeIdentifier(Name);
+    Entry.Language = Language;
+    Entry.Info = ResourceInfo;
+
+    auto Iterator = std::lower_bound(
+        this->m_Entries.begin(),
+        this->m_Entries.end(),
+        Entry,
+        [](const CEntry& Left, const CEntry& Right)
+    {
+        return std::tie(Left.Type, Left.Name, Left.Language) <
+            std::tie(Right.Type, Right.Name, Right.Language);
+    });
+
+    if (this->m_Entries.end() != Iterator &&
+        Iterator->Type == Entry.Type &&
+        Iterator->Name == Entry.Name &&
+        Iterator->Language == Entry.Language)
+    {
+        Iterator->Info = ResourceInfo;
+    }
+    else
+    {
+        this->m_Entries.insert(Iterator, std::move(Entry));
+    }
+
+    return S_OK;
+}
+
+/**
+ * Finds the resource with the specified type and name in the preferred
+ * languages. The languages are tried in order, then the ones with the same
+ * primary language, then the neutral language, then English. Otherwise the
+ * resource with the lowest language identifier is returned.
+ *
+ * @param ResourceInfo The resource info which contains the pointer and size.
+ * @param Type The resource type. It can be MAKEINTRESOURCE(ID).
+ * @param Name The resource name. It can be MAKEINTRESOURCE(ID).
+ * @param Languages The preferred languages.
+ * @param LanguageCount The number of the preferred languages.
+ * @return HRESULT. If the resource is not in the catalog, the return value is
+ *         HRESULT_FROM_WIN32(ERROR_RESOURCE_NAME_NOT_FOUND).
+ */
+HRESULT M2::CResourceCatalog::Find(
+    _Out_ PM2_RESOURCE_INFO ResourceInfo,
+    _In_ LPCWSTR Type,
+    _In_ LPCWSTR Name,
+    _In_ const LANGID* Languages,
+    _In_ size_t LanguageCount) const
+{
+    if (!ResourceInfo || !Type || !Name || (!Languages && LanguageCount))
+        return E_INVALIDARG;
+
+    ResourceInfo->Size = 0;
+    ResourceInfo->Pointer = nullptr;
+
+    std::wstring NormalizedType = CResourceCatalog::NormalizeIdentifier(Type);
+    std::wstring NormalizedName = CResourceCatalog::NormalizeIdentifier(Name);
+
+    // The entries of the same type and name are adjacent and sorted by the
+    // language identifier, and LANG_NEUTRAL is the lowest one.
+    auto First = std::lower_bound(
+        this->m_Entries.begin(),
+        this->m_Entries.end(),
+        std::tie(NormalizedType, NormalizedName),
+        [](const CEntry& Left, const std::tuple<
+            const std::wstring&, const std::wstring&>& Right)
+    {
+        return std::tie(Left.Type, Left.Name) < Right;
+    });
+
+    auto Last = First;
+    while (this->m_Entries.end() != Last &&
+        Last->Type == NormalizedType &&
+        Last->Name == NormalizedName)
+    {
+        ++Last;
+    }
+
+    if (First == Last)
+    {
+        return __HRESULT_FROM_WIN32(ERROR_RESOURCE_NAME_NOT_FOUND);
+    }
+
+    auto Candidate = Last;
+
+    for (size_t i = 0; Last == Candidate && i < LanguageCount; ++i)
+    {
+        Candidate = std::find_if(First, Last, [&](const CEntry& Entry)
+        {
+            return Languages[i] == Entry.Language;
+        });
+    }
+
+    for (size_t i = 0; Last == Candidate && i < LanguageCount; ++i)
+    {
+        Candidate = std::find_if(First, Last, [&](const CEntry& Entry)
+        {
+            return PRIMARYLANGID(Languages[i]) ==
+                PRIMARYLANGID(Entry.Language);
+        });
+    }
+
+    if (Last == Candidate)
+    {
+        Candidate = std::find_if(First, Last, [](const CEntry& Entry)
+        {
+            return LANG_NEUTRAL == PRIMARYLANGID(Entry.Language);
+        });
+    }
+
+    if (Last == Candidate)
+    {
+        Candidate = std::find_if(First, Last, [](const CEntry& Entry)
+        {
+            return MAKELANGID(LANG_ENGLISH, SUBLANG_ENGLISH_US) ==
+                Entry.Language;
+        });
+    }
+
+    if (Last == Candidate)
+    {
+        Candidate = std::find_if(First, Last, [](const CEntry& Entry)
+        {
+            return LANG_ENGLISH == PRIMARYLANGID(Entry.Language);
+        });
+    }
+
+    if (Last == Candidate)
+    {
+        Candidate = First;
+    }
+
+    *ResourceInfo = Candidate->Info;
+
+    return S_OK;
+}
+
+/**
+ * Finds the resource with the specified type and name. The preferred
+ * languages are the UI language of the current thread, the default UI
+ * language of the current user and the one of the system.
+ *
+ * @param ResourceInfo The resource info which contains the pointer and size.
+ * @param Type The resource type. It can be MAKEINTRESOURCE(ID).
+ * @param Name The resource name. It can be MAKEINTRESOURCE(ID).
+ * @return HRESULT. If the resource is not in the catalog, the return value is
+ *         HRESULT_FROM_WIN32(ERROR_RESOURCE_NAME_NOT_FOUND).
+ */
+HRESULT M2::CResourceCatalog::Find(
+    _Out_ PM2_RESOURCE_INFO ResourceInfo,
+    _In_ LPCWSTR Type,
+    _In_ LPCWSTR Name) const
+{
+    // The languages are queried on every lookup, because the UI language of
+    // the thread can be changed by SetThreadUILanguage.
+    const LANGID Languages[] =
+    {
+        GetThreadUILanguage(),
+        GetUserDefaultUILanguage(),
+        GetSystemDefaultUILanguage()
+    };
+
+    return this->Find(
+        ResourceInfo,
+        Type,
+        Name,
+        Languages,
+        sizeof(Languages) / sizeof(*Languages));
+}
+
 /**
  * Retrieves the path of the shared Windows directory on a multi-user system.
  *
@@ -130,83 +431,26 @@ HRESULT M2StartService(
     _In_ LPCWSTR lpServiceName,
     _Out_ LPSERVICE_STATUS_PROCESS lpServiceStatus)
 {
-    M2::CServiceHandle hSCM;
-    M2::CServiceHandle hService;
-
-    DWORD nBytesNeeded = 0;
-    DWORD nOldCheckPoint = 0;
-    ULONGLONG nLastTick = 0;
-    bool bStartServiceWCalled = false;
-
-    hSCM = OpenSCManagerW(
-        nullptr,
-        nullptr,
-        SC_MANAGER_CONNECT);
-    if (!hSCM)
-        return M2GetLastHRESULTErrorKnownFailedCall();
+    // The service start only uses the timers of the loop, so the loop never
+    // waits alertably, and the callers, such as the ones impersonating
+    // System, do not run the APCs queued to their threads.
+    M2::CEventLoop EventLoop;
 
-    hService = OpenServiceW(
-        hSCM,
-        lpServiceName,
-        SERVICE_QUERY_STATUS | SERVICE_START);
-    if (!hService)
-        return M2GetLastHRESULTErrorKnownFailedCall();
+    HRESULT hr = E_FAIL;
 
-    while (QueryServiceStatusEx(
-        hService,
-        SC_STATUS_PROCESS_INFO,
-        reinterpret_cast<LPBYTE>(lpServiceStatus),
-        sizeof(SERVICE_STATUS_PROCESS),
-        &nBytesNeeded))
+    EventLoop.StartServiceAsync(
+        lpServiceName,
+        lpServiceStatus,
+        [&hr](HRESULT Result)
     {
-        if (SERVICE_STOPPED == lpServiceStatus->dwCurrentState)
-        {
-            // Failed if the service had stopped again.
-            if (bStartServiceWCalled)
-                return E_FAIL;
+        hr = Result;
+    });
 
-            if (!StartServiceW(hService, 0, nullptr))
-                return M2GetLastHRESULTErrorKnownFailedCall();
+    HRESULT hrRun = EventLoop.Run();
+    if (FAILED(hrRun))
+        return hrRun;
 
-            bStartServiceWCalled = true;
-        }
-        else if (
-            SERVICE_STOP_PENDING == lpServiceStatus->dwCurrentState ||
-            SERVICE_START_PENDING == lpServiceStatus->dwCurrentState)
-        {
-            ULONGLONG nCurrentTick = GetTickCount64();
-
-            if (!nLastTick)
-            {
-                nLastTick = nCurrentTick;
-                nOldCheckPoint = lpServiceStatus->dwCheckPoint;
-
-                // Same as the .Net System.ServiceProcess, wait 250ms.
-                SleepEx(250, FALSE);
-            }
-            else
-            {
-                // Check the timeout if the checkpoint is not increased.
-                if (lpServiceStatus->dwCheckPoint <= nOldCheckPoint)
-                {
-                    ULONGLONG nDiff = nCurrentTick - nLastTick;
-                    if (nDiff > lpServiceStatus->dwWaitHint)
-                    {
-                        return __HRESULT_FROM_WIN32(ERROR_TIMEOUT);
-                    }
-                }
-
-                // Continue looping.
-                nLastTick = 0;
-            }
-        }
-        else
-        {
-            break;
-        }
-    }
-
-    return S_OK;
+    return hr;
 }
 
 /**
@@ -234,33 +478,334 @@ HRESULT M2LoadLibraryEx(
     ModuleHandle = LoadLibraryExW(LibraryFileName, nullptr, Flags);
     if (!ModuleHandle)
     {
-        const size_t BufferLength = 32768;
-        wchar_t Buffer[BufferLength];
-
         if ((Flags & LOAD_LIBRARY_SEARCH_SYSTEM32) &&
             (M2GetLastErrorKnownFailedCall() == ERROR_INVALID_PARAMETER))
         {
-            if (!wcschr(LibraryFileName, (wchar_t)'\\'))
+            // Build the path on the heap instead of reserving a 64 KiB buffer
+            // on the stack of the caller.
+            std::wstring LibraryFilePath;
+
+            if (!wcschr(LibraryFileName, L'\\'))
+            {
+                UINT Length = GetSystemDirectoryW(nullptr, 0);
+                if (0 == Length)
+                    return M2GetLastHRESULTErrorKnownFailedCall();
+
+                LibraryFilePath.resize(Length - 1);
+                Length = GetSystemDirectoryW(&LibraryFilePath[0], Length);
+                if (0 == Length)
+                    return M2GetLastHRESULTErrorKnownFailedCall();
+
+                LibraryFilePath.resize(Length);
+                LibraryFilePath += L'\\';
+                LibraryFilePath += LibraryFileName;
+
+                LibraryFileName = LibraryFilePath.c_str();
+            }
+
+            ModuleHandle = LoadLibraryExW(LibraryFileName, nullptr, Flags);
+        }
+    }
+
+    return ModuleHandle ? S_OK : M2GetLastHRESULTErrorKnownFailedCall();
+}
+
+namespace
+{
+    volatile LONG g_ImportedProcedureResolveCount = 0;
+}
+
+BOOL CALLBACK M2::CImportedProcedureBase::ResolveCallback(
+    _Inout_ PINIT_ONCE InitOnce,
+    _Inout_opt_ PVOID Parameter,
+    _Out_opt_ PVOID* Context)
+{
+    UNREFERENCED_PARAMETER(InitOnce);
+    UNREFERENCED_PARAMETER(Context);
+
+    CImportedProcedureBase* Object =
+        reinterpret_cast<CImportedProcedureBase*>(Parameter);
+
+    InterlockedIncrement(&g_ImportedProcedureResolveCount);
+
+    HMODULE ModuleHandle = GetModuleHandleW(Object->m_ModuleName);
+    if (ModuleHandle)
+    {
+        Object->m_Status = S_OK;
+    }
+    else
+    {
+        Object->m_Status = M2LoadLibraryEx(
+            ModuleHandle,
+            Object->m_ModuleName,
+            LOAD_LIBRARY_SEARCH_SYSTEM32);
+    }
+
+    if (SUCCEEDED(Object->m_Status))
+    {
+        Object->m_Status = M2GetProcAddress(
+            Object->m_Procedure,
+            ModuleHandle,
+            Object->m_ProcedureName);
+    }
+
+    // The failure is cached too, so the callback always reports success.
+    return TRUE;
+}
+
+/**
+ * Resolves the procedure, or returns the cached result if the procedure has
+ * been resolved.
+ *
+ * @param Procedure The address of the procedure.
+ * @return HRESULT. If the function succeeds, the return value is S_OK.
+ */
+HRESULT M2::CImportedProcedureBase::Resolve(
+    _Out_ FARPROC* Procedure)
+{
+    *Procedure = nullptr;
+
+    if (!InitOnceExecuteOnce(
+        &this->m_InitOnce,
+        CImportedProcedureBase::ResolveCallback,
+        this,
+        nullptr))
+    {
+        return M2GetLastHRESULTErrorKnownFailedCall();
+    }
+
+    if (SUCCEEDED(this->m_Status))
+    {
+        *Procedure = this->m_Procedure;
+    }
+
+    return this->m_Status;
+}
+
+/**
+ * Retrieves the number of the procedures resolved in the current process,
+ * including the failed ones. Each object resolves its procedure at most once.
+ *
+ * @return The number of the resolved procedures.
+ */
+LONG M2::CImportedProcedureBase::GetResolveCount()
+{
+    return g_ImportedProcedureResolveCount;
+}
+
+namespace
+{
+    /**
+     * Counts the logical processors in the affinity mask.
+     */
+    DWORD M2CountAffinityMask(
+        _In_ KAFFINITY Mask)
+    {
+        DWORD Count = 0;
+        for (; Mask; Mask &= Mask - 1)
+            ++Count;
+        return Count;
+    }
+
+    /**
+     * Checks whether the two group affinity masks share a logical processor.
+     */
+    bool M2IsGroupAffinityIntersected(
+        _In_ const GROUP_AFFINITY& Left,
+        _In_ const GROUP_AFFINITY& Right)
+    {
+        return Left.Group == Right.Group && 0 != (Left.Mask & Right.Mask);
+    }
+}
+
+/**
+ * Retrieves the processor topology of all processor groups, including the
+ * packages, the cores with their SMT and efficiency class information, the
+ * NUMA nodes and the caches.
+ *
+ * @param Topology The processor topology.
+ * @return HRESULT. If the function succeeds, the return value is S_OK.
+ * @remark You need to use this function in Windows 7 or later. Use
+ *         M2GetNumberOfHardwareThreads as the fallback in earlier versions of
+ *         Windows.
+ */
+HRESULT M2GetProcessorTopology(
+    _Out_ M2_PROCESSOR_TOPOLOGY& Topology)
+{
+    // Resolved at run time because it is not available in Windows Vista.
+    static M2::CImportedProcedure<decltype(GetLogicalProcessorInformationEx)*>
+        GetLogicalProcessorInformationExProcedure(
+            L"kernel32.dll", "GetLogicalProcessorInformationEx");
+
+    Topology.LogicalProcessorCount = 0;
+    Topology.IsHybrid = false;
+    Topology.Packages.clear();
+    Topology.Cores.clear();
+    Topology.NumaNodes.clear();
+    Topology.Caches.clear();
+
+    decltype(GetLogicalProcessorInformationEx)* pFunc = nullptr;
+    HRESULT hr = GetLogicalProcessorInformationExProcedure.Get(pFunc);
+    if (FAILED(hr))
+        return hr;
+
+    DWORD Length = 0;
+    if (!pFunc(RelationAll, nullptr, &Length))
+    {
+        if (ERROR_INSUFFICIENT_BUFFER != M2GetLastErrorKnownFailedCall())
+            return M2GetLastHRESULTErrorKnownFailedCall();
+    }
+
+    M2::CM2Memory<PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX> Buffer;
+    hr = M2AllocMemory(reinterpret_cast<PVOID*>(&Buffer), Length, false);
+    if (FAILED(hr))
+        return hr;
+
+    if (!pFunc(RelationAll, Buffer, &Length))
+        return M2GetLastHRESULTErrorKnownFailedCall();
+
+    return M2ParseProcessorTopology(Buffer, Length, Topology);
+}
+
+/**
+ * Parses the processor topology from the buffer returned by
+ * GetLogicalProcessorInformationEx with RelationAll.
+ *
+ * @param Buffer The buffer of the processor information records.
+ * @param Length The size of the buffer in bytes.
+ * @param Topology The processor topology.
+ * @return HRESULT. If the function succeeds, the return value is S_OK. If a
+ *         record does not fit in the buffer, the return value is
+ *         HRESULT_FROM_WIN32(ERROR_INVALID_DATA).
+ */
+HRESULT M2ParseProcessorTopology(
+    _In_reads_bytes_(Length) PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX Buffer,
+    _In_ DWORD Length,
+    _Out_ M2_PROCESSOR_TOPOLOGY& Topology)
+{
+    Topology.LogicalProcessorCount = 0;
+    Topology.IsHybrid = false;
+    Topology.Packages.clear();
+    Topology.Cores.clear();
+    Topology.NumaNodes.clear();
+    Topology.Caches.clear();
+
+    const DWORD HeaderSize = FIELD_OFFSET(
+        SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX, Processor);
+
+    for (DWORD Offset = 0; Offset < Length;)
+    {
+        PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX Information =
+            reinterpret_cast<PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX>(
+                reinterpret_cast<PBYTE>(Buffer) + Offset);
+
+        // A record which is empty or runs past the buffer would make the
+        // loop read outside the buffer or never end.
+        if (Length - Offset < HeaderSize ||
+            Information->Size < HeaderSize ||
+            Information->Size > Length - Offset)
+        {
+            return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+        }
+
+        if (RelationProcessorCore == Information->Relationship)
+        {
+            M2_PROCESSOR_CORE_INFO Core = { 0 };
+            Core.GroupMask = Information->Processor.GroupMask[0];
+            Core.LogicalProcessorCount =
+                M2CountAffinityMask(Core.GroupMask.Mask);
+            Core.PackageIndex = static_cast<DWORD>(-1);
+            Core.NumaNodeNumber = static_cast<DWORD>(-1);
+            Core.EfficiencyClass = Information->Processor.EfficiencyClass;
+            Core.IsSimultaneousMultithreading =
+                (LTP_PC_SMT == Information->Processor.Flags);
+
+            Topology.LogicalProcessorCount += Core.LogicalProcessorCount;
+            Topology.Cores.push_back(Core);
+        }
+        else if (RelationProcessorPackage == Information->Relationship)
+        {
+            if (Information->Size < FIELD_OFFSET(
+                SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX,
+                Processor.GroupMask) +
+                Information->Processor.GroupCount * sizeof(GROUP_AFFINITY))
             {
-                UINT NewLength = GetSystemDirectoryW(
-                    Buffer,
-                    BufferLength);
+                return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+            }
+
+            M2_PROCESSOR_PACKAGE_INFO Package;
+            Package.GroupMasks.assign(
+                Information->Processor.GroupMask,
+                Information->Processor.GroupMask +
+                Information->Processor.GroupCount);
+            Package.CoreCount = 0;
+            Package.LogicalProcessorCount = 0;
+
+            Topology.Packages.push_back(std::move(Package));
+        }
+        else if (RelationNumaNode == Information->Relationship)
+        {
+            M2_NUMA_NODE_INFO NumaNode;
+            NumaNode.NodeNumber = Information->NumaNode.NodeNumber;
+            NumaNode.GroupMask = Information->NumaNode.GroupMask;
 
-                Buffer[NewLength++] = '\\';
+            Topology.NumaNodes.push_back(NumaNode);
+        }
+        else if (RelationCache == Information->Relationship)
+        {
+            M2_PROCESSOR_CACHE_INFO Cache;
+            Cache.Level = Information->Cache.Level;
+            Cache.Associativity = Information->Cache.Associativity;
+            Cache.LineSize = Information->Cache.LineSize;
+            Cache.CacheSize = Information->Cache.CacheSize;
+            Cache.Type = Information->Cache.Type;
+            Cache.GroupMask = Information->Cache.GroupMask;
+
+            Topology.Caches.push_back(Cache);
+        }
 
-                for (; *LibraryFileName; ++LibraryFileName)
+        Offset += Information->Size;
+    }
+
+    // Link each core to its package and NUMA node.
+    for (M2_PROCESSOR_CORE_INFO& Core : Topology.Cores)
+    {
+        for (size_t i = 0; i < Topology.Packages.size(); ++i)
+        {
+            M2_PROCESSOR_PACKAGE_INFO& Package = Topology.Packages[i];
+
+            for (const GROUP_AFFINITY& GroupMask : Package.GroupMasks)
+            {
+                if (M2IsGroupAffinityIntersected(GroupMask, Core.GroupMask))
                 {
-                    Buffer[NewLength++] = *LibraryFileName;
+                    Core.PackageIndex = static_cast<DWORD>(i);
+                    ++Package.CoreCount;
+                    Package.LogicalProcessorCount +=
+                        Core.LogicalProcessorCount;
+                    break;
                 }
+            }
 
-                Buffer[NewLength] = L'\0';
+            if (static_cast<DWORD>(-1) != Core.PackageIndex)
+                break;
+        }
 
-                LibraryFileName = Buffer;
+        for (const M2_NUMA_NODE_INFO& NumaNode : Topology.NumaNodes)
+        {
+            if (M2IsGroupAffinityIntersected(
+                NumaNode.GroupMask, Core.GroupMask))
+            {
+                Core.NumaNodeNumber = NumaNode.NodeNumber;
+                break;
             }
+        }
 
-            ModuleHandle = LoadLibraryExW(LibraryFileName, nullptr, Flags);
+        // The efficiency classes are the same on the non-hybrid processors.
+        if (Core.EfficiencyClass != Topology.Cores[0].EfficiencyClass)
+        {
+            Topology.IsHybrid = true;
         }
     }
 
-    return ModuleHandle ? S_OK : M2GetLastHRESULTErrorKnownFailedCall();
+    return S_OK;
 }
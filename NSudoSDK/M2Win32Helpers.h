@@ -49,6 +49,120 @@ HRESULT M2LoadResource(
 
 namespace M2
 {
+    /**
+     * The resource catalog which indexes the resources once and serves the
+     * following lookups from a flat table sorted by type, name and language.
+     */
+#pragma region CResourceCatalog
+
+    class CResourceCatalog : CDisableObjectCopying
+    {
+    private:
+        struct CEntry
+        {
+            std::wstring Type;
+            std::wstring Name;
+            WORD Language;
+            M2_RESOURCE_INFO Info;
+        };
+
+        std::vector<CEntry> m_Entries;
+
+        static std::wstring NormalizeIdentifier(
+            _In_ LPCWSTR Identifier);
+
+        static BOOL CALLBACK EnumerateNamesCallback(
+            _In_opt_ HMODULE hModule,
+            _In_ LPCWSTR lpType,
+            _In_ LPWSTR lpName,
+            _In_ LONG_PTR lParam);
+
+        static BOOL CALLBACK EnumerateLanguagesCallback(
+            _In_opt_ HMODULE hModule,
+            _In_ LPCWSTR lpType,
+            _In_ LPCWSTR lpName,
+            _In_ WORD wLanguage,
+            _In_ LONG_PTR lParam);
+
+    public:
+        CResourceCatalog() = default;
+
+        /**
+         * Indexes all resources of the specified types in the specified
+         * module.
+         *
+         * @param hModule A handle to the module. If this parameter is NULL,
+         *                the module used to create the current process is
+         *                used.
+         * @param Types The resource types to index.
+         * @param TypeCount The number of the resource types.
+         * @return HRESULT. If the function succeeds, the return value is S_OK.
+         */
+        HRESULT AddModule(
+            _In_opt_ HMODULE hModule,
+            _In_ const LPCWSTR* Types,
+            _In_ size_t TypeCount);
+
+        /**
+         * Adds a resource which is already in memory to the catalog, which
+         * makes it possible to serve the lookups from an in-memory image
+         * instead of a module. The memory must outlive the catalog.
+         *
+         * @param Type The resource type. It can be MAKEINTRESOURCE(ID).
+         * @param Name The resource name. It can be MAKEINTRESOURCE(ID).
+         * @param Language The language identifier of the resource.
+         * @param ResourceInfo The pointer and the size of the resource.
+         * @return HRESULT. If the function succeeds, the return value is S_OK.
+         */
+        HRESULT AddResource(
+            _In_ LPCWSTR Type,
+            _In_ LPCWSTR Name,
+            _In_ WORD Language,
+            _In_ const M2_RESOURCE_INFO& ResourceInfo);
+
+        /**
+         * Finds the resource with the specified type and name in the
+         * preferred languages. The languages are tried in order, then the
+         * ones with the same primary language, then the neutral language,
+         * then English. Otherwise the resource with the lowest language
+         * identifier is returned.
+         *
+         * @param ResourceInfo The resource info which contains the pointer
+         *                     and size.
+         * @param Type The resource type. It can be MAKEINTRESOURCE(ID).
+         * @param Name The resource name. It can be MAKEINTRESOURCE(ID).
+         * @param Languages The preferred languages.
+         * @param LanguageCount The number of the preferred languages.
+         * @return HRESULT. If the resource is not in the catalog, the return
+         *         value is HRESULT_FROM_WIN32(ERROR_RESOURCE_NAME_NOT_FOUND).
+         */
+        HRESULT Find(
+            _Out_ PM2_RESOURCE_INFO ResourceInfo,
+            _In_ LPCWSTR Type,
+            _In_ LPCWSTR Name,
+            _In_ const LANGID* Languages,
+            _In_ size_t LanguageCount) const;
+
+        /**
+         * Finds the resource with the specified type and name. The preferred
+         * languages are the UI language of the current thread, the default
+         * UI language of the current user and the one of the system.
+         *
+         * @param ResourceInfo The resource info which contains the pointer
+         *                     and size.
+         * @param Type The resource type. It can be MAKEINTRESOURCE(ID).
+         * @param Name The resource name. It can be MAKEINTRESOURCE(ID).
+         * @return HRESULT. If the resource is not in the catalog, the return
+         *         value is HRESULT_FROM_WIN32(ERROR_RESOURCE_NAME_NOT_FOUND).
+         */
+        HRESULT Find(
+            _Out_ PM2_RESOURCE_INFO ResourceInfo,
+            _In_ LPCWSTR Type,
+            _In_ LPCWSTR Name) const;
+    };
+
+#pragma endregion
+
     /**
      * The handle definer for SC_HANDLE object.
      */
@@ -198,4 +312,185 @@ HRESULT M2LoadLibraryEx(
     _In_ LPCWSTR LibraryFileName,
     _In_ DWORD Flags);
 
+namespace M2
+{
+    /**
+     * The procedure imported from a module at run time. The module is loaded
+     * and the procedure is resolved only once, and the result is cached for
+     * the following calls, including the failure.
+     */
+#pragma region CImportedProcedure
+
+    class CImportedProcedureBase : CDisableObjectCopying
+    {
+    private:
+        INIT_ONCE m_InitOnce = INIT_ONCE_STATIC_INIT;
+        LPCWSTR m_ModuleName;
+        LPCSTR m_ProcedureName;
+        HRESULT m_Status = E_PENDING;
+        FARPROC m_Procedure = nullptr;
+
+        static BOOL CALLBACK ResolveCallback(
+            _Inout_ PINIT_ONCE InitOnce,
+            _Inout_opt_ PVOID Parameter,
+            _Out_opt_ PVOID* Context);
+
+    protected:
+        /**
+         * Resolves the procedure, or returns the cached result if the
+         * procedure has been resolved.
+         *
+         * @param Procedure The address of the procedure.
+         * @return HRESULT. If the function succeeds, the return value is S_OK.
+         */
+        HRESULT Resolve(
+            _Out_ FARPROC* Procedure);
+
+    public:
+        /**
+         * Creates the imported procedure. Nothing is loaded until the first
+         * call to Get.
+         *
+         * @param ModuleName The name of the module which exports the
+         *                   procedure. If the module is not loaded, it will
+         *                   be loaded from the system directory and stays
+         *                   loaded until the process exits.
+         * @param ProcedureName The name of the procedure, or the ordinal
+         *                      value in the low-order word.
+         */
+        CImportedProcedureBase(
+            _In_ LPCWSTR ModuleName,
+            _In_ LPCSTR ProcedureName) :
+            m_ModuleName(ModuleName),
+            m_ProcedureName(ProcedureName)
+        {
+
+        }
+
+        /**
+         * Retrieves the number of the procedures resolved in the current
+         * process, including the failed ones. Each object resolves its
+         * procedure at most once.
+         *
+         * @return The number of the resolved procedures.
+         */
+        static LONG GetResolveCount();
+    };
+
+    template<typename ProcedureType>
+    class CImportedProcedure : public CImportedProcedureBase
+    {
+    public:
+        CImportedProcedure(
+            _In_ LPCWSTR ModuleName,
+            _In_ LPCSTR ProcedureName) :
+            CImportedProcedureBase(ModuleName, ProcedureName)
+        {
+
+        }
+
+        /**
+         * Gets the address of the procedure.
+         *
+         * @param Procedure The address of the procedure.
+         * @return HRESULT. If the function succeeds, the return value is S_OK.
+         */
+        HRESULT Get(
+            _Out_ ProcedureType& Procedure)
+        {
+            return this->Resolve(reinterpret_cast<FARPROC*>(&Procedure));
+        }
+    };
+
+#pragma endregion
+}
+
+/**
+ * The information of a processor package (socket).
+ */
+typedef struct _M2_PROCESSOR_PACKAGE_INFO
+{
+    std::vector<GROUP_AFFINITY> GroupMasks;
+    DWORD CoreCount;
+    DWORD LogicalProcessorCount;
+} M2_PROCESSOR_PACKAGE_INFO, *PM2_PROCESSOR_PACKAGE_INFO;
+
+/**
+ * The information of a processor core.
+ */
+typedef struct _M2_PROCESSOR_CORE_INFO
+{
+    GROUP_AFFINITY GroupMask;
+    DWORD LogicalProcessorCount;
+    DWORD PackageIndex;
+    DWORD NumaNodeNumber;
+    BYTE EfficiencyClass;
+    bool IsSimultaneousMultithreading;
+} M2_PROCESSOR_CORE_INFO, *PM2_PROCESSOR_CORE_INFO;
+
+/**
+ * The information of a NUMA node.
+ */
+typedef struct _M2_NUMA_NODE_INFO
+{
+    DWORD NodeNumber;
+    GROUP_AFFINITY GroupMask;
+} M2_NUMA_NODE_INFO, *PM2_NUMA_NODE_INFO;
+
+/**
+ * The information of a processor cache.
+ */
+typedef struct _M2_PROCESSOR_CACHE_INFO
+{
+    BYTE Level;
+    BYTE Associativity;
+    WORD LineSize;
+    DWORD CacheSize;
+    PROCESSOR_CACHE_TYPE Type;
+    GROUP_AFFINITY GroupMask;
+} M2_PROCESSOR_CACHE_INFO, *PM2_PROCESSOR_CACHE_INFO;
+
+/**
+ * The processor topology of the system.
+ */
+typedef struct _M2_PROCESSOR_TOPOLOGY
+{
+    DWORD LogicalProcessorCount;
+    bool IsHybrid;
+    std::vector<M2_PROCESSOR_PACKAGE_INFO> Packages;
+    std::vector<M2_PROCESSOR_CORE_INFO> Cores;
+    std::vector<M2_NUMA_NODE_INFO> NumaNodes;
+    std::vector<M2_PROCESSOR_CACHE_INFO> Caches;
+} M2_PROCESSOR_TOPOLOGY, *PM2_PROCESSOR_TOPOLOGY;
+
+/**
+ * Retrieves the processor topology of all processor groups, including the
+ * packages, the cores with their SMT and efficiency class information, the
+ * NUMA nodes and the caches.
+ *
+ * @param Topology The processor topology.
+ * @return HRESULT. If the function succeeds, the return value is S_OK.
+ * @remark You need to use this function in Windows 7 or later. Use
+ *         M2GetNumberOfHardwareThreads as the fallback in earlier versions of
+ *         Windows.
+ */
+HRESULT M2GetProcessorTopology(
+    _Out_ M2_PROCESSOR_TOPOLOGY& Topology);
+
+/**
+ * Parses the processor topology from the buffer returned by
+ * GetLogicalProcessorInformationEx with RelationAll.
+ *
+ * @param Buffer The buffer of the processor information records.
+ * @param Length The size of the buffer in bytes.
+ * @param Topology The processor topology.
+ * @return HRESULT. If the function succeeds, the return value is S_OK. If a
+ *         record does not fit in the buffer, the return value is
+ *         HRESULT_FROM_WIN32(ERROR_INVALID_DATA).
+ */
+HRESULT M2ParseProcessorTopology(
+    _In_reads_bytes_(Length) PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX Buffer,
+    _In_ DWORD Length,
+    _Out_ M2_PROCESSOR_TOPOLOGY& Topology);
+
 #endif // _M2_WIN32_HELPERS_
@@ -0,0 +1,286 @@
+﻿/*
+ * PROJECT:   NSudo
+ * FILE:      M2AllocationHelpersTests.cpp
+ * PURPOSE:   Unit tests for the allocation accounting helpers
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#include "stdafx.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <new>
+
+// The test project defines M2_ENABLE_ALLOCATION_ACCOUNTING and
+// M2_ENABLE_OPERATOR_NEW_ACCOUNTING, so the SDK and the operator new shim
+// count the allocations of the tests.
+
+namespace
+{
+    /**
+     * The statistics of a tag and allocation function pair.
+     */
+    struct NSUDO_TEST_ALLOCATION_SITE
+    {
+        bool IsFound = false;
+        ULONGLONG AllocationCount = 0;
+        ULONGLONG AllocatedBytes = 0;
+        ULONGLONG FreeCount = 0;
+    };
+
+    NSUDO_TEST_ALLOCATION_SITE NSudoTestGetAllocationSite(
+        _In_opt_z_ const char* Tag,
+        _In_z_ const char* Source)
+    {
+        NSUDO_TEST_ALLOCATION_SITE Site;
+        Site.IsFound = M2GetAllocationSiteStatistics(
+            Tag,
+            Source,
+            &Site.AllocationCount,
+            &Site.AllocatedBytes,
+            &Site.FreeCount);
+        return Site;
+    }
+
+    const char* NSudoTestGetAllocationTag()
+    {
+        const char* Tag = M2SetAllocationTag(nullptr);
+        M2SetAllocationTag(Tag);
+        return Tag;
+    }
+
+    // The tags of the child process of AllocationSitesOverflowToUnattributed,
+    // one more than the registry can have.
+    char g_OverflowTags[M2_ALLOCATION_SITE_COUNT + 1][64];
+}
+
+NSUDO_TEST(AllocationTagsNestAndRestore)
+{
+    const char* OriginalTag = NSudoTestGetAllocationTag();
+
+    {
+        M2_ALLOCATION_TAG("NSudoTests.Outer");
+        M2RecordAllocation("NSudoTests.Tags", 10);
+
+        {
+            M2_ALLOCATION_TAG("NSudoTests.Inner");
+            M2RecordAllocation("NSudoTests.Tags", 20);
+
+            // The tag is per thread, so another thread does not see it.
+            M2::CHandle Thread = M2::CThread([]()
+            {
+                M2RecordAllocation("NSudoTests.Tags", 40);
+            }).Detach();
+            NSUDO_TEST_ASSERT(Thread);
+            NSUDO_TEST_ASSERT(WAIT_OBJECT_0 == WaitForSingleObjectEx(
+                Thread, 60 * 1000, FALSE));
+        }
+
+        NSUDO_TEST_ASSERT(0 == strcmp(
+            "NSudoTests.Outer", NSudoTestGetAllocationTag()));
+        M2RecordAllocation("NSudoTests.Tags", 30);
+    }
+
+    NSUDO_TEST_ASSERT(OriginalTag == NSudoTestGetAllocationTag());
+
+    NSUDO_TEST_ALLOCATION_SITE Outer = NSudoTestGetAllocationSite(
+        "NSudoTests.Outer", "NSudoTests.Tags");
+    NSUDO_TEST_ASSERT(Outer.IsFound);
+    NSUDO_TEST_ASSERT(2 == Outer.AllocationCount);
+    NSUDO_TEST_ASSERT(40 == Outer.AllocatedBytes);
+
+    NSUDO_TEST_ALLOCATION_SITE Inner = NSudoTestGetAllocationSite(
+        "NSudoTests.Inner", "NSudoTests.Tags");
+    NSUDO_TEST_ASSERT(Inner.IsFound);
+    NSUDO_TEST_ASSERT(1 == Inner.AllocationCount);
+    NSUDO_TEST_ASSERT(20 == Inner.AllocatedBytes);
+
+    NSUDO_TEST_ALLOCATION_SITE Untagged = NSudoTestGetAllocationSite(
+        nullptr, "NSudoTests.Tags");
+    NSUDO_TEST_ASSERT(Untagged.IsFound);
+    NSUDO_TEST_ASSERT(1 == Untagged.AllocationCount);
+    NSUDO_TEST_ASSERT(40 == Untagged.AllocatedBytes);
+}
+
+NSUDO_TEST(AllocationCountsOfExitedThreadsAreKept)
+{
+    // Each thread counts into its own counters, which the next thread reuses
+    // after it exits.
+    for (int i = 0; i < 8; ++i)
+    {
+        M2::CHandle Thread = M2::CThread([]()
+        {
+            M2_ALLOCATION_TAG("NSudoTests.ExitedThreads");
+            M2RecordAllocation("NSudoTests.Threads", 8);
+            M2RecordFree("NSudoTests.Threads");
+        }).Detach();
+        NSUDO_TEST_ASSERT(Thread);
+        NSUDO_TEST_ASSERT(WAIT_OBJECT_0 == WaitForSingleObjectEx(
+            Thread, 60 * 1000, FALSE));
+    }
+
+    NSUDO_TEST_ALLOCATION_SITE Site = NSudoTestGetAllocationSite(
+        "NSudoTests.ExitedThreads", "NSudoTests.Threads");
+    NSUDO_TEST_ASSERT(Site.IsFound);
+    NSUDO_TEST_ASSERT(8 == Site.AllocationCount);
+    NSUDO_TEST_ASSERT(64 == Site.AllocatedBytes);
+    NSUDO_TEST_ASSERT(8 == Site.FreeCount);
+}
+
+NSUDO_TEST(AllocationFreesAreCounted)
+{
+    PVOID Blocks[3] = { nullptr };
+
+    {
+        M2_ALLOCATION_TAG("NSudoTests.Allocate");
+
+        for (PVOID& Block : Blocks)
+        {
+            NSUDO_TEST_ASSERT(S_OK == M2AllocMemory(&Block, 100));
+        }
+
+        NSUDO_TEST_ASSERT(S_OK == M2FreeMemory(Blocks[0]));
+
+        // The reallocation is a free and an allocation.
+        NSUDO_TEST_ASSERT(S_OK == M2ReAllocMemory(&Blocks[0], Blocks[1], 50));
+    }
+
+    {
+        // The frees are counted under the tag of the thread which frees.
+        M2_ALLOCATION_TAG("NSudoTests.Free");
+
+        NSUDO_TEST_ASSERT(S_OK == M2FreeMemory(Blocks[0]));
+        NSUDO_TEST_ASSERT(S_OK == M2FreeMemory(Blocks[2]));
+    }
+
+    NSUDO_TEST_ALLOCATION_SITE Allocate = NSudoTestGetAllocationSite(
+        "NSudoTests.Allocate", "M2AllocMemory");
+    NSUDO_TEST_ASSERT(Allocate.IsFound);
+    NSUDO_TEST_ASSERT(4 == Allocate.AllocationCount);
+    NSUDO_TEST_ASSERT(350 == Allocate.AllocatedBytes);
+    NSUDO_TEST_ASSERT(2 == Allocate.FreeCount);
+
+    NSUDO_TEST_ALLOCATION_SITE Free = NSudoTestGetAllocationSite(
+        "NSudoTests.Free", "M2AllocMemory");
+    NSUDO_TEST_ASSERT(Free.IsFound);
+    NSUDO_TEST_ASSERT(0 == Free.AllocationCount);
+    NSUDO_TEST_ASSERT(0 == Free.AllocatedBytes);
+    NSUDO_TEST_ASSERT(2 == Free.FreeCount);
+
+    NSUDO_TEST_ASSERT(!NSudoTestGetAllocationSite(
+        "NSudoTests.Free", "operator new").IsFound);
+}
+
+NSUDO_TEST(OperatorNewAllocationsAreCounted)
+{
+    {
+        M2_ALLOCATION_TAG("NSudoTests.OperatorNew");
+
+        // The operators are called directly, because the compiler may omit
+        // the allocations of the new expressions.
+        void* Block = ::operator new(100);
+        ::operator delete(Block);
+
+        Block = ::operator new[](28, std::nothrow);
+        NSUDO_TEST_ASSERT(Block);
+        ::operator delete[](Block);
+
+        // The empty allocation is counted with its requested size.
+        Block = ::operator new(0);
+        ::operator delete(Block, static_cast<size_t>(0));
+
+        // Deleting nullptr is not a free.
+        ::operator delete(nullptr);
+    }
+
+    NSUDO_TEST_ALLOCATION_SITE Site = NSudoTestGetAllocationSite(
+        "NSudoTests.OperatorNew", "operator new");
+    NSUDO_TEST_ASSERT(Site.IsFound);
+    NSUDO_TEST_ASSERT(3 == Site.AllocationCount);
+    NSUDO_TEST_ASSERT(128 == Site.AllocatedBytes);
+    NSUDO_TEST_ASSERT(3 == Site.FreeCount);
+}
+
+// The child process of AllocationSitesOverflowToUnattributed. It does nothing
+// in the normal runs of the tests, because it fills the registry of the
+// process.
+NSUDO_TEST(AllocationSitesOverflowChild)
+{
+    if (!GetEnvironmentVariableW(
+        L"NSUDO_TEST_ALLOCATION_OVERFLOW", nullptr, 0))
+    {
+        return;
+    }
+
+    ULONGLONG AllocationCount = 0;
+    ULONGLONG AllocatedBytes = 0;
+    ULONGLONG FreeCount = 0;
+    M2GetAllocationTotals(&AllocationCount, &AllocatedBytes, &FreeCount);
+
+    NSUDO_TEST_ALLOCATION_SITE Unattributed = NSudoTestGetAllocationSite(
+        "(unattributed)", "(any)");
+
+    // Each tag is a new pair. The sites recorded before by the test program
+    // take some of the slots, so the last pairs are beyond the limit.
+    for (size_t i = 0; i < _countof(g_OverflowTags); ++i)
+    {
+        sprintf_s(g_OverflowTags[i], "NSudoTests.Overflow.%zu", i);
+
+        M2_ALLOCATION_TAG(g_OverflowTags[i]);
+        M2RecordAllocation("NSudoTests.Overflow", 2);
+        M2RecordFree("NSudoTests.Overflow");
+    }
+
+    size_t FoundCount = 0;
+    for (size_t i = 0; i < _countof(g_OverflowTags); ++i)
+    {
+        NSUDO_TEST_ALLOCATION_SITE Site = NSudoTestGetAllocationSite(
+            g_OverflowTags[i], "NSudoTests.Overflow");
+        if (!Site.IsFound)
+            continue;
+
+        // The pairs are registered in order, so the found ones come first.
+        NSUDO_TEST_ASSERT(FoundCount++ == i);
+        NSUDO_TEST_ASSERT(1 == Site.AllocationCount);
+        NSUDO_TEST_ASSERT(2 == Site.AllocatedBytes);
+        NSUDO_TEST_ASSERT(1 == Site.FreeCount);
+    }
+    NSUDO_TEST_ASSERT(0 < FoundCount);
+    NSUDO_TEST_ASSERT(FoundCount < _countof(g_OverflowTags));
+
+    // The pairs beyond the limit are not lost.
+    ULONGLONG OverflowCount = _countof(g_OverflowTags) - FoundCount;
+
+    NSUDO_TEST_ALLOCATION_SITE NewUnattributed = NSudoTestGetAllocationSite(
+        "(unattributed)", "(any)");
+    NSUDO_TEST_ASSERT(NewUnattributed.IsFound);
+    NSUDO_TEST_ASSERT(
+        Unattributed.AllocationCount + OverflowCount ==
+        NewUnattributed.AllocationCount);
+    NSUDO_TEST_ASSERT(
+        Unattributed.AllocatedBytes + OverflowCount * 2 ==
+        NewUnattributed.AllocatedBytes);
+    NSUDO_TEST_ASSERT(
+        Unattributed.FreeCount + OverflowCount == NewUnattributed.FreeCount);
+
+    ULONGLONG NewAllocationCount = 0;
+    ULONGLONG NewAllocatedBytes = 0;
+    ULONGLONG NewFreeCount = 0;
+    M2GetAllocationTotals(
+        &NewAllocationCount, &NewAllocatedBytes, &NewFreeCount);
+    NSUDO_TEST_ASSERT(
+        AllocationCount + _countof(g_OverflowTags) <= NewAllocationCount);
+    NSUDO_TEST_ASSERT(FreeCount + _countof(g_OverflowTags) <= NewFreeCount);
+}
+
+NSUDO_TEST(AllocationSitesOverflowToUnattributed)
+{
+    NSUDO_TEST_ASSERT(0 == NSudoTestRunChildProcess(
+        L"AllocationSitesOverflowChild",
+        L"NSUDO_TEST_ALLOCATION_OVERFLOW",
+        L"1"));
+}
@@ -0,0 +1,209 @@
+﻿/*
+ * PROJECT:   NSudo
+ * FILE:      M2AsyncHelpersTests.cpp
+ * PURPOSE:   Unit tests for the single-threaded event loop
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#include "stdafx.h"
+
+#include <string>
+#include <vector>
+
+namespace
+{
+    /**
+     * Creates both ends of an overlapped byte-mode named pipe with a unique
+     * name.
+     */
+    void NSudoTestCreateOverlappedPipe(
+        _Out_ M2::CHandle& ServerHandle,
+        _Out_ M2::CHandle& ClientHandle)
+    {
+        wchar_t PipeName[64];
+        swprintf_s(
+            PipeName,
+            L"\\\\.\\pipe\\NSudoTests.%lu.%llu",
+            GetCurrentProcessId(),
+            M2GetPerformanceCounter());
+
+        ServerHandle = CreateNamedPipeW(
+            PipeName,
+            PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+            PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT,
+            1,
+            4096,
+            4096,
+            0,
+            nullptr);
+        NSUDO_TEST_ASSERT(!ServerHandle.IsInvalid());
+
+        ClientHandle = CreateFileW(
+            PipeName,
+            GENERIC_READ | GENERIC_WRITE,
+            0,
+            nullptr,
+            OPEN_EXISTING,
+            FILE_FLAG_OVERLAPPED,
+            nullptr);
+        NSUDO_TEST_ASSERT(!ClientHandle.IsInvalid());
+    }
+
+    volatile LONG g_TestApcCount = 0;
+
+    VOID CALLBACK NSudoTestApcRoutine(
+        _In_ ULONG_PTR Parameter)
+    {
+        UNREFERENCED_PARAMETER(Parameter);
+        InterlockedIncrement(&g_TestApcCount);
+    }
+}
+
+NSUDO_TEST(EventLoopRunsTimersInDueOrder)
+{
+    M2::CEventLoop Loop;
+
+    std::vector<int> Order;
+
+    Loop.DelayAsync(60, [&Order]() { Order.push_back(3); });
+    Loop.DelayAsync(20, [&Order]() { Order.push_back(1); });
+    Loop.DelayAsync(40, [&Order]() { Order.push_back(2); });
+
+    // The timers with the same due time run in the order they were added.
+    Loop.DelayAsync(0, [&Order]() { Order.push_back(-2); });
+    Loop.DelayAsync(0, [&Order]() { Order.push_back(-1); });
+
+    // The posted callbacks run before the timers, and a timer added by a
+    // callback is also waited for.
+    Loop.Post([&Loop, &Order]()
+    {
+        Order.push_back(-3);
+        Loop.DelayAsync(80, [&Order]() { Order.push_back(4); });
+    });
+
+    ULONGLONG StartTime = GetTickCount64();
+    NSUDO_TEST_ASSERT(S_OK == Loop.Run());
+
+    NSUDO_TEST_ASSERT(GetTickCount64() - StartTime >= 70);
+    NSUDO_TEST_ASSERT((std::vector<int>{ -3, -2, -1, 1, 2, 3, 4 }) == Order);
+}
+
+NSUDO_TEST(EventLoopCompletesHandleWaits)
+{
+    M2::CHandle SignaledEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    M2::CHandle UnsignaledEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    NSUDO_TEST_ASSERT(SignaledEvent && UnsignaledEvent);
+
+    M2::CEventLoop Loop;
+
+    HRESULT SignaledResult = E_PENDING;
+    Loop.WaitForHandleAsync(
+        SignaledEvent,
+        INFINITE,
+        [&SignaledResult](HRESULT Result) { SignaledResult = Result; });
+
+    HRESULT TimedOutResult = E_PENDING;
+    Loop.WaitForHandleAsync(
+        UnsignaledEvent,
+        10,
+        [&TimedOutResult](HRESULT Result) { TimedOutResult = Result; });
+
+    // The event is signaled by another thread after the loop starts.
+    HANDLE EventHandle = SignaledEvent;
+    M2::CHandle Signaler = M2::CThread([EventHandle]()
+    {
+        Sleep(20);
+        SetEvent(EventHandle);
+    }).Detach();
+    NSUDO_TEST_ASSERT(Signaler);
+
+    NSUDO_TEST_ASSERT(S_OK == Loop.Run());
+
+    NSUDO_TEST_ASSERT(S_OK == SignaledResult);
+    NSUDO_TEST_ASSERT(HRESULT_FROM_WIN32(ERROR_TIMEOUT) == TimedOutResult);
+
+    WaitForSingleObjectEx(Signaler, INFINITE, FALSE);
+}
+
+NSUDO_TEST(EventLoopCompletesFileOperations)
+{
+    M2::CHandle ServerHandle;
+    M2::CHandle ClientHandle;
+    NSudoTestCreateOverlappedPipe(ServerHandle, ClientHandle);
+
+    M2::CEventLoop Loop;
+
+    const std::string Data = "Hello, NSudo";
+    char Buffer[64] = { 0 };
+
+    HRESULT ReadResult = E_PENDING;
+    DWORD NumberOfBytesRead = 0;
+    Loop.ReadFileAsync(
+        ServerHandle,
+        Buffer,
+        sizeof(Buffer),
+        [&](HRESULT Result, DWORD Size)
+    {
+        ReadResult = Result;
+        NumberOfBytesRead = Size;
+    });
+
+    // The read is pending until the write, which is started by a timer, so
+    // the loop waits alertably for both completion routines.
+    HRESULT WriteResult = E_PENDING;
+    DWORD NumberOfBytesWritten = 0;
+    Loop.DelayAsync(10, [&]()
+    {
+        Loop.WriteFileAsync(
+            ClientHandle,
+            Data.data(),
+            static_cast<DWORD>(Data.size()),
+            [&](HRESULT Result, DWORD Size)
+        {
+            WriteResult = Result;
+            NumberOfBytesWritten = Size;
+        });
+    });
+
+    NSUDO_TEST_ASSERT(S_OK == Loop.Run());
+
+    NSUDO_TEST_ASSERT(S_OK == WriteResult);
+    NSUDO_TEST_ASSERT(Data.size() == NumberOfBytesWritten);
+    NSUDO_TEST_ASSERT(S_OK == ReadResult);
+    NSUDO_TEST_ASSERT(Data == std::string(Buffer, NumberOfBytesRead));
+
+    // The failure to start an operation is reported to the callback.
+    HRESULT FailedResult = S_OK;
+    Loop.ReadFileAsync(
+        INVALID_HANDLE_VALUE,
+        Buffer,
+        sizeof(Buffer),
+        [&FailedResult](HRESULT Result, DWORD) { FailedResult = Result; });
+
+    NSUDO_TEST_ASSERT(S_OK == Loop.Run());
+    NSUDO_TEST_ASSERT(FAILED(FailedResult));
+}
+
+NSUDO_TEST(EventLoopWithoutFileOperationsDoesNotRunApcs)
+{
+    M2::CEventLoop Loop;
+
+    LONG ApcCount = g_TestApcCount;
+    NSUDO_TEST_ASSERT(QueueUserAPC(
+        NSudoTestApcRoutine, GetCurrentThread(), 0));
+
+    // The timer makes the loop wait, and the wait must not be alertable.
+    bool IsTimerRun = false;
+    Loop.DelayAsync(20, [&IsTimerRun]() { IsTimerRun = true; });
+
+    NSUDO_TEST_ASSERT(S_OK == Loop.Run());
+    NSUDO_TEST_ASSERT(IsTimerRun);
+    NSUDO_TEST_ASSERT(ApcCount == g_TestApcCount);
+
+    // Drain the APC, so it does not run in another test case.
+    SleepEx(0, TRUE);
+    NSUDO_TEST_ASSERT(ApcCount + 1 == g_TestApcCount);
+}
@@ -0,0 +1,679 @@
+﻿/*
+ * PROJECT:   NSudo
+ * FILE:      M2BaseHelpersTests.cpp
+ * PURPOSE:   Unit tests for the base helpers
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#include "stdafx.h"
+
+#include <utility>
+#include <vector>
+
+namespace
+{
+    // The class queried by the tests. The fake backend serves every class.
+    const TOKEN_INFORMATION_CLASS g_TestClass = TokenGroups;
+
+    /**
+     * The state of the fake token backend.
+     */
+    struct NSUDO_TEST_TOKEN_BACKEND
+    {
+        // The size of the information which the fake token has.
+        DWORD InformationSize = 0;
+
+        // The error of every call, or ERROR_SUCCESS to serve the information.
+        DWORD Error = ERROR_SUCCESS;
+
+        DWORD CallCount = 0;
+        DWORD LastBufferLength = 0;
+    };
+
+    NSUDO_TEST_TOKEN_BACKEND g_TokenBackend;
+
+    BOOL WINAPI NSudoTestGetTokenInformation(
+        _In_ HANDLE TokenHandle,
+        _In_ TOKEN_INFORMATION_CLASS TokenInformationClass,
+        _Out_opt_ LPVOID TokenInformation,
+        _In_ DWORD TokenInformationLength,
+        _Out_ PDWORD ReturnLength)
+    {
+        UNREFERENCED_PARAMETER(TokenHandle);
+        UNREFERENCED_PARAMETER(TokenInformationClass);
+
+        ++g_TokenBackend.CallCount;
+        g_TokenBackend.LastBufferLength = TokenInformationLength;
+
+        *ReturnLength = g_TokenBackend.InformationSize;
+
+        if (ERROR_SUCCESS != g_TokenBackend.Error)
+        {
+            SetLastError(g_TokenBackend.Error);
+            return FALSE;
+        }
+
+        if (!TokenInformation ||
+            TokenInformationLength < g_TokenBackend.InformationSize)
+        {
+            SetLastError(ERROR_INSUFFICIENT_BUFFER);
+            return FALSE;
+        }
+
+        memset(TokenInformation, 0x5A, g_TokenBackend.InformationSize);
+        return TRUE;
+    }
+
+    /**
+     * Installs the fake token backend with clear size hints, and restores
+     * GetTokenInformation when the test case ends.
+     */
+    class CNSudoTestTokenBackendScope : M2::CDisableObjectCopying
+    {
+    public:
+        CNSudoTestTokenBackendScope(
+            _In_ DWORD InformationSize)
+        {
+            g_TokenBackend = NSUDO_TEST_TOKEN_BACKEND();
+            g_TokenBackend.InformationSize = InformationSize;
+
+            M2SetTokenInformationQuery(NSudoTestGetTokenInformation);
+            M2ResetTokenInformationSizeHints();
+        }
+
+        ~CNSudoTestTokenBackendScope()
+        {
+            M2SetTokenInformationQuery(nullptr);
+            M2ResetTokenInformationSizeHints();
+        }
+    };
+
+    /**
+     * Checks the statistics of the size hints.
+     */
+    bool NSudoTestCheckStatistics(
+        _In_ ULONGLONG ExpectedHitCount,
+        _In_ ULONGLONG ExpectedMissCount)
+    {
+        ULONGLONG HitCount = 0;
+        ULONGLONG MissCount = 0;
+        M2GetTokenInformationSizeHintStatistics(&HitCount, &MissCount);
+
+        return ExpectedHitCount == HitCount && ExpectedMissCount == MissCount;
+    }
+}
+
+NSUDO_TEST(TokenInformationSizeHintSkipsSizeQuery)
+{
+    CNSudoTestTokenBackendScope Scope(100);
+
+    PVOID Information = nullptr;
+
+    // The first query needs the size query.
+    NSUDO_TEST_ASSERT(S_OK == M2GetTokenInformation(
+        &Information, INVALID_HANDLE_VALUE, g_TestClass));
+    M2FreeMemory(Information);
+    NSUDO_TEST_ASSERT(2 == g_TokenBackend.CallCount);
+    NSUDO_TEST_ASSERT(100 == M2GetTokenInformationSizeHint(g_TestClass));
+    NSUDO_TEST_ASSERT(NSudoTestCheckStatistics(0, 1));
+
+    // The next query tries the size hint first.
+    g_TokenBackend.CallCount = 0;
+    NSUDO_TEST_ASSERT(S_OK == M2GetTokenInformation(
+        &Information, INVALID_HANDLE_VALUE, g_TestClass));
+    M2FreeMemory(Information);
+    NSUDO_TEST_ASSERT(1 == g_TokenBackend.CallCount);
+    NSUDO_TEST_ASSERT(100 == g_TokenBackend.LastBufferLength);
+    NSUDO_TEST_ASSERT(NSudoTestCheckStatistics(1, 1));
+
+    // The other classes have no hint.
+    NSUDO_TEST_ASSERT(0 == M2GetTokenInformationSizeHint(TokenUser));
+    NSUDO_TEST_ASSERT(0 == M2GetTokenInformationSizeHint(
+        static_cast<TOKEN_INFORMATION_CLASS>(MaxTokenInfoClass)));
+}
+
+NSUDO_TEST(TokenInformationSizeHintRetriesWhenStale)
+{
+    CNSudoTestTokenBackendScope Scope(100);
+
+    PVOID Information = nullptr;
+    NSUDO_TEST_ASSERT(S_OK == M2GetTokenInformation(
+        &Information, INVALID_HANDLE_VALUE, g_TestClass));
+    M2FreeMemory(Information);
+
+    // The information grew, so the size hint fails once and the reported
+    // size is used without another size query.
+    g_TokenBackend.InformationSize = 300;
+    g_TokenBackend.CallCount = 0;
+    NSUDO_TEST_ASSERT(S_OK == M2GetTokenInformation(
+        &Information, INVALID_HANDLE_VALUE, g_TestClass));
+    M2FreeMemory(Information);
+    NSUDO_TEST_ASSERT(2 == g_TokenBackend.CallCount);
+    NSUDO_TEST_ASSERT(300 == g_TokenBackend.LastBufferLength);
+    NSUDO_TEST_ASSERT(300 == M2GetTokenInformationSizeHint(g_TestClass));
+    NSUDO_TEST_ASSERT(NSudoTestCheckStatistics(0, 2));
+
+    // The size hint only grows, so the smaller information still fits.
+    g_TokenBackend.InformationSize = 50;
+    NSUDO_TEST_ASSERT(S_OK == M2GetTokenInformation(
+        &Information, INVALID_HANDLE_VALUE, g_TestClass));
+    M2FreeMemory(Information);
+    NSUDO_TEST_ASSERT(300 == M2GetTokenInformationSizeHint(g_TestClass));
+    NSUDO_TEST_ASSERT(NSudoTestCheckStatistics(1, 2));
+}
+
+NSUDO_TEST(TokenInformationSizeHintIgnoresFailures)
+{
+    CNSudoTestTokenBackendScope Scope(100);
+    g_TokenBackend.Error = ERROR_ACCESS_DENIED;
+
+    PVOID Information = nullptr;
+    NSUDO_TEST_ASSERT(HRESULT_FROM_WIN32(ERROR_ACCESS_DENIED) ==
+        M2GetTokenInformation(&Information, INVALID_HANDLE_VALUE, g_TestClass));
+    NSUDO_TEST_ASSERT(nullptr == Information);
+
+    M2::CArena Arena;
+    NSUDO_TEST_ASSERT(HRESULT_FROM_WIN32(ERROR_ACCESS_DENIED) ==
+        M2GetTokenInformation(
+            &Information, INVALID_HANDLE_VALUE, g_TestClass, Arena));
+
+    M2::CTokenInfo<TOKEN_GROUPS> Groups;
+    NSUDO_TEST_ASSERT(HRESULT_FROM_WIN32(ERROR_ACCESS_DENIED) ==
+        Groups.Query(INVALID_HANDLE_VALUE, g_TestClass));
+    NSUDO_TEST_ASSERT(nullptr == Groups.Get());
+
+    NSUDO_TEST_ASSERT(0 == M2GetTokenInformationSizeHint(g_TestClass));
+    NSUDO_TEST_ASSERT(NSudoTestCheckStatistics(0, 0));
+}
+
+NSUDO_TEST(TokenInformationSizeHintIsUsedByArenaQueries)
+{
+    CNSudoTestTokenBackendScope Scope(100);
+
+    // The arena has no unused space, so the first query needs the size
+    // query.
+    M2::CArena Arena;
+    PVOID Information = nullptr;
+    NSUDO_TEST_ASSERT(S_OK == M2GetTokenInformation(
+        &Information, INVALID_HANDLE_VALUE, g_TestClass, Arena));
+    NSUDO_TEST_ASSERT(Information);
+    NSUDO_TEST_ASSERT(2 == g_TokenBackend.CallCount);
+    NSUDO_TEST_ASSERT(NSudoTestCheckStatistics(0, 1));
+
+    // The size hint is allocated from the arena first.
+    M2::CArena OtherArena;
+    g_TokenBackend.CallCount = 0;
+    NSUDO_TEST_ASSERT(S_OK == M2GetTokenInformation(
+        &Information, INVALID_HANDLE_VALUE, g_TestClass, OtherArena));
+    NSUDO_TEST_ASSERT(Information);
+    NSUDO_TEST_ASSERT(1 == g_TokenBackend.CallCount);
+    NSUDO_TEST_ASSERT(NSudoTestCheckStatistics(1, 1));
+}
+
+NSUDO_TEST(TokenInformationSizeHintIsUsedByTokenInfo)
+{
+    CNSudoTestTokenBackendScope Scope(32);
+
+    // The information fits in the inline buffer.
+    M2::CTokenInfo<TOKEN_GROUPS, 64> Groups;
+    NSUDO_TEST_ASSERT(S_OK == Groups.Query(INVALID_HANDLE_VALUE, g_TestClass));
+    NSUDO_TEST_ASSERT(Groups.Get());
+    NSUDO_TEST_ASSERT(1 == g_TokenBackend.CallCount);
+    NSUDO_TEST_ASSERT(64 == g_TokenBackend.LastBufferLength);
+    NSUDO_TEST_ASSERT(NSudoTestCheckStatistics(1, 0));
+
+    // The larger information moves to the heap buffer after one failed call.
+    g_TokenBackend.InformationSize = 200;
+    g_TokenBackend.CallCount = 0;
+    NSUDO_TEST_ASSERT(S_OK == Groups.Query(INVALID_HANDLE_VALUE, g_TestClass));
+    NSUDO_TEST_ASSERT(2 == g_TokenBackend.CallCount);
+    NSUDO_TEST_ASSERT(200 == g_TokenBackend.LastBufferLength);
+    NSUDO_TEST_ASSERT(NSudoTestCheckStatistics(1, 1));
+
+    TOKEN_GROUPS* HeapInformation = Groups.Get();
+
+    // The size hint is used at once, and the heap buffer is reused.
+    g_TokenBackend.CallCount = 0;
+    NSUDO_TEST_ASSERT(S_OK == Groups.Query(INVALID_HANDLE_VALUE, g_TestClass));
+    NSUDO_TEST_ASSERT(1 == g_TokenBackend.CallCount);
+    NSUDO_TEST_ASSERT(HeapInformation == Groups.Get());
+    NSUDO_TEST_ASSERT(NSudoTestCheckStatistics(2, 1));
+
+    // Another instance starts with the size hint too.
+    M2::CTokenInfo<TOKEN_GROUPS, 64> OtherGroups;
+    g_TokenBackend.CallCount = 0;
+    NSUDO_TEST_ASSERT(S_OK == OtherGroups.Query(
+        INVALID_HANDLE_VALUE, g_TestClass));
+    NSUDO_TEST_ASSERT(1 == g_TokenBackend.CallCount);
+    NSUDO_TEST_ASSERT(200 == g_TokenBackend.LastBufferLength);
+    NSUDO_TEST_ASSERT(NSudoTestCheckStatistics(3, 1));
+}
+
+namespace
+{
+    volatile LONG g_SingletonConstructionCount = 0;
+
+    /**
+     * The object whose construction is slow, which widens the race of the
+     * threads accessing the singleton for the first time.
+     */
+    struct CNSudoTestSlowObject
+    {
+        CNSudoTestSlowObject()
+        {
+            InterlockedIncrement(&g_SingletonConstructionCount);
+            Sleep(20);
+        }
+    };
+
+    /**
+     * Appends the record to the file specified by the environment variable
+     * NSUDO_TEST_SINGLETON_FILE, which only the child process of the
+     * DestroyOnExit test has.
+     */
+    void NSudoTestAppendExitRecord(
+        _In_ char Record)
+    {
+        wchar_t FilePath[MAX_PATH];
+        DWORD Length = GetEnvironmentVariableW(
+            L"NSUDO_TEST_SINGLETON_FILE", FilePath, MAX_PATH);
+        if (0 == Length || Length >= MAX_PATH)
+            return;
+
+        FILE* FileStream = nullptr;
+        if (0 == _wfopen_s(&FileStream, FilePath, L"ab"))
+        {
+            fputc(Record, FileStream);
+            fclose(FileStream);
+        }
+    }
+
+    template<char Record>
+    struct CNSudoTestExitObject
+    {
+        ~CNSudoTestExitObject()
+        {
+            NSudoTestAppendExitRecord(Record);
+        }
+    };
+}
+
+NSUDO_TEST(SingletonIsCreatedOnceByConcurrentGet)
+{
+    typedef M2::CSingleton<CNSudoTestSlowObject> CSlowSingleton;
+
+    const DWORD ThreadCount = 16;
+
+    volatile LONG Start = 0;
+    CNSudoTestSlowObject* Instances[ThreadCount] = { nullptr };
+
+    std::vector<HANDLE> Threads;
+    for (DWORD i = 0; i < ThreadCount; ++i)
+    {
+        HANDLE ThreadHandle = M2::CThread([&Start, &Instances, i]()
+        {
+            while (!Start)
+                YieldProcessor();
+
+            Instances[i] = &CSlowSingleton::Get();
+        }).Detach();
+        NSUDO_TEST_ASSERT(nullptr != ThreadHandle);
+        Threads.push_back(ThreadHandle);
+    }
+
+    InterlockedExchange(&Start, 1);
+
+    DWORD WaitResult = WaitForMultipleObjectsEx(
+        ThreadCount, Threads.data(), TRUE, 60 * 1000, FALSE);
+    for (HANDLE ThreadHandle : Threads)
+        CloseHandle(ThreadHandle);
+    NSUDO_TEST_ASSERT(WAIT_OBJECT_0 == WaitResult);
+
+    NSUDO_TEST_ASSERT(1 == g_SingletonConstructionCount);
+    for (CNSudoTestSlowObject* Instance : Instances)
+    {
+        NSUDO_TEST_ASSERT(&CSlowSingleton::Get() == Instance);
+    }
+}
+
+// The child process of SingletonDestroyOnExitRunsDestructors. It does nothing
+// in the normal runs of the tests.
+NSUDO_TEST(SingletonDestroyOnExitChild)
+{
+    if (!GetEnvironmentVariableW(L"NSUDO_TEST_SINGLETON_FILE", nullptr, 0))
+        return;
+
+    M2::CSingleton<CNSudoTestExitObject<'A'>, true>::Get();
+    M2::CSingleton<CNSudoTestExitObject<'B'>, true>::Get();
+    M2::CSingleton<CNSudoTestExitObject<'L'>>::Get();
+}
+
+NSUDO_TEST(SingletonDestroyOnExitRunsDestructors)
+{
+    CNSudoTestDirectory Directory;
+    std::wstring RecordFilePath = Directory.GetFilePath(L"Records.txt");
+    NSudoTestWriteFile(RecordFilePath, "");
+
+    NSUDO_TEST_ASSERT(0 == NSudoTestRunChildProcess(
+        L"SingletonDestroyOnExitChild",
+        L"NSUDO_TEST_SINGLETON_FILE",
+        RecordFilePath));
+
+    // The instances are destroyed in the reverse order of construction, and
+    // the instance without DestroyOnExit is not destroyed.
+    NSUDO_TEST_ASSERT("BA" == NSudoTestReadFile(RecordFilePath));
+}
+
+namespace
+{
+    /**
+     * A counter value and the nanoseconds it converts to. The values are
+     * computed with 128-bit integers, and the counts are large enough that
+     * multiplying them by 10^9 first overflows 64 bits.
+     */
+    struct NSUDO_TEST_CLOCK_CASE
+    {
+        ULONGLONG Frequency;
+        ULONGLONG PerformanceCount;
+        ULONGLONG Nanoseconds;
+    };
+
+    // The count of each case is 1000 days plus the frequency minus one.
+    const NSUDO_TEST_CLOCK_CASE g_ClockCases[] =
+    {
+        { 3579545, 309272688000000 + 3579544, 86400000999999720 },
+        { 14318180, 1237090752000000 + 14318179, 86400000999999930 },
+        { 2441406, 210937478400000 + 2441405, 86400000999999590 },
+        { 10000000, 864000000000000 + 9999999, 86400000999999900 },
+        { 24000000, 2073600000000000 + 23999999, 86400000999999958 },
+    };
+}
+
+NSUDO_TEST(PerformanceCountConversionDoesNotOverflow)
+{
+    for (const NSUDO_TEST_CLOCK_CASE& Case : g_ClockCases)
+    {
+        NSUDO_TEST_ASSERT(Case.Nanoseconds ==
+            M2ConvertPerformanceCountToNanoseconds(
+                Case.PerformanceCount, Case.Frequency));
+
+        // One count less than a whole second is rounded down.
+        ULONGLONG AlmostOneSecond = M2ConvertPerformanceCountToNanoseconds(
+            Case.Frequency - 1, Case.Frequency);
+        NSUDO_TEST_ASSERT(AlmostOneSecond < 1000000000);
+        NSUDO_TEST_ASSERT(
+            999999999 - 1000000000 / Case.Frequency <= AlmostOneSecond);
+        NSUDO_TEST_ASSERT(1000000000 == M2ConvertPerformanceCountToNanoseconds(
+            Case.Frequency, Case.Frequency));
+        NSUDO_TEST_ASSERT(0 == M2ConvertPerformanceCountToNanoseconds(
+            0, Case.Frequency));
+    }
+}
+
+NSUDO_TEST(PerformanceCountConversionIsMonotonic)
+{
+    // The conversion must not step back where the remainder wraps at the
+    // second boundaries.
+    for (const NSUDO_TEST_CLOCK_CASE& Case : g_ClockCases)
+    {
+        ULONGLONG Boundary = Case.PerformanceCount + 1;
+
+        ULONGLONG Previous = M2ConvertPerformanceCountToNanoseconds(
+            Boundary - 1000, Case.Frequency);
+        for (ULONGLONG Count = Boundary - 999; Count < Boundary + 1000; ++Count)
+        {
+            ULONGLONG Current = M2ConvertPerformanceCountToNanoseconds(
+                Count, Case.Frequency);
+            NSUDO_TEST_ASSERT(Previous <= Current);
+            Previous = Current;
+        }
+    }
+
+    ULONGLONG Previous = M2GetNanosecondCount();
+    for (int i = 0; i < 100000; ++i)
+    {
+        ULONGLONG Current = M2GetNanosecondCount();
+        NSUDO_TEST_ASSERT(Previous <= Current);
+        Previous = Current;
+    }
+}
+
+NSUDO_TEST(TickCountAgreesWithGetTickCount64)
+{
+    // The two clocks may disagree on the time spent in sleep or hibernation
+    // before the test, so only the elapsed times are compared. The tolerance
+    // covers the resolution of GetTickCount64, which is the timer tick.
+    const ULONGLONG Tolerance = 50;
+
+    ULONGLONG StartTickCount = M2GetTickCount();
+    ULONGLONG StartTickCount64 = GetTickCount64();
+
+    Sleep(500);
+
+    ULONGLONG Elapsed = M2GetTickCount() - StartTickCount;
+    ULONGLONG Elapsed64 = GetTickCount64() - StartTickCount64;
+
+    NSUDO_TEST_ASSERT(Elapsed >= 500);
+    NSUDO_TEST_ASSERT(Elapsed + Tolerance >= Elapsed64);
+    NSUDO_TEST_ASSERT(Elapsed64 + Tolerance >= Elapsed);
+}
+
+namespace
+{
+    // The size of the overflow block header, which is padded to the
+    // alignment.
+    const SIZE_T g_ArenaHeaderSize = MEMORY_ALLOCATION_ALIGNMENT;
+
+    bool NSudoTestIsAligned(
+        _In_ PVOID Block)
+    {
+        return 0 == (reinterpret_cast<ULONG_PTR>(Block) %
+            MEMORY_ALLOCATION_ALIGNMENT);
+    }
+
+    /**
+     * Checks that the blocks of odd sizes are aligned and do not overlap.
+     */
+    void NSudoTestCheckArenaAlignment(
+        _In_ M2::CArena& Arena)
+    {
+        std::vector<std::pair<PBYTE, PBYTE>> Blocks;
+
+        for (SIZE_T Size = 1; Size < 4096; Size = Size * 3 + 1)
+        {
+            PVOID Block = nullptr;
+            NSUDO_TEST_ASSERT(S_OK == Arena.Allocate(&Block, Size));
+            NSUDO_TEST_ASSERT(Block);
+            NSUDO_TEST_ASSERT(NSudoTestIsAligned(Block));
+
+            PBYTE Begin = reinterpret_cast<PBYTE>(Block);
+            PBYTE End = Begin + Size;
+            for (auto& Previous : Blocks)
+            {
+                NSUDO_TEST_ASSERT(
+                    End <= Previous.first || Begin >= Previous.second);
+            }
+            Blocks.push_back(std::make_pair(Begin, End));
+
+            memset(Block, 0xA5, Size);
+        }
+
+        // An empty block is aligned as well.
+        PVOID Block = nullptr;
+        NSUDO_TEST_ASSERT(S_OK == Arena.Allocate(&Block, 0));
+        NSUDO_TEST_ASSERT(NSudoTestIsAligned(Block));
+    }
+
+    /**
+     * Fills the current block, and allocates one byte to start an overflow
+     * block. The size of the new block is the allocated byte padded to the
+     * alignment, the header and the space which is left.
+     */
+    SIZE_T NSudoTestAllocateOverflowBlock(
+        _In_ M2::CArena& Arena)
+    {
+        PVOID Available = nullptr;
+        SIZE_T AvailableSize = 0;
+        Arena.GetAvailableSpace(&Available, &AvailableSize);
+
+        PVOID Block = nullptr;
+        if (Available)
+        {
+            NSUDO_TEST_ASSERT(S_OK == Arena.Allocate(&Block, AvailableSize));
+            NSUDO_TEST_ASSERT(Available == Block);
+        }
+
+        NSUDO_TEST_ASSERT(S_OK == Arena.Allocate(&Block, 1));
+        NSUDO_TEST_ASSERT(NSudoTestIsAligned(Block));
+        NSUDO_TEST_ASSERT(Available != Block);
+
+        Arena.GetAvailableSpace(&Available, &AvailableSize);
+        NSUDO_TEST_ASSERT(
+            reinterpret_cast<PBYTE>(Block) + MEMORY_ALLOCATION_ALIGNMENT ==
+            Available);
+
+        return g_ArenaHeaderSize + MEMORY_ALLOCATION_ALIGNMENT + AvailableSize;
+    }
+
+    /**
+     * Checks that the overflow blocks double from 4 KiB, and stay at 1 MiB.
+     */
+    void NSudoTestCheckArenaOverflowBlocks(
+        _In_ M2::CArena& Arena)
+    {
+        SIZE_T ExpectedSize = 4096;
+        for (int i = 0; i < 12; ++i)
+        {
+            NSUDO_TEST_ASSERT(
+                ExpectedSize == NSudoTestAllocateOverflowBlock(Arena));
+            if (ExpectedSize < 1024 * 1024)
+                ExpectedSize *= 2;
+        }
+        NSUDO_TEST_ASSERT(1024 * 1024 == ExpectedSize);
+    }
+}
+
+NSUDO_TEST(ArenaBlocksAreAligned)
+{
+    M2::CArena Arena;
+    NSudoTestCheckArenaAlignment(Arena);
+
+    // The size of the buffer is not a multiple of the alignment.
+    M2::CStackArena<100> StackArena;
+    NSudoTestCheckArenaAlignment(StackArena);
+
+    // A block larger than the next overflow block gets its own block.
+    PVOID Block = nullptr;
+    NSUDO_TEST_ASSERT(S_OK == Arena.Allocate(&Block, 3 * 1024 * 1024));
+    NSUDO_TEST_ASSERT(NSudoTestIsAligned(Block));
+    memset(Block, 0xA5, 3 * 1024 * 1024);
+
+    NSUDO_TEST_ASSERT(FAILED(Arena.Allocate(&Block, MAXSIZE_T)));
+    NSUDO_TEST_ASSERT(nullptr == Block);
+}
+
+NSUDO_TEST(ArenaOverflowBlocksDoubleUpToTheCap)
+{
+    M2::CArena Arena;
+    NSudoTestCheckArenaOverflowBlocks(Arena);
+
+    // The initial buffer is not an overflow block, so the first overflow
+    // block of a stack arena is the smallest one.
+    M2::CStackArena<256> StackArena;
+    NSudoTestCheckArenaOverflowBlocks(StackArena);
+}
+
+NSUDO_TEST(ArenaResetRestoresTheInitialBuffer)
+{
+    M2::CStackArena<256> Arena;
+
+    PVOID InitialBlock = nullptr;
+    NSUDO_TEST_ASSERT(S_OK == Arena.Allocate(&InitialBlock, 16));
+    NSUDO_TEST_ASSERT(reinterpret_cast<PBYTE>(InitialBlock) >=
+        reinterpret_cast<PBYTE>(&Arena));
+    NSUDO_TEST_ASSERT(reinterpret_cast<PBYTE>(InitialBlock) <
+        reinterpret_cast<PBYTE>(&Arena) + sizeof(Arena));
+
+    NSudoTestAllocateOverflowBlock(Arena);
+    NSudoTestAllocateOverflowBlock(Arena);
+
+    Arena.Reset();
+
+    PVOID Available = nullptr;
+    SIZE_T AvailableSize = 0;
+    Arena.GetAvailableSpace(&Available, &AvailableSize);
+    NSUDO_TEST_ASSERT(InitialBlock == Available);
+    NSUDO_TEST_ASSERT(256 == AvailableSize);
+
+    PVOID Block = nullptr;
+    NSUDO_TEST_ASSERT(S_OK == Arena.Allocate(&Block, 16));
+    NSUDO_TEST_ASSERT(InitialBlock == Block);
+
+    // The overflow blocks start from the smallest size again.
+    NSUDO_TEST_ASSERT(4096 == NSudoTestAllocateOverflowBlock(Arena));
+
+    // The arena without a buffer has no space after the reset.
+    M2::CArena HeapArena;
+    NSudoTestAllocateOverflowBlock(HeapArena);
+    HeapArena.Reset();
+    HeapArena.GetAvailableSpace(&Available, &AvailableSize);
+    NSUDO_TEST_ASSERT(nullptr == Available);
+    NSUDO_TEST_ASSERT(0 == AvailableSize);
+    NSUDO_TEST_ASSERT(4096 == NSudoTestAllocateOverflowBlock(HeapArena));
+}
+
+NSUDO_TEST(ArenaAndAllocMemorySkipZeroing)
+{
+    const SIZE_T Size = 256;
+
+    // The arena does not zero the blocks, so the reused buffer keeps the old
+    // content.
+    M2::CStackArena<Size> Arena;
+    PVOID Block = nullptr;
+    NSUDO_TEST_ASSERT(S_OK == Arena.Allocate(&Block, Size));
+    memset(Block, 0xA5, Size);
+    Arena.Reset();
+    NSUDO_TEST_ASSERT(S_OK == Arena.Allocate(&Block, Size));
+    for (SIZE_T i = 0; i < Size; ++i)
+    {
+        NSUDO_TEST_ASSERT(0xA5 == reinterpret_cast<PBYTE>(Block)[i]);
+    }
+
+    // The heap usually gives the block which was freed last to the next
+    // allocation of the same size. The heap may reuse the start of the freed
+    // block for its own data, so only the end of the block is checked, and
+    // the heap may give another block, so only one of the tries must see the
+    // old content.
+    bool IsOldContentSeen = false;
+    for (int i = 0; i < 16 && !IsOldContentSeen; ++i)
+    {
+        NSUDO_TEST_ASSERT(S_OK == M2AllocMemory(&Block, Size, false));
+        memset(Block, 0xA5, Size);
+        NSUDO_TEST_ASSERT(S_OK == M2FreeMemory(Block));
+
+        NSUDO_TEST_ASSERT(S_OK == M2AllocMemory(&Block, Size, false));
+        IsOldContentSeen =
+            0xA5 == reinterpret_cast<PBYTE>(Block)[Size - 1] &&
+            0xA5 == reinterpret_cast<PBYTE>(Block)[Size / 2];
+        NSUDO_TEST_ASSERT(S_OK == M2FreeMemory(Block));
+    }
+    NSUDO_TEST_ASSERT(IsOldContentSeen);
+
+    // The reused block is zeroed by default.
+    for (int i = 0; i < 16; ++i)
+    {
+        NSUDO_TEST_ASSERT(S_OK == M2AllocMemory(&Block, Size, false));
+        memset(Block, 0xA5, Size);
+        NSUDO_TEST_ASSERT(S_OK == M2FreeMemory(Block));
+
+        NSUDO_TEST_ASSERT(S_OK == M2AllocMemory(&Block, Size));
+        for (SIZE_T j = 0; j < Size; ++j)
+        {
+            NSUDO_TEST_ASSERT(0 == reinterpret_cast<PBYTE>(Block)[j]);
+        }
+        NSUDO_TEST_ASSERT(S_OK == M2FreeMemory(Block));
+    }
+}
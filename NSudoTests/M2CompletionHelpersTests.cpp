@@ -0,0 +1,324 @@
+﻿/*
+ * PROJECT:   NSudo
+ * FILE:      M2CompletionHelpersTests.cpp
+ * PURPOSE:   Unit tests for the I/O completion port engine
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#include "stdafx.h"
+
+#include <string>
+
+namespace
+{
+    /**
+     * The result of a completion, which is recorded by its callback.
+     */
+    struct CNSudoTestCompletion
+    {
+        bool IsCompleted = false;
+        HRESULT Result = E_PENDING;
+        DWORD NumberOfBytesTransferred = 0;
+        std::string Data;
+
+        M2::CCompletionCallback GetCallback()
+        {
+            return [this](HRESULT Result, DWORD Size, LPVOID Buffer)
+            {
+                this->IsCompleted = true;
+                this->Result = Result;
+                this->NumberOfBytesTransferred = Size;
+                if (Buffer && Size)
+                    this->Data.assign(static_cast<char*>(Buffer), Size);
+            };
+        }
+    };
+
+    /**
+     * Processes the completions until the completion is recorded. The test
+     * case fails if it does not complete in ten seconds.
+     */
+    void NSudoTestWaitCompletion(
+        _In_ M2::CCompletionEngine& Engine,
+        _In_ const CNSudoTestCompletion& Completion)
+    {
+        ULONGLONG StartTime = GetTickCount64();
+        while (!Completion.IsCompleted)
+        {
+            NSUDO_TEST_ASSERT(GetTickCount64() - StartTime < 10 * 1000);
+
+            DWORD CompletedCount = 0;
+            NSUDO_TEST_ASSERT(S_OK == Engine.ProcessCompletions(
+                100, &CompletedCount));
+        }
+    }
+
+    HANDLE NSudoTestCreateOverlappedFile(
+        _In_ const std::wstring& FilePath)
+    {
+        HANDLE FileHandle = CreateFileW(
+            FilePath.c_str(),
+            GENERIC_READ | GENERIC_WRITE,
+            0,
+            nullptr,
+            CREATE_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED,
+            nullptr);
+        NSUDO_TEST_ASSERT(INVALID_HANDLE_VALUE != FileHandle);
+        return FileHandle;
+    }
+
+    /**
+     * Creates both ends of an overlapped named pipe with a unique name.
+     *
+     * @param PipeMode The type and the read mode of the pipe.
+     */
+    void NSudoTestCreateOverlappedPipe(
+        _In_ DWORD PipeMode,
+        _Out_ M2::CHandle& ServerHandle,
+        _Out_ M2::CHandle& ClientHandle)
+    {
+        wchar_t PipeName[64];
+        swprintf_s(
+            PipeName,
+            L"\\\\.\\pipe\\NSudoTests.%lu.%llu",
+            GetCurrentProcessId(),
+            M2GetPerformanceCounter());
+
+        ServerHandle = CreateNamedPipeW(
+            PipeName,
+            PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+            PipeMode | PIPE_WAIT,
+            1,
+            4096,
+            4096,
+            0,
+            nullptr);
+        NSUDO_TEST_ASSERT(!ServerHandle.IsInvalid());
+
+        ClientHandle = CreateFileW(
+            PipeName,
+            GENERIC_READ | GENERIC_WRITE,
+            0,
+            nullptr,
+            OPEN_EXISTING,
+            FILE_FLAG_OVERLAPPED,
+            nullptr);
+        NSUDO_TEST_ASSERT(!ClientHandle.IsInvalid());
+
+        if (PIPE_READMODE_MESSAGE & PipeMode)
+        {
+            DWORD ClientMode = PIPE_READMODE_MESSAGE;
+            NSUDO_TEST_ASSERT(SetNamedPipeHandleState(
+                ClientHandle, &ClientMode, nullptr, nullptr));
+        }
+    }
+}
+
+NSUDO_TEST(CompletionEngineRunsPostedCallbacks)
+{
+    M2::CCompletionEngine Engine;
+
+    CNSudoTestCompletion Completion;
+    NSUDO_TEST_ASSERT(S_OK == Engine.Post(Completion.GetCallback()));
+
+    NSudoTestWaitCompletion(Engine, Completion);
+    NSUDO_TEST_ASSERT(S_OK == Completion.Result);
+
+    // Nothing is left, so the next call times out without a completion.
+    DWORD CompletedCount = 1;
+    NSUDO_TEST_ASSERT(S_OK == Engine.ProcessCompletions(0, &CompletedCount));
+    NSUDO_TEST_ASSERT(0 == CompletedCount);
+}
+
+NSUDO_TEST(CompletionEngineCompletesFileOperations)
+{
+    CNSudoTestDirectory Directory;
+    M2::CHandle FileHandle = NSudoTestCreateOverlappedFile(
+        Directory.GetFilePath(L"Completion.bin"));
+
+    M2::CCompletionEngine Engine;
+    NSUDO_TEST_ASSERT(S_OK == Engine.Associate(FileHandle));
+
+    // Associating again is not an error.
+    NSUDO_TEST_ASSERT(S_OK == Engine.Associate(FileHandle));
+
+    {
+        // The data fits in the buffer of the operation, so the caller buffer
+        // can be freed before the write completes.
+        CNSudoTestCompletion Write;
+        std::string Data = "Hello, NSudo";
+        NSUDO_TEST_ASSERT(S_OK == Engine.SubmitWrite(
+            FileHandle,
+            Data.data(),
+            static_cast<DWORD>(Data.size()),
+            0,
+            Write.GetCallback()));
+        Data.assign(Data.size(), '\0');
+
+        NSudoTestWaitCompletion(Engine, Write);
+        NSUDO_TEST_ASSERT(S_OK == Write.Result);
+        NSUDO_TEST_ASSERT(12 == Write.NumberOfBytesTransferred);
+    }
+
+    {
+        CNSudoTestCompletion Read;
+        NSUDO_TEST_ASSERT(S_OK == Engine.SubmitRead(
+            FileHandle, nullptr, 5, 7, Read.GetCallback()));
+
+        NSudoTestWaitCompletion(Engine, Read);
+        NSUDO_TEST_ASSERT(S_OK == Read.Result);
+        NSUDO_TEST_ASSERT("NSudo" == Read.Data);
+    }
+
+    {
+        // The failure of the operation is reported to the callback.
+        CNSudoTestCompletion Read;
+        HRESULT hr = Engine.SubmitRead(
+            FileHandle, nullptr, 5, 100, Read.GetCallback());
+        if (S_OK == hr)
+        {
+            NSudoTestWaitCompletion(Engine, Read);
+            hr = Read.Result;
+        }
+        NSUDO_TEST_ASSERT(HRESULT_FROM_WIN32(ERROR_HANDLE_EOF) == hr);
+    }
+
+    {
+        CNSudoTestCompletion Read;
+        NSUDO_TEST_ASSERT(E_INVALIDARG == Engine.SubmitRead(
+            FileHandle,
+            nullptr,
+            M2_COMPLETION_INLINE_BUFFER_SIZE + 1,
+            0,
+            Read.GetCallback()));
+        NSUDO_TEST_ASSERT(!Read.IsCompleted);
+    }
+}
+
+NSUDO_TEST(CompletionEngineRejectsUnassociatedHandles)
+{
+    CNSudoTestDirectory Directory;
+    M2::CHandle FileHandle = NSudoTestCreateOverlappedFile(
+        Directory.GetFilePath(L"Unassociated.bin"));
+
+    M2::CCompletionEngine Engine;
+
+    CNSudoTestCompletion Completion;
+    NSUDO_TEST_ASSERT(HRESULT_FROM_WIN32(ERROR_INVALID_HANDLE) ==
+        Engine.SubmitWrite(FileHandle, "A", 1, 0, Completion.GetCallback()));
+    NSUDO_TEST_ASSERT(HRESULT_FROM_WIN32(ERROR_INVALID_HANDLE) ==
+        Engine.SubmitRead(FileHandle, nullptr, 1, 0, Completion.GetCallback()));
+
+    DWORD CompletedCount = 0;
+    NSUDO_TEST_ASSERT(S_OK == Engine.ProcessCompletions(0, &CompletedCount));
+    NSUDO_TEST_ASSERT(0 == CompletedCount);
+    NSUDO_TEST_ASSERT(!Completion.IsCompleted);
+}
+
+NSUDO_TEST(CompletionEngineReportsCanceledReads)
+{
+    M2::CHandle ServerHandle;
+    M2::CHandle ClientHandle;
+    NSudoTestCreateOverlappedPipe(
+        PIPE_TYPE_BYTE | PIPE_READMODE_BYTE, ServerHandle, ClientHandle);
+
+    M2::CCompletionEngine Engine;
+    NSUDO_TEST_ASSERT(S_OK == Engine.Associate(ServerHandle));
+
+    // Nobody writes to the pipe, so the read stays pending until it is
+    // canceled, and the callback is still called once.
+    CNSudoTestCompletion Read;
+    NSUDO_TEST_ASSERT(S_OK == Engine.SubmitRead(
+        ServerHandle, nullptr, 16, 0, Read.GetCallback()));
+
+    DWORD CompletedCount = 0;
+    NSUDO_TEST_ASSERT(S_OK == Engine.ProcessCompletions(0, &CompletedCount));
+    NSUDO_TEST_ASSERT(!Read.IsCompleted);
+
+    NSUDO_TEST_ASSERT(CancelIoEx(ServerHandle, nullptr));
+
+    NSudoTestWaitCompletion(Engine, Read);
+    NSUDO_TEST_ASSERT(
+        HRESULT_FROM_WIN32(ERROR_OPERATION_ABORTED) == Read.Result);
+    NSUDO_TEST_ASSERT(0 == Read.NumberOfBytesTransferred);
+}
+
+NSUDO_TEST(CompletionEngineReportsPartialMessageReads)
+{
+    M2::CHandle ServerHandle;
+    M2::CHandle ClientHandle;
+    NSudoTestCreateOverlappedPipe(
+        PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE, ServerHandle, ClientHandle);
+
+    M2::CCompletionEngine Engine;
+    NSUDO_TEST_ASSERT(S_OK == Engine.Associate(ServerHandle));
+
+    const std::string Message = "0123456789ABCDEF";
+
+    DWORD NumberOfBytesWritten = 0;
+    OVERLAPPED Overlapped = { 0 };
+    if (!WriteFile(
+        ClientHandle,
+        Message.data(),
+        static_cast<DWORD>(Message.size()),
+        &NumberOfBytesWritten,
+        &Overlapped))
+    {
+        NSUDO_TEST_ASSERT(ERROR_IO_PENDING == GetLastError());
+        NSUDO_TEST_ASSERT(GetOverlappedResult(
+            ClientHandle, &Overlapped, &NumberOfBytesWritten, TRUE));
+    }
+    NSUDO_TEST_ASSERT(Message.size() == NumberOfBytesWritten);
+
+    // The message is longer than the read, so ReadFile fails with
+    // ERROR_MORE_DATA and still queues the completion. The operation must
+    // stay owned by the port until the completion is processed.
+    CNSudoTestCompletion First;
+    NSUDO_TEST_ASSERT(S_OK == Engine.SubmitRead(
+        ServerHandle, nullptr, 10, 0, First.GetCallback()));
+
+    NSudoTestWaitCompletion(Engine, First);
+    NSUDO_TEST_ASSERT(HRESULT_FROM_WIN32(ERROR_MORE_DATA) == First.Result);
+    NSUDO_TEST_ASSERT(10 == First.NumberOfBytesTransferred);
+    NSUDO_TEST_ASSERT("0123456789" == First.Data);
+
+    CNSudoTestCompletion Rest;
+    NSUDO_TEST_ASSERT(S_OK == Engine.SubmitRead(
+        ServerHandle, nullptr, 10, 0, Rest.GetCallback()));
+
+    NSudoTestWaitCompletion(Engine, Rest);
+    NSUDO_TEST_ASSERT(S_OK == Rest.Result);
+    NSUDO_TEST_ASSERT("ABCDEF" == Rest.Data);
+
+    // No completion is left behind by the partial read.
+    DWORD CompletedCount = 1;
+    NSUDO_TEST_ASSERT(S_OK == Engine.ProcessCompletions(0, &CompletedCount));
+    NSUDO_TEST_ASSERT(0 == CompletedCount);
+}
+
+NSUDO_TEST(CompletionEngineCompletesWaits)
+{
+    M2::CHandle SignaledEvent = CreateEventW(nullptr, TRUE, TRUE, nullptr);
+    M2::CHandle UnsignaledEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    NSUDO_TEST_ASSERT(SignaledEvent && UnsignaledEvent);
+
+    M2::CCompletionEngine Engine;
+
+    CNSudoTestCompletion Signaled;
+    NSUDO_TEST_ASSERT(S_OK == Engine.SubmitWait(
+        SignaledEvent, INFINITE, Signaled.GetCallback()));
+
+    CNSudoTestCompletion TimedOut;
+    NSUDO_TEST_ASSERT(S_OK == Engine.SubmitWait(
+        UnsignaledEvent, 10, TimedOut.GetCallback()));
+
+    NSudoTestWaitCompletion(Engine, Signaled);
+    NSudoTestWaitCompletion(Engine, TimedOut);
+
+    NSUDO_TEST_ASSERT(S_OK == Signaled.Result);
+    NSUDO_TEST_ASSERT(HRESULT_FROM_WIN32(ERROR_TIMEOUT) == TimedOut.Result);
+}
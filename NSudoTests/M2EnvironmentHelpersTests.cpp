@@ -0,0 +1,405 @@
+﻿/*
+ * PROJECT:   NSudo
+ * FILE:      M2EnvironmentHelpersTests.cpp
+ * PURPOSE:   Unit tests for the environment blocks and their cache
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#include "stdafx.h"
+
+#include <string>
+#include <vector>
+
+namespace
+{
+    /**
+     * Makes an environment block from the "Name=Value" strings.
+     */
+    std::vector<wchar_t> NSudoTestMakeEnvironmentBlock(
+        _In_ const std::vector<std::wstring>& Variables)
+    {
+        std::vector<wchar_t> Block;
+
+        for (const std::wstring& Variable : Variables)
+        {
+            Block.insert(Block.end(), Variable.begin(), Variable.end());
+            Block.push_back(L'\0');
+        }
+        Block.push_back(L'\0');
+
+        return Block;
+    }
+
+    /**
+     * Makes an environment block from the environment of the current process,
+     * which is the one read by the ExpandEnvironmentStrings function.
+     */
+    std::vector<wchar_t> NSudoTestGetProcessEnvironmentBlock()
+    {
+        std::vector<wchar_t> Block;
+
+        LPWCH Environment = GetEnvironmentStringsW();
+        NSUDO_TEST_ASSERT(Environment);
+
+        const wchar_t* End = Environment;
+        while (End[0] || End[1])
+            ++End;
+
+        Block.assign(Environment, End + 2);
+
+        FreeEnvironmentStringsW(Environment);
+
+        return Block;
+    }
+
+    // The time returned by the stub clock.
+    ULONGLONG g_StubTime = 0;
+
+    // The number of the blocks created by the stub creator.
+    DWORD g_StubCreationCount = 0;
+
+    // The error returned by the stub creator.
+    HRESULT g_StubCreationResult = S_OK;
+
+    ULONGLONG NSudoTestGetStubTime()
+    {
+        return g_StubTime;
+    }
+
+    /**
+     * Creates a block whose "Generation" variable is the number of the
+     * blocks created so far.
+     */
+    HRESULT NSudoTestCreateStubEnvironmentBlock(
+        _Out_ std::vector<wchar_t>& Block,
+        _In_opt_ HANDLE TokenHandle,
+        _In_ bool Inherit)
+    {
+        UNREFERENCED_PARAMETER(TokenHandle);
+
+        Block.clear();
+
+        if (FAILED(g_StubCreationResult))
+            return g_StubCreationResult;
+
+        ++g_StubCreationCount;
+
+        Block = NSudoTestMakeEnvironmentBlock({
+            L"Generation=" + std::to_wstring(g_StubCreationCount),
+            std::wstring(L"Inherit=") + (Inherit ? L"1" : L"0") });
+
+        return S_OK;
+    }
+
+    void NSudoTestResetStubCreator()
+    {
+        g_StubTime = 1000;
+        g_StubCreationCount = 0;
+        g_StubCreationResult = S_OK;
+    }
+
+    /**
+     * Gets the value of the variable, or "<undefined>".
+     */
+    std::wstring NSudoTestFind(
+        _In_ const M2::CEnvironmentBlock& Block,
+        _In_ std::wstring_view Name)
+    {
+        std::wstring_view Value;
+        if (!Block.Find(Name, Value))
+            return L"<undefined>";
+
+        return std::wstring(Value);
+    }
+
+    std::wstring NSudoTestExpand(
+        _In_ const M2::CEnvironmentBlock& Block,
+        _In_ const std::wstring& Source)
+    {
+        std::wstring ExpandedString;
+        NSUDO_TEST_ASSERT(S_OK == Block.ExpandStrings(ExpandedString, Source));
+        return ExpandedString;
+    }
+}
+
+#pragma region CEnvironmentBlock
+
+NSUDO_TEST(EnvironmentBlockFindsVariables)
+{
+    M2::CEnvironmentBlock Block(NSudoTestMakeEnvironmentBlock({
+        L"=C:=C:\\Windows",
+        L"=ExitCode=00000000",
+        L"Path=C:\\Windows",
+        L"PATHEXT=.COM;.EXE",
+        L"Empty=",
+        L"Equals=A=B",
+        L"path=C:\\Duplicate",
+        L"NoSeparator" }));
+
+    NSUDO_TEST_ASSERT(L"C:\\Windows" == NSudoTestFind(Block, L"=C:"));
+    NSUDO_TEST_ASSERT(L"00000000" == NSudoTestFind(Block, L"=ExitCode"));
+
+    // The names are case-insensitive, and the first definition wins.
+    NSUDO_TEST_ASSERT(L"C:\\Windows" == NSudoTestFind(Block, L"PATH"));
+    NSUDO_TEST_ASSERT(L".COM;.EXE" == NSudoTestFind(Block, L"PathExt"));
+
+    NSUDO_TEST_ASSERT(L"" == NSudoTestFind(Block, L"Empty"));
+    NSUDO_TEST_ASSERT(L"A=B" == NSudoTestFind(Block, L"Equals"));
+
+    NSUDO_TEST_ASSERT(L"<undefined>" == NSudoTestFind(Block, L"Pat"));
+    NSUDO_TEST_ASSERT(L"<undefined>" == NSudoTestFind(Block, L"NoSeparator"));
+    NSUDO_TEST_ASSERT(L"<undefined>" == NSudoTestFind(Block, L"=D:"));
+    NSUDO_TEST_ASSERT(L"<undefined>" == NSudoTestFind(Block, L""));
+}
+
+NSUDO_TEST(EnvironmentBlockAcceptsUnterminatedBlocks)
+{
+    std::vector<wchar_t> Variables = { L'A', L'=', L'1' };
+
+    M2::CEnvironmentBlock Block(std::move(Variables), 42);
+
+    NSUDO_TEST_ASSERT(L"1" == NSudoTestFind(Block, L"A"));
+    NSUDO_TEST_ASSERT(42 == Block.GetCreationTime());
+
+    const wchar_t* Raw = static_cast<const wchar_t*>(Block.Get());
+    NSUDO_TEST_ASSERT(0 == wcscmp(Raw, L"A=1"));
+    NSUDO_TEST_ASSERT(L'\0' == Raw[4]);
+}
+
+NSUDO_TEST(EnvironmentBlockExpandsStrings)
+{
+    M2::CEnvironmentBlock Block(NSudoTestMakeEnvironmentBlock({
+        L"=C:=C:\\Windows",
+        L"SystemRoot=C:\\Windows",
+        L"Percent=%SystemRoot%",
+        L"Empty=" }));
+
+    NSUDO_TEST_ASSERT(
+        L"C:\\Windows\\System32" ==
+        NSudoTestExpand(Block, L"%systemroot%\\System32"));
+    NSUDO_TEST_ASSERT(L"C:\\Windows" == NSudoTestExpand(Block, L"%=C:%"));
+    NSUDO_TEST_ASSERT(L"[]" == NSudoTestExpand(Block, L"[%Empty%]"));
+
+    // The values are not expanded again.
+    NSUDO_TEST_ASSERT(
+        L"%SystemRoot%" == NSudoTestExpand(Block, L"%Percent%"));
+
+    // The undefined variables are left unchanged.
+    NSUDO_TEST_ASSERT(L"%Undefined%" == NSudoTestExpand(Block, L"%Undefined%"));
+    NSUDO_TEST_ASSERT(L"%%" == NSudoTestExpand(Block, L"%%"));
+    NSUDO_TEST_ASSERT(L"100%" == NSudoTestExpand(Block, L"100%"));
+
+    // The closing "%" of an undefined variable opens the next one.
+    NSUDO_TEST_ASSERT(
+        L"%UndefinedC:\\Windows" ==
+        NSudoTestExpand(Block, L"%Undefined%SystemRoot%"));
+}
+
+NSUDO_TEST(EnvironmentBlockMatchesExpandEnvironmentStrings)
+{
+    struct
+    {
+        LPCWSTR Name;
+        LPCWSTR Value;
+    } Variables[] =
+    {
+        { L"NSUDO_TEST_A", L"Alpha" },
+        { L"NSudoTestMixedCase", L"Mixed" },
+        { L"NSUDO TEST SPACE", L"Space" },
+        { L"NSUDO_TEST_PERCENT", L"%NSUDO_TEST_A%" },
+        { L"NSUDO_TEST_EMPTY", L"" },
+        // The per-drive current directory is set the same way as cmd.exe.
+        { L"=Q:", L"Q:\\NSudo" },
+    };
+
+    for (const auto& Variable : Variables)
+    {
+        SetEnvironmentVariableW(Variable.Name, Variable.Value);
+    }
+
+    LPCWSTR Sources[] =
+    {
+        L"",
+        L"Plain",
+        L"%NSUDO_TEST_A%",
+        L"[%nsudo_test_a%]",
+        L"%NSUDOTESTMIXEDCASE%",
+        L"%NSUDO TEST SPACE%",
+        L"%NSUDO_TEST_PERCENT%",
+        L"[%NSUDO_TEST_EMPTY%]",
+        L"%=Q:%\\Work",
+        L"%NSUDO_TEST_UNDEFINED%",
+        L"%NSUDO_TEST_UNDEFINED%NSUDO_TEST_A%",
+        L"%NSUDO_TEST_A%NSUDO_TEST_A%",
+        L"%NSUDO_TEST_A%%NSUDO_TEST_A%",
+        L"%%",
+        L"A%%B",
+        L"%%NSUDO_TEST_A%%",
+        L"%",
+        L"100%",
+        L"%NSUDO_TEST_A",
+    };
+
+    M2::CEnvironmentBlock Block(NSudoTestGetProcessEnvironmentBlock());
+
+    for (LPCWSTR Source : Sources)
+    {
+        std::wstring Expected;
+        NSUDO_TEST_ASSERT(S_OK == M2ExpandEnvironmentStrings(Expected, Source));
+
+        NSUDO_TEST_ASSERT(Expected == NSudoTestExpand(Block, Source));
+    }
+
+    for (const auto& Variable : Variables)
+    {
+        SetEnvironmentVariableW(Variable.Name, nullptr);
+    }
+}
+
+#pragma endregion
+
+#pragma region CEnvironmentBlockCache
+
+NSUDO_TEST(EnvironmentBlockCacheSharesBlocks)
+{
+    NSudoTestResetStubCreator();
+
+    M2::CEnvironmentBlockCache Cache(
+        0, NSudoTestCreateStubEnvironmentBlock, NSudoTestGetStubTime);
+
+    M2::CEnvironmentBlockReference First;
+    M2::CEnvironmentBlockReference Second;
+    NSUDO_TEST_ASSERT(S_OK == Cache.Acquire(First, nullptr, true));
+    NSUDO_TEST_ASSERT(S_OK == Cache.Acquire(Second, nullptr, true));
+
+    NSUDO_TEST_ASSERT(First == Second);
+    NSUDO_TEST_ASSERT(1 == g_StubCreationCount);
+    NSUDO_TEST_ASSERT(1000 == First->GetCreationTime());
+
+    // The inherit flag is a part of the key.
+    M2::CEnvironmentBlockReference NotInherited;
+    NSUDO_TEST_ASSERT(S_OK == Cache.Acquire(NotInherited, nullptr, false));
+    NSUDO_TEST_ASSERT(First != NotInherited);
+    NSUDO_TEST_ASSERT(L"0" == NSudoTestFind(*NotInherited, L"Inherit"));
+    NSUDO_TEST_ASSERT(2 == g_StubCreationCount);
+
+    // The blocks without the maximum age never expire.
+    g_StubTime += 365ULL * 24 * 60 * 60 * 1000;
+    NSUDO_TEST_ASSERT(S_OK == Cache.Acquire(Second, nullptr, true));
+    NSUDO_TEST_ASSERT(First == Second);
+    NSUDO_TEST_ASSERT(2 == g_StubCreationCount);
+}
+
+NSUDO_TEST(EnvironmentBlockCacheSharesBlocksOfSameToken)
+{
+    NSudoTestResetStubCreator();
+
+    M2::CEnvironmentBlockCache Cache(
+        0, NSudoTestCreateStubEnvironmentBlock, NSudoTestGetStubTime);
+
+    M2::CHandle Token;
+    NSUDO_TEST_ASSERT(OpenProcessToken(
+        GetCurrentProcess(), TOKEN_QUERY, &Token));
+
+    M2::CEnvironmentBlockReference First;
+    M2::CEnvironmentBlockReference Second;
+    M2::CEnvironmentBlockReference WithoutToken;
+    NSUDO_TEST_ASSERT(S_OK == Cache.Acquire(First, Token, true));
+    NSUDO_TEST_ASSERT(S_OK == Cache.Acquire(Second, Token, true));
+    NSUDO_TEST_ASSERT(S_OK == Cache.Acquire(WithoutToken, nullptr, true));
+
+    NSUDO_TEST_ASSERT(First == Second);
+    NSUDO_TEST_ASSERT(First != WithoutToken);
+    NSUDO_TEST_ASSERT(2 == g_StubCreationCount);
+}
+
+NSUDO_TEST(EnvironmentBlockCacheExpiresBlocks)
+{
+    NSudoTestResetStubCreator();
+
+    M2::CEnvironmentBlockCache Cache(
+        60 * 1000, NSudoTestCreateStubEnvironmentBlock, NSudoTestGetStubTime);
+
+    M2::CEnvironmentBlockReference First;
+    NSUDO_TEST_ASSERT(S_OK == Cache.Acquire(First, nullptr, true));
+
+    // The block is used until it reaches the maximum age.
+    g_StubTime += 60 * 1000 - 1;
+    M2::CEnvironmentBlockReference Second;
+    NSUDO_TEST_ASSERT(S_OK == Cache.Acquire(Second, nullptr, true));
+    NSUDO_TEST_ASSERT(First == Second);
+    NSUDO_TEST_ASSERT(1 == g_StubCreationCount);
+
+    g_StubTime += 1;
+    NSUDO_TEST_ASSERT(S_OK == Cache.Acquire(Second, nullptr, true));
+    NSUDO_TEST_ASSERT(First != Second);
+    NSUDO_TEST_ASSERT(2 == g_StubCreationCount);
+    NSUDO_TEST_ASSERT(g_StubTime == Second->GetCreationTime());
+    NSUDO_TEST_ASSERT(L"2" == NSudoTestFind(*Second, L"Generation"));
+
+    // The expired block stays valid for its holders.
+    NSUDO_TEST_ASSERT(L"1" == NSudoTestFind(*First, L"Generation"));
+
+    // The age is counted from the creation of the new block.
+    g_StubTime += 60 * 1000 - 1;
+    M2::CEnvironmentBlockReference Third;
+    NSUDO_TEST_ASSERT(S_OK == Cache.Acquire(Third, nullptr, true));
+    NSUDO_TEST_ASSERT(Second == Third);
+    NSUDO_TEST_ASSERT(2 == g_StubCreationCount);
+}
+
+NSUDO_TEST(EnvironmentBlockCacheInvalidatesBlocks)
+{
+    NSudoTestResetStubCreator();
+
+    M2::CEnvironmentBlockCache Cache(
+        60 * 1000, NSudoTestCreateStubEnvironmentBlock, NSudoTestGetStubTime);
+
+    M2::CEnvironmentBlockReference First;
+    M2::CEnvironmentBlockReference NotInherited;
+    NSUDO_TEST_ASSERT(S_OK == Cache.Acquire(First, nullptr, true));
+    NSUDO_TEST_ASSERT(S_OK == Cache.Acquire(NotInherited, nullptr, false));
+    NSUDO_TEST_ASSERT(2 == g_StubCreationCount);
+
+    Cache.Invalidate();
+
+    // All blocks are created again, and the old ones stay valid.
+    M2::CEnvironmentBlockReference Second;
+    NSUDO_TEST_ASSERT(S_OK == Cache.Acquire(Second, nullptr, true));
+    NSUDO_TEST_ASSERT(S_OK == Cache.Acquire(NotInherited, nullptr, false));
+    NSUDO_TEST_ASSERT(First != Second);
+    NSUDO_TEST_ASSERT(4 == g_StubCreationCount);
+    NSUDO_TEST_ASSERT(L"1" == NSudoTestFind(*First, L"Generation"));
+    NSUDO_TEST_ASSERT(L"3" == NSudoTestFind(*Second, L"Generation"));
+
+    // Invalidating an empty cache is harmless.
+    Cache.Invalidate();
+    Cache.Invalidate();
+    NSUDO_TEST_ASSERT(S_OK == Cache.Acquire(Second, nullptr, true));
+    NSUDO_TEST_ASSERT(5 == g_StubCreationCount);
+}
+
+NSUDO_TEST(EnvironmentBlockCacheDoesNotCacheFailures)
+{
+    NSudoTestResetStubCreator();
+
+    M2::CEnvironmentBlockCache Cache(
+        0, NSudoTestCreateStubEnvironmentBlock, NSudoTestGetStubTime);
+
+    g_StubCreationResult = E_ACCESSDENIED;
+
+    M2::CEnvironmentBlockReference Block;
+    NSUDO_TEST_ASSERT(E_ACCESSDENIED == Cache.Acquire(Block, nullptr, true));
+    NSUDO_TEST_ASSERT(!Block);
+
+    g_StubCreationResult = S_OK;
+
+    NSUDO_TEST_ASSERT(S_OK == Cache.Acquire(Block, nullptr, true));
+    NSUDO_TEST_ASSERT(Block);
+    NSUDO_TEST_ASSERT(1 == g_StubCreationCount);
+}
+
+#pragma endregion
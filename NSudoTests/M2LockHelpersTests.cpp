@@ -0,0 +1,472 @@
+﻿/*
+ * PROJECT:   NSudo
+ * FILE:      M2LockHelpersTests.cpp
+ * PURPOSE:   Unit tests for the adaptive and instrumented locks
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#include "stdafx.h"
+
+#include <vector>
+
+namespace
+{
+    const LONG g_LockThreadCount = 8;
+    const LONG g_LockIterationsPerThread = 20000;
+
+    /**
+     * Starts the threads, which get their indexes, and waits for them to
+     * exit.
+     */
+    template<typename TFunction>
+    void NSudoTestRunThreads(
+        _In_ DWORD ThreadCount,
+        _In_ TFunction Function)
+    {
+        std::vector<HANDLE> Threads;
+        for (DWORD i = 0; i < ThreadCount; ++i)
+        {
+            HANDLE ThreadHandle = M2::CThread([Function, i]()
+            {
+                Function(i);
+            }).Detach();
+            NSUDO_TEST_ASSERT(nullptr != ThreadHandle);
+            Threads.push_back(ThreadHandle);
+        }
+
+        DWORD WaitResult = WaitForMultipleObjectsEx(
+            static_cast<DWORD>(Threads.size()),
+            Threads.data(),
+            TRUE,
+            60 * 1000,
+            FALSE);
+
+        for (HANDLE ThreadHandle : Threads)
+            CloseHandle(ThreadHandle);
+
+        NSUDO_TEST_ASSERT(WAIT_OBJECT_0 == WaitResult);
+    }
+
+    /**
+     * Uses the polling fallback of M2WaitOnAddress until the object is
+     * destroyed.
+     */
+    class CNSudoTestWaitOnAddressFallback : M2::CDisableObjectCopying
+    {
+    private:
+        bool m_PreviousValue;
+
+    public:
+        CNSudoTestWaitOnAddressFallback() :
+            m_PreviousValue(M2ForceWaitOnAddressFallback(true))
+        {
+
+        }
+
+        ~CNSudoTestWaitOnAddressFallback()
+        {
+            M2ForceWaitOnAddressFallback(this->m_PreviousValue);
+        }
+    };
+
+    /**
+     * The data protected by the lock. The owner count is checked inside the
+     * lock, so a second owner is detected even if the counter survives.
+     */
+    template<typename TLock>
+    struct CNSudoTestLockData
+    {
+        TLock Lock;
+        volatile LONG OwnerCount = 0;
+        volatile LONG ReaderCount = 0;
+        volatile LONG ViolationCount = 0;
+        LONG Counter = 0;
+    };
+
+    void NSudoTestCheckAdaptiveLock()
+    {
+        CNSudoTestLockData<M2::CAdaptiveLock> Data;
+
+        NSudoTestRunThreads(g_LockThreadCount, [&Data](DWORD)
+        {
+            for (LONG i = 0; i < g_LockIterationsPerThread; ++i)
+            {
+                Data.Lock.Lock();
+
+                if (1 != InterlockedIncrement(&Data.OwnerCount))
+                    InterlockedIncrement(&Data.ViolationCount);
+                ++Data.Counter;
+                InterlockedDecrement(&Data.OwnerCount);
+
+                Data.Lock.Unlock();
+            }
+        });
+
+        NSUDO_TEST_ASSERT(0 == Data.ViolationCount);
+        NSUDO_TEST_ASSERT(
+            g_LockThreadCount * g_LockIterationsPerThread == Data.Counter);
+
+        NSUDO_TEST_ASSERT(Data.Lock.TryLock());
+        NSUDO_TEST_ASSERT(!Data.Lock.TryLock());
+        Data.Lock.Unlock();
+    }
+
+    void NSudoTestCheckAdaptiveSRWLock()
+    {
+        CNSudoTestLockData<M2::CAdaptiveSRWLock> Data;
+
+        // The half of the threads are readers, which check that no writer
+        // owns the lock at the same time.
+        NSudoTestRunThreads(g_LockThreadCount, [&Data](DWORD Index)
+        {
+            for (LONG i = 0; i < g_LockIterationsPerThread; ++i)
+            {
+                if (Index % 2)
+                {
+                    Data.Lock.SharedLock();
+
+                    InterlockedIncrement(&Data.ReaderCount);
+                    if (0 != Data.OwnerCount)
+                        InterlockedIncrement(&Data.ViolationCount);
+                    InterlockedDecrement(&Data.ReaderCount);
+
+                    Data.Lock.SharedUnlock();
+                }
+                else
+                {
+                    Data.Lock.ExclusiveLock();
+
+                    if (1 != InterlockedIncrement(&Data.OwnerCount) ||
+                        0 != Data.ReaderCount)
+                    {
+                        InterlockedIncrement(&Data.ViolationCount);
+                    }
+                    ++Data.Counter;
+                    InterlockedDecrement(&Data.OwnerCount);
+
+                    Data.Lock.ExclusiveUnlock();
+                }
+            }
+        });
+
+        NSUDO_TEST_ASSERT(0 == Data.ViolationCount);
+        NSUDO_TEST_ASSERT(
+            (g_LockThreadCount / 2) * g_LockIterationsPerThread ==
+            Data.Counter);
+    }
+
+    /**
+     * Holds the exclusive lock while the readers park, and checks that
+     * releasing the lock wakes all of them.
+     */
+    void NSudoTestCheckParkedReadersAreWoken()
+    {
+        M2::CAdaptiveSRWLock Lock;
+        volatile LONG WaitingCount = 0;
+        volatile LONG AcquiredCount = 0;
+
+        Lock.ExclusiveLock();
+
+        HANDLE Releaser = M2::CThread([&]()
+        {
+            // Give the readers time to spin out and park.
+            while (g_LockThreadCount != WaitingCount)
+                SwitchToThread();
+            Sleep(100);
+
+            Lock.ExclusiveUnlock();
+        }).Detach();
+        NSUDO_TEST_ASSERT(nullptr != Releaser);
+
+        NSudoTestRunThreads(g_LockThreadCount, [&](DWORD)
+        {
+            InterlockedIncrement(&WaitingCount);
+
+            Lock.SharedLock();
+            InterlockedIncrement(&AcquiredCount);
+            Lock.SharedUnlock();
+        });
+
+        WaitForSingleObjectEx(Releaser, INFINITE, FALSE);
+        CloseHandle(Releaser);
+
+        NSUDO_TEST_ASSERT(g_LockThreadCount == AcquiredCount);
+        NSUDO_TEST_ASSERT(Lock.TryExclusiveLock());
+        Lock.ExclusiveUnlock();
+    }
+}
+
+NSUDO_TEST(AdaptiveLockExcludesContendingThreads)
+{
+    NSudoTestCheckAdaptiveLock();
+}
+
+NSUDO_TEST(AdaptiveSRWLockExcludesWritersFromReaders)
+{
+    NSudoTestCheckAdaptiveSRWLock();
+}
+
+NSUDO_TEST(AdaptiveSRWLockWaitingWriterBlocksNewReaders)
+{
+    M2::CAdaptiveSRWLock Lock;
+    volatile LONG Order = 0;
+    volatile LONG WriterOrder = 0;
+    volatile LONG ReaderOrder = 0;
+
+    Lock.SharedLock();
+
+    HANDLE Writer = M2::CThread([&]()
+    {
+        Lock.ExclusiveLock();
+        WriterOrder = InterlockedIncrement(&Order);
+        Sleep(20);
+        Lock.ExclusiveUnlock();
+    }).Detach();
+    NSUDO_TEST_ASSERT(nullptr != Writer);
+
+    // The new readers fail once the writer is waiting, although the lock is
+    // only owned by a reader.
+    ULONGLONG StartTime = GetTickCount64();
+    while (Lock.TrySharedLock())
+    {
+        Lock.SharedUnlock();
+        NSUDO_TEST_ASSERT(GetTickCount64() - StartTime < 60 * 1000);
+        SwitchToThread();
+    }
+
+    HANDLE Reader = M2::CThread([&]()
+    {
+        Lock.SharedLock();
+        ReaderOrder = InterlockedIncrement(&Order);
+        Lock.SharedUnlock();
+    }).Detach();
+    NSUDO_TEST_ASSERT(nullptr != Reader);
+
+    // The new reader does not get the lock while the writer is waiting.
+    Sleep(50);
+    NSUDO_TEST_ASSERT(0 == Order);
+
+    Lock.SharedUnlock();
+
+    HANDLE Threads[] = { Writer, Reader };
+    DWORD WaitResult = WaitForMultipleObjectsEx(
+        2, Threads, TRUE, 60 * 1000, FALSE);
+    CloseHandle(Writer);
+    CloseHandle(Reader);
+
+    NSUDO_TEST_ASSERT(WAIT_OBJECT_0 == WaitResult);
+    NSUDO_TEST_ASSERT(1 == WriterOrder);
+    NSUDO_TEST_ASSERT(2 == ReaderOrder);
+}
+
+NSUDO_TEST(AdaptiveSRWLockWakesParkedReaders)
+{
+    NSudoTestCheckParkedReadersAreWoken();
+}
+
+NSUDO_TEST(AdaptiveLocksWorkWithPollingFallback)
+{
+    // The wake functions do nothing in the fallback, so the waiters must
+    // notice the releases by polling.
+    CNSudoTestWaitOnAddressFallback Fallback;
+
+    NSudoTestCheckAdaptiveLock();
+    NSudoTestCheckAdaptiveSRWLock();
+    NSudoTestCheckParkedReadersAreWoken();
+}
+
+#pragma region Lock Instrumentation
+
+// The test project defines M2_ENABLE_LOCK_INSTRUMENTATION, so the SDK is
+// built with the instrumented locks as well.
+
+namespace
+{
+    LONG64 NSudoTestGetHistogramCount(
+        _In_ const volatile LONG64* Histogram)
+    {
+        LONG64 Count = 0;
+        for (int i = 0; i < M2_LOCK_HISTOGRAM_BUCKET_COUNT; ++i)
+            Count += Histogram[i];
+        return Count;
+    }
+
+    /**
+     * Waits until the statistics have the acquisition of the waiting thread,
+     * and gives the thread time to fail the try and block.
+     */
+    void NSudoTestWaitForAcquisitions(
+        _In_ PM2_LOCK_STATISTICS Statistics,
+        _In_ LONG64 Acquisitions)
+    {
+        ULONGLONG StartTime = GetTickCount64();
+        while (Statistics->Acquisitions < Acquisitions)
+        {
+            NSUDO_TEST_ASSERT(GetTickCount64() - StartTime < 60 * 1000);
+            SwitchToThread();
+        }
+        Sleep(50);
+    }
+}
+
+NSUDO_TEST(LockHistogramSamplesUseLogarithmicBuckets)
+{
+    LONG64 Histogram[M2_LOCK_HISTOGRAM_BUCKET_COUNT] = { 0 };
+
+    M2AddLockHistogramSample(Histogram, 0);
+    M2AddLockHistogramSample(Histogram, 1);
+    M2AddLockHistogramSample(Histogram, 2);
+    M2AddLockHistogramSample(Histogram, 3);
+    M2AddLockHistogramSample(Histogram, 1024);
+    M2AddLockHistogramSample(Histogram, 2047);
+    M2AddLockHistogramSample(Histogram, MAXULONGLONG);
+
+    NSUDO_TEST_ASSERT(2 == Histogram[0]);
+    NSUDO_TEST_ASSERT(2 == Histogram[1]);
+    NSUDO_TEST_ASSERT(2 == Histogram[10]);
+    NSUDO_TEST_ASSERT(1 == Histogram[M2_LOCK_HISTOGRAM_BUCKET_COUNT - 1]);
+    NSUDO_TEST_ASSERT(7 == NSudoTestGetHistogramCount(Histogram));
+}
+
+NSUDO_TEST(InstrumentedLockRecordsAcquisitions)
+{
+    M2::CInstrumentedLock<M2::CAdaptiveLock> Lock(
+        "NSudoTests.InstrumentedLock.Uncontended");
+    PM2_LOCK_STATISTICS Statistics =
+        M2GetLockStatistics("NSudoTests.InstrumentedLock.Uncontended");
+
+    for (int i = 0; i < 10; ++i)
+    {
+        Lock.Lock();
+        Lock.Unlock();
+    }
+
+    NSUDO_TEST_ASSERT(Lock.TryLock());
+
+    // The failed try is not an acquisition.
+    NSUDO_TEST_ASSERT(!Lock.TryLock());
+    Lock.Unlock();
+
+    NSUDO_TEST_ASSERT(11 == Statistics->Acquisitions);
+    NSUDO_TEST_ASSERT(0 == Statistics->ContendedAcquisitions);
+    NSUDO_TEST_ASSERT(0 == Statistics->TotalWaitNanoseconds);
+    NSUDO_TEST_ASSERT(0 == NSudoTestGetHistogramCount(
+        Statistics->WaitHistogram));
+    NSUDO_TEST_ASSERT(11 == NSudoTestGetHistogramCount(
+        Statistics->HoldHistogram));
+
+    // The report has the site.
+    NSUDO_TEST_ASSERT(std::string::npos != M2GetLockStatisticsReport().find(
+        "NSudoTests.InstrumentedLock.Uncontended: acquisitions=11 "
+        "contended=0 wait_ns=0"));
+}
+
+NSUDO_TEST(InstrumentedLockRecordsContendedAcquisitions)
+{
+    M2::CInstrumentedLock<M2::CAdaptiveLock> Lock(
+        "NSudoTests.InstrumentedLock.Contended");
+    PM2_LOCK_STATISTICS Statistics =
+        M2GetLockStatistics("NSudoTests.InstrumentedLock.Contended");
+
+    Lock.Lock();
+
+    M2::CHandle Waiter = M2::CThread([&Lock]()
+    {
+        Lock.Lock();
+        Lock.Unlock();
+    }).Detach();
+    NSUDO_TEST_ASSERT(Waiter);
+
+    NSudoTestWaitForAcquisitions(Statistics, 2);
+    Lock.Unlock();
+
+    NSUDO_TEST_ASSERT(WAIT_OBJECT_0 == WaitForSingleObjectEx(
+        Waiter, 60 * 1000, FALSE));
+
+    NSUDO_TEST_ASSERT(2 == Statistics->Acquisitions);
+    NSUDO_TEST_ASSERT(1 == Statistics->ContendedAcquisitions);
+    NSUDO_TEST_ASSERT(1 == NSudoTestGetHistogramCount(
+        Statistics->WaitHistogram));
+    NSUDO_TEST_ASSERT(2 == NSudoTestGetHistogramCount(
+        Statistics->HoldHistogram));
+
+    // The waiter was blocked while the lock was held for about 50 ms. The
+    // tolerance covers a sleep which returns early by a part of a tick.
+    NSUDO_TEST_ASSERT(Statistics->TotalWaitNanoseconds >= 40 * 1000 * 1000);
+    NSUDO_TEST_ASSERT(Statistics->TotalHoldNanoseconds >= 40 * 1000 * 1000);
+}
+
+NSUDO_TEST(InstrumentedSRWLockRecordsSharedAcquisitions)
+{
+    M2::CInstrumentedLock<M2::CAdaptiveSRWLock> Lock(
+        "NSudoTests.InstrumentedLock.SRW");
+    PM2_LOCK_STATISTICS Statistics =
+        M2GetLockStatistics("NSudoTests.InstrumentedLock.SRW");
+
+    Lock.SharedLock();
+    NSUDO_TEST_ASSERT(Lock.TrySharedLock());
+    NSUDO_TEST_ASSERT(!Lock.TryExclusiveLock());
+
+    // The writer waits for both readers.
+    M2::CHandle Writer = M2::CThread([&Lock]()
+    {
+        Lock.ExclusiveLock();
+        Lock.ExclusiveUnlock();
+    }).Detach();
+    NSUDO_TEST_ASSERT(Writer);
+
+    NSudoTestWaitForAcquisitions(Statistics, 3);
+    Lock.SharedUnlock();
+    Lock.SharedUnlock();
+
+    NSUDO_TEST_ASSERT(WAIT_OBJECT_0 == WaitForSingleObjectEx(
+        Writer, 60 * 1000, FALSE));
+
+    // Only the exclusive acquisition has the hold time recorded.
+    NSUDO_TEST_ASSERT(3 == Statistics->Acquisitions);
+    NSUDO_TEST_ASSERT(1 == Statistics->ContendedAcquisitions);
+    NSUDO_TEST_ASSERT(1 == NSudoTestGetHistogramCount(
+        Statistics->WaitHistogram));
+    NSUDO_TEST_ASSERT(1 == NSudoTestGetHistogramCount(
+        Statistics->HoldHistogram));
+}
+
+NSUDO_TEST(InstrumentedCriticalSectionTimesOutermostAcquisition)
+{
+    M2::CInstrumentedLock<M2::CCriticalSection> Lock(
+        "NSudoTests.InstrumentedLock.Recursive");
+    PM2_LOCK_STATISTICS Statistics =
+        M2GetLockStatistics("NSudoTests.InstrumentedLock.Recursive");
+
+    // The nested acquisitions are counted, but the hold time is one sample
+    // from the outermost acquisition to the outermost release.
+    Lock.Lock();
+    Sleep(50);
+    Lock.Lock();
+    NSUDO_TEST_ASSERT(Lock.TryLock());
+    Lock.Unlock();
+    Lock.Unlock();
+    Sleep(50);
+    Lock.Unlock();
+
+    NSUDO_TEST_ASSERT(3 == Statistics->Acquisitions);
+    NSUDO_TEST_ASSERT(0 == Statistics->ContendedAcquisitions);
+    NSUDO_TEST_ASSERT(1 == NSudoTestGetHistogramCount(
+        Statistics->HoldHistogram));
+    NSUDO_TEST_ASSERT(Statistics->TotalHoldNanoseconds >= 90 * 1000 * 1000);
+
+    // The next acquisition is timed on its own.
+    LONG64 TotalHoldNanoseconds = Statistics->TotalHoldNanoseconds;
+    Lock.Lock();
+    Lock.Unlock();
+    NSUDO_TEST_ASSERT(2 == NSudoTestGetHistogramCount(
+        Statistics->HoldHistogram));
+    NSUDO_TEST_ASSERT(
+        Statistics->TotalHoldNanoseconds - TotalHoldNanoseconds <
+        50 * 1000 * 1000);
+}
+
+#pragma endregion
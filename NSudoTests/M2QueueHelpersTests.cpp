@@ -0,0 +1,290 @@
+﻿/*
+ * PROJECT:   NSudo
+ * FILE:      M2QueueHelpersTests.cpp
+ * PURPOSE:   Unit tests for the multi-producer single-consumer queues
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#include "stdafx.h"
+
+#include <memory>
+#include <vector>
+
+namespace
+{
+    const ULONGLONG g_ProducerCount = 4;
+    const ULONGLONG g_ItemsPerProducer = 100000;
+
+    /**
+     * Starts the producer threads. Each producer gets its index, and the
+     * caller consumes on the current thread while they run.
+     */
+    template<typename TFunction>
+    std::vector<HANDLE> NSudoTestStartProducers(
+        _In_ ULONGLONG ProducerCount,
+        _In_ TFunction Function)
+    {
+        std::vector<HANDLE> Producers;
+        for (ULONGLONG i = 0; i < ProducerCount; ++i)
+        {
+            M2::CThread Producer([Function, i]()
+            {
+                Function(i);
+            });
+
+            HANDLE ProducerHandle = Producer.Detach();
+            NSUDO_TEST_ASSERT(nullptr != ProducerHandle);
+            Producers.push_back(ProducerHandle);
+        }
+
+        return Producers;
+    }
+
+    void NSudoTestWaitProducers(
+        _In_ std::vector<HANDLE>& Producers)
+    {
+        NSUDO_TEST_ASSERT(WAIT_OBJECT_0 == WaitForMultipleObjectsEx(
+            static_cast<DWORD>(Producers.size()),
+            Producers.data(),
+            TRUE,
+            60 * 1000,
+            FALSE));
+
+        for (HANDLE Producer : Producers)
+            CloseHandle(Producer);
+        Producers.clear();
+    }
+
+    /**
+     * Checks that the items of each producer arrive in order and only once.
+     * The item is the index of the producer in the high part and its
+     * sequence number in the low part.
+     */
+    class CNSudoTestItemChecker
+    {
+    private:
+        std::vector<ULONGLONG> m_NextSequences;
+        ULONGLONG m_Count = 0;
+
+    public:
+        CNSudoTestItemChecker() :
+            m_NextSequences(static_cast<size_t>(g_ProducerCount), 0)
+        {
+
+        }
+
+        void Check(
+            _In_ ULONGLONG Item)
+        {
+            ULONGLONG Producer = Item >> 32;
+            NSUDO_TEST_ASSERT(Producer < g_ProducerCount);
+            NSUDO_TEST_ASSERT(
+                this->m_NextSequences[static_cast<size_t>(Producer)]++ ==
+                (Item & 0xFFFFFFFF));
+            ++this->m_Count;
+        }
+
+        ULONGLONG GetCount() const
+        {
+            return this->m_Count;
+        }
+    };
+
+    struct CNSudoTestQueueNode : M2::CMPSCQueueNode
+    {
+        ULONGLONG Item;
+    };
+
+    /**
+     * The item which counts its live instances, so the tests can find the
+     * leaked and the double destroyed items.
+     */
+    struct CNSudoTestCountedItem
+    {
+        static volatile LONG LiveCount;
+
+        std::unique_ptr<int> Value;
+
+        CNSudoTestCountedItem()
+        {
+            InterlockedIncrement(&LiveCount);
+        }
+
+        CNSudoTestCountedItem(
+            CNSudoTestCountedItem&& Other) :
+            Value(std::move(Other.Value))
+        {
+            InterlockedIncrement(&LiveCount);
+        }
+
+        CNSudoTestCountedItem& operator=(
+            CNSudoTestCountedItem&& Other)
+        {
+            this->Value = std::move(Other.Value);
+            return *this;
+        }
+
+        ~CNSudoTestCountedItem()
+        {
+            InterlockedDecrement(&LiveCount);
+        }
+    };
+
+    volatile LONG CNSudoTestCountedItem::LiveCount = 0;
+}
+
+NSUDO_TEST(BoundedMPSCQueueKeepsOrderOfEachProducer)
+{
+    // The queue is much smaller than the items, so the producers often find
+    // it full and the positions wrap many times.
+    auto Queue = std::make_unique<M2::CBoundedMPSCQueue<ULONGLONG, 256>>();
+
+    std::vector<HANDLE> Producers = NSudoTestStartProducers(
+        g_ProducerCount,
+        [&Queue](ULONGLONG Producer)
+    {
+        for (ULONGLONG i = 0; i < g_ItemsPerProducer; ++i)
+        {
+            ULONGLONG Item = (Producer << 32) | i;
+            while (!Queue->TryEnqueue(Item))
+                SwitchToThread();
+        }
+    });
+
+    CNSudoTestItemChecker Checker;
+    while (Checker.GetCount() < g_ProducerCount * g_ItemsPerProducer)
+    {
+        ULONGLONG Item = 0;
+        Queue->Dequeue(Item);
+        Checker.Check(Item);
+    }
+
+    NSudoTestWaitProducers(Producers);
+
+    ULONGLONG Item = 0;
+    NSUDO_TEST_ASSERT(!Queue->TryDequeue(Item));
+}
+
+NSUDO_TEST(BoundedMPSCQueueDequeuesBatches)
+{
+    auto Queue = std::make_unique<M2::CBoundedMPSCQueue<ULONGLONG, 1024>>();
+
+    std::vector<HANDLE> Producers = NSudoTestStartProducers(
+        g_ProducerCount,
+        [&Queue](ULONGLONG Producer)
+    {
+        for (ULONGLONG i = 0; i < g_ItemsPerProducer; ++i)
+        {
+            ULONGLONG Item = (Producer << 32) | i;
+            while (!Queue->TryEnqueue(Item))
+                SwitchToThread();
+        }
+    });
+
+    CNSudoTestItemChecker Checker;
+    ULONGLONG Items[64];
+    while (Checker.GetCount() < g_ProducerCount * g_ItemsPerProducer)
+    {
+        size_t Count = Queue->DequeueBatch(Items, _countof(Items));
+        NSUDO_TEST_ASSERT(Count <= _countof(Items));
+        for (size_t i = 0; i < Count; ++i)
+            Checker.Check(Items[i]);
+        if (!Count)
+            SwitchToThread();
+    }
+
+    NSudoTestWaitProducers(Producers);
+}
+
+NSUDO_TEST(BoundedMPSCQueueDestroysItems)
+{
+    {
+        M2::CBoundedMPSCQueue<CNSudoTestCountedItem, 8> Queue;
+
+        for (int i = 0; i < 8; ++i)
+        {
+            CNSudoTestCountedItem Item;
+            Item.Value = std::make_unique<int>(i);
+            NSUDO_TEST_ASSERT(Queue.TryEnqueue(Item));
+            NSUDO_TEST_ASSERT(!Item.Value);
+        }
+
+        // The item stays with the caller if the queue is full.
+        CNSudoTestCountedItem Rejected;
+        Rejected.Value = std::make_unique<int>(8);
+        NSUDO_TEST_ASSERT(!Queue.TryEnqueue(Rejected));
+        NSUDO_TEST_ASSERT(Rejected.Value && 8 == *Rejected.Value);
+
+        CNSudoTestCountedItem Item;
+        NSUDO_TEST_ASSERT(Queue.TryDequeue(Item));
+        NSUDO_TEST_ASSERT(Item.Value && 0 == *Item.Value);
+
+        // Seven items are in the queue, and the queue destroys them.
+        NSUDO_TEST_ASSERT(9 == CNSudoTestCountedItem::LiveCount);
+    }
+
+    NSUDO_TEST_ASSERT(0 == CNSudoTestCountedItem::LiveCount);
+}
+
+NSUDO_TEST(IntrusiveMPSCQueueKeepsOrderOfEachProducer)
+{
+    std::vector<std::unique_ptr<CNSudoTestQueueNode[]>> Nodes;
+    for (ULONGLONG i = 0; i < g_ProducerCount; ++i)
+    {
+        Nodes.push_back(std::make_unique<CNSudoTestQueueNode[]>(
+            static_cast<size_t>(g_ItemsPerProducer)));
+    }
+
+    M2::CIntrusiveMPSCQueue<CNSudoTestQueueNode> Queue;
+
+    std::vector<HANDLE> Producers = NSudoTestStartProducers(
+        g_ProducerCount,
+        [&Queue, &Nodes](ULONGLONG Producer)
+    {
+        CNSudoTestQueueNode* ProducerNodes =
+            Nodes[static_cast<size_t>(Producer)].get();
+        for (ULONGLONG i = 0; i < g_ItemsPerProducer; ++i)
+        {
+            ProducerNodes[i].Item = (Producer << 32) | i;
+            Queue.Push(&ProducerNodes[i]);
+        }
+    });
+
+    CNSudoTestItemChecker Checker;
+    while (Checker.GetCount() < g_ProducerCount * g_ItemsPerProducer)
+    {
+        CNSudoTestQueueNode* Node = Queue.Pop();
+        NSUDO_TEST_ASSERT(nullptr != Node);
+        Checker.Check(Node->Item);
+    }
+
+    NSudoTestWaitProducers(Producers);
+
+    NSUDO_TEST_ASSERT(nullptr == Queue.TryPop());
+}
+
+NSUDO_TEST(IntrusiveMPSCQueueReturnsLastNode)
+{
+    CNSudoTestQueueNode Nodes[3];
+    M2::CIntrusiveMPSCQueue<CNSudoTestQueueNode> Queue;
+
+    NSUDO_TEST_ASSERT(nullptr == Queue.TryPop());
+
+    // The stub is pushed back when the queue becomes empty, so the queue
+    // can be drained and refilled many times.
+    for (int Round = 0; Round < 3; ++Round)
+    {
+        for (CNSudoTestQueueNode& Node : Nodes)
+            Queue.Push(&Node);
+
+        CNSudoTestQueueNode* Popped[4];
+        NSUDO_TEST_ASSERT(3 == Queue.PopBatch(Popped, _countof(Popped)));
+        for (size_t i = 0; i < 3; ++i)
+            NSUDO_TEST_ASSERT(&Nodes[i] == Popped[i]);
+
+        NSUDO_TEST_ASSERT(nullptr == Queue.TryPop());
+    }
+}
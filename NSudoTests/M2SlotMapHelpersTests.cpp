@@ -0,0 +1,108 @@
+﻿/*
+ * PROJECT:   NSudo
+ * FILE:      M2SlotMapHelpersTests.cpp
+ * PURPOSE:   Unit tests for the generational slot map
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#include "stdafx.h"
+
+#include <string>
+
+NSUDO_TEST(SlotMapFindsInsertedValues)
+{
+    M2::CSlotMap<std::string> Map;
+
+    M2_SLOT_ID First = Map.Insert(std::string("First"));
+    M2_SLOT_ID Second = Map.Insert(std::string("Second"));
+
+    NSUDO_TEST_ASSERT(M2_INVALID_SLOT_ID != First);
+    NSUDO_TEST_ASSERT(M2_INVALID_SLOT_ID != Second);
+    NSUDO_TEST_ASSERT(First != Second);
+    NSUDO_TEST_ASSERT(2 == Map.GetCount());
+
+    NSUDO_TEST_ASSERT("First" == *Map.Find(First));
+    NSUDO_TEST_ASSERT("Second" == *Map.Find(Second));
+
+    NSUDO_TEST_ASSERT(nullptr == Map.Find(M2_INVALID_SLOT_ID));
+    NSUDO_TEST_ASSERT(!Map.Erase(M2_INVALID_SLOT_ID));
+}
+
+NSUDO_TEST(SlotMapRejectsStaleIds)
+{
+    M2::CSlotMap<std::string> Map;
+
+    M2_SLOT_ID Stale = Map.Insert(std::string("Stale"));
+    M2_SLOT_ID Other = Map.Insert(std::string("Other"));
+
+    NSUDO_TEST_ASSERT(Map.Erase(Stale));
+    NSUDO_TEST_ASSERT(1 == Map.GetCount());
+
+    // The erased identifier is rejected even before its slot is reused.
+    NSUDO_TEST_ASSERT(nullptr == Map.Find(Stale));
+    NSUDO_TEST_ASSERT(!Map.Erase(Stale));
+
+    // The slot is reused with the next generation, so the stale identifier
+    // does not refer to the new value.
+    M2_SLOT_ID Reused = Map.Insert(std::string("Reused"));
+    NSUDO_TEST_ASSERT(static_cast<DWORD>(Stale) == static_cast<DWORD>(Reused));
+    NSUDO_TEST_ASSERT(Stale != Reused);
+    NSUDO_TEST_ASSERT(nullptr == Map.Find(Stale));
+    NSUDO_TEST_ASSERT(!Map.Erase(Stale));
+    NSUDO_TEST_ASSERT("Reused" == *Map.Find(Reused));
+
+    // The identifiers out of the range of the slots are rejected.
+    NSUDO_TEST_ASSERT(nullptr == Map.Find(Other + 100));
+
+    NSUDO_TEST_ASSERT("Other" == *Map.Find(Other));
+    NSUDO_TEST_ASSERT(2 == Map.GetCount());
+}
+
+NSUDO_TEST(SlotMapSkipsGenerationZeroOnWrap)
+{
+    M2::CSlotMap<int, 3> Map;
+
+    M2_SLOT_ID Ids[4];
+    for (int i = 0; i < 4; ++i)
+    {
+        Ids[i] = Map.Insert(int(i));
+        NSUDO_TEST_ASSERT(M2_INVALID_SLOT_ID != Ids[i]);
+        NSUDO_TEST_ASSERT(0 == static_cast<DWORD>(Ids[i]));
+        NSUDO_TEST_ASSERT(0 != static_cast<DWORD>(Ids[i] >> 32));
+        NSUDO_TEST_ASSERT(i == *Map.Find(Ids[i]));
+
+        if (i < 3)
+        {
+            NSUDO_TEST_ASSERT(Map.Erase(Ids[i]));
+        }
+    }
+
+    // The generations are 1, 2, 3 and then 1 again instead of 0.
+    NSUDO_TEST_ASSERT(1 == static_cast<DWORD>(Ids[3] >> 32));
+
+    // The wrap is the documented limit of the detection, the first identifier
+    // refers to the slot again.
+    NSUDO_TEST_ASSERT(Ids[0] == Ids[3]);
+    NSUDO_TEST_ASSERT(nullptr == Map.Find(Ids[1]));
+    NSUDO_TEST_ASSERT(nullptr == Map.Find(Ids[2]));
+    NSUDO_TEST_ASSERT(1 == Map.GetCount());
+}
+
+NSUDO_TEST(SlotMapStoresMovableHandles)
+{
+    M2::CSlotMap<M2::CHandle> Map;
+
+    M2_SLOT_ID Id = Map.Insert(M2::CHandle(
+        CreateEventW(nullptr, TRUE, FALSE, nullptr)));
+
+    M2::CHandle* Event = Map.Find(Id);
+    NSUDO_TEST_ASSERT(Event && Event->Get());
+    NSUDO_TEST_ASSERT(SetEvent(*Event));
+
+    // The handle is closed when it is erased.
+    NSUDO_TEST_ASSERT(Map.Erase(Id));
+    NSUDO_TEST_ASSERT(0 == Map.GetCount());
+}
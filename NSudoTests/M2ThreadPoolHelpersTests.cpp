@@ -0,0 +1,283 @@
+﻿/*
+ * PROJECT:   NSudo
+ * FILE:      M2ThreadPoolHelpersTests.cpp
+ * PURPOSE:   Unit tests for the work-stealing thread pool
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#include "stdafx.h"
+
+#include "M2ThreadPoolHelpers.h"
+
+#include <atomic>
+#include <vector>
+
+namespace
+{
+    const LONG g_DequeRaceRounds = 100000;
+
+    /**
+     * Creates the thread pool with the specified number of workers.
+     */
+    M2_THREAD_POOL_OPTIONS NSudoTestGetPoolOptions(
+        _In_ DWORD WorkerCount)
+    {
+        M2_THREAD_POOL_OPTIONS Options = { 0 };
+        Options.WorkerCount = WorkerCount;
+        return Options;
+    }
+
+    /**
+     * Blocks the only worker of the pool until the release event is set, so
+     * the tasks queued meanwhile are not started by the worker.
+     */
+    void NSudoTestBlockWorker(
+        _In_ M2::CThreadPoolTaskGroup& Group,
+        _In_ HANDLE StartedEvent,
+        _In_ HANDLE ReleaseEvent)
+    {
+        Group.Run([StartedEvent, ReleaseEvent]()
+        {
+            SetEvent(StartedEvent);
+            WaitForSingleObjectEx(ReleaseEvent, INFINITE, FALSE);
+        });
+
+        NSUDO_TEST_ASSERT(WAIT_OBJECT_0 == WaitForSingleObjectEx(
+            StartedEvent, 60 * 1000, FALSE));
+    }
+
+    M2_PROCESSOR_CORE_INFO NSudoTestMakeCore(
+        _In_ WORD Group,
+        _In_ DWORD FirstProcessor,
+        _In_ DWORD LogicalProcessorCount)
+    {
+        M2_PROCESSOR_CORE_INFO Core = { 0 };
+        Core.GroupMask.Group = Group;
+        for (DWORD i = 0; i < LogicalProcessorCount; ++i)
+        {
+            Core.GroupMask.Mask |= KAFFINITY(1) << (FirstProcessor + i);
+        }
+        Core.LogicalProcessorCount = LogicalProcessorCount;
+        Core.IsSimultaneousMultithreading = (LogicalProcessorCount > 1);
+        return Core;
+    }
+}
+
+NSUDO_TEST(WorkStealingDequeGivesTheLastTaskOnce)
+{
+    M2::CWorkStealingDeque Deque;
+    M2::CThreadPoolTask Task;
+
+    std::atomic<LONG> Round{ 0 };
+    std::atomic<LONG> StolenRound{ 0 };
+    std::atomic<M2::CThreadPoolTask*> StolenTask{ nullptr };
+
+    // The thief steals once per round, while the owner pops the same task.
+    M2::CHandle Thief = M2::CThread([&]()
+    {
+        for (LONG i = 1; i <= g_DequeRaceRounds; ++i)
+        {
+            while (Round.load(std::memory_order_acquire) != i)
+                YieldProcessor();
+
+            StolenTask.store(Deque.Steal(), std::memory_order_relaxed);
+            StolenRound.store(i, std::memory_order_release);
+        }
+    }).Detach();
+    NSUDO_TEST_ASSERT(Thief);
+
+    LONG LostCount = 0;
+    LONG DuplicatedCount = 0;
+
+    for (LONG i = 1; i <= g_DequeRaceRounds; ++i)
+    {
+        NSUDO_TEST_ASSERT(Deque.Push(&Task));
+        Round.store(i, std::memory_order_release);
+
+        M2::CThreadPoolTask* PoppedTask = Deque.Pop();
+
+        while (StolenRound.load(std::memory_order_acquire) != i)
+            YieldProcessor();
+
+        M2::CThreadPoolTask* Stolen =
+            StolenTask.load(std::memory_order_relaxed);
+
+        if (!PoppedTask && !Stolen)
+            ++LostCount;
+        else if (PoppedTask && Stolen)
+            ++DuplicatedCount;
+    }
+
+    NSUDO_TEST_ASSERT(WAIT_OBJECT_0 == WaitForSingleObjectEx(
+        Thief, 60 * 1000, FALSE));
+
+    NSUDO_TEST_ASSERT(0 == LostCount);
+    NSUDO_TEST_ASSERT(0 == DuplicatedCount);
+    NSUDO_TEST_ASSERT(nullptr == Deque.Pop());
+    NSUDO_TEST_ASSERT(nullptr == Deque.Steal());
+}
+
+NSUDO_TEST(ThreadPoolTaskGroupCancelSkipsQueuedTasks)
+{
+    M2::CHandle StartedEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    M2::CHandle ReleaseEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    NSUDO_TEST_ASSERT(StartedEvent && ReleaseEvent);
+
+    M2_THREAD_POOL_OPTIONS Options = NSudoTestGetPoolOptions(1);
+    M2::CThreadPool Pool(&Options);
+
+    M2::CThreadPoolTaskGroup BlockerGroup(Pool);
+    NSudoTestBlockWorker(BlockerGroup, StartedEvent, ReleaseEvent);
+
+    volatile LONG RunCount = 0;
+
+    M2::CThreadPoolTaskGroup Group(Pool);
+    for (int i = 0; i < 100; ++i)
+    {
+        Group.Run([&RunCount]() { InterlockedIncrement(&RunCount); });
+    }
+
+    NSUDO_TEST_ASSERT(!Group.IsCanceled());
+    Group.Cancel();
+    NSUDO_TEST_ASSERT(Group.IsCanceled());
+
+    SetEvent(ReleaseEvent);
+
+    // The canceled tasks are counted as completed, so Wait returns.
+    Group.Wait();
+    NSUDO_TEST_ASSERT(0 == RunCount);
+
+    BlockerGroup.Wait();
+
+    // The other groups are not affected by the cancellation.
+    M2::CThreadPoolTaskGroup OtherGroup(Pool);
+    OtherGroup.Run([&RunCount]() { InterlockedIncrement(&RunCount); });
+    OtherGroup.Wait();
+    NSUDO_TEST_ASSERT(1 == RunCount);
+}
+
+NSUDO_TEST(ThreadPoolTaskGroupWaitRunsTasksInline)
+{
+    M2::CHandle StartedEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    M2::CHandle ReleaseEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    NSUDO_TEST_ASSERT(StartedEvent && ReleaseEvent);
+
+    M2_THREAD_POOL_OPTIONS Options = NSudoTestGetPoolOptions(1);
+    M2::CThreadPool Pool(&Options);
+
+    M2::CThreadPoolTaskGroup BlockerGroup(Pool);
+    NSudoTestBlockWorker(BlockerGroup, StartedEvent, ReleaseEvent);
+
+    // The only worker is blocked, so the waiting thread runs all tasks.
+    std::vector<DWORD> ThreadIds(16, 0);
+
+    M2::CThreadPoolTaskGroup Group(Pool);
+    for (size_t i = 0; i < ThreadIds.size(); ++i)
+    {
+        Group.Run([&ThreadIds, i]() { ThreadIds[i] = GetCurrentThreadId(); });
+    }
+    Group.Wait();
+
+    for (DWORD ThreadId : ThreadIds)
+    {
+        NSUDO_TEST_ASSERT(GetCurrentThreadId() == ThreadId);
+    }
+
+    SetEvent(ReleaseEvent);
+    BlockerGroup.Wait();
+
+    // A task which waits for its child on the only worker runs the child
+    // itself instead of blocking the worker.
+    DWORD ParentThreadId = 0;
+    DWORD ChildThreadId = 0;
+
+    M2::CThreadPoolTaskGroup ParentGroup(Pool);
+    ParentGroup.Run([&]()
+    {
+        ParentThreadId = GetCurrentThreadId();
+
+        M2::CThreadPoolTaskGroup ChildGroup(Pool);
+        ChildGroup.Run([&]() { ChildThreadId = GetCurrentThreadId(); });
+        ChildGroup.Wait();
+    });
+    ParentGroup.Wait();
+
+    NSUDO_TEST_ASSERT(0 != ChildThreadId);
+    NSUDO_TEST_ASSERT(ParentThreadId == ChildThreadId ||
+        GetCurrentThreadId() == ChildThreadId);
+}
+
+NSUDO_TEST(ThreadPoolRunsTasksWithAffinityHints)
+{
+    M2::CThreadPool Pool;
+
+    volatile LONG RunCount = 0;
+
+    // An unknown group is ignored, and a known group is only preferred.
+    M2::CThreadPoolTaskGroup Group(Pool);
+    for (WORD i = 0; i < 64; ++i)
+    {
+        Group.Run([&RunCount]() { InterlockedIncrement(&RunCount); }, 0);
+        Group.Run([&RunCount]() { InterlockedIncrement(&RunCount); }, 0x100);
+        Group.Run([&RunCount]() { InterlockedIncrement(&RunCount); });
+    }
+    Group.Wait();
+
+    NSUDO_TEST_ASSERT(64 * 3 == RunCount);
+}
+
+NSUDO_TEST(ThreadPoolWorkersAreSpreadOverGroups)
+{
+    // Two full groups of 32 SMT cores and a smaller group of 16 cores.
+    M2_PROCESSOR_TOPOLOGY Topology;
+    Topology.LogicalProcessorCount = 0;
+    Topology.IsHybrid = false;
+    for (WORD Group = 0; Group < 3; ++Group)
+    {
+        DWORD CoreCount = (Group < 2) ? 32 : 16;
+        for (DWORD i = 0; i < CoreCount; ++i)
+        {
+            Topology.Cores.push_back(NSudoTestMakeCore(Group, i * 2, 2));
+            Topology.LogicalProcessorCount += 2;
+        }
+    }
+
+    std::vector<GROUP_AFFINITY> Affinities;
+    M2GetThreadPoolWorkerAffinities(
+        Topology, false, Topology.LogicalProcessorCount, Affinities);
+    NSUDO_TEST_ASSERT(Topology.LogicalProcessorCount == Affinities.size());
+
+    DWORD GroupWorkerCounts[3] = { 0 };
+    for (auto& Affinity : Affinities)
+    {
+        NSUDO_TEST_ASSERT(Affinity.Group < 3);
+        ++GroupWorkerCounts[Affinity.Group];
+
+        // The workers are not bound, so they can use the whole group.
+        NSUDO_TEST_ASSERT(Affinity.Mask == ((Affinity.Group < 2)
+            ? ~KAFFINITY(0)
+            : (KAFFINITY(1) << 32) - 1));
+    }
+    NSUDO_TEST_ASSERT(64 == GroupWorkerCounts[0]);
+    NSUDO_TEST_ASSERT(64 == GroupWorkerCounts[1]);
+    NSUDO_TEST_ASSERT(32 == GroupWorkerCounts[2]);
+
+    // The first workers already cover all groups.
+    NSUDO_TEST_ASSERT(0 == Affinities[0].Group);
+    NSUDO_TEST_ASSERT(1 == Affinities[1].Group);
+    NSUDO_TEST_ASSERT(2 == Affinities[2].Group);
+
+    // The bound workers get the cores in order.
+    M2GetThreadPoolWorkerAffinities(Topology, true, 4, Affinities);
+    NSUDO_TEST_ASSERT(4 == Affinities.size());
+    NSUDO_TEST_ASSERT(0 == Affinities[1].Group);
+    NSUDO_TEST_ASSERT((KAFFINITY(3) << 2) == Affinities[1].Mask);
+
+    // The workers need no affinity with only one group.
+    Topology.Cores.resize(32);
+    M2GetThreadPoolWorkerAffinities(Topology, false, 64, Affinities);
+    NSUDO_TEST_ASSERT(Affinities.empty());
+}
@@ -0,0 +1,99 @@
+﻿/*
+ * PROJECT:   NSudo
+ * FILE:      M2TraceHelpersTests.cpp
+ * PURPOSE:   Unit tests for the trace helpers
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#include "stdafx.h"
+
+namespace
+{
+    /**
+     * Enables the tracing to the specified file through a temporary
+     * environment variable.
+     */
+    HRESULT NSudoTestTraceInitialize(
+        _In_ const std::wstring& TraceFilePath)
+    {
+        if (!SetEnvironmentVariableW(
+            L"NSUDO_TEST_TRACE_FILE", TraceFilePath.c_str()))
+        {
+            return E_FAIL;
+        }
+
+        HRESULT hr = M2TraceInitialize(L"NSUDO_TEST_TRACE_FILE");
+        SetEnvironmentVariableW(L"NSUDO_TEST_TRACE_FILE", nullptr);
+        return hr;
+    }
+}
+
+NSUDO_TEST(TraceEventNamesAreEscaped)
+{
+    CNSudoTestDirectory Directory;
+    std::wstring TraceFilePath = Directory.GetFilePath(L"Trace.json");
+
+    NSUDO_TEST_ASSERT(S_OK == NSudoTestTraceInitialize(TraceFilePath));
+
+    const char* const Name = "Quote\" Backslash\\ Tab\t";
+
+    ULONGLONG Count = M2GetPerformanceCounter();
+    M2TraceRecordEvent(Name, Count, Count);
+
+    NSUDO_TEST_ASSERT(S_OK == M2TraceUninitialize());
+
+    nlohmann::json TraceJSON = nlohmann::json::parse(
+        NSudoTestReadFile(TraceFilePath), nullptr, false);
+    NSUDO_TEST_ASSERT(TraceJSON.is_object());
+
+    bool IsFound = false;
+    for (auto& Event : TraceJSON["traceEvents"])
+    {
+        if (Name == Event["name"].get<std::string>())
+            IsFound = true;
+    }
+    NSUDO_TEST_ASSERT(IsFound);
+}
+
+NSUDO_TEST(TraceEventsAreWrittenOncePerSession)
+{
+    CNSudoTestDirectory Directory;
+
+    const char* const Names[] = { "FirstSession", "SecondSession" };
+
+    for (size_t i = 0; i < 2; ++i)
+    {
+        std::wstring TraceFilePath = Directory.GetFilePath(
+            i ? L"Trace2.json" : L"Trace1.json");
+
+        NSUDO_TEST_ASSERT(S_OK == NSudoTestTraceInitialize(TraceFilePath));
+
+        ULONGLONG Count = M2GetPerformanceCounter();
+        M2TraceRecordEvent(Names[i], Count, Count);
+
+        NSUDO_TEST_ASSERT(S_OK == M2TraceUninitialize());
+
+        nlohmann::json TraceJSON = nlohmann::json::parse(
+            NSudoTestReadFile(TraceFilePath), nullptr, false);
+        NSUDO_TEST_ASSERT(TraceJSON.is_object());
+
+        // Each file only has the event of its own session, and the time
+        // stamp is relative to the start of that session.
+        size_t EventCount = 0;
+        for (auto& Event : TraceJSON["traceEvents"])
+        {
+            if (Names[i] != Event["name"].get<std::string>())
+                continue;
+
+            ++EventCount;
+
+            double TimeStamp = Event["ts"].get<double>();
+            NSUDO_TEST_ASSERT(TimeStamp >= 0.0 && TimeStamp < 60e6);
+        }
+        NSUDO_TEST_ASSERT(1 == EventCount);
+        NSUDO_TEST_ASSERT(1 == TraceJSON["traceEvents"].size());
+    }
+}
@@ -0,0 +1,537 @@
+﻿/*
+ * PROJECT:   NSudo
+ * FILE:      M2Win32HelpersTests.cpp
+ * PURPOSE:   Unit tests for the Win32 helpers
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#include "stdafx.h"
+
+#pragma region CResourceCatalog
+
+namespace
+{
+    // The in-memory image of a resource in four languages. The content of
+    // each resource is its language identifier, so the tests can tell which
+    // one is returned.
+    const LANGID g_ResourceLanguages[] =
+    {
+        MAKELANGID(LANG_NEUTRAL, SUBLANG_NEUTRAL),
+        MAKELANGID(LANG_CHINESE, SUBLANG_CHINESE_TRADITIONAL),
+        MAKELANGID(LANG_ENGLISH, SUBLANG_ENGLISH_US),
+        MAKELANGID(LANG_CHINESE, SUBLANG_CHINESE_SIMPLIFIED)
+    };
+
+    void NSudoTestAddResources(
+        _Inout_ M2::CResourceCatalog& Catalog,
+        _In_ bool IncludeNeutral)
+    {
+        for (const LANGID& Language : g_ResourceLanguages)
+        {
+            if (!IncludeNeutral && LANG_NEUTRAL == PRIMARYLANGID(Language))
+                continue;
+
+            M2_RESOURCE_INFO ResourceInfo;
+            ResourceInfo.Size = sizeof(LANGID);
+            ResourceInfo.Pointer = const_cast<LANGID*>(&Language);
+
+            NSUDO_TEST_ASSERT(S_OK == Catalog.AddResource(
+                L"String", MAKEINTRESOURCEW(2000), Language, ResourceInfo));
+        }
+    }
+
+    LANGID NSudoTestFindResource(
+        _In_ const M2::CResourceCatalog& Catalog,
+        _In_ std::initializer_list<LANGID> Languages)
+    {
+        M2_RESOURCE_INFO ResourceInfo;
+        NSUDO_TEST_ASSERT(S_OK == Catalog.Find(
+            &ResourceInfo,
+            L"STRING",
+            L"#2000",
+            Languages.begin(),
+            Languages.size()));
+        NSUDO_TEST_ASSERT(sizeof(LANGID) == ResourceInfo.Size);
+
+        return *reinterpret_cast<LANGID*>(ResourceInfo.Pointer);
+    }
+}
+
+NSUDO_TEST(ResourceCatalogPrefersExactLanguage)
+{
+    M2::CResourceCatalog Catalog;
+    NSudoTestAddResources(Catalog, true);
+
+    NSUDO_TEST_ASSERT(
+        MAKELANGID(LANG_CHINESE, SUBLANG_CHINESE_SIMPLIFIED) ==
+        NSudoTestFindResource(Catalog, {
+            MAKELANGID(LANG_CHINESE, SUBLANG_CHINESE_SIMPLIFIED) }));
+
+    // The first preferred language wins over the later ones.
+    NSUDO_TEST_ASSERT(
+        MAKELANGID(LANG_ENGLISH, SUBLANG_ENGLISH_US) ==
+        NSudoTestFindResource(Catalog, {
+            MAKELANGID(LANG_ENGLISH, SUBLANG_ENGLISH_US),
+            MAKELANGID(LANG_CHINESE, SUBLANG_CHINESE_SIMPLIFIED) }));
+
+    // An exact match of a later language wins over a primary language match
+    // of an earlier one.
+    NSUDO_TEST_ASSERT(
+        MAKELANGID(LANG_CHINESE, SUBLANG_CHINESE_SIMPLIFIED) ==
+        NSudoTestFindResource(Catalog, {
+            MAKELANGID(LANG_ENGLISH, SUBLANG_ENGLISH_UK),
+            MAKELANGID(LANG_CHINESE, SUBLANG_CHINESE_SIMPLIFIED) }));
+}
+
+NSUDO_TEST(ResourceCatalogFallsBackToPrimaryLanguage)
+{
+    M2::CResourceCatalog Catalog;
+    NSudoTestAddResources(Catalog, true);
+
+    NSUDO_TEST_ASSERT(
+        MAKELANGID(LANG_ENGLISH, SUBLANG_ENGLISH_US) ==
+        NSudoTestFindResource(Catalog, {
+            MAKELANGID(LANG_JAPANESE, SUBLANG_JAPANESE_JAPAN),
+            MAKELANGID(LANG_ENGLISH, SUBLANG_ENGLISH_UK) }));
+}
+
+NSUDO_TEST(ResourceCatalogFallsBackToNeutralThenEnglish)
+{
+    M2::CResourceCatalog Catalog;
+    NSudoTestAddResources(Catalog, true);
+
+    NSUDO_TEST_ASSERT(
+        MAKELANGID(LANG_NEUTRAL, SUBLANG_NEUTRAL) ==
+        NSudoTestFindResource(Catalog, {
+            MAKELANGID(LANG_JAPANESE, SUBLANG_JAPANESE_JAPAN) }));
+
+    M2::CResourceCatalog CatalogWithoutNeutral;
+    NSudoTestAddResources(CatalogWithoutNeutral, false);
+
+    NSUDO_TEST_ASSERT(
+        MAKELANGID(LANG_ENGLISH, SUBLANG_ENGLISH_US) ==
+        NSudoTestFindResource(CatalogWithoutNeutral, {
+            MAKELANGID(LANG_JAPANESE, SUBLANG_JAPANESE_JAPAN) }));
+
+    NSUDO_TEST_ASSERT(
+        MAKELANGID(LANG_ENGLISH, SUBLANG_ENGLISH_US) ==
+        NSudoTestFindResource(CatalogWithoutNeutral, {}));
+}
+
+NSUDO_TEST(ResourceCatalogFollowsThreadUILanguage)
+{
+    M2::CResourceCatalog Catalog;
+    NSudoTestAddResources(Catalog, true);
+
+    LANGID PreviousLanguage = GetThreadUILanguage();
+
+    NSUDO_TEST_ASSERT(SetThreadUILanguage(
+        MAKELANGID(LANG_CHINESE, SUBLANG_CHINESE_TRADITIONAL)));
+
+    M2_RESOURCE_INFO ResourceInfo;
+    HRESULT hr = Catalog.Find(
+        &ResourceInfo, L"String", MAKEINTRESOURCEW(2000));
+
+    SetThreadUILanguage(PreviousLanguage);
+
+    NSUDO_TEST_ASSERT(S_OK == hr);
+    NSUDO_TEST_ASSERT(
+        MAKELANGID(LANG_CHINESE, SUBLANG_CHINESE_TRADITIONAL) ==
+        *reinterpret_cast<LANGID*>(ResourceInfo.Pointer));
+}
+
+NSUDO_TEST(ResourceCatalogReportsMissingResource)
+{
+    M2::CResourceCatalog Catalog;
+    NSudoTestAddResources(Catalog, true);
+
+    M2_RESOURCE_INFO ResourceInfo;
+    NSUDO_TEST_ASSERT(
+        HRESULT_FROM_WIN32(ERROR_RESOURCE_NAME_NOT_FOUND) == Catalog.Find(
+            &ResourceInfo, L"String", MAKEINTRESOURCEW(2001)));
+    NSUDO_TEST_ASSERT(nullptr == ResourceInfo.Pointer);
+}
+
+#pragma endregion
+
+#pragma region CImportedProcedure
+
+namespace
+{
+    typedef decltype(GetTickCount64)* PNSUDO_TEST_PROCEDURE;
+}
+
+NSUDO_TEST(ImportedProcedureCachesResolvedProcedure)
+{
+    M2::CImportedProcedure<PNSUDO_TEST_PROCEDURE> Procedure(
+        L"kernel32.dll", "GetTickCount64");
+
+    // Nothing is resolved until the first call.
+    LONG ResolveCount = M2::CImportedProcedureBase::GetResolveCount();
+
+    PNSUDO_TEST_PROCEDURE pFunc = nullptr;
+    NSUDO_TEST_ASSERT(S_OK == Procedure.Get(pFunc));
+    NSUDO_TEST_ASSERT(ResolveCount + 1 ==
+        M2::CImportedProcedureBase::GetResolveCount());
+    NSUDO_TEST_ASSERT(reinterpret_cast<FARPROC>(pFunc) == GetProcAddress(
+        GetModuleHandleW(L"kernel32.dll"), "GetTickCount64"));
+    NSUDO_TEST_ASSERT(0 != pFunc());
+
+    PNSUDO_TEST_PROCEDURE CachedFunc = nullptr;
+    NSUDO_TEST_ASSERT(S_OK == Procedure.Get(CachedFunc));
+    NSUDO_TEST_ASSERT(pFunc == CachedFunc);
+    NSUDO_TEST_ASSERT(ResolveCount + 1 ==
+        M2::CImportedProcedureBase::GetResolveCount());
+}
+
+NSUDO_TEST(ImportedProcedureCachesFailures)
+{
+    M2::CImportedProcedure<PNSUDO_TEST_PROCEDURE> MissingProcedure(
+        L"kernel32.dll", "NSudoTestMissingProcedure");
+    M2::CImportedProcedure<PNSUDO_TEST_PROCEDURE> MissingModule(
+        L"NSudoTestMissingModule.dll", "GetTickCount64");
+
+    LONG ResolveCount = M2::CImportedProcedureBase::GetResolveCount();
+
+    for (int i = 0; i < 3; ++i)
+    {
+        PNSUDO_TEST_PROCEDURE pFunc = GetTickCount64;
+        NSUDO_TEST_ASSERT(HRESULT_FROM_WIN32(ERROR_PROC_NOT_FOUND) ==
+            MissingProcedure.Get(pFunc));
+        NSUDO_TEST_ASSERT(nullptr == pFunc);
+
+        pFunc = GetTickCount64;
+        NSUDO_TEST_ASSERT(FAILED(MissingModule.Get(pFunc)));
+        NSUDO_TEST_ASSERT(nullptr == pFunc);
+    }
+
+    // Each failure is resolved once and never retried.
+    NSUDO_TEST_ASSERT(ResolveCount + 2 ==
+        M2::CImportedProcedureBase::GetResolveCount());
+}
+
+NSUDO_TEST(ImportedProcedureIsResolvedOnceByConcurrentGet)
+{
+    const DWORD ThreadCount = 16;
+
+    M2::CImportedProcedure<PNSUDO_TEST_PROCEDURE> Procedure(
+        L"kernel32.dll", "GetTickCount64");
+
+    LONG ResolveCount = M2::CImportedProcedureBase::GetResolveCount();
+
+    volatile LONG Start = 0;
+    HRESULT Results[ThreadCount];
+    PNSUDO_TEST_PROCEDURE Procedures[ThreadCount] = { nullptr };
+
+    std::vector<HANDLE> Threads;
+    for (DWORD i = 0; i < ThreadCount; ++i)
+    {
+        HANDLE ThreadHandle = M2::CThread([&, i]()
+        {
+            while (!Start)
+                YieldProcessor();
+
+            Results[i] = Procedure.Get(Procedures[i]);
+        }).Detach();
+        NSUDO_TEST_ASSERT(nullptr != ThreadHandle);
+        Threads.push_back(ThreadHandle);
+    }
+
+    InterlockedExchange(&Start, 1);
+
+    DWORD WaitResult = WaitForMultipleObjectsEx(
+        ThreadCount, Threads.data(), TRUE, 60 * 1000, FALSE);
+    for (HANDLE ThreadHandle : Threads)
+        CloseHandle(ThreadHandle);
+    NSUDO_TEST_ASSERT(WAIT_OBJECT_0 == WaitResult);
+
+    NSUDO_TEST_ASSERT(ResolveCount + 1 ==
+        M2::CImportedProcedureBase::GetResolveCount());
+    for (DWORD i = 0; i < ThreadCount; ++i)
+    {
+        NSUDO_TEST_ASSERT(S_OK == Results[i]);
+        NSUDO_TEST_ASSERT(Procedures[0] == Procedures[i]);
+    }
+    NSUDO_TEST_ASSERT(nullptr != Procedures[0]);
+}
+
+#pragma endregion
+
+#pragma region Processor Topology
+
+namespace
+{
+    /**
+     * Builds the buffer of the processor information records in the layout
+     * of GetLogicalProcessorInformationEx.
+     */
+    class CNSudoTestProcessorInformation
+    {
+    private:
+        std::vector<ULONGLONG> m_Buffer;
+        DWORD m_Length = 0;
+
+        PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX AddRecord(
+            _In_ LOGICAL_PROCESSOR_RELATIONSHIP Relationship,
+            _In_ WORD GroupCount)
+        {
+            size_t Size = FIELD_OFFSET(
+                SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX,
+                Processor.GroupMask) + GroupCount * sizeof(GROUP_AFFINITY);
+            if (Size < sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX))
+                Size = sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX);
+
+            // The records are aligned like the ones of the system.
+            Size = (Size + sizeof(ULONGLONG) - 1) & ~(sizeof(ULONGLONG) - 1);
+
+            this->m_Buffer.resize(
+                (this->m_Length + Size) / sizeof(ULONGLONG), 0);
+
+            PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX Information =
+                reinterpret_cast<PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX>(
+                    reinterpret_cast<PBYTE>(this->m_Buffer.data()) +
+                    this->m_Length);
+            Information->Relationship = Relationship;
+            Information->Size = static_cast<DWORD>(Size);
+
+            this->m_Length += static_cast<DWORD>(Size);
+
+            return Information;
+        }
+
+    public:
+        static GROUP_AFFINITY MakeGroupMask(
+            _In_ WORD Group,
+            _In_ KAFFINITY Mask)
+        {
+            GROUP_AFFINITY GroupMask = { 0 };
+            GroupMask.Group = Group;
+            GroupMask.Mask = Mask;
+            return GroupMask;
+        }
+
+        /**
+         * Adds the cores with the same number of logical processors, which
+         * use the consecutive processors of the group from the first one.
+         */
+        void AddCores(
+            _In_ WORD Group,
+            _In_ DWORD FirstProcessor,
+            _In_ DWORD CoreCount,
+            _In_ DWORD ThreadsPerCore,
+            _In_ BYTE EfficiencyClass)
+        {
+            for (DWORD i = 0; i < CoreCount; ++i)
+            {
+                PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX Information =
+                    this->AddRecord(RelationProcessorCore, 1);
+                Information->Processor.Flags =
+                    (ThreadsPerCore > 1) ? LTP_PC_SMT : 0;
+                Information->Processor.EfficiencyClass = EfficiencyClass;
+                Information->Processor.GroupCount = 1;
+                Information->Processor.GroupMask[0] = MakeGroupMask(
+                    Group,
+                    ((KAFFINITY(1) << ThreadsPerCore) - 1) <<
+                    (FirstProcessor + i * ThreadsPerCore));
+            }
+        }
+
+        void AddPackage(
+            _In_ std::initializer_list<GROUP_AFFINITY> GroupMasks)
+        {
+            PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX Information =
+                this->AddRecord(
+                    RelationProcessorPackage,
+                    static_cast<WORD>(GroupMasks.size()));
+            Information->Processor.GroupCount =
+                static_cast<WORD>(GroupMasks.size());
+
+            WORD Index = 0;
+            for (const GROUP_AFFINITY& GroupMask : GroupMasks)
+            {
+                Information->Processor.GroupMask[Index++] = GroupMask;
+            }
+        }
+
+        void AddNumaNode(
+            _In_ DWORD NodeNumber,
+            _In_ GROUP_AFFINITY GroupMask)
+        {
+            PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX Information =
+                this->AddRecord(RelationNumaNode, 1);
+            Information->NumaNode.NodeNumber = NodeNumber;
+            Information->NumaNode.GroupMask = GroupMask;
+        }
+
+        void AddCache(
+            _In_ BYTE Level,
+            _In_ PROCESSOR_CACHE_TYPE Type,
+            _In_ DWORD CacheSize,
+            _In_ GROUP_AFFINITY GroupMask)
+        {
+            PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX Information =
+                this->AddRecord(RelationCache, 1);
+            Information->Cache.Level = Level;
+            Information->Cache.Associativity = 8;
+            Information->Cache.LineSize = 64;
+            Information->Cache.CacheSize = CacheSize;
+            Information->Cache.Type = Type;
+            Information->Cache.GroupMask = GroupMask;
+        }
+
+        void AddGroups()
+        {
+            this->AddRecord(RelationGroup, 1);
+        }
+
+        PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX GetBuffer()
+        {
+            return reinterpret_cast<PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX>(
+                this->m_Buffer.data());
+        }
+
+        DWORD GetLength() const
+        {
+            return this->m_Length;
+        }
+    };
+
+    /**
+     * Builds a hybrid system with three processor groups. The first package
+     * is group 0 with 4 performance cores with SMT and 4 efficiency cores.
+     * The second package spans group 1 with 4 performance cores with SMT and
+     * group 2 with 4 efficiency cores. Each group is a NUMA node.
+     */
+    void NSudoTestBuildHybridSystem(
+        _Inout_ CNSudoTestProcessorInformation& Information,
+        _In_ BYTE PerformanceClass,
+        _In_ BYTE EfficiencyClass)
+    {
+        typedef CNSudoTestProcessorInformation CInformation;
+
+        Information.AddCores(0, 0, 4, 2, PerformanceClass);
+        Information.AddCores(0, 8, 4, 1, EfficiencyClass);
+        Information.AddCores(1, 0, 4, 2, PerformanceClass);
+        Information.AddCores(2, 0, 4, 1, EfficiencyClass);
+
+        Information.AddCache(1, CacheData, 48 * 1024,
+            CInformation::MakeGroupMask(0, 0x3));
+        Information.AddCache(1, CacheInstruction, 32 * 1024,
+            CInformation::MakeGroupMask(0, 0x3));
+        Information.AddCache(2, CacheUnified, 2 * 1024 * 1024,
+            CInformation::MakeGroupMask(0, 0xF00));
+        Information.AddCache(3, CacheUnified, 30 * 1024 * 1024,
+            CInformation::MakeGroupMask(0, 0xFFF));
+        Information.AddCache(3, CacheUnified, 30 * 1024 * 1024,
+            CInformation::MakeGroupMask(1, 0xFF));
+
+        Information.AddPackage({ CInformation::MakeGroupMask(0, 0xFFF) });
+        Information.AddPackage({
+            CInformation::MakeGroupMask(1, 0xFF),
+            CInformation::MakeGroupMask(2, 0xF) });
+
+        Information.AddNumaNode(0, CInformation::MakeGroupMask(0, 0xFFF));
+        Information.AddNumaNode(1, CInformation::MakeGroupMask(1, 0xFF));
+        Information.AddNumaNode(2, CInformation::MakeGroupMask(2, 0xF));
+
+        // The records of the other relationships are skipped.
+        Information.AddGroups();
+    }
+}
+
+NSUDO_TEST(ProcessorTopologyParsesHybridMultiGroupSystem)
+{
+    CNSudoTestProcessorInformation Information;
+    NSudoTestBuildHybridSystem(Information, 1, 0);
+
+    M2_PROCESSOR_TOPOLOGY Topology;
+    NSUDO_TEST_ASSERT(S_OK == M2ParseProcessorTopology(
+        Information.GetBuffer(), Information.GetLength(), Topology));
+
+    NSUDO_TEST_ASSERT(24 == Topology.LogicalProcessorCount);
+    NSUDO_TEST_ASSERT(Topology.IsHybrid);
+    NSUDO_TEST_ASSERT(16 == Topology.Cores.size());
+    NSUDO_TEST_ASSERT(3 == Topology.NumaNodes.size());
+
+    DWORD SMTCoreCount = 0;
+    DWORD EfficiencyCoreCount = 0;
+    for (const M2_PROCESSOR_CORE_INFO& Core : Topology.Cores)
+    {
+        if (Core.IsSimultaneousMultithreading)
+        {
+            ++SMTCoreCount;
+            NSUDO_TEST_ASSERT(2 == Core.LogicalProcessorCount);
+            NSUDO_TEST_ASSERT(1 == Core.EfficiencyClass);
+        }
+        else
+        {
+            ++EfficiencyCoreCount;
+            NSUDO_TEST_ASSERT(1 == Core.LogicalProcessorCount);
+            NSUDO_TEST_ASSERT(0 == Core.EfficiencyClass);
+        }
+
+        // Each group is a NUMA node, and group 0 is the first package.
+        NSUDO_TEST_ASSERT(Core.GroupMask.Group == Core.NumaNodeNumber);
+        NSUDO_TEST_ASSERT(
+            (0 == Core.GroupMask.Group ? 0u : 1u) == Core.PackageIndex);
+    }
+    NSUDO_TEST_ASSERT(8 == SMTCoreCount);
+    NSUDO_TEST_ASSERT(8 == EfficiencyCoreCount);
+
+    NSUDO_TEST_ASSERT(2 == Topology.Packages.size());
+    for (const M2_PROCESSOR_PACKAGE_INFO& Package : Topology.Packages)
+    {
+        NSUDO_TEST_ASSERT(8 == Package.CoreCount);
+        NSUDO_TEST_ASSERT(12 == Package.LogicalProcessorCount);
+    }
+    NSUDO_TEST_ASSERT(1 == Topology.Packages[0].GroupMasks.size());
+    NSUDO_TEST_ASSERT(2 == Topology.Packages[1].GroupMasks.size());
+    NSUDO_TEST_ASSERT(2 == Topology.Packages[1].GroupMasks[1].Group);
+
+    NSUDO_TEST_ASSERT(5 == Topology.Caches.size());
+    NSUDO_TEST_ASSERT(1 == Topology.Caches[0].Level);
+    NSUDO_TEST_ASSERT(CacheData == Topology.Caches[0].Type);
+    NSUDO_TEST_ASSERT(CacheInstruction == Topology.Caches[1].Type);
+    NSUDO_TEST_ASSERT(2 == Topology.Caches[2].Level);
+    NSUDO_TEST_ASSERT(2 * 1024 * 1024 == Topology.Caches[2].CacheSize);
+    NSUDO_TEST_ASSERT(3 == Topology.Caches[4].Level);
+    NSUDO_TEST_ASSERT(1 == Topology.Caches[4].GroupMask.Group);
+    NSUDO_TEST_ASSERT(64 == Topology.Caches[4].LineSize);
+}
+
+NSUDO_TEST(ProcessorTopologyIsNotHybridWithOneEfficiencyClass)
+{
+    CNSudoTestProcessorInformation Information;
+    NSudoTestBuildHybridSystem(Information, 0, 0);
+
+    M2_PROCESSOR_TOPOLOGY Topology;
+    NSUDO_TEST_ASSERT(S_OK == M2ParseProcessorTopology(
+        Information.GetBuffer(), Information.GetLength(), Topology));
+
+    NSUDO_TEST_ASSERT(24 == Topology.LogicalProcessorCount);
+    NSUDO_TEST_ASSERT(!Topology.IsHybrid);
+}
+
+NSUDO_TEST(ProcessorTopologyRejectsTruncatedRecords)
+{
+    CNSudoTestProcessorInformation Information;
+    Information.AddCores(0, 0, 2, 2, 0);
+
+    M2_PROCESSOR_TOPOLOGY Topology;
+
+    // The second record is cut in the middle.
+    NSUDO_TEST_ASSERT(HRESULT_FROM_WIN32(ERROR_INVALID_DATA) ==
+        M2ParseProcessorTopology(
+            Information.GetBuffer(), Information.GetLength() - 8, Topology));
+
+    // An empty record would never move to the next one.
+    Information.GetBuffer()->Size = 0;
+    NSUDO_TEST_ASSERT(HRESULT_FROM_WIN32(ERROR_INVALID_DATA) ==
+        M2ParseProcessorTopology(
+            Information.GetBuffer(), Information.GetLength(), Topology));
+}
+
+#pragma endregion
@@ -0,0 +1,864 @@
+﻿/*
+ * PROJECT:   NSudo
+ * FILE:      NSudoAppTests.cpp
+ * PURPOSE:   Unit tests for the internals of NSudo
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#include "stdafx.h"
+
+// The internals of NSudo are not exported by any header, so NSudo.cpp is
+// compiled into this translation unit without its entry point.
+#include "../NSudo/NSudo.cpp"
+
+#include "NSudoStubPlatform.h"
+
+#include <set>
+
+#pragma region CNSudoShortCutAdapter
+
+namespace
+{
+    bool NSudoTestFileExists(
+        _In_ const std::wstring& FilePath)
+    {
+        return INVALID_FILE_ATTRIBUTES != GetFileAttributesW(
+            FilePath.c_str());
+    }
+
+    /**
+     * Tells whether the journal has no records, which is the state after a
+     * compaction.
+     */
+    bool NSudoTestJournalIsEmpty(
+        _In_ const std::wstring& ShortCutListPath)
+    {
+        WIN32_FILE_ATTRIBUTE_DATA Data;
+        if (!GetFileAttributesExW(
+            (ShortCutListPath + L".journal").c_str(),
+            GetFileExInfoStandard,
+            &Data))
+        {
+            return true;
+        }
+
+        return 0 == Data.nFileSizeLow && 0 == Data.nFileSizeHigh;
+    }
+
+    /**
+     * Tells whether a temporary file of the compaction is left behind.
+     */
+    bool NSudoTestCompactionFileExists(
+        _In_ const std::wstring& ShortCutListPath)
+    {
+        WIN32_FIND_DATAW FindData;
+        HANDLE FindHandle = FindFirstFileW(
+            (ShortCutListPath + L".*.tmp").c_str(), &FindData);
+        if (INVALID_HANDLE_VALUE == FindHandle)
+            return false;
+
+        FindClose(FindHandle);
+        return true;
+    }
+
+    std::map<std::wstring, std::wstring> NSudoTestReadShortCuts(
+        _In_ const std::wstring& ShortCutListPath)
+    {
+        std::map<std::wstring, std::wstring> ShortCutList;
+        CNSudoShortCutAdapter::Read(ShortCutListPath, ShortCutList);
+        return ShortCutList;
+    }
+}
+
+NSUDO_TEST(ShortCutJournalRecordsAddAndRemove)
+{
+    CNSudoTestDirectory Directory;
+    std::wstring Path = Directory.GetFilePath(L"NSudo.json");
+
+    std::map<std::wstring, std::wstring> ShortCutList;
+    NSUDO_TEST_ASSERT(CNSudoShortCutAdapter::Add(
+        Path, ShortCutList, L"命令提示符", L"cmd"));
+    NSUDO_TEST_ASSERT(CNSudoShortCutAdapter::Add(
+        Path, ShortCutList, L"Hosts", L"notepad hosts"));
+    NSUDO_TEST_ASSERT(CNSudoShortCutAdapter::Add(
+        Path, ShortCutList, L"Hosts", L"notepad %windir%\\hosts"));
+    NSUDO_TEST_ASSERT(CNSudoShortCutAdapter::Remove(
+        Path, ShortCutList, L"命令提示符"));
+
+    // Only the journal is written before the compaction.
+    NSUDO_TEST_ASSERT(!NSudoTestFileExists(Path));
+
+    std::map<std::wstring, std::wstring> Expected =
+    {
+        { L"Hosts", L"notepad %windir%\\hosts" }
+    };
+    NSUDO_TEST_ASSERT(Expected == ShortCutList);
+    NSUDO_TEST_ASSERT(Expected == NSudoTestReadShortCuts(Path));
+}
+
+NSUDO_TEST(ShortCutJournalIsMergedWithConfig)
+{
+    CNSudoTestDirectory Directory;
+    std::wstring Path = Directory.GetFilePath(L"NSudo.json");
+
+    NSudoTestWriteFile(
+        Path,
+        "\xEF\xBB\xBF{ \"ShortCutList_V2\": "
+        "{ \"A\": \"a\", \"B\": \"b\", \"C\": 1 } }");
+    NSudoTestWriteFile(
+        Path + L".journal",
+        "{\"Key\":\"A\",\"Op\":\"Remove\"}\n"
+        "{\"Key\":\"B\",\"Op\":\"Add\",\"Value\":\"b2\"}\n"
+        "{\"Key\":\"D\",\"Op\":\"Add\",\"Value\":\"d\"}\n");
+
+    // The values which are not strings are skipped.
+    std::map<std::wstring, std::wstring> Expected =
+    {
+        { L"B", L"b2" },
+        { L"D", L"d" }
+    };
+    NSUDO_TEST_ASSERT(Expected == NSudoTestReadShortCuts(Path));
+}
+
+NSUDO_TEST(ShortCutJournalIgnoresTornTail)
+{
+    CNSudoTestDirectory Directory;
+    std::wstring Path = Directory.GetFilePath(L"NSudo.json");
+    std::wstring JournalPath = Path + L".journal";
+
+    // The process was terminated while the second record was appended.
+    const std::string CompleteRecord =
+        "{\"Key\":\"A\",\"Op\":\"Add\",\"Value\":\"a\"}\n";
+    NSudoTestWriteFile(
+        JournalPath,
+        CompleteRecord + "{\"Key\":\"B\",\"Op\":\"Add\",\"Val");
+
+    std::map<std::wstring, std::wstring> ShortCutList =
+        NSudoTestReadShortCuts(Path);
+    NSUDO_TEST_ASSERT(1 == ShortCutList.size());
+    NSUDO_TEST_ASSERT(L"a" == ShortCutList[L"A"]);
+
+    // The next append drops the torn tail instead of extending it.
+    NSUDO_TEST_ASSERT(CNSudoShortCutAdapter::Add(
+        Path, ShortCutList, L"C", L"c"));
+    NSUDO_TEST_ASSERT(
+        CompleteRecord + "{\"Key\":\"C\",\"Op\":\"Add\",\"Value\":\"c\"}\n" ==
+        NSudoTestReadFile(JournalPath));
+
+    std::map<std::wstring, std::wstring> Expected =
+    {
+        { L"A", L"a" },
+        { L"C", L"c" }
+    };
+    NSUDO_TEST_ASSERT(Expected == NSudoTestReadShortCuts(Path));
+}
+
+NSUDO_TEST(ShortCutJournalIgnoresCompleteRecordWithoutLineFeed)
+{
+    CNSudoTestDirectory Directory;
+    std::wstring Path = Directory.GetFilePath(L"NSudo.json");
+
+    // The line feed is the commit mark, so a record which is complete JSON
+    // but was not acknowledged is not replayed.
+    NSudoTestWriteFile(
+        Path + L".journal",
+        "{\"Key\":\"A\",\"Op\":\"Add\",\"Value\":\"a\"}");
+
+    NSUDO_TEST_ASSERT(NSudoTestReadShortCuts(Path).empty());
+}
+
+NSUDO_TEST(ShortCutJournalSkipsDamagedLines)
+{
+    CNSudoTestDirectory Directory;
+    std::wstring Path = Directory.GetFilePath(L"NSudo.json");
+
+    NSudoTestWriteFile(
+        Path + L".journal",
+        "{\"Key\":\"A\",\"Op\":\"Add\",\"Value\":\"a\"}\n"
+        "{\"Key\":\"B\",\"Op\":\"Add\",\"Val\n"
+        "\n"
+        "[1,2,3]\n"
+        "{\"Key\":1,\"Op\":\"Add\",\"Value\":\"x\"}\n"
+        "{\"Key\":\"E\",\"Op\":\"Add\",\"Value\":2}\n"
+        "{\"Key\":\"F\",\"Op\":\"Rename\",\"Value\":\"f\"}\n"
+        "{\"Key\":\"G\",\"Op\":\"Add\",\"Value\":\"g\"}\n");
+
+    std::map<std::wstring, std::wstring> Expected =
+    {
+        { L"A", L"a" },
+        { L"G", L"g" }
+    };
+    NSUDO_TEST_ASSERT(Expected == NSudoTestReadShortCuts(Path));
+}
+
+NSUDO_TEST(ShortCutJournalReplayAfterCompactionIsIdempotent)
+{
+    CNSudoTestDirectory Directory;
+    std::wstring Path = Directory.GetFilePath(L"NSudo.json");
+    std::wstring JournalPath = Path + L".journal";
+
+    std::map<std::wstring, std::wstring> ShortCutList;
+    NSUDO_TEST_ASSERT(CNSudoShortCutAdapter::Add(
+        Path, ShortCutList, L"A", L"a"));
+    NSUDO_TEST_ASSERT(CNSudoShortCutAdapter::Add(
+        Path, ShortCutList, L"B", L"b"));
+    NSUDO_TEST_ASSERT(CNSudoShortCutAdapter::Remove(
+        Path, ShortCutList, L"A"));
+
+    std::string Journal = NSudoTestReadFile(JournalPath);
+
+    NSUDO_TEST_ASSERT(CNSudoShortCutAdapter::Write(Path, ShortCutList));
+    NSUDO_TEST_ASSERT(NSudoTestJournalIsEmpty(Path));
+    NSUDO_TEST_ASSERT(!NSudoTestCompactionFileExists(Path));
+
+    // The process was terminated after NSudo.json was replaced but before
+    // the journal was emptied.
+    NSudoTestWriteFile(JournalPath, Journal);
+
+    NSUDO_TEST_ASSERT(ShortCutList == NSudoTestReadShortCuts(Path));
+}
+
+NSUDO_TEST(ShortCutCompactionIgnoresStaleTemporaryFile)
+{
+    CNSudoTestDirectory Directory;
+    std::wstring Path = Directory.GetFilePath(L"NSudo.json");
+
+    // The process was terminated while the temporary file was written.
+    const std::string StaleContent = "{ \"ShortCutList_V2\": { \"A\": ";
+    std::wstring StalePath = Path + L".1.1.tmp";
+    NSudoTestWriteFile(
+        Path,
+        "{ \"ShortCutList_V2\": { \"A\": \"a\" } }");
+    NSudoTestWriteFile(StalePath, StaleContent);
+
+    std::map<std::wstring, std::wstring> ShortCutList =
+        NSudoTestReadShortCuts(Path);
+    NSUDO_TEST_ASSERT(1 == ShortCutList.size());
+
+    NSUDO_TEST_ASSERT(CNSudoShortCutAdapter::Add(
+        Path, ShortCutList, L"B", L"b"));
+    NSUDO_TEST_ASSERT(CNSudoShortCutAdapter::Write(Path, ShortCutList));
+    NSUDO_TEST_ASSERT(2 == ShortCutList.size());
+    NSUDO_TEST_ASSERT(ShortCutList == NSudoTestReadShortCuts(Path));
+
+    // The compaction uses its own temporary file and leaves the stale one
+    // alone.
+    NSUDO_TEST_ASSERT(StaleContent == NSudoTestReadFile(StalePath));
+    NSUDO_TEST_ASSERT(DeleteFileW(StalePath.c_str()));
+    NSUDO_TEST_ASSERT(!NSudoTestCompactionFileExists(Path));
+}
+
+NSUDO_TEST(ShortCutCompactionKeepsOtherSettings)
+{
+    CNSudoTestDirectory Directory;
+    std::wstring Path = Directory.GetFilePath(L"NSudo.json");
+
+    NSudoTestWriteFile(
+        Path,
+        "\xEF\xBB\xBF{ \"Settings\": { \"Theme\": \"Dark\" }, "
+        "\"ShortCutList_V2\": { \"Old\": \"old\" } }");
+
+    std::map<std::wstring, std::wstring> ShortCutList =
+        NSudoTestReadShortCuts(Path);
+
+    // Append records until the journal passes the compaction threshold.
+    const std::wstring Value(1024, L'v');
+    size_t Count = 0;
+    while (!NSudoTestJournalIsEmpty(Path) || 0 == Count)
+    {
+        NSUDO_TEST_ASSERT(CNSudoShortCutAdapter::Add(
+            Path,
+            ShortCutList,
+            L"快捷命令" + std::to_wstring(Count++),
+            Value));
+        NSUDO_TEST_ASSERT(Count < 1024);
+    }
+
+    NSUDO_TEST_ASSERT(Count + 1 == ShortCutList.size());
+    NSUDO_TEST_ASSERT(ShortCutList == NSudoTestReadShortCuts(Path));
+
+    std::string Content = NSudoTestReadFile(Path);
+    NSUDO_TEST_ASSERT(0 == Content.compare(0, 3, "\xEF\xBB\xBF"));
+
+    nlohmann::json ConfigJSON = nlohmann::json::parse(
+        Content.begin() + 3, Content.end(), nullptr, false);
+    NSUDO_TEST_ASSERT(ConfigJSON.is_object());
+    NSUDO_TEST_ASSERT(
+        "Dark" == ConfigJSON["Settings"]["Theme"].get<std::string>());
+    NSUDO_TEST_ASSERT(
+        "old" == ConfigJSON["ShortCutList_V2"]["Old"].get<std::string>());
+}
+
+NSUDO_TEST(ShortCutCompactionNeverReplacesUnparsableConfig)
+{
+    CNSudoTestDirectory Directory;
+    std::wstring Path = Directory.GetFilePath(L"NSudo.json");
+
+    const std::string Content = "{ \"ShortCutList_V2\": { \"A\": ";
+    NSudoTestWriteFile(Path, Content);
+
+    std::map<std::wstring, std::wstring> ShortCutList;
+    NSUDO_TEST_ASSERT(CNSudoShortCutAdapter::Add(
+        Path, ShortCutList, L"B", L"b"));
+    NSUDO_TEST_ASSERT(!CNSudoShortCutAdapter::Write(Path, ShortCutList));
+    NSUDO_TEST_ASSERT(Content == NSudoTestReadFile(Path));
+
+    // The record stays in the journal for the next compaction.
+    NSUDO_TEST_ASSERT(!NSudoTestJournalIsEmpty(Path));
+}
+
+NSUDO_TEST(ShortCutFailedCompactionDoesNotFailUpdate)
+{
+    CNSudoTestDirectory Directory;
+    std::wstring Path = Directory.GetFilePath(L"NSudo.json");
+
+    const std::string Content = "{ \"ShortCutList_V2\": { \"A\": ";
+    NSudoTestWriteFile(Path, Content);
+
+    // The journal is past the compaction threshold of 256 KiB, so the next
+    // change tries to compact it, which fails with the unparsable config.
+    std::string Journal;
+    for (int i = 0; Journal.size() <= 256 * 1024; ++i)
+    {
+        Journal += "{\"Op\":\"Add\",\"Key\":\"K" + std::to_string(i) +
+            "\",\"Value\":\"v\"}\n";
+    }
+    NSudoTestWriteFile(Path + L".journal", Journal);
+
+    std::map<std::wstring, std::wstring> ShortCutList =
+        NSudoTestReadShortCuts(Path);
+    size_t ShortCutCount = ShortCutList.size();
+
+    NSUDO_TEST_ASSERT(CNSudoShortCutAdapter::Add(
+        Path, ShortCutList, L"B", L"b"));
+    NSUDO_TEST_ASSERT(CNSudoShortCutAdapter::Remove(
+        Path, ShortCutList, L"K0"));
+
+    NSUDO_TEST_ASSERT(Content == NSudoTestReadFile(Path));
+    NSUDO_TEST_ASSERT(!NSudoTestCompactionFileExists(Path));
+
+    // The changes are saved in the journal.
+    ShortCutList = NSudoTestReadShortCuts(Path);
+    NSUDO_TEST_ASSERT(ShortCutCount == ShortCutList.size());
+    NSUDO_TEST_ASSERT(L"b" == ShortCutList[L"B"]);
+    NSUDO_TEST_ASSERT(ShortCutList.end() == ShortCutList.find(L"K0"));
+}
+
+NSUDO_TEST(ShortCutCompactionKeepsRecordsOfOtherProcesses)
+{
+    CNSudoTestDirectory Directory;
+    std::wstring Path = Directory.GetFilePath(L"NSudo.json");
+
+    std::map<std::wstring, std::wstring> ShortCutList;
+    NSUDO_TEST_ASSERT(CNSudoShortCutAdapter::Add(
+        Path, ShortCutList, L"A", L"a"));
+
+    // Another process appends a record after this one read the list.
+    std::map<std::wstring, std::wstring> OtherShortCutList =
+        NSudoTestReadShortCuts(Path);
+    NSUDO_TEST_ASSERT(CNSudoShortCutAdapter::Add(
+        Path, OtherShortCutList, L"B", L"b"));
+
+    NSUDO_TEST_ASSERT(CNSudoShortCutAdapter::Write(Path, ShortCutList));
+
+    std::map<std::wstring, std::wstring> Expected =
+    {
+        { L"A", L"a" },
+        { L"B", L"b" }
+    };
+    NSUDO_TEST_ASSERT(Expected == ShortCutList);
+    NSUDO_TEST_ASSERT(Expected == NSudoTestReadShortCuts(Path));
+}
+
+NSUDO_TEST(ShortCutConcurrentUpdatesAreNotLost)
+{
+    CNSudoTestDirectory Directory;
+    std::wstring Path = Directory.GetFilePath(L"NSudo.json");
+
+    const size_t WriterCount = 4;
+    const size_t RecordsPerWriter = 64;
+
+    // Each writer has its own list like a separate process, and compacts
+    // after every 16 records while the others keep appending.
+    volatile LONG FailedCount = 0;
+    std::vector<HANDLE> Writers;
+    for (size_t i = 0; i < WriterCount; ++i)
+    {
+        M2::CThread Writer([&Path, &FailedCount, i, RecordsPerWriter]()
+        {
+            std::map<std::wstring, std::wstring> ShortCutList;
+            for (size_t j = 0; j < RecordsPerWriter; ++j)
+            {
+                std::wstring Name =
+                    std::to_wstring(i) + L"." + std::to_wstring(j);
+                if (!CNSudoShortCutAdapter::Add(
+                    Path, ShortCutList, Name, Name))
+                {
+                    InterlockedIncrement(&FailedCount);
+                }
+
+                if (15 == j % 16 &&
+                    !CNSudoShortCutAdapter::Write(Path, ShortCutList))
+                {
+                    InterlockedIncrement(&FailedCount);
+                }
+            }
+        });
+
+        HANDLE WriterHandle = Writer.Detach();
+        NSUDO_TEST_ASSERT(nullptr != WriterHandle);
+        Writers.push_back(WriterHandle);
+    }
+
+    DWORD WaitResult = WaitForMultipleObjectsEx(
+        static_cast<DWORD>(Writers.size()),
+        Writers.data(),
+        TRUE,
+        60 * 1000,
+        FALSE);
+    for (HANDLE WriterHandle : Writers)
+        CloseHandle(WriterHandle);
+    NSUDO_TEST_ASSERT(WAIT_OBJECT_0 == WaitResult);
+
+    NSUDO_TEST_ASSERT(0 == FailedCount);
+    NSUDO_TEST_ASSERT(!NSudoTestCompactionFileExists(Path));
+
+    std::map<std::wstring, std::wstring> ShortCutList =
+        NSudoTestReadShortCuts(Path);
+    NSUDO_TEST_ASSERT(WriterCount * RecordsPerWriter == ShortCutList.size());
+}
+
+#pragma endregion
+
+#pragma region Context Menu
+
+NSUDO_TEST(ContextMenuItemsMatchDefinition)
+{
+    // The definition is copied next to the tests by the post-build event.
+    std::wstring DefinitionPath = M2GetCurrentProcessModulePath();
+    DefinitionPath.resize(DefinitionPath.find_last_of(L'\\'));
+    DefinitionPath.append(L"\\NSudoContextMenuManagement.json");
+
+    nlohmann::json DefinitionJSON = nlohmann::json::parse(
+        NSudoTestReadFile(DefinitionPath), nullptr, false);
+    NSUDO_TEST_ASSERT(DefinitionJSON.is_object());
+
+    const nlohmann::json& Items = DefinitionJSON["ContextMenu"];
+    NSUDO_TEST_ASSERT(Items.is_array());
+    NSUDO_TEST_ASSERT(_countof(g_ContextMenuItems) == Items.size());
+
+    std::wstring SubCommands;
+
+    for (size_t i = 0; i < Items.size(); ++i)
+    {
+        const NSUDO_CONTEXT_MENU_ITEM& Item = g_ContextMenuItems[i];
+
+        std::wstring ItemName = M2MakeUTF16String(
+            Items[i]["ItemName"].get<std::string>());
+
+        NSUDO_TEST_ASSERT(ItemName == Item.ItemName);
+        NSUDO_TEST_ASSERT(
+            Items[i]["ItemDescriptionID"].get<std::string>() ==
+            Item.ItemDescriptionID);
+        NSUDO_TEST_ASSERT(
+            L" " + M2MakeUTF16String(
+                Items[i]["ItemCommandParameters"].get<std::string>()) ==
+            Item.ItemCommandParameters);
+        NSUDO_TEST_ASSERT(
+            Items[i]["HasLUAShield"].get<bool>() == Item.HasLUAShield);
+
+        SubCommands.append(ItemName);
+        SubCommands.push_back(L';');
+    }
+
+    NSUDO_TEST_ASSERT(SubCommands == NSudoContextMenuSubCommands.data());
+    NSUDO_TEST_ASSERT(
+        SubCommands.size() + 1 == NSudoContextMenuSubCommands.size());
+}
+
+#pragma endregion
+
+#pragma region Command Paths
+
+namespace
+{
+    /**
+     * Installs the stub platform before any facet of g_ResourceManagement is
+     * initialized, so the command paths run without creating tokens or
+     * processes.
+     */
+    struct CNSudoTestStubPlatformInstaller
+    {
+        CNSudoTestStubPlatformInstaller()
+        {
+            NSUDO_STUB_PLATFORM_STATE& State = NSudoGetStubPlatformState();
+
+            State.Files[L"C:\\NSudo\\NSudo.json"] =
+                "{\"ShortCutList_V2\":"
+                "{\"Hosts\":\"notepad %SystemRoot%\\\\System32\\\\hosts\"}}";
+
+            NSudoSetStubEnvironment({ L"SystemRoot=C:\\Windows" });
+
+            g_ResourceManagement.SetPlatform(g_NSudoStubPlatform);
+        }
+    };
+
+    CNSudoTestStubPlatformInstaller g_StubPlatformInstaller;
+
+    NSUDO_MESSAGE NSudoTestRunCommandLine(
+        _In_ const std::wstring& CommandLine)
+    {
+        std::wstring ApplicationName;
+        std::map<std::wstring, std::wstring> OptionsAndParameters;
+        std::wstring UnresolvedCommandLine;
+
+        M2SpiltCommandLineEx(
+            CommandLine,
+            std::vector<std::wstring>{ L"-", L"/", L"--" },
+            std::vector<std::wstring>{ L"=", L":" },
+            ApplicationName,
+            OptionsAndParameters,
+            UnresolvedCommandLine);
+
+        return NSudoCommandLineParser(
+            false,
+            false,
+            ApplicationName,
+            OptionsAndParameters,
+            UnresolvedCommandLine);
+    }
+}
+
+NSUDO_TEST(ParseLaunchRequestLeavesCurrentDirectoryEmpty)
+{
+    std::map<std::wstring, std::wstring> OptionsAndParameters;
+    OptionsAndParameters[L"U"] = L"T";
+    std::wstring UnresolvedCommandLine = L"cmd";
+
+    NSUDO_LAUNCH_REQUEST Request;
+    NSUDO_TEST_ASSERT(NSUDO_MESSAGE::SUCCESS == NSudoParseLaunchRequest(
+        OptionsAndParameters,
+        UnresolvedCommandLine,
+        Request));
+    NSUDO_TEST_ASSERT(Request.CurrentDirectory.empty());
+}
+
+NSUDO_TEST(LaunchExpandsShortCutInAppDirectory)
+{
+    NSUDO_STUB_PLATFORM_STATE& State = NSudoGetStubPlatformState();
+    LONG LaunchProcessCount = State.LaunchProcessCount;
+
+    NSUDO_TEST_ASSERT(NSUDO_MESSAGE::SUCCESS == NSudoTestRunCommandLine(
+        L"NSudo.exe -U:T -P:E Hosts"));
+
+    NSUDO_TEST_ASSERT(LaunchProcessCount + 1 == State.LaunchProcessCount);
+    NSUDO_TEST_ASSERT(
+        L"notepad C:\\Windows\\System32\\hosts" == State.LastCommandLine);
+    NSUDO_TEST_ASSERT(L"C:\\NSudo" == State.LastCurrentDirectory);
+}
+
+NSUDO_TEST(LaunchUsesRequestedCurrentDirectory)
+{
+    NSUDO_STUB_PLATFORM_STATE& State = NSudoGetStubPlatformState();
+
+    NSUDO_TEST_ASSERT(NSUDO_MESSAGE::SUCCESS == NSudoTestRunCommandLine(
+        L"NSudo.exe -U:S -CurrentDirectory=D:\\Work cmd /c echo %Undefined%"));
+
+    NSUDO_TEST_ASSERT(
+        L"cmd /c echo %Undefined%" == State.LastCommandLine);
+    NSUDO_TEST_ASSERT(L"D:\\Work" == State.LastCurrentDirectory);
+}
+
+NSUDO_TEST(InvalidOptionDoesNotLaunch)
+{
+    NSUDO_STUB_PLATFORM_STATE& State = NSudoGetStubPlatformState();
+    LONG LaunchTokenCount = State.LaunchTokenCount;
+    LONG LaunchProcessCount = State.LaunchProcessCount;
+
+    NSUDO_TEST_ASSERT(
+        NSUDO_MESSAGE::INVALID_COMMAND_PARAMETER ==
+        NSudoTestRunCommandLine(L"NSudo.exe -U:Invalid cmd"));
+
+    NSUDO_TEST_ASSERT(LaunchTokenCount == State.LaunchTokenCount);
+    NSUDO_TEST_ASSERT(LaunchProcessCount == State.LaunchProcessCount);
+}
+
+NSUDO_TEST(InvalidOptionDoesNotPrepareToken)
+{
+    // The token facet is initialized only once, so start from a new
+    // g_ResourceManagement whose token is not prepared yet.
+    g_ResourceManagement.~CNSudoResourceManagement();
+    new (&g_ResourceManagement) CNSudoResourceManagement(g_NSudoStubPlatform);
+
+    NSUDO_STUB_PLATFORM_STATE& State = NSudoGetStubPlatformState();
+    LONG PrepareTokenCount = State.PrepareTokenCount;
+
+    const wchar_t* const InvalidCommandLines[] =
+    {
+        L"NSudo.exe -U:X cmd",
+        L"NSudo.exe -Version foo",
+        L"NSudo.exe -U:T -Unknown cmd",
+        L"NSudo.exe -U:T",
+        L"NSudo.exe Hosts"
+    };
+
+    for (const wchar_t* CommandLine : InvalidCommandLines)
+    {
+        NSUDO_TEST_ASSERT(
+            NSUDO_MESSAGE::INVALID_COMMAND_PARAMETER ==
+            NSudoTestRunCommandLine(CommandLine));
+    }
+
+    g_ResourceManagement.WaitForTokenPreparation();
+    NSUDO_TEST_ASSERT(PrepareTokenCount == State.PrepareTokenCount);
+
+    // The valid request prepares the token once.
+    NSUDO_TEST_ASSERT(NSUDO_MESSAGE::SUCCESS == NSudoTestRunCommandLine(
+        L"NSudo.exe -U:T Hosts"));
+    NSUDO_TEST_ASSERT(PrepareTokenCount + 1 == State.PrepareTokenCount);
+}
+
+#pragma endregion
+
+#pragma region Batch Mode
+
+namespace
+{
+    /**
+     * Runs the batch jobs and returns the result lines.
+     */
+    NSUDO_MESSAGE NSudoTestExecuteBatchJobs(
+        _In_ const std::string& Jobs,
+        _Out_ std::vector<nlohmann::json>& Results)
+    {
+        Results.clear();
+
+        CNSudoTestDirectory Directory;
+        std::wstring ResultPath = Directory.GetFilePath(L"Results.jsonl");
+
+        NSUDO_MESSAGE Message = NSUDO_MESSAGE::SUCCESS;
+        {
+            M2::CHandle ResultFile = CreateFileW(
+                ResultPath.c_str(),
+                GENERIC_WRITE,
+                FILE_SHARE_READ,
+                nullptr,
+                CREATE_ALWAYS,
+                FILE_ATTRIBUTE_NORMAL,
+                nullptr);
+            NSUDO_TEST_ASSERT(!ResultFile.IsInvalid());
+
+            Message = NSudoExecuteBatchJobs(false, Jobs, ResultFile);
+        }
+
+        std::string Content = NSudoTestReadFile(ResultPath);
+
+        size_t LineStart = 0;
+        while (LineStart < Content.size())
+        {
+            size_t LineEnd = Content.find('\n', LineStart);
+            NSUDO_TEST_ASSERT(std::string::npos != LineEnd);
+
+            Results.push_back(nlohmann::json::parse(
+                Content.substr(LineStart, LineEnd - LineStart)));
+            LineStart = LineEnd + 1;
+        }
+
+        return Message;
+    }
+}
+
+NSUDO_TEST(ParseBatchJobReadsOptions)
+{
+    NSUDO_LAUNCH_REQUEST Request;
+    std::string Id;
+
+    NSUDO_TEST_ASSERT(NSUDO_MESSAGE::SUCCESS == NSudoParseBatchJob(
+        "{\"Id\":\"1\",\"U\":\"T\",\"P\":\"E\",\"Priority\":\"High\","
+        "\"Wait\":true,\"UseCurrentConsole\":false,\"CommandLine\":\"Hosts\"}",
+        Request,
+        Id));
+
+    NSUDO_TEST_ASSERT("1" == Id);
+    NSUDO_TEST_ASSERT(
+        NSudoOptionUserValue::TrustedInstaller == Request.UserMode);
+    NSUDO_TEST_ASSERT(
+        NSudoOptionPrivilegesValue::EnableAllPrivileges ==
+        Request.PrivilegesMode);
+    NSUDO_TEST_ASSERT(HIGH_PRIORITY_CLASS == Request.ProcessPriority);
+    NSUDO_TEST_ASSERT(INFINITE == Request.WaitInterval);
+
+    // The switches which are false are omitted.
+    NSUDO_TEST_ASSERT(Request.CreateNewConsole);
+
+    // The shortcut is translated, and the environment variables are expanded
+    // at launch.
+    NSUDO_TEST_ASSERT(
+        L"notepad %SystemRoot%\\System32\\hosts" == Request.CommandLine);
+
+    // The identifiers which are not strings are kept as JSON.
+    NSUDO_TEST_ASSERT(NSUDO_MESSAGE::SUCCESS == NSudoParseBatchJob(
+        "{\"Id\":7,\"U\":\"S\",\"CommandLine\":\"cmd\"}",
+        Request,
+        Id));
+    NSUDO_TEST_ASSERT("7" == Id);
+
+    // The UTF-8 BOM is skipped by the JSON parser.
+    NSUDO_TEST_ASSERT(NSUDO_MESSAGE::SUCCESS == NSudoParseBatchJob(
+        "\xEF\xBB\xBF{\"U\":\"S\",\"CommandLine\":\"cmd\"}",
+        Request,
+        Id));
+    NSUDO_TEST_ASSERT(Id.empty());
+    NSUDO_TEST_ASSERT(L"cmd" == Request.CommandLine);
+}
+
+NSUDO_TEST(ParseBatchJobRejectsMalformedLines)
+{
+    const char* Lines[] =
+    {
+        "{",
+        "{\"U\":\"T\",\"CommandLine\":\"cmd\"",
+        "{\"U\":\"T\"} {\"CommandLine\":\"cmd\"}",
+        "[\"U\",\"T\"]",
+        "\"cmd\"",
+        "U=T cmd",
+        // The options are valid JSON, but not a valid launch request.
+        "{\"CommandLine\":\"cmd\"}",
+        "{\"U\":\"T\"}",
+        "{\"U\":\"Invalid\",\"CommandLine\":\"cmd\"}",
+        "{\"Unknown\":\"T\",\"U\":\"T\",\"CommandLine\":\"cmd\"}",
+    };
+
+    for (const char* Line : Lines)
+    {
+        NSUDO_LAUNCH_REQUEST Request;
+        std::string Id;
+
+        NSUDO_TEST_ASSERT(
+            NSUDO_MESSAGE::INVALID_COMMAND_PARAMETER ==
+            NSudoParseBatchJob(Line, Request, Id));
+    }
+}
+
+NSUDO_TEST(ParseBatchJobRejectsNonStringValues)
+{
+    const char* Lines[] =
+    {
+        "{\"U\":1,\"CommandLine\":\"cmd\"}",
+        "{\"U\":null,\"CommandLine\":\"cmd\"}",
+        "{\"U\":[\"T\"],\"CommandLine\":\"cmd\"}",
+        "{\"U\":{\"T\":true},\"CommandLine\":\"cmd\"}",
+        "{\"U\":\"T\",\"Wait\":1}",
+        "{\"U\":\"T\",\"CommandLine\":1}",
+        "{\"U\":\"T\",\"CommandLine\":true}",
+        "{\"U\":\"T\",\"CommandLine\":[\"cmd\"]}",
+    };
+
+    for (const char* Line : Lines)
+    {
+        NSUDO_LAUNCH_REQUEST Request;
+        std::string Id;
+
+        NSUDO_TEST_ASSERT(
+            NSUDO_MESSAGE::INVALID_COMMAND_PARAMETER ==
+            NSudoParseBatchJob(Line, Request, Id));
+    }
+}
+
+NSUDO_TEST(LaunchTokenKeyDependsOnTokenOptionsOnly)
+{
+    NSUDO_LAUNCH_REQUEST Request;
+    Request.UserMode = NSudoOptionUserValue::System;
+    Request.PrivilegesMode = NSudoOptionPrivilegesValue::EnableAllPrivileges;
+    Request.IntegrityLevelMode = NSudoOptionIntegrityLevelValue::Medium;
+
+    NSUDO_LAUNCH_REQUEST OtherRequest = Request;
+    OtherRequest.ProcessPriorityMode = NSudoOptionProcessPriorityValue::High;
+    OtherRequest.WindowMode = NSudoOptionWindowModeValue::Hide;
+    OtherRequest.WaitInterval = INFINITE;
+    OtherRequest.CurrentDirectory = L"D:\\Work";
+    OtherRequest.CreateNewConsole = false;
+    OtherRequest.CommandLine = L"cmd";
+
+    NSUDO_TEST_ASSERT(
+        NSudoGetLaunchTokenKey(Request) ==
+        NSudoGetLaunchTokenKey(OtherRequest));
+
+    // Each combination of the token options has its own key.
+    std::set<DWORD> Keys;
+    for (int User = 0; User <= 5; ++User)
+    {
+        for (int Privileges = 0; Privileges <= 2; ++Privileges)
+        {
+            for (int IntegrityLevel = 0; IntegrityLevel <= 4; ++IntegrityLevel)
+            {
+                Request.UserMode =
+                    static_cast<NSudoOptionUserValue>(User);
+                Request.PrivilegesMode =
+                    static_cast<NSudoOptionPrivilegesValue>(Privileges);
+                Request.IntegrityLevelMode =
+                    static_cast<NSudoOptionIntegrityLevelValue>(
+                        IntegrityLevel);
+
+                Keys.insert(NSudoGetLaunchTokenKey(Request));
+            }
+        }
+    }
+    NSUDO_TEST_ASSERT(6 * 3 * 5 == Keys.size());
+}
+
+NSUDO_TEST(ExecuteBatchJobsSharesTokensAndReportsLines)
+{
+    NSUDO_STUB_PLATFORM_STATE& State = NSudoGetStubPlatformState();
+    LONG LaunchTokenCount = State.LaunchTokenCount;
+    LONG LaunchProcessCount = State.LaunchProcessCount;
+
+    std::vector<nlohmann::json> Results;
+    NSUDO_TEST_ASSERT(
+        NSUDO_MESSAGE::INVALID_COMMAND_PARAMETER ==
+        NSudoTestExecuteBatchJobs(
+            "\xEF\xBB\xBF{\"Id\":\"A\",\"U\":\"S\",\"CommandLine\":\"Hosts\"}\r\n"
+            "\r\n"
+            "{\"Id\":\"B\",\"U\":1,\"CommandLine\":\"cmd\"}\r\n"
+            "{\"Id\":\"C\",\"U\":\"S\",\"Wait\":true,\"CommandLine\":\"cmd\"}",
+            Results));
+
+    NSUDO_TEST_ASSERT(3 == Results.size());
+
+    // The empty line is skipped but counted.
+    NSUDO_TEST_ASSERT(1 == Results[0]["Line"]);
+    NSUDO_TEST_ASSERT("A" == Results[0]["Id"]);
+    NSUDO_TEST_ASSERT("Message.Success" == Results[0]["Status"]);
+    NSUDO_TEST_ASSERT(false == Results[0]["TokenReused"]);
+
+    NSUDO_TEST_ASSERT(3 == Results[1]["Line"]);
+    NSUDO_TEST_ASSERT("B" == Results[1]["Id"]);
+    NSUDO_TEST_ASSERT(
+        "Message.InvalidCommandParameter" == Results[1]["Status"]);
+
+    NSUDO_TEST_ASSERT(4 == Results[2]["Line"]);
+    NSUDO_TEST_ASSERT("C" == Results[2]["Id"]);
+    NSUDO_TEST_ASSERT("Message.Success" == Results[2]["Status"]);
+    NSUDO_TEST_ASSERT(true == Results[2]["TokenReused"]);
+
+    NSUDO_TEST_ASSERT(LaunchTokenCount + 1 == State.LaunchTokenCount);
+    NSUDO_TEST_ASSERT(LaunchProcessCount + 2 == State.LaunchProcessCount);
+    NSUDO_TEST_ASSERT(L"cmd" == State.LastCommandLine);
+}
+
+NSUDO_TEST(ExecuteBatchRejectsMissingJobFile)
+{
+    NSUDO_STUB_PLATFORM_STATE& State = NSudoGetStubPlatformState();
+    LONG LaunchProcessCount = State.LaunchProcessCount;
+
+    NSUDO_TEST_ASSERT(
+        NSUDO_MESSAGE::INVALID_COMMAND_PARAMETER ==
+        NSudoTestRunCommandLine(L"NSudo.exe -Batch=C:\\Jobs\\Missing.jsonl"));
+
+    NSUDO_TEST_ASSERT(LaunchProcessCount == State.LaunchProcessCount);
+}
+
+#pragma endregion
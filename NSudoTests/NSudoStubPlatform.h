@@ -0,0 +1,233 @@
+﻿/*
+ * PROJECT:   NSudo
+ * FILE:      NSudoStubPlatform.h
+ * PURPOSE:   In-memory implementation of the platform layer of NSudo
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#pragma once
+
+#ifndef _NSUDO_STUB_PLATFORM_
+#define _NSUDO_STUB_PLATFORM_
+
+// This header must be included after NSudo.cpp, which defines NSUDO_PLATFORM.
+
+/**
+ * The data served by the stub platform and the calls recorded by it. The
+ * resources, the files and the environment are set by the caller before the
+ * first facet of CNSudoResourceManagement is initialized.
+ */
+struct NSUDO_STUB_PLATFORM_STATE
+{
+    std::wstring ExePath = L"C:\\NSudo\\NSudo.exe";
+
+    // The string resources keyed by their IDs.
+    std::map<UINT, std::string> Resources;
+
+    // The files keyed by their paths.
+    std::map<std::wstring, std::string> Files;
+
+    bool IsElevated = true;
+    DWORD SessionID = 1;
+
+    // The environment block used to expand the command lines.
+    std::vector<wchar_t> Environment = { L'\0' };
+
+    volatile LONG PrepareTokenCount = 0;
+    volatile LONG LaunchTokenCount = 0;
+    volatile LONG LaunchProcessCount = 0;
+    std::wstring LastCommandLine;
+    std::wstring LastCurrentDirectory;
+};
+
+inline NSUDO_STUB_PLATFORM_STATE& NSudoGetStubPlatformState()
+{
+    static NSUDO_STUB_PLATFORM_STATE State;
+    return State;
+}
+
+/**
+ * Sets the environment block of the stub platform.
+ *
+ * @param Variables The "Name=Value" strings.
+ */
+inline void NSudoSetStubEnvironment(
+    _In_ const std::vector<std::wstring>& Variables)
+{
+    std::vector<wchar_t>& Environment = NSudoGetStubPlatformState().Environment;
+
+    Environment.clear();
+    for (const std::wstring& Variable : Variables)
+    {
+        Environment.insert(Environment.end(), Variable.begin(), Variable.end());
+        Environment.push_back(L'\0');
+    }
+    Environment.push_back(L'\0');
+}
+
+inline std::wstring NSudoStubGetExePath()
+{
+    return NSudoGetStubPlatformState().ExePath;
+}
+
+inline HRESULT NSudoStubLoadResource(
+    _Out_ PM2_RESOURCE_INFO ResourceInfo,
+    _In_ LPCWSTR Type,
+    _In_ LPCWSTR Name)
+{
+    ResourceInfo->Size = 0;
+    ResourceInfo->Pointer = nullptr;
+
+    if (0 != _wcsicmp(Type, L"String") || !IS_INTRESOURCE(Name))
+        return HRESULT_FROM_WIN32(ERROR_RESOURCE_TYPE_NOT_FOUND);
+
+    std::map<UINT, std::string>& Resources =
+        NSudoGetStubPlatformState().Resources;
+
+    auto Resource = Resources.find(
+        static_cast<UINT>(reinterpret_cast<ULONG_PTR>(Name)));
+    if (Resources.end() == Resource)
+        return HRESULT_FROM_WIN32(ERROR_RESOURCE_NAME_NOT_FOUND);
+
+    ResourceInfo->Size = static_cast<DWORD>(Resource->second.size());
+    ResourceInfo->Pointer = const_cast<char*>(Resource->second.data());
+
+    return S_OK;
+}
+
+inline HRESULT NSudoStubReadFile(
+    _In_ const std::wstring& FilePath,
+    _Out_ std::string& Content)
+{
+    Content.clear();
+
+    std::map<std::wstring, std::string>& Files =
+        NSudoGetStubPlatformState().Files;
+
+    auto File = Files.find(FilePath);
+    if (Files.end() == File)
+        return HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
+
+    Content = File->second;
+
+    return S_OK;
+}
+
+inline bool NSudoStubPrepareCurrentProcessToken(
+    _Out_ M2::CHandle& OriginalToken)
+{
+    NSUDO_STUB_PLATFORM_STATE& State = NSudoGetStubPlatformState();
+
+    OriginalToken.Close();
+    InterlockedIncrement(&State.PrepareTokenCount);
+
+    return State.IsElevated;
+}
+
+inline BOOL WINAPI NSudoStubGetCurrentProcessSessionID(
+    _Out_ PDWORD SessionID)
+{
+    *SessionID = NSudoGetStubPlatformState().SessionID;
+    return TRUE;
+}
+
+inline BOOL WINAPI NSudoStubImpersonateAsSystem()
+{
+    return NSudoGetStubPlatformState().IsElevated;
+}
+
+inline BOOL WINAPI NSudoStubRevertToSelf()
+{
+    return TRUE;
+}
+
+inline NSUDO_MESSAGE NSudoStubCreateLaunchToken(
+    _In_ const NSUDO_LAUNCH_REQUEST& Request,
+    _In_ DWORD SessionID,
+    _Out_ M2::CHandle& Token)
+{
+    UNREFERENCED_PARAMETER(Request);
+    UNREFERENCED_PARAMETER(SessionID);
+
+    Token.Close();
+    InterlockedIncrement(&NSudoGetStubPlatformState().LaunchTokenCount);
+
+    return NSUDO_MESSAGE::SUCCESS;
+}
+
+inline HRESULT NSudoStubCreateEnvironmentBlock(
+    _Out_ std::vector<wchar_t>& Block,
+    _In_opt_ HANDLE TokenHandle,
+    _In_ bool Inherit)
+{
+    UNREFERENCED_PARAMETER(TokenHandle);
+    UNREFERENCED_PARAMETER(Inherit);
+
+    Block = NSudoGetStubPlatformState().Environment;
+
+    return S_OK;
+}
+
+inline bool NSudoStubAcquireEnvironmentBlock(
+    _Out_ M2::CEnvironmentBlockReference& Environment)
+{
+    // The same cache as NSudo, so the cost of a cache hit is measured, but
+    // the token is not opened.
+    static M2::CEnvironmentBlockCache EnvironmentBlockCache(
+        0, NSudoStubCreateEnvironmentBlock);
+
+    return SUCCEEDED(EnvironmentBlockCache.Acquire(
+        Environment, nullptr, true));
+}
+
+inline bool NSudoStubLaunchProcess(
+    _In_opt_ HANDLE hToken,
+    _In_ LPCWSTR lpCommandLine,
+    _In_opt_ LPCWSTR lpCurrentDirectory,
+    _In_ LPVOID lpEnvironment,
+    _In_ DWORD WaitInterval,
+    _In_ DWORD ProcessPriority,
+    _In_ DWORD ShowWindowMode,
+    _In_ bool CreateNewConsole)
+{
+    UNREFERENCED_PARAMETER(hToken);
+    UNREFERENCED_PARAMETER(lpEnvironment);
+    UNREFERENCED_PARAMETER(WaitInterval);
+    UNREFERENCED_PARAMETER(ProcessPriority);
+    UNREFERENCED_PARAMETER(ShowWindowMode);
+    UNREFERENCED_PARAMETER(CreateNewConsole);
+
+    NSUDO_STUB_PLATFORM_STATE& State = NSudoGetStubPlatformState();
+
+    InterlockedIncrement(&State.LaunchProcessCount);
+    State.LastCommandLine = lpCommandLine;
+    State.LastCurrentDirectory = lpCurrentDirectory
+        ? lpCurrentDirectory
+        : std::wstring();
+
+    return true;
+}
+
+/**
+ * The platform layer which serves NSUDO_STUB_PLATFORM_STATE. It does not
+ * create tokens or processes, so the command paths can be tested and
+ * measured without elevation.
+ */
+inline const NSUDO_PLATFORM g_NSudoStubPlatform =
+{
+    NSudoStubGetExePath,
+    NSudoStubLoadResource,
+    NSudoStubReadFile,
+    NSudoStubPrepareCurrentProcessToken,
+    NSudoStubGetCurrentProcessSessionID,
+    NSudoStubImpersonateAsSystem,
+    NSudoStubRevertToSelf,
+    NSudoStubCreateLaunchToken,
+    NSudoStubAcquireEnvironmentBlock,
+    NSudoStubLaunchProcess
+};
+
+#endif // _NSUDO_STUB_PLATFORM_
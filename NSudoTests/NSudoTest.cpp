@@ -0,0 +1,261 @@
+﻿/*
+ * PROJECT:   NSudo
+ * FILE:      NSudoTest.cpp
+ * PURPOSE:   Implementation for the unit test framework
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#include "stdafx.h"
+
+#include <stdio.h>
+
+#include <exception>
+#include <string>
+#include <vector>
+
+namespace
+{
+    struct NSUDO_TEST_CASE
+    {
+        const char* Name;
+        PNSUDO_TEST_FUNCTION Function;
+    };
+
+    /**
+     * The failure of an assertion, which unwinds the current test case.
+     */
+    class CNSudoTestFailure : public std::exception
+    {
+    public:
+        CNSudoTestFailure(
+            _In_ const char* Message) :
+            std::exception(Message)
+        {
+
+        }
+    };
+
+    std::vector<NSUDO_TEST_CASE>& NSudoGetTestCases()
+    {
+        // The registrations run during the static initialization of the
+        // translation units, so the list is created on first use.
+        static std::vector<NSUDO_TEST_CASE> TestCases;
+        return TestCases;
+    }
+
+    volatile LONG g_TestDirectoryCount = 0;
+}
+
+void NSudoRegisterTestCase(
+    _In_z_ const char* Name,
+    _In_ PNSUDO_TEST_FUNCTION Function)
+{
+    NSudoGetTestCases().push_back({ Name, Function });
+}
+
+[[noreturn]] void NSudoFailTestCase(
+    _In_z_ const char* File,
+    _In_ int Line,
+    _In_z_ const char* Expression)
+{
+    char Message[1024];
+    sprintf_s(
+        Message,
+        "%s(%d): assertion failed: %s",
+        File,
+        Line,
+        Expression);
+
+    throw CNSudoTestFailure(Message);
+}
+
+void NSudoTestWriteFile(
+    _In_ const std::wstring& FilePath,
+    _In_ const std::string& Content)
+{
+    FILE* FileStream = nullptr;
+    NSUDO_TEST_ASSERT(0 == _wfopen_s(&FileStream, FilePath.c_str(), L"wb"));
+
+    size_t NumberOfBytesWritten = fwrite(
+        Content.data(), sizeof(char), Content.size(), FileStream);
+
+    fclose(FileStream);
+
+    NSUDO_TEST_ASSERT(Content.size() == NumberOfBytesWritten);
+}
+
+std::string NSudoTestReadFile(
+    _In_ const std::wstring& FilePath)
+{
+    FILE* FileStream = nullptr;
+    NSUDO_TEST_ASSERT(0 == _wfopen_s(&FileStream, FilePath.c_str(), L"rb"));
+
+    std::string Content;
+
+    char Buffer[4096];
+    size_t NumberOfBytesRead = 0;
+    while (0 != (NumberOfBytesRead = fread(
+        Buffer, sizeof(char), sizeof(Buffer), FileStream)))
+    {
+        Content.append(Buffer, NumberOfBytesRead);
+    }
+
+    bool IsFailed = 0 != ferror(FileStream);
+
+    fclose(FileStream);
+
+    NSUDO_TEST_ASSERT(!IsFailed);
+
+    return Content;
+}
+
+DWORD NSudoTestRunChildProcess(
+    _In_ const std::wstring& CaseName,
+    _In_z_ const wchar_t* VariableName,
+    _In_ const std::wstring& VariableValue)
+{
+    wchar_t ModulePath[MAX_PATH];
+    DWORD Length = GetModuleFileNameW(nullptr, ModulePath, MAX_PATH);
+    NSUDO_TEST_ASSERT(0 != Length && Length < MAX_PATH);
+
+    std::wstring CommandLine =
+        L"\"" + std::wstring(ModulePath) + L"\" " + CaseName;
+
+    // The child inherits the environment variable.
+    NSUDO_TEST_ASSERT(SetEnvironmentVariableW(
+        VariableName, VariableValue.c_str()));
+
+    STARTUPINFOW StartupInfo = { 0 };
+    StartupInfo.cb = sizeof(STARTUPINFOW);
+    PROCESS_INFORMATION ProcessInformation = { 0 };
+    BOOL IsCreated = CreateProcessW(
+        nullptr,
+        &CommandLine[0],
+        nullptr,
+        nullptr,
+        FALSE,
+        0,
+        nullptr,
+        nullptr,
+        &StartupInfo,
+        &ProcessInformation);
+
+    SetEnvironmentVariableW(VariableName, nullptr);
+    NSUDO_TEST_ASSERT(IsCreated);
+
+    M2::CHandle ProcessHandle = ProcessInformation.hProcess;
+    M2::CHandle ThreadHandle = ProcessInformation.hThread;
+
+    NSUDO_TEST_ASSERT(WAIT_OBJECT_0 == WaitForSingleObjectEx(
+        ProcessHandle, 60 * 1000, FALSE));
+
+    DWORD ExitCode = MAXDWORD;
+    NSUDO_TEST_ASSERT(GetExitCodeProcess(ProcessHandle, &ExitCode));
+
+    return ExitCode;
+}
+
+CNSudoTestDirectory::CNSudoTestDirectory()
+{
+    wchar_t TemporaryPath[MAX_PATH];
+    DWORD Length = GetTempPathW(MAX_PATH, TemporaryPath);
+    NSUDO_TEST_ASSERT(0 != Length && Length < MAX_PATH);
+
+    wchar_t Name[64];
+    swprintf_s(
+        Name,
+        L"NSudoTests.%lu.%ld",
+        GetCurrentProcessId(),
+        InterlockedIncrement(&g_TestDirectoryCount));
+
+    this->m_Path = std::wstring(TemporaryPath) + Name;
+
+    NSUDO_TEST_ASSERT(CreateDirectoryW(this->m_Path.c_str(), nullptr));
+}
+
+CNSudoTestDirectory::~CNSudoTestDirectory()
+{
+    WIN32_FIND_DATAW FindData;
+    HANDLE FindHandle = FindFirstFileW(
+        (this->m_Path + L"\\*").c_str(), &FindData);
+    if (INVALID_HANDLE_VALUE != FindHandle)
+    {
+        do
+        {
+            if (!(FindData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+            {
+                DeleteFileW(this->GetFilePath(FindData.cFileName).c_str());
+            }
+        } while (FindNextFileW(FindHandle, &FindData));
+
+        FindClose(FindHandle);
+    }
+
+    RemoveDirectoryW(this->m_Path.c_str());
+}
+
+/**
+ * Runs the test cases and prints their results. The test cases whose names
+ * contain the first argument are run, or all test cases if there is no
+ * argument.
+ *
+ * @return The number of the failed test cases.
+ */
+int main(int argc, char* argv[])
+{
+    const char* Filter = argc > 1 ? argv[1] : nullptr;
+
+    int PassedCount = 0;
+    int FailedCount = 0;
+
+    for (const NSUDO_TEST_CASE& TestCase : NSudoGetTestCases())
+    {
+        if (Filter && !strstr(TestCase.Name, Filter))
+            continue;
+
+        printf("[ RUN    ] %s\n", TestCase.Name);
+
+        ULONGLONG StartTime = M2GetPerformanceCounter();
+
+        bool IsPassed = false;
+
+        try
+        {
+            TestCase.Function();
+            IsPassed = true;
+        }
+        catch (const std::exception& Exception)
+        {
+            printf("%s\n", Exception.what());
+        }
+        catch (...)
+        {
+            printf("unknown exception\n");
+        }
+
+        ULONGLONG Milliseconds = M2ConvertPerformanceCountToNanoseconds(
+            M2GetPerformanceCounter() - StartTime) / 1000000;
+
+        printf(
+            "[ %s ] %s (%llu ms)\n",
+            IsPassed ? "    OK" : "FAILED",
+            TestCase.Name,
+            Milliseconds);
+
+        if (IsPassed)
+        {
+            ++PassedCount;
+        }
+        else
+        {
+            ++FailedCount;
+        }
+    }
+
+    printf("%d passed, %d failed\n", PassedCount, FailedCount);
+
+    return FailedCount;
+}
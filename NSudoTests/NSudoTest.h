@@ -0,0 +1,149 @@
+﻿/*
+ * PROJECT:   NSudo
+ * FILE:      NSudoTest.h
+ * PURPOSE:   Definition for the unit test framework
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#pragma once
+
+#ifndef _NSUDO_TEST_
+#define _NSUDO_TEST_
+
+#include <Windows.h>
+
+#include "M2BaseHelpers.h"
+
+#include <string>
+
+/**
+ * The function of a test case. A test case fails when one of its assertions
+ * fails or it throws an exception.
+ */
+typedef void(*PNSUDO_TEST_FUNCTION)();
+
+/**
+ * Registers a test case. Use NSUDO_TEST instead of calling this function.
+ *
+ * @param Name The name of the test case. It must be a string literal.
+ * @param Function The function of the test case.
+ */
+void NSudoRegisterTestCase(
+    _In_z_ const char* Name,
+    _In_ PNSUDO_TEST_FUNCTION Function);
+
+/**
+ * Reports the failed assertion and stops the current test case. Use
+ * NSUDO_TEST_ASSERT instead of calling this function.
+ *
+ * @param File The source file of the assertion.
+ * @param Line The line of the assertion.
+ * @param Expression The expression of the assertion.
+ */
+[[noreturn]] void NSudoFailTestCase(
+    _In_z_ const char* File,
+    _In_ int Line,
+    _In_z_ const char* Expression);
+
+/**
+ * Writes the content to the file, and replaces the file if it exists. The
+ * current test case fails if the file cannot be written.
+ *
+ * @param FilePath The path of the file.
+ * @param Content The content of the file.
+ */
+void NSudoTestWriteFile(
+    _In_ const std::wstring& FilePath,
+    _In_ const std::string& Content);
+
+/**
+ * Reads the whole file. The current test case fails if the file cannot be
+ * read.
+ *
+ * @param FilePath The path of the file.
+ * @return The content of the file.
+ */
+std::string NSudoTestReadFile(
+    _In_ const std::wstring& FilePath);
+
+/**
+ * Runs a test case in a child process of the test program, for the cases
+ * which change the state of the whole process. The child has the environment
+ * variable, which the child test case checks so it does nothing in the
+ * normal runs. The current test case fails if the child cannot be started or
+ * does not exit in one minute.
+ *
+ * @param CaseName The name of the child test case.
+ * @param VariableName The name of the environment variable.
+ * @param VariableValue The value of the environment variable.
+ * @return The exit code of the child, which is the number of the failed test
+ *         cases.
+ */
+DWORD NSudoTestRunChildProcess(
+    _In_ const std::wstring& CaseName,
+    _In_z_ const wchar_t* VariableName,
+    _In_ const std::wstring& VariableValue);
+
+/**
+ * The registration of a test case, which runs before main.
+ */
+struct CNSudoTestCaseRegistration
+{
+    CNSudoTestCaseRegistration(
+        _In_z_ const char* Name,
+        _In_ PNSUDO_TEST_FUNCTION Function)
+    {
+        NSudoRegisterTestCase(Name, Function);
+    }
+};
+
+/**
+ * The empty directory under the temporary directory for the files of a test
+ * case. The directory and its files are deleted by the destructor.
+ */
+class CNSudoTestDirectory : M2::CDisableObjectCopying
+{
+private:
+    std::wstring m_Path;
+
+public:
+    CNSudoTestDirectory();
+
+    ~CNSudoTestDirectory();
+
+    const std::wstring& GetPath() const
+    {
+        return this->m_Path;
+    }
+
+    std::wstring GetFilePath(
+        _In_ const std::wstring& FileName) const
+    {
+        return this->m_Path + L"\\" + FileName;
+    }
+};
+
+/**
+ * Defines and registers a test case.
+ *
+ * @param Name The name of the test case.
+ */
+#define NSUDO_TEST(Name) \
+    static void Name(); \
+    static CNSudoTestCaseRegistration Name##Registration(#Name, Name); \
+    static void Name()
+
+/**
+ * Stops the current test case as failed if the expression is false.
+ *
+ * @param Expression The expression which should be true.
+ */
+#define NSUDO_TEST_ASSERT(Expression) \
+    ((Expression) \
+        ? (void)0 \
+        : NSudoFailTestCase(__FILE__, __LINE__, #Expression))
+
+#endif // _NSUDO_TEST_
@@ -0,0 +1,11 @@
+﻿/*
+ * PROJECT:   NSudo
+ * FILE:      stdafx.cpp
+ * PURPOSE:   Precompiled Header for the unit tests
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+#include "stdafx.h"
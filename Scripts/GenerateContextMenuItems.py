@@ -0,0 +1,93 @@
+#
+# PROJECT:   NSudo
+# FILE:      GenerateContextMenuItems.py
+# PURPOSE:   Generates the install plan of the context menu
+#
+# LICENSE:   The MIT License
+#
+# DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+#
+# NSudo\Resources\NSudoContextMenuManagement.json is the definition of the
+# context menu. Run this script after changing it to regenerate
+# NSudo\NSudoContextMenuItems.h, and the unit tests check that they match.
+#
+# Usage: python GenerateContextMenuItems.py
+#
+
+import json
+import os
+
+ROOT_PATH = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..')
+SOURCE_PATH = os.path.join(
+    ROOT_PATH, 'NSudo', 'Resources', 'NSudoContextMenuManagement.json')
+TARGET_PATH = os.path.join(ROOT_PATH, 'NSudo', 'NSudoContextMenuItems.h')
+
+HEADER = '''\
+/*
+ * PROJECT:   NSudo
+ * FILE:      NSudoContextMenuItems.h
+ * PURPOSE:   The install plan of the context menu
+ *
+ * LICENSE:   The MIT License
+ *
+ * DEVELOPER: Mouri_Naruto (Mouri_Naruto AT Outlook.com)
+ */
+
+// This file is generated from Resources\\NSudoContextMenuManagement.json by
+// Scripts\\GenerateContextMenuItems.py. Do not edit it.
+
+#pragma once
+
+/**
+ * The install plan of the context menu. Each item becomes a CommandStore
+ * entry whose command is "<Quoted NSudo Path>" followed by the
+ * ItemCommandParameters and NSudoContextMenuCommandSuffix, so the installer
+ * only concatenates three fixed segments for each item.
+ */
+constexpr NSUDO_CONTEXT_MENU_ITEM g_ContextMenuItems[] =
+{
+'''
+
+
+def make_literal(value, prefix=''):
+    literal = prefix + '"'
+    for character in value:
+        if character in '"\\':
+            literal += '\\' + character
+        elif ' ' <= character <= '~':
+            literal += character
+        elif prefix and ord(character) <= 0xFFFF:
+            literal += '\\u%04X' % ord(character)
+        else:
+            raise ValueError('Unsupported character in %r' % value)
+    return literal + '"'
+
+
+def main():
+    with open(SOURCE_PATH, encoding='utf-8-sig') as source:
+        items = json.load(source)['ContextMenu']
+
+    entries = []
+    for item in items:
+        # The parameters are appended to the quoted path of NSudo, so they
+        # start with a space.
+        entries.append(
+            '    {\n'
+            '        %s,\n'
+            '        %s,\n'
+            '        %s,\n'
+            '        %s\n'
+            '    }' % (
+                make_literal(item['ItemName'], 'L'),
+                make_literal(item['ItemDescriptionID']),
+                make_literal(' ' + item['ItemCommandParameters'], 'L'),
+                'true' if item['HasLUAShield'] else 'false'))
+
+    content = HEADER + ',\n'.join(entries) + '\n};\n'
+
+    with open(TARGET_PATH, 'w', encoding='utf-8-sig', newline='\n') as target:
+        target.write(content)
+
+
+if __name__ == '__main__':
+    main()